@@ -0,0 +1,1358 @@
+/*
+ * ec_backend.c
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <ec_backend.h>
+#include "common.h"
+#include "log.h"
+#include "error.h"
+#include "hash.h"
+#include "rmem_backend.h"
+#include "tcp_backend.h"
+#include "loop_backend.h"
+#include "ec_gf.h"
+
+#define EC_MAGIC 0x52564d4543434f44ULL
+#define EC_META_TAG 0xfffffff0U
+#define EC_RECORD_TAG 0xfffffff2U
+#define EC_HASH_SIZE (1 << 16)
+/* Groups read and rebuilt at a time */
+#define EC_BATCH 64
+/* Room per server in the control buffer, for its meta or record header */
+#define CTL_SLOT 64
+#define NO_INDEX UINT32_MAX
+
+/* A user tag t is block 2t on its server and is staged in 2t + 1, and so
+ * are the parity blocks of group g */
+#define DATA_TAG(t) ((t) << 1)
+#define STAGE_TAG(t) (((t) << 1) | 1)
+
+/* What drives every server */
+enum ec_layer {
+    EC_RDMA,
+    EC_TCP,
+    EC_LOOP,
+};
+
+enum ec_op {
+    JOB_NONE,
+    JOB_CONNECT,
+    JOB_DISCONNECT,
+    JOB_PUT_V,
+    JOB_PUT_V_SYNC,             /* and wait until the server has them */
+    JOB_GET_V,
+    JOB_MULTI_MALLOC,
+    JOB_COMMIT,
+};
+
+enum record_state {
+    RECORD_PREPARED = 1,
+    RECORD_APPLIED = 2,
+};
+
+/* What a server is in the set, under EC_META_TAG */
+struct ec_meta {
+    uint64_t magic;
+    uint32_t k;
+    uint32_t m;
+    uint32_t index;
+    uint32_t block;
+};
+
+/* A commit, kept under EC_RECORD_TAG on every server */
+struct ec_record {
+    uint64_t magic;
+    uint64_t txid;
+    uint64_t sum;               /* of everything after state */
+    uint32_t state;
+    uint32_t n;
+    struct ec_write {
+        uint32_t tag;
+        uint32_t size;          /* 0 frees the block */
+    } writes[];
+};
+
+#define RECORD_MAX_WRITES ((EC_RECORD_SIZE - \
+            sizeof(struct ec_record)) / sizeof(struct ec_write))
+
+/* A put waiting for the next commit */
+struct ec_stage {
+    uint32_t size;
+    uint8_t data[];
+};
+
+/* What register_data hands out: a registration per server */
+struct ec_reg {
+    void *regs[EC_MAX];
+};
+
+/* A buffer registered with every server */
+struct ec_buf {
+    uint8_t *data;
+    size_t size;
+    struct ec_reg *reg;
+};
+
+struct ec_set;
+
+struct ec_server {
+    struct ec_set *set;
+    rmem_layer_t *layer;
+    char *host;
+    char *port;
+    pthread_t thread;
+    uint64_t seen;              /* last run the worker looked at */
+    int lost;                   /* came back empty, to be rebuilt */
+    uint32_t *known;            /* tags it held at connect */
+    uint32_t nknown;
+
+    /* the server's part of the current operation */
+    enum ec_op op;
+    int err;
+    uint32_t n;                 /* in iov */
+    uint32_t ntags;
+    uint32_t ncopies;
+    uint32_t nfree;
+
+    /* scratch, grown as needed */
+    uint32_t cap;
+    rmem_iov_t *iov;
+    uint32_t *index;            /* position in the caller's arrays */
+    uint32_t *tags;
+    uint64_t *addrs;
+    uint32_t *src;
+    uint32_t *dst;
+    uint32_t *sizes;
+    uint32_t *frees;
+};
+
+struct ec_set {
+    int n;
+    int k;
+    int m;
+    enum ec_layer backend;
+    uint32_t block;
+    uint8_t coef[EC_MAX * EC_MAX];
+    struct ec_server servers[EC_MAX];
+
+    pthread_mutex_t lock;
+    pthread_cond_t go;
+    pthread_cond_t done;
+    uint64_t run;               /* bumped for every parallel run */
+    int outstanding;
+    int stop;
+
+    hash_t blocks;              /* tags allocated */
+    hash_t groups;              /* groups with parity */
+    hash_t staged;              /* tag to struct ec_stage */
+    uint32_t *frees;
+    uint32_t nfrees;
+    uint32_t frees_cap;
+
+    struct ec_buf old;          /* old contents and parity read by a commit */
+    struct ec_buf new;          /* new contents and parity */
+    struct ec_buf rec;
+    struct ec_buf ctl;
+    uint64_t txid;
+};
+
+/* A write of the commit being built, with its staged data */
+struct ec_pending {
+    uint32_t group;
+    struct ec_write w;
+    struct ec_stage *st;
+};
+
+static char present;
+
+static int member_of(struct ec_set *es, uint32_t tag)
+{
+    return (tag >> 1) % es->k;
+}
+
+static uint32_t group_of(struct ec_set *es, uint32_t tag)
+{
+    return (((tag >> 1) / es->k) << 1) | (tag & 1);
+}
+
+static uint32_t member_tag(struct ec_set *es, uint32_t group, int i)
+{
+    return ((((group >> 1) * es->k) + i) << 1) | (group & 1);
+}
+
+static void set_add(hash_t set, uint32_t key)
+{
+    if (hash_get_item(set, key) == NULL)
+        hash_insert_item(set, key, &present);
+}
+
+static void *reg_of(void *reg, int server)
+{
+    return reg != NULL ? ((struct ec_reg *)reg)->regs[server] : NULL;
+}
+
+static void grow(struct ec_server *sv, uint32_t n)
+{
+    if (n < sv->cap)
+        return;
+
+    sv->cap = n >= 2 * sv->cap ? n + 1 : 2 * sv->cap;
+    TEST_Z(sv->iov = realloc(sv->iov, sv->cap * sizeof(*sv->iov)));
+    TEST_Z(sv->index = realloc(sv->index, sv->cap * sizeof(*sv->index)));
+    TEST_Z(sv->tags = realloc(sv->tags, sv->cap * sizeof(*sv->tags)));
+    TEST_Z(sv->addrs = realloc(sv->addrs, sv->cap * sizeof(*sv->addrs)));
+    TEST_Z(sv->src = realloc(sv->src, sv->cap * sizeof(*sv->src)));
+    TEST_Z(sv->dst = realloc(sv->dst, sv->cap * sizeof(*sv->dst)));
+    TEST_Z(sv->sizes = realloc(sv->sizes, sv->cap * sizeof(*sv->sizes)));
+    TEST_Z(sv->frees = realloc(sv->frees, sv->cap * sizeof(*sv->frees)));
+}
+
+static void add_iov(struct ec_server *sv, enum ec_op op, uint32_t tag,
+        void *addr, void *reg, size_t size, uint32_t index)
+{
+    grow(sv, sv->n);
+    sv->iov[sv->n] = (rmem_iov_t){ tag, addr, reg, size, 0 };
+    sv->index[sv->n++] = index;
+    sv->op = op;
+}
+
+static void add_tag(struct ec_server *sv, uint32_t tag, uint32_t index)
+{
+    grow(sv, sv->ntags);
+    sv->tags[sv->ntags] = tag;
+    sv->index[sv->ntags++] = index;
+    sv->op = JOB_MULTI_MALLOC;
+}
+
+static void add_copy(struct ec_server *sv, uint32_t src, uint32_t dst,
+        uint32_t size)
+{
+    grow(sv, sv->ncopies);
+    sv->src[sv->ncopies] = src;
+    sv->dst[sv->ncopies] = dst;
+    sv->sizes[sv->ncopies++] = size;
+    sv->op = JOB_COMMIT;
+}
+
+static void add_free(struct ec_server *sv, uint32_t tag)
+{
+    grow(sv, sv->nfree);
+    sv->frees[sv->nfree++] = tag;
+    sv->op = JOB_COMMIT;
+}
+
+static void clear_jobs(struct ec_set *es)
+{
+    for (int s = 0; s < es->n; s++) {
+        struct ec_server *sv = &es->servers[s];
+
+        sv->op = JOB_NONE;
+        sv->n = sv->ntags = sv->ncopies = sv->nfree = 0;
+    }
+}
+
+/*
+ * REGISTRATION
+ */
+
+static struct ec_reg *ec_register(struct ec_set *es, void *buf, size_t size)
+{
+    struct ec_reg *reg = malloc(sizeof(*reg));
+
+    RETURN_ERROR(reg == NULL, NULL, ("Failure: out of memory\n"));
+    for (int s = 0; s < es->n; s++) {
+        rmem_layer_t *layer = es->servers[s].layer;
+
+        reg->regs[s] = layer->register_data(layer, buf, size);
+    }
+
+    return reg;
+}
+
+static void ec_deregister(struct ec_set *es, struct ec_reg *reg)
+{
+    if (reg == NULL)
+        return;
+    for (int s = 0; s < es->n; s++) {
+        rmem_layer_t *layer = es->servers[s].layer;
+
+        layer->deregister_data(layer, reg->regs[s]);
+    }
+    free(reg);
+}
+
+static void buf_release(struct ec_set *es, struct ec_buf *b)
+{
+    ec_deregister(es, b->reg);
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+static void buf_reserve(struct ec_set *es, struct ec_buf *b, size_t size)
+{
+    if (size <= b->size)
+        return;
+
+    size = size > 2 * b->size ? size : 2 * b->size;
+    buf_release(es, b);
+    TEST_NZ(posix_memalign((void **)&b->data, 64, size));
+    b->size = size;
+    TEST_Z(b->reg = ec_register(es, b->data, size));
+}
+
+/*
+ * WORKERS
+ */
+
+static int put_v(rmem_layer_t *layer, rmem_iov_t *iov, int n)
+{
+    int err = 0;
+
+    if (layer->put_v != NULL)
+        return layer->put_v(layer, iov, n);
+    for (int i = 0; i < n; i++) {
+        iov[i].status = layer->put(layer, iov[i].tag, iov[i].addr,
+                iov[i].reg, iov[i].size);
+        if (iov[i].status != 0 && err == 0)
+            err = iov[i].status;
+    }
+    return err;
+}
+
+static int get_v(rmem_layer_t *layer, rmem_iov_t *iov, int n)
+{
+    int err = 0;
+
+    if (layer->get_v != NULL)
+        return layer->get_v(layer, iov, n);
+    for (int i = 0; i < n; i++) {
+        iov[i].status = layer->get(layer, iov[i].addr, iov[i].reg,
+                iov[i].tag, iov[i].size);
+        if (iov[i].status != 0 && err == 0)
+            err = iov[i].status;
+    }
+    return err;
+}
+
+static void do_job(struct ec_server *sv)
+{
+    rmem_layer_t *layer = sv->layer;
+
+    switch (sv->op) {
+        case JOB_CONNECT:
+            layer->connect(layer, sv->host, sv->port);
+            sv->err = 0;
+            break;
+        case JOB_DISCONNECT:
+            layer->disconnect(layer);
+            sv->err = 0;
+            break;
+        case JOB_PUT_V:
+            sv->err = put_v(layer, sv->iov, sv->n);
+            break;
+        case JOB_PUT_V_SYNC:
+            // an empty commit is answered once the puts before it are in
+            sv->err = put_v(layer, sv->iov, sv->n);
+            if (sv->err == 0)
+                sv->err = layer->atomic_commit(layer, NULL, NULL, NULL, 0);
+            break;
+        case JOB_GET_V:
+            sv->err = get_v(layer, sv->iov, sv->n);
+            break;
+        case JOB_MULTI_MALLOC:
+            sv->err = layer->multi_malloc(layer, sv->addrs,
+                    sv->set->block, sv->tags, sv->ntags);
+            break;
+        case JOB_COMMIT:
+            if (sv->nfree > 0)
+                layer->multi_free(layer, sv->frees, sv->nfree);
+            sv->err = layer->atomic_commit(layer, sv->src, sv->dst,
+                    sv->sizes, sv->ncopies);
+            break;
+        case JOB_NONE:
+            break;
+    }
+}
+
+static void *ec_worker(void *arg)
+{
+    struct ec_server *sv = arg;
+    struct ec_set *es = sv->set;
+
+    TEST_NZ(pthread_mutex_lock(&es->lock));
+    for (;;) {
+        while (sv->seen == es->run && !es->stop)
+            TEST_NZ(pthread_cond_wait(&es->go, &es->lock));
+        if (sv->seen == es->run)
+            break;
+        sv->seen = es->run;
+        if (sv->op == JOB_NONE)
+            continue;
+        TEST_NZ(pthread_mutex_unlock(&es->lock));
+
+        do_job(sv);
+
+        TEST_NZ(pthread_mutex_lock(&es->lock));
+        sv->op = JOB_NONE;
+        if (--es->outstanding == 0)
+            TEST_NZ(pthread_cond_signal(&es->done));
+    }
+    TEST_NZ(pthread_mutex_unlock(&es->lock));
+
+    return NULL;
+}
+
+/* Run the jobs set on the servers, in parallel when there are several, and
+ * return the first error */
+static int run_jobs(struct ec_set *es)
+{
+    struct ec_server *one = NULL;
+    int njobs = 0, err = 0;
+
+    for (int s = 0; s < es->n; s++) {
+        es->servers[s].err = 0;
+        if (es->servers[s].op != JOB_NONE) {
+            one = &es->servers[s];
+            njobs++;
+        }
+    }
+
+    if (njobs == 1) {
+        do_job(one);
+        one->op = JOB_NONE;
+        return one->err;
+    }
+
+    if (njobs > 1) {
+        TEST_NZ(pthread_mutex_lock(&es->lock));
+        es->outstanding = njobs;
+        es->run++;
+        TEST_NZ(pthread_cond_broadcast(&es->go));
+        while (es->outstanding > 0)
+            TEST_NZ(pthread_cond_wait(&es->done, &es->lock));
+        TEST_NZ(pthread_mutex_unlock(&es->lock));
+    }
+
+    for (int s = 0; s < es->n && err == 0; s++)
+        err = es->servers[s].err;
+    return err;
+}
+
+/*
+ * COMMIT RECORDS
+ */
+
+static uint64_t record_sum(struct ec_record *rec)
+{
+    unsigned char *p = (unsigned char *)&rec->n;
+    unsigned char *end = (unsigned char *)&rec->writes[rec->n];
+    uint64_t sum = 0xcbf29ce484222325ULL;
+
+    // FNV-1a
+    for (; p < end; p++)
+        sum = (sum ^ *p) * 0x100000001b3ULL;
+    return sum;
+}
+
+/* Queue a put of the first size bytes of the record on every live server */
+static void record_put(struct ec_set *es, enum ec_op op, size_t size)
+{
+    for (int s = 0; s < es->n; s++)
+        if (!es->servers[s].lost)
+            add_iov(&es->servers[s], op, EC_RECORD_TAG, es->rec.data,
+                    reg_of(es->rec.reg, s), size, NO_INDEX);
+}
+
+/* Copy the staging blocks of writes, sorted by group, in on every live
+ * server, and free the blocks they free */
+static int commit_writes(struct ec_set *es, struct ec_write *w, uint32_t n)
+{
+    int err;
+
+    clear_jobs(es);
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t t = w[i].tag, g = group_of(es, t);
+        struct ec_server *sv = &es->servers[member_of(es, t)];
+
+        if (w[i].size == 0) {
+            if (hash_get_item(es->blocks, t) != NULL) {
+                add_free(sv, DATA_TAG(t));
+                add_free(sv, STAGE_TAG(t));
+            }
+        } else {
+            add_copy(sv, STAGE_TAG(t), DATA_TAG(t), w[i].size);
+        }
+
+        if (i + 1 < n && group_of(es, w[i + 1].tag) == g)
+            continue;
+        for (int j = 0; j < es->m; j++)
+            add_copy(&es->servers[es->k + j], STAGE_TAG(g), DATA_TAG(g),
+                    es->block);
+    }
+    for (int s = 0; s < es->n; s++)
+        if (es->servers[s].lost)
+            es->servers[s].op = JOB_NONE;
+
+    err = run_jobs(es);
+    if (err == 0)
+        for (uint32_t i = 0; i < n; i++)
+            if (w[i].size == 0)
+                hash_delete_item(es->blocks, w[i].tag);
+    return err;
+}
+
+/* Finish the last commit if every live server has its record prepared: it
+ * was only applied anywhere once they all had. */
+static void replay_record(struct ec_set *es)
+{
+    struct ec_record *rec = (struct ec_record *)es->rec.data;
+    int nlive = 0, prepared = 0, applied = 0, from = -1;
+    uint32_t n;
+
+    clear_jobs(es);
+    for (int s = 0; s < es->n; s++)
+        if (!es->servers[s].lost)
+            add_iov(&es->servers[s], JOB_GET_V, EC_RECORD_TAG,
+                    es->ctl.data + s * CTL_SLOT, reg_of(es->ctl.reg, s),
+                    sizeof(*rec), NO_INDEX);
+    CHECK_ERROR(run_jobs(es) != 0,
+            ("Failure: could not read the commit records\n"));
+
+    for (int s = 0; s < es->n; s++) {
+        struct ec_record *hdr = (void *)(es->ctl.data + s * CTL_SLOT);
+
+        if (!es->servers[s].lost && hdr->magic == EC_MAGIC &&
+                hdr->txid > es->txid)
+            es->txid = hdr->txid;
+    }
+    for (int s = 0; s < es->n; s++) {
+        struct ec_record *hdr = (void *)(es->ctl.data + s * CTL_SLOT);
+
+        if (es->servers[s].lost)
+            continue;
+        nlive++;
+        if (hdr->magic != EC_MAGIC || hdr->txid != es->txid)
+            continue;
+        if (hdr->state == RECORD_APPLIED)
+            applied++;
+        else if (hdr->state == RECORD_PREPARED)
+            prepared++, from = s;
+    }
+    if (applied > 0 || prepared == 0)
+        return;
+    if (prepared < nlive) {
+        LOG(1, ("discarding incomplete commit record %ld\n", es->txid));
+        return;
+    }
+
+    // the whole record must be on every one of them
+    n = ((struct ec_record *)(es->ctl.data + from * CTL_SLOT))->n;
+    for (int s = 0; s < es->n; s++) {
+        rmem_layer_t *layer = es->servers[s].layer;
+
+        if (es->servers[s].lost)
+            continue;
+        if (n > RECORD_MAX_WRITES || layer->get(layer, rec,
+                    reg_of(es->rec.reg, s), EC_RECORD_TAG,
+                    sizeof(*rec) + n * sizeof(struct ec_write)) != 0 ||
+                rec->n != n || rec->sum != record_sum(rec)) {
+            LOG(1, ("discarding incomplete commit record %ld\n", es->txid));
+            return;
+        }
+    }
+
+    CHECK_ERROR(commit_writes(es, rec->writes, n) != 0,
+            ("Failure: could not finish commit %ld\n", es->txid));
+    rec->state = RECORD_APPLIED;
+    clear_jobs(es);
+    record_put(es, JOB_PUT_V_SYNC, sizeof(*rec));
+    CHECK_ERROR(run_jobs(es) != 0,
+            ("Failure: could not mark commit %ld applied\n", es->txid));
+
+    LOG(1, ("finished commit %ld over %d blocks\n", es->txid, n));
+}
+
+/*
+ * MEMBERSHIP AND REBUILD
+ */
+
+static uint32_t server_tags(struct ec_set *es, struct ec_server *sv,
+        uint32_t **tags)
+{
+    switch (es->backend) {
+    case EC_TCP:
+        return tcp_layer_tags(sv->layer, tags);
+    case EC_LOOP:
+        return loop_layer_tags(sv->layer, tags);
+    default:
+        return rmem_layer_tags(sv->layer, tags);
+    }
+}
+
+/* Make the lost servers members of the set, once they hold their share */
+static void write_meta(struct ec_set *es)
+{
+    clear_jobs(es);
+    memset(es->rec.data, 0, sizeof(struct ec_record));
+    for (int s = 0; s < es->n; s++) {
+        struct ec_server *sv = &es->servers[s];
+        struct ec_meta *meta = (void *)(es->ctl.data + s * CTL_SLOT);
+        rmem_layer_t *layer = sv->layer;
+
+        if (!sv->lost)
+            continue;
+        CHECK_ERROR(layer->malloc(layer, sizeof(*meta), EC_META_TAG) == 0 ||
+                layer->malloc(layer, EC_RECORD_SIZE, EC_RECORD_TAG) == 0,
+                ("Failure: no room for the erasure code metadata on %s\n",
+                 sv->host));
+
+        meta->magic = EC_MAGIC;
+        meta->k = es->k;
+        meta->m = es->m;
+        meta->index = s;
+        meta->block = es->block;
+        add_iov(sv, JOB_PUT_V_SYNC, EC_RECORD_TAG, es->rec.data,
+                reg_of(es->rec.reg, s), sizeof(struct ec_record), NO_INDEX);
+        add_iov(sv, JOB_PUT_V_SYNC, EC_META_TAG, meta,
+                reg_of(es->ctl.reg, s), sizeof(*meta), NO_INDEX);
+    }
+    CHECK_ERROR(run_jobs(es) != 0,
+            ("Failure: could not write the erasure code metadata\n"));
+
+    for (int s = 0; s < es->n; s++)
+        es->servers[s].lost = 0;
+}
+
+/* Find the servers that came back empty */
+static void load_meta(struct ec_set *es)
+{
+    int nlost = 0;
+
+    clear_jobs(es);
+    for (int s = 0; s < es->n; s++) {
+        struct ec_server *sv = &es->servers[s];
+
+        sv->lost = 1;
+        for (uint32_t i = 0; i < sv->nknown; i++)
+            if (sv->known[i] == EC_META_TAG)
+                sv->lost = 0;
+        if (!sv->lost)
+            add_iov(sv, JOB_GET_V, EC_META_TAG, es->ctl.data + s * CTL_SLOT,
+                    reg_of(es->ctl.reg, s), sizeof(struct ec_meta),
+                    NO_INDEX);
+        nlost += sv->lost;
+    }
+    CHECK_ERROR(run_jobs(es) != 0,
+            ("Failure: could not read the erasure code metadata\n"));
+
+    for (int s = 0; s < es->n; s++) {
+        struct ec_meta *meta = (void *)(es->ctl.data + s * CTL_SLOT);
+
+        if (es->servers[s].lost)
+            continue;
+        CHECK_ERROR(meta->magic != EC_MAGIC || meta->k != es->k ||
+                meta->m != es->m || meta->index != s ||
+                meta->block != es->block,
+                ("Failure: %s:%s is not server %d of %d + %d with %d byte "
+                 "blocks\n", es->servers[s].host, es->servers[s].port, s,
+                 es->k, es->m, es->block));
+    }
+
+    if (nlost == es->n) {
+        LOG(5, ("new set of %d + %d servers\n", es->k, es->m));
+        write_meta(es);
+        return;
+    }
+    CHECK_ERROR(nlost > es->m,
+            ("Failure: %d servers lost, the code only covers %d\n",
+             nlost, es->m));
+}
+
+/* Collect the blocks and groups the live servers hold */
+static void load_tags(struct ec_set *es)
+{
+    for (int s = 0; s < es->n; s++) {
+        struct ec_server *sv = &es->servers[s];
+
+        for (uint32_t i = 0; i < sv->nknown && !sv->lost; i++) {
+            uint32_t t = sv->known[i] >> 1;
+
+            if ((sv->known[i] & 1) || t >= EC_RESERVED_TAG)
+                continue;
+            if (s < es->k) {
+                set_add(es->blocks, t);
+                set_add(es->groups, group_of(es, t));
+            } else {
+                set_add(es->groups, t);
+            }
+        }
+    }
+}
+
+/* Decode the lost servers' blocks from k live ones, group by group, and
+ * write them back */
+static void rebuild(struct ec_set *es)
+{
+    int rows[EC_MAX], nlost = 0, nrows = 0;
+    uint8_t a[EC_MAX * EC_MAX], inv[EC_MAX * EC_MAX];
+    size_t block = es->block;
+    uint32_t *groups, ngroups = 0;
+    hash_iterator_t it;
+    int k = es->k;
+
+    // the live data servers first, parity for the rest
+    for (int s = 0; s < es->n; s++) {
+        if (es->servers[s].lost)
+            nlost++;
+        else if (nrows < k)
+            rows[nrows++] = s;
+    }
+    if (nlost == 0)
+        return;
+
+    for (int r = 0; r < k; r++)
+        for (int c = 0; c < k; c++)
+            a[r * k + c] = rows[r] < k ? rows[r] == c :
+                es->coef[(rows[r] - k) * k + c];
+    CHECK_ERROR(ec_gf_invert(a, inv, k) != 0,
+            ("Failure: cannot decode from the live servers\n"));
+
+    TEST_Z(groups = malloc((hash_num_elements(es->groups) + 1) *
+                sizeof(*groups)));
+    for (it = hash_begin(es->groups); !hash_is_iterator_null(it);
+            hash_next_iterator(it))
+        groups[ngroups++] = hash_iterator_key(it);
+    hash_delete_iterator(it);
+
+    buf_reserve(es, &es->old, EC_BATCH * k * block);
+    buf_reserve(es, &es->new, EC_BATCH * es->n * block);
+
+    for (uint32_t b = 0; b < ngroups; b += EC_BATCH) {
+        uint32_t nb = ngroups - b < EC_BATCH ? ngroups - b : EC_BATCH;
+
+        clear_jobs(es);
+        for (uint32_t gi = 0; gi < nb; gi++) {
+            for (int r = 0; r < k; r++) {
+                int s = rows[r];
+                uint32_t t = s < k ? member_tag(es, groups[b + gi], s) :
+                    groups[b + gi];
+                uint8_t *dst = es->old.data + (gi * k + r) * block;
+
+                // never allocated, zeros to the parity
+                if (s < k && hash_get_item(es->blocks, t) == NULL) {
+                    memset(dst, 0, block);
+                    continue;
+                }
+                add_iov(&es->servers[s], JOB_GET_V, DATA_TAG(t), dst,
+                        reg_of(es->old.reg, s), block, NO_INDEX);
+            }
+        }
+        CHECK_ERROR(run_jobs(es) != 0,
+                ("Failure: could not read the groups to rebuild\n"));
+
+        clear_jobs(es);
+        for (uint32_t gi = 0; gi < nb; gi++) {
+            uint8_t *src[EC_MAX], *data[EC_MAX];
+            uint8_t *out = es->new.data + gi * es->n * block;
+
+            for (int r = 0; r < k; r++) {
+                src[r] = es->old.data + (gi * k + r) * block;
+                if (rows[r] < k)
+                    data[rows[r]] = src[r];
+            }
+            for (int s = 0; s < es->n; s++) {
+                uint8_t *dst = out + s * block;
+
+                if (!es->servers[s].lost)
+                    continue;
+                memset(dst, 0, block);
+                if (s < k) {
+                    for (int r = 0; r < k; r++)
+                        ec_gf_mul_add(dst, src[r], inv[s * k + r], block);
+                    data[s] = dst;
+                }
+            }
+            // parity last, from all the data
+            for (int s = k; s < es->n; s++)
+                if (es->servers[s].lost)
+                    for (int i = 0; i < k; i++)
+                        ec_gf_mul_add(out + s * block, data[i],
+                                es->coef[(s - k) * k + i], block);
+
+            for (int s = 0; s < es->n; s++) {
+                struct ec_server *sv = &es->servers[s];
+                uint32_t t = s < k ? member_tag(es, groups[b + gi], s) :
+                    groups[b + gi];
+
+                if (!sv->lost)
+                    continue;
+                add_tag(sv, DATA_TAG(t), NO_INDEX);
+                add_tag(sv, STAGE_TAG(t), NO_INDEX);
+                if (s < k)
+                    set_add(es->blocks, t);
+            }
+        }
+        CHECK_ERROR(run_jobs(es) != 0,
+                ("Failure: could not allocate the rebuilt blocks\n"));
+
+        clear_jobs(es);
+        for (uint32_t gi = 0; gi < nb; gi++) {
+            for (int s = 0; s < es->n; s++) {
+                uint32_t t = s < k ? member_tag(es, groups[b + gi], s) :
+                    groups[b + gi];
+
+                if (es->servers[s].lost)
+                    add_iov(&es->servers[s], JOB_PUT_V, DATA_TAG(t),
+                            es->new.data + (gi * es->n + s) * block,
+                            reg_of(es->new.reg, s), block, NO_INDEX);
+            }
+        }
+        CHECK_ERROR(run_jobs(es) != 0,
+                ("Failure: could not write the rebuilt blocks\n"));
+    }
+    free(groups);
+
+    write_meta(es);
+    LOG(1, ("rebuilt %d servers, %d groups\n", nlost, ngroups));
+}
+
+/*
+ * LAYER
+ */
+
+static void ec_connect(rmem_layer_t* rcfg, char* host, char* port)
+{
+    struct ec_set *es = rcfg->layer_data;
+    char *hosts, *save = NULL, *name;
+    char *backend = getenv("RMEM_EC_BACKEND");
+    char *parity = getenv("RMEM_EC_PARITY");
+    char *block = getenv("RMEM_EC_BLOCK");
+
+    es->m = parity != NULL ? strtol(parity, NULL, 0) : 1;
+    es->block = block != NULL ? strtoul(block, NULL, 0) :
+        sysconf(_SC_PAGESIZE);
+    if (backend == NULL || strcmp(backend, "rdma") == 0)
+        es->backend = EC_RDMA;
+    else if (strcmp(backend, "tcp") == 0)
+        es->backend = EC_TCP;
+    else if (strcmp(backend, "loop") == 0)
+        es->backend = EC_LOOP;
+    else
+        CHECK_ERROR(1, ("Failure: unknown RMEM_EC_BACKEND %s\n", backend));
+    TEST_Z(hosts = strdup(host));
+
+    for (name = strtok_r(hosts, ",", &save); name != NULL;
+            name = strtok_r(NULL, ",", &save)) {
+        struct ec_server *sv = &es->servers[es->n];
+        char *colon = strchr(name, ':');
+
+        CHECK_ERROR(es->n == EC_MAX,
+                ("Failure: more than %d servers\n", EC_MAX));
+        TEST_Z(sv->host = strdup(name));
+        if (colon != NULL) {
+            sv->host[colon - name] = '\0';
+            TEST_Z(sv->port = strdup(colon + 1));
+        } else {
+            TEST_Z(sv->port = strdup(port));
+        }
+
+        sv->layer = es->backend == EC_TCP ? create_tcp_layer() :
+            es->backend == EC_LOOP ? create_loop_layer() :
+            create_rmem_layer();
+        CHECK_ERROR(sv->layer->flags & RMEM_LAYER_NO_SHADOW,
+                ("Failure: servers must commit from staging blocks\n"));
+
+        sv->set = es;
+        sv->seen = es->run;
+        sv->op = JOB_CONNECT;
+        TEST_NZ(pthread_create(&sv->thread, NULL, ec_worker, sv));
+        es->n++;
+    }
+    free(hosts);
+    es->k = es->n - es->m;
+    CHECK_ERROR(es->m < 1 || es->k < 1,
+            ("Failure: %d servers cannot hold %d parity and some data\n",
+             es->n, es->m));
+    ec_gf_cauchy(es->coef, es->k, es->m);
+
+    run_jobs(es);
+
+    buf_reserve(es, &es->rec, EC_RECORD_SIZE);
+    buf_reserve(es, &es->ctl, EC_MAX * CTL_SLOT);
+    for (int s = 0; s < es->n; s++) {
+        struct ec_server *sv = &es->servers[s];
+
+        sv->nknown = server_tags(es, sv, &sv->known);
+    }
+
+    load_meta(es);
+    load_tags(es);
+    replay_record(es);
+    rebuild(es);
+
+    for (int s = 0; s < es->n; s++) {
+        free(es->servers[s].known);
+        es->servers[s].known = NULL;
+    }
+
+    LOG(5, ("connected to %d + %d servers (%s kernels)\n", es->k, es->m,
+                ec_gf_kernel()));
+}
+
+static void ec_disconnect(rmem_layer_t* rcfg)
+{
+    struct ec_set *es = rcfg->layer_data;
+    hash_iterator_t it;
+
+    for (it = hash_begin(es->staged); !hash_is_iterator_null(it);
+            hash_next_iterator(it))
+        free(hash_iterator_value(it));
+    hash_delete_iterator(it);
+    hash_destroy(es->staged);
+    hash_destroy(es->blocks);
+    hash_destroy(es->groups);
+    es->staged = hash_create(EC_HASH_SIZE);
+    es->blocks = hash_create(EC_HASH_SIZE);
+    es->groups = hash_create(EC_HASH_SIZE);
+    es->nfrees = 0;
+
+    buf_release(es, &es->old);
+    buf_release(es, &es->new);
+    buf_release(es, &es->rec);
+    buf_release(es, &es->ctl);
+
+    clear_jobs(es);
+    for (int s = 0; s < es->n; s++)
+        es->servers[s].op = JOB_DISCONNECT;
+    run_jobs(es);
+
+    TEST_NZ(pthread_mutex_lock(&es->lock));
+    es->stop = 1;
+    TEST_NZ(pthread_cond_broadcast(&es->go));
+    TEST_NZ(pthread_mutex_unlock(&es->lock));
+
+    for (int s = 0; s < es->n; s++) {
+        struct ec_server *sv = &es->servers[s];
+
+        TEST_NZ(pthread_join(sv->thread, NULL));
+        free(sv->host);
+        free(sv->port);
+        free(sv->iov);
+        free(sv->index);
+        free(sv->tags);
+        free(sv->addrs);
+        free(sv->src);
+        free(sv->dst);
+        free(sv->sizes);
+        free(sv->frees);
+        memset(sv, 0, sizeof(*sv));
+    }
+    es->n = 0;
+    es->stop = 0;
+}
+
+static int ec_multi_malloc(rmem_layer_t *rcfg,
+    uint64_t *addrs, uint64_t size, uint32_t *tags, uint32_t n)
+{
+    struct ec_set *es = rcfg->layer_data;
+    int err;
+
+    RETURN_ERROR(size != es->block, EINVAL,
+            ("Failure: blocks are %d bytes, not %ld\n", es->block, size));
+    for (uint32_t i = 0; i < n; i++)
+        RETURN_ERROR(tags[i] >= EC_RESERVED_TAG, EINVAL,
+                ("Failure: tag %x is reserved\n", tags[i]));
+
+    // new blocks and parity are zeroed by the server, which is what the
+    // parity holds for blocks never allocated
+    clear_jobs(es);
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t g = group_of(es, tags[i]);
+        struct ec_server *sv = &es->servers[member_of(es, tags[i])];
+
+        add_tag(sv, DATA_TAG(tags[i]), i);
+        add_tag(sv, STAGE_TAG(tags[i]), NO_INDEX);
+        if (hash_get_item(es->groups, g) != NULL)
+            continue;
+        for (int j = 0; j < es->m; j++) {
+            add_tag(&es->servers[es->k + j], DATA_TAG(g), NO_INDEX);
+            add_tag(&es->servers[es->k + j], STAGE_TAG(g), NO_INDEX);
+        }
+        set_add(es->groups, g);
+    }
+
+    err = run_jobs(es);
+    for (int s = 0; s < es->k; s++) {
+        struct ec_server *sv = &es->servers[s];
+
+        for (uint32_t j = 0; j < sv->ntags; j++)
+            if (sv->index[j] != NO_INDEX)
+                addrs[sv->index[j]] = sv->addrs[j];
+    }
+    if (err == 0)
+        for (uint32_t i = 0; i < n; i++)
+            set_add(es->blocks, tags[i]);
+    return err;
+}
+
+static uint64_t ec_malloc(rmem_layer_t* rcfg, size_t size, uint32_t tag)
+{
+    uint64_t addr;
+
+    if (ec_multi_malloc(rcfg, &addr, size, &tag, 1) != 0)
+        return 0;
+    return addr;
+}
+
+/* Applied with the next commit, which takes the block out of the parity */
+static int ec_free(rmem_layer_t* rcfg, uint32_t tag)
+{
+    struct ec_set *es = rcfg->layer_data;
+
+    if (es->nfrees == es->frees_cap) {
+        es->frees_cap = es->frees_cap ? 2 * es->frees_cap : 256;
+        TEST_Z(es->frees = realloc(es->frees,
+                    es->frees_cap * sizeof(*es->frees)));
+    }
+    es->frees[es->nfrees++] = tag;
+
+    return 0;
+}
+
+static int ec_multi_free(rmem_layer_t *rcfg,
+    uint32_t *tags, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+        ec_free(rcfg, tags[i]);
+
+    return 0;
+}
+
+static int ec_put(rmem_layer_t* rcfg, uint32_t tag,
+        void *src, void *src_reg, size_t size)
+{
+    struct ec_set *es = rcfg->layer_data;
+    struct ec_stage *st = hash_get_item(es->staged, tag);
+
+    RETURN_ERROR(size > es->block, EINVAL,
+            ("Failure: put of %ld bytes to a %d byte block\n", size,
+             es->block));
+    if (st == NULL) {
+        st = malloc(sizeof(*st) + es->block);
+        RETURN_ERROR(st == NULL, ENOMEM, ("Failure: out of memory\n"));
+        st->size = 0;
+        hash_insert_item(es->staged, tag, st);
+    }
+
+    // a shorter put keeps the rest of an earlier one
+    memcpy(st->data, src, size);
+    if (size > st->size)
+        st->size = size;
+
+    return 0;
+}
+
+static int ec_put_v(rmem_layer_t* rcfg, rmem_iov_t *iov, int n)
+{
+    int err = 0;
+
+    for (int i = 0; i < n; i++) {
+        iov[i].status = ec_put(rcfg, iov[i].tag, iov[i].addr, iov[i].reg,
+                iov[i].size);
+        if (iov[i].status != 0 && err == 0)
+            err = iov[i].status;
+    }
+    return err;
+}
+
+static int ec_get(rmem_layer_t* rcfg, void *dst,
+        void *dst_reg, uint32_t tag, size_t size)
+{
+    struct ec_set *es = rcfg->layer_data;
+    int s = member_of(es, tag);
+    rmem_layer_t *layer = es->servers[s].layer;
+
+    return layer->get(layer, dst, reg_of(dst_reg, s), DATA_TAG(tag), size);
+}
+
+static int ec_get_v(rmem_layer_t* rcfg, rmem_iov_t *iov, int n)
+{
+    struct ec_set *es = rcfg->layer_data;
+    int err;
+
+    clear_jobs(es);
+    for (int i = 0; i < n; i++) {
+        int s = member_of(es, iov[i].tag);
+
+        add_iov(&es->servers[s], JOB_GET_V, DATA_TAG(iov[i].tag),
+                iov[i].addr, reg_of(iov[i].reg, s), iov[i].size, i);
+    }
+
+    err = run_jobs(es);
+    for (int s = 0; s < es->k; s++) {
+        struct ec_server *sv = &es->servers[s];
+
+        for (uint32_t j = 0; j < sv->n; j++)
+            iov[sv->index[j]].status = sv->iov[j].status;
+    }
+    return err;
+}
+
+static int cmp_pending(const void *a, const void *b)
+{
+    const struct ec_pending *pa = a, *pb = b;
+
+    // by group, then tag, a free first
+    if (pa->group != pb->group)
+        return pa->group < pb->group ? -1 : 1;
+    if (pa->w.tag != pb->w.tag)
+        return pa->w.tag < pb->w.tag ? -1 : 1;
+    return (pa->w.size != 0) - (pb->w.size != 0);
+}
+
+/* Collect the frees and the staged puts of tags, sorted by group and each
+ * tag once, a free taking the place of any put */
+static uint32_t gather(struct ec_set *es, uint32_t *tags, uint32_t ntag,
+        struct ec_pending **out)
+{
+    struct ec_pending *p;
+    uint32_t n = 0, u = 0;
+
+    TEST_Z(p = malloc((ntag + es->nfrees + 1) * sizeof(*p)));
+    for (uint32_t i = 0; i < es->nfrees; i++) {
+        uint32_t t = es->frees[i];
+        struct ec_stage *st = hash_get_item(es->staged, t);
+
+        if (st != NULL) {
+            hash_delete_item(es->staged, t);
+            free(st);
+        }
+        if (hash_get_item(es->blocks, t) != NULL)
+            p[n++] = (struct ec_pending){ group_of(es, t), { t, 0 }, NULL };
+    }
+    es->nfrees = 0;
+
+    for (uint32_t i = 0; i < ntag; i++) {
+        struct ec_stage *st = hash_get_item(es->staged, tags[i]);
+
+        if (st == NULL)
+            continue;
+        hash_delete_item(es->staged, tags[i]);
+        p[n++] = (struct ec_pending){ group_of(es, tags[i]),
+            { tags[i], st->size }, st };
+    }
+
+    qsort(p, n, sizeof(*p), cmp_pending);
+    for (uint32_t i = 0; i < n; i++) {
+        if (u > 0 && p[u - 1].w.tag == p[i].w.tag) {
+            free(p[i].st);
+            continue;
+        }
+        p[u++] = p[i];
+    }
+
+    *out = p;
+    return u;
+}
+
+static int ec_atomic_commit(rmem_layer_t* rcfg,
+        uint32_t* tags_src, uint32_t* tags_dst, uint32_t* sizes, uint32_t ntag)
+{
+    struct ec_set *es = rcfg->layer_data;
+    struct ec_record *rec = (struct ec_record *)es->rec.data;
+    struct ec_pending *p;
+    size_t block = es->block;
+    uint32_t n, ngroups = 0;
+    int k = es->k, m = es->m, err;
+
+    n = gather(es, tags_dst, ntag, &p);
+    if (n == 0) {
+        free(p);
+        return 0;
+    }
+    RETURN_ERROR(n > RECORD_MAX_WRITES, E2BIG,
+            ("Failure: %d blocks do not fit a commit record\n", n));
+
+    for (uint32_t i = 0; i < n; i++)
+        ngroups += i == 0 ||
+            group_of(es, p[i].w.tag) != group_of(es, p[i - 1].w.tag);
+
+    /* a block per write, then m parity blocks per group, for both the old
+     * and the new contents */
+    buf_reserve(es, &es->old, (n + ngroups * m) * block);
+    buf_reserve(es, &es->new, (n + ngroups * m) * block);
+
+    for (uint32_t i = 0; i < n; i++) {
+        uint8_t *dst = es->new.data + i * block;
+
+        if (p[i].st != NULL)
+            memcpy(dst, p[i].st->data, p[i].w.size);
+        else
+            memset(dst, 0, block);
+    }
+
+    // read the old blocks and parity of the groups only partly written
+    clear_jobs(es);
+    for (uint32_t a = 0, r = 0, b; a < n; a = b, r++) {
+        uint32_t g = group_of(es, p[a].w.tag);
+        int full;
+
+        for (b = a; b < n && group_of(es, p[b].w.tag) == g; b++)
+            ;
+        full = b - a == k;
+        for (uint32_t i = a; i < b; i++)
+            full = full && (p[i].w.size == 0 || p[i].w.size == block);
+        if (full)
+            continue;
+
+        for (uint32_t i = a; i < b; i++) {
+            int s = member_of(es, p[i].w.tag);
+
+            add_iov(&es->servers[s], JOB_GET_V, DATA_TAG(p[i].w.tag),
+                    es->old.data + i * block, reg_of(es->old.reg, s),
+                    p[i].w.size ? p[i].w.size : block, NO_INDEX);
+        }
+        for (int j = 0; j < m; j++)
+            add_iov(&es->servers[k + j], JOB_GET_V, DATA_TAG(g),
+                    es->old.data + (n + r * m + j) * block,
+                    reg_of(es->old.reg, k + j), block, NO_INDEX);
+    }
+    err = run_jobs(es);
+    if (err != 0)
+        goto out;
+
+    // new parity: encoded whole, or the old one plus the differences
+    for (uint32_t a = 0, r = 0, b; a < n; a = b, r++) {
+        uint32_t g = group_of(es, p[a].w.tag);
+        uint8_t *data[EC_MAX], *par[EC_MAX];
+        int full;
+
+        for (b = a; b < n && group_of(es, p[b].w.tag) == g; b++)
+            ;
+        for (int j = 0; j < m; j++)
+            par[j] = es->new.data + (n + r * m + j) * block;
+        full = b - a == k;
+        for (uint32_t i = a; i < b; i++)
+            full = full && (p[i].w.size == 0 || p[i].w.size == block);
+
+        if (full) {
+            for (uint32_t i = a; i < b; i++)
+                data[member_of(es, p[i].w.tag)] = es->new.data + i * block;
+            ec_gf_encode(par, data, es->coef, k, m, block);
+            continue;
+        }
+
+        for (int j = 0; j < m; j++)
+            memcpy(par[j], es->old.data + (n + r * m + j) * block, block);
+        for (uint32_t i = a; i < b; i++) {
+            uint8_t *delta = es->old.data + i * block;
+            size_t len = p[i].w.size ? p[i].w.size : block;
+            int s = member_of(es, p[i].w.tag);
+
+            ec_gf_mul_add(delta, es->new.data + i * block, 1, len);
+            for (int j = 0; j < m; j++)
+                ec_gf_mul_add(par[j], delta, es->coef[j * k + s], len);
+        }
+    }
+
+    // stage the blocks and the parity, and the record on every server
+    clear_jobs(es);
+    for (uint32_t i = 0, r = 0; i < n; i++) {
+        uint32_t t = p[i].w.tag, g = group_of(es, t);
+        int s = member_of(es, t);
+
+        if (p[i].w.size != 0)
+            add_iov(&es->servers[s], JOB_PUT_V_SYNC, STAGE_TAG(t),
+                    es->new.data + i * block, reg_of(es->new.reg, s),
+                    p[i].w.size, NO_INDEX);
+        if (i + 1 < n && group_of(es, p[i + 1].w.tag) == g)
+            continue;
+        for (int j = 0; j < m; j++)
+            add_iov(&es->servers[k + j], JOB_PUT_V_SYNC, STAGE_TAG(g),
+                    es->new.data + (n + r * m + j) * block,
+                    reg_of(es->new.reg, k + j), block, NO_INDEX);
+        r++;
+    }
+
+    rec->magic = EC_MAGIC;
+    rec->txid = ++es->txid;
+    rec->state = RECORD_PREPARED;
+    rec->n = n;
+    for (uint32_t i = 0; i < n; i++)
+        rec->writes[i] = p[i].w;
+    rec->sum = record_sum(rec);
+    record_put(es, JOB_PUT_V_SYNC,
+            sizeof(*rec) + n * sizeof(struct ec_write));
+    err = run_jobs(es);
+    if (err != 0)
+        goto out;
+
+    // every server has the record, any of them may apply it now
+    err = commit_writes(es, rec->writes, n);
+    if (err != 0)
+        goto out;
+
+    // done before the next commit overwrites any staging block it would
+    // replay
+    rec->state = RECORD_APPLIED;
+    clear_jobs(es);
+    record_put(es, JOB_PUT_V_SYNC, sizeof(*rec));
+    err = run_jobs(es);
+
+out:
+    for (uint32_t i = 0; i < n; i++)
+        free(p[i].st);
+    free(p);
+    return err;
+}
+
+static void* ec_register_data(rmem_layer_t* rcfg, void* buf, size_t size)
+{
+    return ec_register(rcfg->layer_data, buf, size);
+}
+
+static void ec_deregister_data(rmem_layer_t* rcfg, void*buf)
+{
+    ec_deregister(rcfg->layer_data, buf);
+}
+
+rmem_layer_t* create_ec_layer()
+{
+    rmem_layer_t *layer = malloc(sizeof(rmem_layer_t));
+    struct ec_set *es = calloc(1, sizeof(struct ec_set));
+
+    CHECK_ERROR(layer == NULL || es == NULL,
+            ("Failure: Error allocating layer struct\n"));
+
+    TEST_NZ(pthread_mutex_init(&es->lock, NULL));
+    TEST_NZ(pthread_cond_init(&es->go, NULL));
+    TEST_NZ(pthread_cond_init(&es->done, NULL));
+    es->staged = hash_create(EC_HASH_SIZE);
+    es->blocks = hash_create(EC_HASH_SIZE);
+    es->groups = hash_create(EC_HASH_SIZE);
+
+    layer->connect = ec_connect;
+    layer->disconnect = ec_disconnect;
+    layer->malloc = ec_malloc;
+    layer->free = ec_free;
+    layer->put = ec_put;
+    layer->get = ec_get;
+    layer->put_v = ec_put_v;
+    layer->get_v = ec_get_v;
+    layer->atomic_commit = ec_atomic_commit;
+    layer->register_data = ec_register_data;
+    layer->deregister_data = ec_deregister_data;
+    layer->multi_malloc = ec_multi_malloc;
+    layer->multi_free = ec_multi_free;
+    layer->flags = RMEM_LAYER_NO_SHADOW;
+    layer->layer_data = es;
+
+    return layer;
+}
@@ -0,0 +1,43 @@
+/*
+ * ec_backend.h
+ *
+ *  Erasure-coded remote memory. connect takes a comma separated list of
+ *  servers as its host, as the shard backend does: the first k hold data
+ *  and the last m, set with RMEM_EC_PARITY (1 by default), hold Reed-Solomon
+ *  parity, so any m of them can be lost. Every server is driven by its own
+ *  layer, picked with RMEM_EC_BACKEND ("rdma", the default, "tcp" or
+ *  "loop"), and its own thread. Blocks all have the same size,
+ *  RMEM_EC_BLOCK (the page size by default).
+ *
+ *  Block 2b + c lives on data server b % k, and the k blocks with the same
+ *  b / k and c form a group with one parity block on every parity server.
+ *  Remote memory is (k + m) / k times the data, against r times for r
+ *  replicas.
+ *
+ *  Puts are staged in the client and applied at the next atomic_commit
+ *  (RMEM_LAYER_NO_SHADOW). A commit reads the old contents of the blocks it
+ *  writes and the parity of their groups, adds the difference into the
+ *  parity, writes the new blocks and parity to staging blocks on the servers
+ *  and a record of the commit to all of them, then copies the staging
+ *  blocks in on every server. A group written whole is encoded without any
+ *  reads. connect finishes a commit whose record every server has, then
+ *  rebuilds the servers that came back empty from any k of the others.
+ *  Servers must be given in the same order every time. A rebuild allocates
+ *  every block of the groups it finds, the ones never allocated as zeros.
+ *  Tags from EC_RESERVED_TAG up are reserved.
+ */
+
+#ifndef EC_BACKEND_H_
+#define EC_BACKEND_H_
+
+#include "rmem_generic_interface.h"
+
+#define EC_MAX 32
+#define EC_RESERVED_TAG 0x7ffffff0U
+/* Room for the record of the largest commit */
+#define EC_RECORD_SIZE (4 << 20)
+
+/* Of type create_rmem_layer_f */
+rmem_layer_t* create_ec_layer();
+
+#endif /* EC_BACKEND_H_ */
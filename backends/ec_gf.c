@@ -0,0 +1,204 @@
+/*
+ * ec_gf.c
+ */
+
+#include <string.h>
+#include <pthread.h>
+#include <immintrin.h>
+#include "ec_gf.h"
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+/* products of c with the low and the high nibbles, for every c */
+static uint8_t gf_lo[256][16] __attribute__((aligned(16)));
+static uint8_t gf_hi[256][16] __attribute__((aligned(16)));
+
+typedef void (*mul_add_f)(uint8_t *dst, const uint8_t *src, uint8_t c,
+        size_t len);
+
+static pthread_once_t gf_once = PTHREAD_ONCE_INIT;
+static mul_add_f gf_mul_add;
+static const char *gf_kernel;
+
+static void mul_add_scalar(uint8_t *dst, const uint8_t *src, uint8_t c,
+        size_t len)
+{
+    const uint8_t *lo = gf_lo[c], *hi = gf_hi[c];
+
+    for (size_t i = 0; i < len; i++)
+        dst[i] ^= lo[src[i] & 0xf] ^ hi[src[i] >> 4];
+}
+
+__attribute__((target("ssse3")))
+static void mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c,
+        size_t len)
+{
+    __m128i lo = _mm_load_si128((const __m128i *)gf_lo[c]);
+    __m128i hi = _mm_load_si128((const __m128i *)gf_hi[c]);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i l = _mm_shuffle_epi8(lo, _mm_and_si128(s, mask));
+        __m128i h = _mm_shuffle_epi8(hi,
+                _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+
+        d = _mm_xor_si128(d, _mm_xor_si128(l, h));
+        _mm_storeu_si128((__m128i *)(dst + i), d);
+    }
+    mul_add_scalar(dst + i, src + i, c, len - i);
+}
+
+__attribute__((target("avx2")))
+static void mul_add_avx2(uint8_t *dst, const uint8_t *src, uint8_t c,
+        size_t len)
+{
+    __m256i lo = _mm256_broadcastsi128_si256(
+            _mm_load_si128((const __m128i *)gf_lo[c]));
+    __m256i hi = _mm256_broadcastsi128_si256(
+            _mm_load_si128((const __m128i *)gf_hi[c]));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i l = _mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask));
+        __m256i h = _mm256_shuffle_epi8(hi,
+                _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+
+        d = _mm256_xor_si256(d, _mm256_xor_si256(l, h));
+        _mm256_storeu_si256((__m256i *)(dst + i), d);
+    }
+    mul_add_scalar(dst + i, src + i, c, len - i);
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+    if (a == 0 || b == 0)
+        return 0;
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static void gf_init(void)
+{
+    unsigned x = 1;
+
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = gf_exp[i + 255] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= 0x11d;
+    }
+
+    for (int c = 0; c < 256; c++) {
+        for (int n = 0; n < 16; n++) {
+            gf_lo[c][n] = gf_mul(c, n);
+            gf_hi[c][n] = gf_mul(c, n << 4);
+        }
+    }
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        gf_mul_add = mul_add_avx2;
+        gf_kernel = "avx2";
+    } else if (__builtin_cpu_supports("ssse3")) {
+        gf_mul_add = mul_add_ssse3;
+        gf_kernel = "ssse3";
+    } else {
+        gf_mul_add = mul_add_scalar;
+        gf_kernel = "scalar";
+    }
+}
+
+uint8_t ec_gf_mul(uint8_t a, uint8_t b)
+{
+    pthread_once(&gf_once, gf_init);
+    return gf_mul(a, b);
+}
+
+uint8_t ec_gf_inv(uint8_t a)
+{
+    pthread_once(&gf_once, gf_init);
+    return a == 0 ? 0 : gf_exp[255 - gf_log[a]];
+}
+
+void ec_gf_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+    pthread_once(&gf_once, gf_init);
+    if (c != 0)
+        gf_mul_add(dst, src, c, len);
+}
+
+void ec_gf_cauchy(uint8_t *coef, int k, int m)
+{
+    for (int j = 0; j < m; j++)
+        for (int i = 0; i < k; i++)
+            coef[j * k + i] = ec_gf_inv((k + j) ^ i);
+}
+
+void ec_gf_encode(uint8_t **parity, uint8_t **data, const uint8_t *coef,
+        int k, int m, size_t len)
+{
+    for (int j = 0; j < m; j++) {
+        memset(parity[j], 0, len);
+        for (int i = 0; i < k; i++)
+            if (data[i] != NULL)
+                ec_gf_mul_add(parity[j], data[i], coef[j * k + i], len);
+    }
+}
+
+int ec_gf_invert(const uint8_t *a, uint8_t *inv, int n)
+{
+    uint8_t m[n][n];
+
+    pthread_once(&gf_once, gf_init);
+    memcpy(m, a, n * n);
+    for (int r = 0; r < n; r++)
+        for (int c = 0; c < n; c++)
+            inv[r * n + c] = r == c;
+
+    // Gauss-Jordan, where adding is xor
+    for (int c = 0; c < n; c++) {
+        int p = c;
+        uint8_t f;
+
+        while (p < n && m[p][c] == 0)
+            p++;
+        if (p == n)
+            return -1;
+        for (int x = 0; x < n; x++) {
+            uint8_t t = m[c][x];
+
+            m[c][x] = m[p][x];
+            m[p][x] = t;
+            t = inv[c * n + x];
+            inv[c * n + x] = inv[p * n + x];
+            inv[p * n + x] = t;
+        }
+
+        f = ec_gf_inv(m[c][c]);
+        for (int x = 0; x < n; x++) {
+            m[c][x] = ec_gf_mul(m[c][x], f);
+            inv[c * n + x] = ec_gf_mul(inv[c * n + x], f);
+        }
+        for (int r = 0; r < n; r++) {
+            if (r == c || (f = m[r][c]) == 0)
+                continue;
+            for (int x = 0; x < n; x++) {
+                m[r][x] ^= ec_gf_mul(m[c][x], f);
+                inv[r * n + x] ^= ec_gf_mul(inv[c * n + x], f);
+            }
+        }
+    }
+    return 0;
+}
+
+const char *ec_gf_kernel(void)
+{
+    pthread_once(&gf_once, gf_init);
+    return gf_kernel;
+}
@@ -0,0 +1,37 @@
+/*
+ * ec_gf.h
+ *
+ *  GF(2^8) arithmetic for the erasure-coded backend (polynomial 0x11d).
+ *  The bulk kernels multiply a buffer by a constant with two 16-entry
+ *  nibble tables, looked up 16 or 32 bytes at a time with pshufb when the
+ *  CPU has SSSE3 or AVX2, and a byte at a time otherwise.
+ */
+
+#ifndef EC_GF_H_
+#define EC_GF_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint8_t ec_gf_mul(uint8_t a, uint8_t b);
+uint8_t ec_gf_inv(uint8_t a);
+
+/* dst ^= c * src over len bytes */
+void ec_gf_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+
+/* The m x k Cauchy matrix coef[j * k + i] = 1 / ((k + j) ^ i), which with
+ * the identity on top makes a code any k of whose k + m rows can be
+ * inverted. k + m must not exceed 256. */
+void ec_gf_cauchy(uint8_t *coef, int k, int m);
+
+/* parity[j] = sum of coef[j * k + i] * data[i], NULL data being zeros */
+void ec_gf_encode(uint8_t **parity, uint8_t **data, const uint8_t *coef,
+        int k, int m, size_t len);
+
+/* Invert the n x n matrix a into inv. Returns -1 if it is singular. */
+int ec_gf_invert(const uint8_t *a, uint8_t *inv, int n);
+
+/* Name of the kernel in use, for reporting */
+const char *ec_gf_kernel(void);
+
+#endif /* EC_GF_H_ */
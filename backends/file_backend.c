@@ -5,67 +5,404 @@
  *      Author: violet
  */
 
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <file_backend.h>
+#include "hash.h"
+#include "stack.h"
+#include "log.h"
+#include "error.h"
+
+#define FILE_ALIGN 4096
+#define ALIGN_UP(x) (((x) + FILE_ALIGN - 1) & ~((uint64_t)FILE_ALIGN - 1))
+
+/* One tag's slots */
+struct file_entry {
+    uint32_t tag;
+    uint32_t live;
+    uint64_t size;
+    uint64_t off[2];
+    /* epoch << 1 | slot, of the last put. Written in one store, so a crash
+     * leaves either the old or the new value. */
+    volatile uint64_t state;
+};
+
+struct file_hdr {
+    uint64_t magic;
+    volatile uint64_t epoch;    /* last committed epoch */
+    uint64_t nentries;          /* entries ever used, live or free */
+    uint64_t data_end;          /* end of the last slot */
+    struct file_entry entries[FILE_MAX_TAGS];
+};
+
+#define FILE_DATA_START ALIGN_UP(sizeof(struct file_hdr))
+
+struct file_store {
+    int fd;
+    struct file_hdr *hdr;
+    hash_t tags;                /* tag -> struct file_entry * */
+    stack_p free_entries;       /* entries of freed tags, for reuse */
+
+    /* frees wait for the next commit, the committed state may still need
+     * the blocks */
+    uint32_t *frees;
+    uint32_t nfrees, max_frees;
+
+    int dirty;                  /* anything to commit */
+};
+
+/* Slot holding the committed contents of e */
+static int committed_slot(struct file_store *fs, struct file_entry *e)
+{
+    uint64_t state = e->state;
+
+    if ((state >> 1) <= fs->hdr->epoch)
+        return state & 1;
+    return !(state & 1);
+}
+
+static struct file_entry *lookup(struct file_store *fs, uint32_t tag,
+        size_t size)
+{
+    struct file_entry *e = hash_get_item(fs->tags, tag);
+
+    RETURN_ERROR(e == NULL, NULL, ("Failure: tag %d not found\n", tag));
+    RETURN_ERROR(size > e->size, NULL,
+            ("Failure: %ld bytes do not fit in tag %d\n", size, tag));
+    return e;
+}
+
+static int pwrite_full(int fd, const char *buf, size_t size, off_t off)
+{
+    while (size > 0) {
+        ssize_t n = pwrite(fd, buf, size, off);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return EIO;
+        buf += n;
+        off += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int pread_full(int fd, char *buf, size_t size, off_t off)
+{
+    while (size > 0) {
+        ssize_t n = pread(fd, buf, size, off);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return EIO;
+        buf += n;
+        off += n;
+        size -= n;
+    }
+    return 0;
+}
 
 /* Of type rmem_connect_f */
 void file_connect(rmem_layer_t* rcfg, char* host, char* port)
 {
+    struct file_store *fs = rcfg->layer_data;
+    struct stat st;
+    int created;
+
+    fs->fd = open(host, O_RDWR | O_CREAT, 0644);
+    CHECK_ERROR(fs->fd < 0,
+            ("Failure: could not open %s: %s\n", host, strerror(errno)));
+    CHECK_ERROR(fstat(fs->fd, &st) != 0,
+            ("Failure: could not stat %s: %s\n", host, strerror(errno)));
+
+    created = (st.st_size == 0);
+    if (created)
+        CHECK_ERROR(ftruncate(fs->fd, FILE_DATA_START) != 0,
+                ("Failure: could not size %s: %s\n", host, strerror(errno)));
+
+    fs->hdr = mmap(NULL, sizeof(*fs->hdr), PROT_READ | PROT_WRITE,
+            MAP_SHARED, fs->fd, 0);
+    CHECK_ERROR(fs->hdr == MAP_FAILED,
+            ("Failure: could not map %s: %s\n", host, strerror(errno)));
+
+    if (created) {
+        fs->hdr->epoch = 1;
+        fs->hdr->nentries = 0;
+        fs->hdr->data_end = FILE_DATA_START;
+        fs->hdr->magic = FILE_BACKEND_MAGIC;
+        CHECK_ERROR(fdatasync(fs->fd) != 0,
+                ("Failure: could not sync %s: %s\n", host, strerror(errno)));
+    }
+    CHECK_ERROR(fs->hdr->magic != FILE_BACKEND_MAGIC,
+            ("Failure: %s is not a block store\n", host));
 
+    fs->tags = hash_create(FILE_MAX_TAGS / 16);
+    fs->free_entries = stack_create();
+    for (uint64_t i = 0; i < fs->hdr->nentries; i++) {
+        struct file_entry *e = &fs->hdr->entries[i];
+
+        /* a put of an epoch that never committed would count once the
+         * epoch is reached again, point the entry back at its committed
+         * slot; the next commit's fdatasync makes that durable */
+        if ((e->state >> 1) > fs->hdr->epoch)
+            e->state = fs->hdr->epoch << 1 | committed_slot(fs, e);
+
+        if (e->live)
+            hash_insert_item(fs->tags, e->tag, e);
+        else
+            stack_push(fs->free_entries, e);
+    }
+
+    LOG(5, ("opened %s at epoch %ld, %d tags\n", host, fs->hdr->epoch,
+                hash_num_elements(fs->tags)));
 }
 
 /* Of type rmem_disconnect_f */
 void file_disconnect(rmem_layer_t* rcfg)
 {
+    struct file_store *fs = rcfg->layer_data;
 
+    munmap(fs->hdr, sizeof(*fs->hdr));
+    close(fs->fd);
+    hash_destroy(fs->tags);
+    stack_destroy(&fs->free_entries);
+    free(fs->frees);
+    fs->frees = NULL;
+    fs->nfrees = fs->max_frees = 0;
 }
 
 /* Of type rmem_malloc_f */
 uint64_t file_malloc(rmem_layer_t* rcfg, size_t size, uint32_t tag)
 {
+    struct file_store *fs = rcfg->layer_data;
+    struct file_entry *e = hash_get_item(fs->tags, tag);
+
+    /* a tag that survived a restart is handed out again */
+    if (e != NULL)
+        return e->size >= size ? e->off[0] : 0;
+
+    e = stack_size(fs->free_entries) > 0 ?
+        stack_pop(fs->free_entries) : NULL;
+    if (e != NULL && e->size < size) {
+        stack_push(fs->free_entries, e);
+        e = NULL;
+    }
+
+    if (e == NULL) {
+        uint64_t slot = ALIGN_UP(size);
+
+        RETURN_ERROR(fs->hdr->nentries == FILE_MAX_TAGS, 0,
+                ("Failure: out of tags\n"));
+        RETURN_ERROR(ftruncate(fs->fd, fs->hdr->data_end + 2 * slot) != 0,
+                0, ("Failure: could not grow the store: %s\n",
+                    strerror(errno)));
+
+        e = &fs->hdr->entries[fs->hdr->nentries++];
+        e->size = slot;
+        e->off[0] = fs->hdr->data_end;
+        e->off[1] = fs->hdr->data_end + slot;
+        fs->hdr->data_end += 2 * slot;
+    }
 
+    e->tag = tag;
+    e->state = 0;
+    e->live = 1;
+    hash_insert_item(fs->tags, tag, e);
+    fs->dirty = 1;
+
+    return e->off[0];
 }
 
 /* Of type rmem_free_f */
 int file_free(rmem_layer_t* rcfg, uint32_t tag)
 {
+    struct file_store *fs = rcfg->layer_data;
+
+    if (fs->nfrees == fs->max_frees) {
+        uint32_t max = fs->max_frees ? 2 * fs->max_frees : 64;
+        uint32_t *frees = realloc(fs->frees, max * sizeof(*frees));
+
+        RETURN_ERROR(frees == NULL, -1,
+                ("Failure: error allocating free list\n"));
+        fs->frees = frees;
+        fs->max_frees = max;
+    }
 
+    // applied with the next commit
+    fs->frees[fs->nfrees++] = tag;
+    fs->dirty = 1;
+
+    return 0;
+}
+
+int file_multi_malloc(rmem_layer_t *rcfg,
+    uint64_t *addrs, uint64_t size, uint32_t *tags, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        addrs[i] = file_malloc(rcfg, size, tags[i]);
+        if (addrs[i] == 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+int file_multi_free(rmem_layer_t *rcfg,
+    uint32_t *tags, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+        if (file_free(rcfg, tags[i]) != 0)
+            return -1;
+
+    return 0;
 }
 
 /* Of type rmem_put_f */
 int file_put(rmem_layer_t* rcfg, uint32_t tag,
         void *src, void *src_reg, size_t size)
 {
+    struct file_store *fs = rcfg->layer_data;
+    struct file_entry *e = lookup(fs, tag, size);
+    uint64_t next = fs->hdr->epoch + 1;
+
+    if (e == NULL)
+        return EINVAL;
 
+    /* the first put of an epoch takes the slot that is not committed,
+     * later ones overwrite it */
+    if ((e->state >> 1) != next)
+        e->state = next << 1 | !committed_slot(fs, e);
+    fs->dirty = 1;
+
+    return pwrite_full(fs->fd, src, size, e->off[e->state & 1]);
 }
 
 /* Of type rmem_get_f */
 int file_get(rmem_layer_t* rcfg, void *dst,
         void *dst_reg, uint32_t tag, size_t size)
 {
+    struct file_store *fs = rcfg->layer_data;
+    struct file_entry *e = lookup(fs, tag, size);
+
+    if (e == NULL)
+        return EINVAL;
+
+    return pread_full(fs->fd, dst, size, e->off[committed_slot(fs, e)]);
+}
+
+/* Of type rmem_put_v_f */
+int file_put_v(rmem_layer_t* rcfg, rmem_iov_t *iov, int n)
+{
+    int err = 0;
+
+    for (int i = 0; i < n; i++) {
+        iov[i].status = file_put(rcfg, iov[i].tag, iov[i].addr, iov[i].reg,
+                iov[i].size);
+        if (iov[i].status != 0 && err == 0)
+            err = iov[i].status;
+    }
 
+    return err;
 }
 
-/* Of type rmem_atomic_commit_f */
+/* Of type rmem_get_v_f */
+int file_get_v(rmem_layer_t* rcfg, rmem_iov_t *iov, int n)
+{
+    int err = 0;
+
+    for (int i = 0; i < n; i++) {
+        iov[i].status = file_get(rcfg, iov[i].addr, iov[i].reg, iov[i].tag,
+                iov[i].size);
+        if (iov[i].status != 0 && err == 0)
+            err = iov[i].status;
+    }
+
+    return err;
+}
+
+/* Of type rmem_atomic_commit_f
+ *
+ * Every put since the last commit is committed, the tags only name the
+ * blocks rvm expects to be (RMEM_LAYER_NO_SHADOW passes src == dst). */
 int file_atomic_commit(rmem_layer_t* rcfg,
         uint32_t* tags_src, uint32_t* tags_dst, uint32_t* sizes, uint32_t ntag)
 {
+    struct file_store *fs = rcfg->layer_data;
 
+    if (!fs->dirty)
+        return 0;
+
+    /* the slots and entries of this epoch must be on disk before the epoch
+     * that makes them count */
+    RETURN_ERROR(fdatasync(fs->fd) != 0, -1,
+            ("Failure: could not sync the store: %s\n", strerror(errno)));
+    fs->hdr->epoch++;
+    RETURN_ERROR(msync(fs->hdr, FILE_ALIGN, MS_SYNC) != 0, -1,
+            ("Failure: could not sync the store: %s\n", strerror(errno)));
+
+    /* the entries go out with the next commit, until then a crash merely
+     * leaves the tags allocated */
+    for (uint32_t i = 0; i < fs->nfrees; i++) {
+        struct file_entry *e = hash_get_item(fs->tags, fs->frees[i]);
+
+        if (e == NULL)
+            continue;
+        hash_delete_item(fs->tags, fs->frees[i]);
+        e->live = 0;
+        stack_push(fs->free_entries, e);
+    }
+    fs->dirty = (fs->nfrees > 0);
+    fs->nfrees = 0;
+
+    return 0;
 }
 
 /* Of type rmem_register_data_f */
 void* file_register_data(rmem_layer_t* rcfg,
         void* buf, size_t size)
 {
-
+    return buf;
 }
 
 /* Of type rmem_deregister_data_f */
 void file_deregister_data(rmem_layer_t* rcfg, void*buf)
 {
-
+    return;
 }
 
 /* Of type create_rmem_layer_f */
 rmem_layer_t* create_file_layer()
 {
+    rmem_layer_t *layer = malloc(sizeof(rmem_layer_t));
+    struct file_store *fs = calloc(1, sizeof(struct file_store));
+
+    CHECK_ERROR(layer == NULL || fs == NULL,
+            ("Failure: Error allocating layer struct\n"));
+
+    layer->connect = file_connect;
+    layer->disconnect = file_disconnect;
+    layer->malloc = file_malloc;
+    layer->free = file_free;
+    layer->put = file_put;
+    layer->get = file_get;
+    layer->put_v = file_put_v;
+    layer->get_v = file_get_v;
+    layer->atomic_commit = file_atomic_commit;
+    layer->register_data = file_register_data;
+    layer->deregister_data = file_deregister_data;
+    layer->multi_malloc = file_multi_malloc;
+    layer->multi_free = file_multi_free;
+    layer->flags = RMEM_LAYER_NO_SHADOW;
+    layer->layer_data = fs;
 
+    return layer;
 }
@@ -1,6 +1,18 @@
 /*
  * file_backend.h
  *
+ *  Stores blocks in a local file, for durable checkpoints on a single node
+ *  without a server. connect's host argument is the path of the store file,
+ *  which is created if it does not exist; the port is ignored.
+ *
+ *  Every tag has two slots in the file, found through an entry in the
+ *  file's header, which is mapped. A put goes to the slot that does not
+ *  hold the committed data, and atomic_commit makes all puts since the
+ *  last commit durable with fdatasync and then flips the commit epoch in
+ *  the header: an entry's last written slot counts once the epoch it was
+ *  written in is committed. The layer thus has no shadow blocks
+ *  (RMEM_LAYER_NO_SHADOW), and gets read the committed slot.
+ *
  *  Created on: May 8, 2015
  *      Author: violet
  */
@@ -8,6 +20,12 @@
 #ifndef FILE_BACKEND_H_
 #define FILE_BACKEND_H_
 
+#include "rmem_generic_interface.h"
+
+#define FILE_BACKEND_MAGIC 0x52564d46494c4531ULL
+/* Entries in the header, each tag ever allocated needs one */
+#define FILE_MAX_TAGS (1 << 20)
+
 /* Of type rmem_connect_f */
 void file_connect(rmem_layer_t* rcfg, char* host, char* port);
 
@@ -20,6 +38,12 @@ uint64_t file_malloc(rmem_layer_t* rcfg, size_t size, uint32_t tag);
 /* Of type rmem_free_f */
 int file_free(rmem_layer_t* rcfg, uint32_t tag);
 
+int file_multi_malloc(rmem_layer_t *rcfg,
+    uint64_t *addrs, uint64_t size, uint32_t *tags, uint32_t n);
+
+int file_multi_free(rmem_layer_t *rcfg,
+    uint32_t *tags, uint32_t n);
+
 /* Of type rmem_put_f */
 int file_put(rmem_layer_t* rcfg, uint32_t tag,
         void *src, void *src_reg, size_t size);
@@ -28,6 +52,12 @@ int file_put(rmem_layer_t* rcfg, uint32_t tag,
 int file_get(rmem_layer_t* rcfg, void *dst,
         void *dst_reg, uint32_t tag, size_t size);
 
+/* Of type rmem_put_v_f */
+int file_put_v(rmem_layer_t* rcfg, rmem_iov_t *iov, int n);
+
+/* Of type rmem_get_v_f */
+int file_get_v(rmem_layer_t* rcfg, rmem_iov_t *iov, int n);
+
 /* Of type rmem_atomic_commit_f */
 int file_atomic_commit(rmem_layer_t* rcfg,
         uint32_t* tags_src, uint32_t* tags_dst, uint32_t* sizes, uint32_t ntag);
@@ -0,0 +1,1017 @@
+/*
+ * log_backend.c
+ *
+ *  File layout: two superblocks, then records, each aligned to LOG_ALIGN.
+ *  A record is a struct log_rec with its entries, padded to LOG_ALIGN, and
+ *  for commits the block data the LOG_PUT entries point at.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <log_backend.h>
+#include "common.h"
+#include "hash.h"
+#include "log.h"
+#include "error.h"
+
+#define LOG_ALIGN 4096
+#define ALIGN_UP(x) (((x) + LOG_ALIGN - 1) & ~((uint64_t)LOG_ALIGN - 1))
+#define LOG_START (2 * LOG_ALIGN)       /* after the superblocks */
+#define MAX(a,b) ((a)>(b)?(a):(b))
+
+#define RING_ENTRIES 64
+#define WRITE_CHUNK (256 << 10)         /* bytes per write submission */
+/* A checkpoint is taken once the log has grown by this much, or by four
+ * times the size of the index if that is more */
+#define CKPT_MIN_BYTES (64ULL << 20)
+#define STAGE_MIN (1 << 20)
+#define INDEX_HASH_SIZE 65536
+
+enum log_rec_type { LOG_REC_COMMIT = 1, LOG_REC_CKPT = 2 };
+enum log_op { LOG_PUT = 1, LOG_ALLOC = 2, LOG_FREE = 3 };
+
+struct log_ent {
+    uint32_t tag;
+    uint32_t op;        /* enum log_op */
+    uint64_t size;
+    uint64_t off;       /* of the data in the log */
+};
+
+struct log_rec {
+    uint64_t magic;
+    uint64_t seq;       /* records are numbered without gaps */
+    uint64_t len;       /* of the whole record */
+    uint64_t sum;       /* of the whole record, with sum zero */
+    uint32_t type;      /* enum log_rec_type */
+    uint32_t pad;
+    uint64_t nentries;
+    struct log_ent ents[];
+};
+
+struct log_super {
+    uint64_t magic;
+    uint64_t gen;       /* the valid copy with the highest gen counts */
+    uint64_t ckpt_off;  /* last durable checkpoint, 0 for none */
+    uint64_t sum;
+};
+
+/* Version of a tag */
+struct log_tag {
+    uint64_t off;       /* committed data, 0 if never written */
+    uint64_t size;
+    uint64_t staged;    /* 1 + index in ops of a put in this txn, or 0 */
+};
+
+/* A range of the log no longer needed once a checkpoint after `after`
+ * is durable */
+struct log_extent {
+    uint64_t off;
+    uint64_t len;
+    uint64_t after;
+};
+
+struct log_io {
+    void *buf;
+    uint64_t len;
+    uint64_t off;
+};
+
+struct log_uring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_len, cq_len;
+};
+
+struct log_store {
+    int fd;
+    int direct;                 /* fd was opened O_DIRECT */
+    int use_uring;
+    struct log_uring ring;
+
+    hash_t index;               /* tag -> struct log_tag * */
+    uint64_t ntags;
+    uint64_t tail;              /* where the next record goes */
+    uint64_t seq;               /* of the next record */
+    uint64_t since_ckpt;        /* bytes logged since the last checkpoint */
+    uint64_t super_gen;
+    uint64_t ckpt_pending;      /* checkpoint the superblock should name */
+    int failed;                 /* a commit failed half way, refuse more */
+
+    /* the open txn: ops in order, put data in stage */
+    struct log_ent *ops;
+    uint64_t nops, max_ops;
+    char *stage;
+    uint64_t stage_len, stage_cap;
+
+    /* aligned scratch for record headers, checkpoints and reads */
+    void *hdr, *ckpt, *bounce;
+    uint64_t hdr_cap, ckpt_cap, bounce_cap;
+    struct log_io *ios;
+    int max_ios;
+
+    /* shared with the cleaner, under lock */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct log_extent *stale;
+    uint64_t nstale, max_stale;
+    uint64_t durable_ckpt;
+    int stop;
+    pthread_t cleaner;
+};
+
+/* Word-wise hash for torn record detection, not for integrity against
+ * anything but crashes */
+static uint64_t log_sum(uint64_t h, const void *buf, uint64_t len)
+{
+    const uint64_t *p = buf;
+
+    for (uint64_t i = 0; i < len / sizeof(*p); i++)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+/* Grow an aligned buffer to at least len bytes, dropping its contents */
+static void *aligned_buf(void **buf, uint64_t *cap, uint64_t len)
+{
+    if (len > *cap) {
+        free(*buf);
+        *cap = ALIGN_UP(len > 2 * *cap ? len : 2 * *cap);
+        CHECK_ERROR(posix_memalign(buf, LOG_ALIGN, *cap) != 0,
+                ("Failure: error allocating %ld bytes\n", *cap));
+    }
+    return *buf;
+}
+
+/*
+ * IO
+ */
+
+static int uring_init(struct log_uring *r)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+    unsigned *array;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (r->fd < 0)
+        return -1;
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len)
+            r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+
+    r->sq_map = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cq_map = r->sq_map;
+    else
+        r->cq_map = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+            IORING_OFF_SQES);
+    if (r->cq_map == MAP_FAILED || r->sqes == MAP_FAILED)
+        goto fail;
+
+    sq = r->sq_map;
+    cq = r->cq_map;
+    r->entries = p.sq_entries;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // submission slots map to sqes one to one
+    array = (unsigned *)(sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        array[i] = i;
+
+    return 0;
+
+fail:
+    close(r->fd);
+    return -1;
+}
+
+static void uring_destroy(struct log_uring *r)
+{
+    munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+    if (r->cq_map != r->sq_map)
+        munmap(r->cq_map, r->cq_len);
+    munmap(r->sq_map, r->sq_len);
+    close(r->fd);
+}
+
+/* Submit n sqes already in the ring and reap their completions */
+static int uring_run(struct log_uring *r, struct log_io *ios, unsigned n)
+{
+    unsigned head, reaped = 0;
+    int err = 0;
+
+    if (syscall(__NR_io_uring_enter, r->fd, n, n, IORING_ENTER_GETEVENTS,
+                NULL, 0) < 0 && errno != EINTR)
+        return -1;
+
+    head = *r->cq_head;
+    while (reaped < n) {
+        struct io_uring_cqe *cqe;
+
+        if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            if (syscall(__NR_io_uring_enter, r->fd, 0, n - reaped,
+                        IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+                    errno != EINTR)
+                return -1;
+            continue;
+        }
+        cqe = &r->cqes[head & *r->cq_mask];
+        if (cqe->res < 0)
+            err = -1;
+        else if (cqe->user_data != ~0ULL &&
+                (uint64_t)cqe->res != ios[cqe->user_data].len)
+            err = -1;
+        head++;
+        reaped++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+    return err;
+}
+
+/* Write every io and then flush the file, through io_uring when we have it.
+ * The flush is only issued once the writes are done. */
+static int write_sync(struct log_store *ls, struct log_io *ios, int n)
+{
+    struct log_uring *r = &ls->ring;
+    int i = 0;
+
+    if (!ls->use_uring) {
+        for (i = 0; i < n; i++)
+            if (pwrite(ls->fd, ios[i].buf, ios[i].len, ios[i].off) !=
+                    (ssize_t)ios[i].len)
+                return -1;
+        return fdatasync(ls->fd);
+    }
+
+    while (1) {
+        unsigned tail = *r->sq_tail, nsub = 0, sync = 0;
+        struct io_uring_sqe *sqe;
+
+        for (; i < n && nsub < r->entries - 1; i++, nsub++) {
+            sqe = &r->sqes[tail++ & *r->sq_mask];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = ls->fd;
+            sqe->addr = (uintptr_t)ios[i].buf;
+            sqe->len = ios[i].len;
+            sqe->off = ios[i].off;
+            sqe->user_data = i;
+        }
+        if (i == n) {
+            sqe = &r->sqes[tail++ & *r->sq_mask];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->flags = IOSQE_IO_DRAIN;
+            sqe->fd = ls->fd;
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            sqe->user_data = ~0ULL;
+            nsub++;
+            sync = 1;
+        }
+        __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+        if (uring_run(r, ios, nsub))
+            return -1;
+        if (sync)
+            return 0;
+    }
+}
+
+/* Queue buf for the next write_sync, in chunks the device can overlap */
+static int add_io(struct log_store *ls, int n, void *buf, uint64_t len,
+        uint64_t off)
+{
+    for (uint64_t done = 0; done < len; done += WRITE_CHUNK) {
+        if (n == ls->max_ios) {
+            ls->max_ios = ls->max_ios ? 2 * ls->max_ios : 64;
+            TEST_Z(ls->ios = realloc(ls->ios,
+                        ls->max_ios * sizeof(*ls->ios)));
+        }
+        ls->ios[n].buf = (char *)buf + done;
+        ls->ios[n].len = MIN(len - done, WRITE_CHUNK);
+        ls->ios[n++].off = off + done;
+    }
+    return n;
+}
+
+static int read_full(struct log_store *ls, void *buf, uint64_t len,
+        uint64_t off)
+{
+    return pread(ls->fd, buf, len, off) == (ssize_t)len ? 0 : -1;
+}
+
+/*
+ * INDEX
+ */
+
+static struct log_tag *index_add(struct log_store *ls, uint32_t tag,
+        uint64_t size)
+{
+    struct log_tag *t = calloc(1, sizeof(*t));
+
+    CHECK_ERROR(t == NULL, ("Failure: error allocating index entry\n"));
+    t->size = size;
+    hash_insert_item(ls->index, tag, t);
+    ls->ntags++;
+    return t;
+}
+
+static void index_del(struct log_store *ls, uint32_t tag)
+{
+    struct log_tag *t = hash_get_item(ls->index, tag);
+
+    if (t == NULL)
+        return;
+    hash_delete_item(ls->index, tag);
+    free(t);
+    ls->ntags--;
+}
+
+static void index_clear(struct log_store *ls)
+{
+    hash_iterator_t it = hash_begin(ls->index);
+    uint32_t *tags = malloc((ls->ntags + 1) * sizeof(*tags));
+    uint64_t n = 0;
+
+    TEST_Z(tags);
+    for (; !hash_is_iterator_null(it); hash_next_iterator(it))
+        tags[n++] = hash_iterator_key(it);
+    hash_delete_iterator(it);
+    for (uint64_t i = 0; i < n; i++)
+        index_del(ls, tags[i]);
+    free(tags);
+}
+
+/* Caller holds ls->lock */
+static void add_stale(struct log_store *ls, uint64_t off, uint64_t len,
+        uint64_t after)
+{
+    if (off == 0 || len == 0)
+        return;
+    if (ls->nstale == ls->max_stale) {
+        ls->max_stale = ls->max_stale ? 2 * ls->max_stale : 1024;
+        TEST_Z(ls->stale = realloc(ls->stale,
+                    ls->max_stale * sizeof(*ls->stale)));
+    }
+    ls->stale[ls->nstale].off = off;
+    ls->stale[ls->nstale].len = len;
+    ls->stale[ls->nstale++].after = after;
+}
+
+/* Apply the entries of a record found at off during recovery */
+static void replay(struct log_store *ls, struct log_rec *rec, uint64_t off)
+{
+    if (rec->type == LOG_REC_CKPT) {
+        index_clear(ls);
+        ls->ckpt_pending = off;
+        ls->since_ckpt = 0;
+    } else {
+        ls->since_ckpt += rec->len;
+    }
+
+    for (uint64_t i = 0; i < rec->nentries; i++) {
+        struct log_ent *e = &rec->ents[i];
+        struct log_tag *t = hash_get_item(ls->index, e->tag);
+
+        switch (e->op) {
+            case LOG_PUT:
+                if (t == NULL)
+                    t = index_add(ls, e->tag, e->size);
+                t->off = e->off;
+                break;
+            case LOG_ALLOC:
+                if (t == NULL)
+                    t = index_add(ls, e->tag, e->size);
+                break;
+            case LOG_FREE:
+                index_del(ls, e->tag);
+                break;
+        }
+    }
+}
+
+/* Read and check the record at off, numbered seq unless that is 0.
+ * Returns it, or NULL at the end of the log. */
+static struct log_rec *read_rec(struct log_store *ls, uint64_t off,
+        uint64_t seq, uint64_t file_size)
+{
+    struct log_rec *rec = aligned_buf(&ls->bounce, &ls->bounce_cap,
+            LOG_ALIGN);
+    uint64_t sum;
+
+    if (off + LOG_ALIGN > file_size || read_full(ls, rec, LOG_ALIGN, off))
+        return NULL;
+    if (rec->magic != LOG_BACKEND_MAGIC || (seq != 0 && rec->seq != seq) ||
+            rec->len % LOG_ALIGN || rec->len == 0 ||
+            rec->len > file_size - off)
+        return NULL;
+
+    if (rec->len > LOG_ALIGN) {
+        uint64_t len = rec->len;
+
+        rec = aligned_buf(&ls->bounce, &ls->bounce_cap, len);
+        if (read_full(ls, rec, len, off))
+            return NULL;
+    }
+    if (sizeof(*rec) + rec->nentries * sizeof(struct log_ent) > rec->len)
+        return NULL;
+
+    sum = rec->sum;
+    rec->sum = 0;
+    if (log_sum(LOG_BACKEND_MAGIC, rec, rec->len) != sum)
+        return NULL;
+
+    return rec;
+}
+
+static int read_super(struct log_store *ls, int slot, struct log_super *sb)
+{
+    struct log_super *buf = aligned_buf(&ls->bounce, &ls->bounce_cap,
+            LOG_ALIGN);
+    uint64_t sum;
+
+    if (read_full(ls, buf, LOG_ALIGN, slot * LOG_ALIGN))
+        return -1;
+    *sb = *buf;
+    sum = sb->sum;
+    sb->sum = 0;
+    if (sb->magic != LOG_BACKEND_MAGIC ||
+            log_sum(LOG_BACKEND_MAGIC, sb, sizeof(*sb)) != sum)
+        return -1;
+    return 0;
+}
+
+/* Fill buf with the superblock naming the checkpoint at ckpt_off, to go
+ * in the slot the current one is not in */
+static uint64_t make_super(struct log_store *ls, void *buf, uint64_t ckpt_off)
+{
+    struct log_super *sb = buf;
+
+    memset(buf, 0, LOG_ALIGN);
+    sb->magic = LOG_BACKEND_MAGIC;
+    sb->gen = ++ls->super_gen;
+    sb->ckpt_off = ckpt_off;
+    sb->sum = log_sum(LOG_BACKEND_MAGIC, sb, sizeof(*sb));
+
+    return (sb->gen % 2) * LOG_ALIGN;
+}
+
+static void recover(struct log_store *ls, const char *path)
+{
+    struct log_super sb[2];
+    struct log_rec *rec;
+    struct stat st;
+    int ok[2], cur;
+
+    TEST_NZ(fstat(ls->fd, &st));
+    ls->tail = LOG_START;
+    ls->seq = 1;
+
+    if (st.st_size == 0) {
+        void *buf = aligned_buf(&ls->hdr, &ls->hdr_cap, LOG_ALIGN);
+        struct log_io io = { buf, LOG_ALIGN, make_super(ls, buf, 0) };
+
+        CHECK_ERROR(write_sync(ls, &io, 1) != 0,
+                ("Failure: could not initialize %s: %s\n", path,
+                 strerror(errno)));
+        return;
+    }
+
+    ok[0] = read_super(ls, 0, &sb[0]) == 0;
+    ok[1] = read_super(ls, 1, &sb[1]) == 0;
+    CHECK_ERROR(!ok[0] && !ok[1], ("Failure: %s is not a block log\n", path));
+    cur = !ok[0] || (ok[1] && sb[1].gen > sb[0].gen);
+    ls->super_gen = sb[cur].gen;
+    ls->durable_ckpt = sb[cur].ckpt_off;
+
+    if (sb[cur].ckpt_off != 0) {
+        // the checkpoint went to disk before the superblock naming it
+        rec = read_rec(ls, sb[cur].ckpt_off, 0, st.st_size);
+        CHECK_ERROR(rec == NULL || rec->type != LOG_REC_CKPT,
+                ("Failure: checkpoint of %s is damaged\n", path));
+        replay(ls, rec, sb[cur].ckpt_off);
+        ls->ckpt_pending = 0;
+        ls->tail = sb[cur].ckpt_off + rec->len;
+        ls->seq = rec->seq + 1;
+    }
+
+    /* replay commits up to the first that did not make it to disk whole */
+    while ((rec = read_rec(ls, ls->tail, ls->seq, st.st_size)) != NULL) {
+        replay(ls, rec, ls->tail);
+        ls->tail += rec->len;
+        ls->seq++;
+    }
+}
+
+/*
+ * CLEANER
+ */
+
+static int cmp_extent(const void *a, const void *b)
+{
+    const struct log_extent *x = a, *y = b;
+
+    return (x->off > y->off) - (x->off < y->off);
+}
+
+static void punch(struct log_store *ls, uint64_t off, uint64_t len)
+{
+    if (len > 0 && fallocate(ls->fd,
+                FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) != 0)
+        LOG(1, ("could not punch the log at %lx: %s\n", off,
+                    strerror(errno)));
+}
+
+/* Punch everything below the durable checkpoint the index does not point
+ * at. Run after recovery, which does not know what went stale before. */
+static void sweep(struct log_store *ls)
+{
+    hash_iterator_t it = hash_begin(ls->index);
+    struct log_extent *live = malloc((ls->ntags + 1) * sizeof(*live));
+    uint64_t n = 0, off = LOG_START;
+
+    TEST_Z(live);
+    for (; !hash_is_iterator_null(it); hash_next_iterator(it)) {
+        struct log_tag *t = hash_iterator_value(it);
+
+        if (t->off != 0 && t->off < ls->durable_ckpt) {
+            live[n].off = t->off;
+            live[n++].len = ALIGN_UP(t->size);
+        }
+    }
+    hash_delete_iterator(it);
+
+    qsort(live, n, sizeof(*live), cmp_extent);
+    for (uint64_t i = 0; i < n; i++) {
+        if (live[i].off > off)
+            punch(ls, off, live[i].off - off);
+        off = MAX(off, live[i].off + live[i].len);
+    }
+    if (ls->durable_ckpt > off)
+        punch(ls, off, ls->durable_ckpt - off);
+    free(live);
+}
+
+/* Punch out what the durable checkpoint no longer needs, whenever a new
+ * one becomes durable */
+static void *cleaner(void *arg)
+{
+    struct log_store *ls = arg;
+
+    TEST_NZ(pthread_mutex_lock(&ls->lock));
+    while (!ls->stop) {
+        struct log_extent *work = NULL;
+        uint64_t n = 0;
+
+        for (uint64_t i = 0; i < ls->nstale; i++) {
+            if (ls->stale[i].after >= ls->durable_ckpt)
+                continue;
+            if (work == NULL)
+                TEST_Z(work = malloc(ls->nstale * sizeof(*work)));
+            work[n++] = ls->stale[i];
+            ls->stale[i--] = ls->stale[--ls->nstale];
+        }
+        if (n == 0) {
+            TEST_NZ(pthread_cond_wait(&ls->cond, &ls->lock));
+            continue;
+        }
+        TEST_NZ(pthread_mutex_unlock(&ls->lock));
+
+        qsort(work, n, sizeof(*work), cmp_extent);
+        for (uint64_t i = 0, j; i < n; i = j) {
+            uint64_t last = work[i].off + work[i].len;
+
+            for (j = i + 1; j < n && work[j].off == last; j++)
+                last += work[j].len;
+            punch(ls, work[i].off, last - work[i].off);
+        }
+        free(work);
+
+        TEST_NZ(pthread_mutex_lock(&ls->lock));
+    }
+    TEST_NZ(pthread_mutex_unlock(&ls->lock));
+
+    return NULL;
+}
+
+/*
+ * LAYER
+ */
+
+static void log_connect(rmem_layer_t* rcfg, char* host, char* port)
+{
+    struct log_store *ls = rcfg->layer_data;
+
+    ls->direct = 1;
+    ls->fd = open(host, O_RDWR | O_CREAT | O_DIRECT, 0644);
+    if (ls->fd < 0 && errno == EINVAL) {
+        // tmpfs and some others take no O_DIRECT
+        ls->direct = 0;
+        ls->fd = open(host, O_RDWR | O_CREAT, 0644);
+    }
+    CHECK_ERROR(ls->fd < 0,
+            ("Failure: could not open %s: %s\n", host, strerror(errno)));
+
+    ls->use_uring = (uring_init(&ls->ring) == 0);
+    ls->index = hash_create(INDEX_HASH_SIZE);
+    TEST_NZ(pthread_mutex_init(&ls->lock, NULL));
+    TEST_NZ(pthread_cond_init(&ls->cond, NULL));
+
+    recover(ls, host);
+    sweep(ls);
+
+    TEST_NZ(pthread_create(&ls->cleaner, NULL, cleaner, ls));
+
+    LOG(5, ("opened %s%s%s, %ld tags, log ends at %ld\n", host,
+                ls->direct ? " direct" : "",
+                ls->use_uring ? " with io_uring" : "", ls->ntags, ls->tail));
+}
+
+static void log_disconnect(rmem_layer_t* rcfg)
+{
+    struct log_store *ls = rcfg->layer_data;
+
+    TEST_NZ(pthread_mutex_lock(&ls->lock));
+    ls->stop = 1;
+    TEST_NZ(pthread_cond_signal(&ls->cond));
+    TEST_NZ(pthread_mutex_unlock(&ls->lock));
+    TEST_NZ(pthread_join(ls->cleaner, NULL));
+
+    if (ls->use_uring)
+        uring_destroy(&ls->ring);
+    close(ls->fd);
+    index_clear(ls);
+    hash_destroy(ls->index);
+    if (ls->stage != NULL)
+        munmap(ls->stage, ls->stage_cap);
+    free(ls->ops);
+    free(ls->hdr);
+    free(ls->ckpt);
+    free(ls->bounce);
+    free(ls->ios);
+    free(ls->stale);
+}
+
+static struct log_ent *add_op(struct log_store *ls, uint32_t tag,
+        enum log_op op, uint64_t size, uint64_t off)
+{
+    struct log_ent *e;
+
+    if (ls->nops == ls->max_ops) {
+        ls->max_ops = ls->max_ops ? 2 * ls->max_ops : 256;
+        TEST_Z(ls->ops = realloc(ls->ops, ls->max_ops * sizeof(*ls->ops)));
+    }
+    e = &ls->ops[ls->nops++];
+    e->tag = tag;
+    e->op = op;
+    e->size = size;
+    e->off = off;
+    return e;
+}
+
+static uint64_t log_malloc(rmem_layer_t* rcfg, size_t size, uint32_t tag)
+{
+    struct log_store *ls = rcfg->layer_data;
+    struct log_tag *t = hash_get_item(ls->index, tag);
+
+    /* a tag that survived a restart is handed out again */
+    if (t != NULL)
+        return t->size >= size ? (uintptr_t)t : 0;
+
+    t = index_add(ls, tag, size);
+    add_op(ls, tag, LOG_ALLOC, size, 0);
+
+    return (uintptr_t)t;
+}
+
+static int log_free(rmem_layer_t* rcfg, uint32_t tag)
+{
+    struct log_store *ls = rcfg->layer_data;
+    struct log_tag *t = hash_get_item(ls->index, tag);
+
+    if (t == NULL)
+        return -1;
+
+    // the old version goes stale with the commit
+    add_op(ls, tag, LOG_FREE, t->size, t->off);
+    index_del(ls, tag);
+
+    return 0;
+}
+
+static int log_multi_malloc(rmem_layer_t *rcfg,
+    uint64_t *addrs, uint64_t size, uint32_t *tags, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        addrs[i] = log_malloc(rcfg, size, tags[i]);
+        if (addrs[i] == 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int log_multi_free(rmem_layer_t *rcfg,
+    uint32_t *tags, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+        if (log_free(rcfg, tags[i]) != 0)
+            return -1;
+
+    return 0;
+}
+
+static int log_put(rmem_layer_t* rcfg, uint32_t tag,
+        void *src, void *src_reg, size_t size)
+{
+    struct log_store *ls = rcfg->layer_data;
+    struct log_tag *t = hash_get_item(ls->index, tag);
+    struct log_ent *e;
+
+    if (t == NULL || size > t->size)
+        return EINVAL;
+
+    if (t->staged) {
+        // put twice in one txn, the latest wins
+        e = &ls->ops[t->staged - 1];
+    } else {
+        uint64_t len = ALIGN_UP(t->size);
+
+        if (ls->stage_len + len > ls->stage_cap) {
+            uint64_t cap = MAX(2 * ls->stage_cap,
+                    MAX(ls->stage_len + len, STAGE_MIN));
+            void *stage = ls->stage == NULL ?
+                mmap(NULL, cap, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) :
+                mremap(ls->stage, ls->stage_cap, cap, MREMAP_MAYMOVE);
+
+            if (stage == MAP_FAILED)
+                return ENOMEM;
+            ls->stage = stage;
+            ls->stage_cap = cap;
+        }
+        e = add_op(ls, tag, LOG_PUT, t->size, ls->stage_len);
+        t->staged = ls->nops;
+        ls->stage_len += len;
+    }
+
+    memcpy(ls->stage + e->off, src, size);
+    return 0;
+}
+
+static int log_get(rmem_layer_t* rcfg, void *dst,
+        void *dst_reg, uint32_t tag, size_t size)
+{
+    struct log_store *ls = rcfg->layer_data;
+    struct log_tag *t = hash_get_item(ls->index, tag);
+    uint64_t len;
+
+    if (t == NULL || size > t->size)
+        return EINVAL;
+    if (t->off == 0) {
+        memset(dst, 0, size);
+        return 0;
+    }
+
+    // O_DIRECT wants aligned buffers, ours are the caller's
+    len = ALIGN_UP(size);
+    if (read_full(ls, aligned_buf(&ls->bounce, &ls->bounce_cap, len), len,
+                t->off))
+        return EIO;
+    memcpy(dst, ls->bounce, size);
+
+    return 0;
+}
+
+static int log_put_v(rmem_layer_t* rcfg, rmem_iov_t *iov, int n)
+{
+    int err = 0;
+
+    for (int i = 0; i < n; i++) {
+        iov[i].status = log_put(rcfg, iov[i].tag, iov[i].addr, iov[i].reg,
+                iov[i].size);
+        if (iov[i].status != 0 && err == 0)
+            err = iov[i].status;
+    }
+
+    return err;
+}
+
+static int log_get_v(rmem_layer_t* rcfg, rmem_iov_t *iov, int n)
+{
+    int err = 0;
+
+    for (int i = 0; i < n; i++) {
+        iov[i].status = log_get(rcfg, iov[i].addr, iov[i].reg, iov[i].tag,
+                iov[i].size);
+        if (iov[i].status != 0 && err == 0)
+            err = iov[i].status;
+    }
+
+    return err;
+}
+
+/* Queue the whole index as a checkpoint record at off, returns its length */
+static uint64_t add_ckpt(struct log_store *ls, int *nio, uint64_t off)
+{
+    uint64_t len = ALIGN_UP(sizeof(struct log_rec) +
+            ls->ntags * sizeof(struct log_ent));
+    struct log_rec *rec = aligned_buf(&ls->ckpt, &ls->ckpt_cap, len);
+    hash_iterator_t it = hash_begin(ls->index);
+    uint64_t n = 0;
+
+    memset(rec, 0, len);
+    for (; !hash_is_iterator_null(it); hash_next_iterator(it)) {
+        struct log_tag *t = hash_iterator_value(it);
+
+        rec->ents[n].tag = hash_iterator_key(it);
+        rec->ents[n].size = t->size;
+        rec->ents[n].off = t->off;
+        rec->ents[n++].op = t->off ? LOG_PUT : LOG_ALLOC;
+    }
+    hash_delete_iterator(it);
+
+    rec->magic = LOG_BACKEND_MAGIC;
+    rec->seq = ls->seq++;
+    rec->len = len;
+    rec->type = LOG_REC_CKPT;
+    rec->nentries = n;
+    rec->sum = log_sum(LOG_BACKEND_MAGIC, rec, len);
+
+    *nio = add_io(ls, *nio, rec, len, off);
+    return len;
+}
+
+/* Every put since the last commit is committed, the tags only name the
+ * blocks rvm expects to be (RMEM_LAYER_NO_SHADOW passes src == dst). */
+static int log_atomic_commit(rmem_layer_t* rcfg,
+        uint32_t* tags_src, uint32_t* tags_dst, uint32_t* sizes, uint32_t ntag)
+{
+    struct log_store *ls = rcfg->layer_data;
+    uint64_t start = ls->tail, end = ls->tail, ckpt_off = 0, super_off;
+    uint64_t named = ls->ckpt_pending;
+    int nio = 0;
+
+    if (ls->failed)
+        return -1;
+    if (ls->nops == 0 && named == 0)
+        return 0;
+
+    if (ls->nops > 0) {
+        uint64_t hdr_len = ALIGN_UP(sizeof(struct log_rec) +
+                ls->nops * sizeof(struct log_ent));
+        struct log_rec *rec = aligned_buf(&ls->hdr, &ls->hdr_cap, hdr_len);
+
+        memset(rec, 0, hdr_len);
+        rec->magic = LOG_BACKEND_MAGIC;
+        rec->seq = ls->seq++;
+        rec->len = hdr_len + ls->stage_len;
+        rec->type = LOG_REC_COMMIT;
+        rec->nentries = ls->nops;
+        memcpy(rec->ents, ls->ops, ls->nops * sizeof(struct log_ent));
+
+        TEST_NZ(pthread_mutex_lock(&ls->lock));
+        for (uint64_t i = 0; i < ls->nops; i++) {
+            struct log_ent *e = &rec->ents[i];
+            struct log_tag *t;
+
+            if (e->op == LOG_FREE) {
+                add_stale(ls, e->off, ALIGN_UP(e->size), start);
+            } else if (e->op == LOG_PUT) {
+                e->off += start + hdr_len;
+                if ((t = hash_get_item(ls->index, e->tag)) != NULL &&
+                        t->staged == i + 1) {
+                    add_stale(ls, t->off, ALIGN_UP(t->size), start);
+                    t->off = e->off;
+                    t->staged = 0;
+                } else {
+                    // freed after the put, gone with this commit
+                    add_stale(ls, e->off, ALIGN_UP(e->size), start);
+                }
+            }
+        }
+        add_stale(ls, start, hdr_len, start);
+        TEST_NZ(pthread_mutex_unlock(&ls->lock));
+
+        rec->sum = log_sum(log_sum(LOG_BACKEND_MAGIC, rec, hdr_len),
+                ls->stage, ls->stage_len);
+        nio = add_io(ls, nio, rec, hdr_len, start);
+        nio = add_io(ls, nio, ls->stage, ls->stage_len, start + hdr_len);
+        end += rec->len;
+        ls->since_ckpt += rec->len;
+    }
+
+    /* a checkpoint named by the superblock of the next commit */
+    if (ls->since_ckpt >= MAX(CKPT_MIN_BYTES,
+                4 * ls->ntags * sizeof(struct log_ent))) {
+        ckpt_off = end;
+        end += add_ckpt(ls, &nio, ckpt_off);
+        ls->since_ckpt = 0;
+    }
+
+    /* name the checkpoint the last commit made durable */
+    if (named != 0) {
+        void *buf = aligned_buf(&ls->bounce, &ls->bounce_cap, LOG_ALIGN);
+
+        super_off = make_super(ls, buf, named);
+        nio = add_io(ls, nio, buf, LOG_ALIGN, super_off);
+    }
+
+    if (write_sync(ls, ls->ios, nio) != 0) {
+        LOG(1, ("commit of %ld bytes failed: %s\n", end - start,
+                    strerror(errno)));
+        ls->failed = 1;
+        return -1;
+    }
+
+    ls->tail = end;
+    ls->nops = 0;
+    ls->stage_len = 0;
+    ls->ckpt_pending = ckpt_off;
+
+    if (named != 0 || ckpt_off != 0) {
+        TEST_NZ(pthread_mutex_lock(&ls->lock));
+        if (ckpt_off != 0)
+            add_stale(ls, ckpt_off, end - ckpt_off, ckpt_off);
+        if (named != 0) {
+            ls->durable_ckpt = named;
+            TEST_NZ(pthread_cond_signal(&ls->cond));
+        }
+        TEST_NZ(pthread_mutex_unlock(&ls->lock));
+    }
+
+    return 0;
+}
+
+static void* log_register_data(rmem_layer_t* rcfg,
+        void* buf, size_t size)
+{
+    return buf;
+}
+
+static void log_deregister_data(rmem_layer_t* rcfg, void*buf)
+{
+    return;
+}
+
+rmem_layer_t* create_log_layer()
+{
+    rmem_layer_t *layer = malloc(sizeof(rmem_layer_t));
+    struct log_store *ls = calloc(1, sizeof(struct log_store));
+
+    CHECK_ERROR(layer == NULL || ls == NULL,
+            ("Failure: Error allocating layer struct\n"));
+
+    layer->connect = log_connect;
+    layer->disconnect = log_disconnect;
+    layer->malloc = log_malloc;
+    layer->free = log_free;
+    layer->put = log_put;
+    layer->get = log_get;
+    layer->put_v = log_put_v;
+    layer->get_v = log_get_v;
+    layer->atomic_commit = log_atomic_commit;
+    layer->register_data = log_register_data;
+    layer->deregister_data = log_deregister_data;
+    layer->multi_malloc = log_multi_malloc;
+    layer->multi_free = log_multi_free;
+    layer->flags = RMEM_LAYER_NO_SHADOW;
+    layer->layer_data = ls;
+
+    return layer;
+}
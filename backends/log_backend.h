@@ -0,0 +1,34 @@
+/*
+ * log_backend.h
+ *
+ *  Stores blocks in a log-structured file on a local SSD. connect's host
+ *  argument is the path of the log, created if it does not exist; the port
+ *  is ignored.
+ *
+ *  Puts are staged in memory. atomic_commit appends them with a commit
+ *  record to the end of the log, written with O_DIRECT through io_uring in
+ *  one batch that ends in a single flush, so a commit costs one flush
+ *  whatever its size. A commit only counts if its whole record checksums,
+ *  so a torn one is dropped on recovery. Gets read the committed version
+ *  through an in-memory index from tag to log offset.
+ *
+ *  Every so often the index itself is appended as a checkpoint record, and
+ *  the next commit points the superblock at it. Recovery loads the last
+ *  checkpoint and replays the commits after it. A background thread punches
+ *  holes over versions no checkpoint needs any more.
+ *
+ *  Without io_uring (old kernels, seccomp) the same writes go through
+ *  pwrite and fdatasync.
+ */
+
+#ifndef LOG_BACKEND_H_
+#define LOG_BACKEND_H_
+
+#include "rmem_generic_interface.h"
+
+#define LOG_BACKEND_MAGIC 0x52564d4c4f473031ULL
+
+/* Of type create_rmem_layer_f */
+rmem_layer_t* create_log_layer();
+
+#endif /* LOG_BACKEND_H_ */
@@ -0,0 +1,519 @@
+/*
+ * loop_backend.c
+ *
+ *  Store file layout: struct loop_file_hdr, then every block as a struct
+ *  loop_file_block followed by its data.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "../common.h"
+#include "../rmem_table.h"
+#include "../data/hash.h"
+#include "loop_backend.h"
+#include "../utils/log.h"
+#include "../utils/error.h"
+
+static const int HASH_SIZE = 10000;
+/* The last stretch of a delay is spun, sleeps overshoot by about this */
+#define LOOP_SPIN_NS 50000
+
+struct loop_file_hdr {
+    uint64_t magic;
+    uint64_t nblocks;
+};
+
+struct loop_file_block {
+    uint32_t tag;
+    uint32_t pad;
+    uint64_t size;
+};
+
+/* What a server would hold */
+struct loop_store {
+    struct loop_store *next;
+    char *name;
+    char *path;                 /**< file the store is kept in, or NULL */
+    pthread_mutex_t mutex;
+    struct rmem_table table;
+    hash_t sizes;               /**< tag -> malloc'd size of the block */
+    uint64_t link_free;         /**< when the link is done with the
+                                     transfers so far, in ns */
+};
+
+struct loop_rmem {
+    struct loop_store *store;
+    uint64_t latency;           /**< ns */
+    double ns_per_byte;
+    uint64_t jitter;            /**< ns */
+    unsigned int seed;
+    /* frees waiting for the next commit, as a server connection keeps them */
+    struct rmem_txn_list txn;
+    uint32_t *freed;
+    uint32_t nfreed, max_freed;
+};
+
+static pthread_mutex_t s_stores_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct loop_store *s_stores;
+static int s_atexit;
+
+/*
+ * NETWORK MODEL
+ */
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    TEST_NZ(clock_gettime(CLOCK_MONOTONIC, &ts));
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void wait_until(uint64_t t)
+{
+    uint64_t now;
+
+    while ((now = now_ns()) < t) {
+        if (t - now > LOOP_SPIN_NS) {
+            struct timespec ts = {
+                .tv_sec = (t - LOOP_SPIN_NS) / 1000000000ULL,
+                .tv_nsec = (t - LOOP_SPIN_NS) % 1000000000ULL
+            };
+
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+    }
+}
+
+/* Return once an operation moving bytes would have. The bytes queue behind
+ * those of every other layer on the store's link. */
+static void loop_delay(struct loop_rmem *lp, uint64_t bytes)
+{
+    struct loop_store *st = lp->store;
+    uint64_t done;
+
+    if (lp->latency == 0 && lp->ns_per_byte == 0 && lp->jitter == 0)
+        return;
+
+    done = now_ns();
+    if (lp->ns_per_byte > 0 && bytes > 0) {
+        TEST_NZ(pthread_mutex_lock(&st->mutex));
+        if (st->link_free > done)
+            done = st->link_free;
+        done += bytes * lp->ns_per_byte;
+        st->link_free = done;
+        TEST_NZ(pthread_mutex_unlock(&st->mutex));
+    }
+    done += lp->latency;
+    if (lp->jitter > 0)
+        done += rand_r(&lp->seed) % (lp->jitter + 1);
+
+    wait_until(done);
+}
+
+static double env_double(const char *name, double def)
+{
+    char *value = getenv(name);
+
+    return value != NULL ? strtod(value, NULL) : def;
+}
+
+/*
+ * STORES
+ */
+
+/* Called with the store's mutex held */
+static void *store_alloc(struct loop_store *st, size_t size, uint32_t tag)
+{
+    void *ptr = rmem_table_alloc(&st->table, size, tag);
+    uint64_t *size_ptr;
+
+    if (ptr != NULL && hash_get_item(st->sizes, tag) == NULL) {
+        TEST_Z(size_ptr = malloc(sizeof(*size_ptr)));
+        *size_ptr = size;
+        hash_insert_item(st->sizes, tag, size_ptr);
+    }
+    return ptr;
+}
+
+/* Block holding size bytes at tag, or NULL. Called with the mutex held. */
+static void *store_block(struct loop_store *st, uint32_t tag, size_t size)
+{
+    uint64_t *block_size = hash_get_item(st->sizes, tag);
+
+    if (block_size == NULL || size > *block_size)
+        return NULL;
+    return rmem_table_lookup(&st->table, tag);
+}
+
+static void store_load(struct loop_store *st)
+{
+    struct loop_file_hdr hdr;
+    struct loop_file_block blk;
+    FILE *f = fopen(st->path, "r");
+    void *ptr;
+
+    if (f == NULL) {
+        CHECK_ERROR(errno != ENOENT,
+                ("Failure: cannot open %s - %s\n", st->path, strerror(errno)));
+        return;
+    }
+
+    CHECK_ERROR(fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+            hdr.magic != LOOP_BACKEND_MAGIC,
+            ("Failure: %s is not a loopback store\n", st->path));
+    for (uint64_t i = 0; i < hdr.nblocks; i++) {
+        CHECK_ERROR(fread(&blk, sizeof(blk), 1, f) != 1,
+                ("Failure: %s is truncated\n", st->path));
+        ptr = store_alloc(st, blk.size, blk.tag);
+        CHECK_ERROR(ptr == NULL,
+                ("Failure: no room for block %u of %s\n", blk.tag, st->path));
+        CHECK_ERROR(fread(ptr, 1, blk.size, f) != blk.size,
+                ("Failure: %s is truncated\n", st->path));
+    }
+    fclose(f);
+
+    LOG(1, ("loaded %lu blocks from %s\n", hdr.nblocks, st->path));
+}
+
+/* Write the store next to its file and rename it over, so a crash while
+ * saving leaves the last copy. Called with the mutex held. */
+static void store_save(struct loop_store *st)
+{
+    struct loop_file_hdr hdr = {
+        .magic = LOOP_BACKEND_MAGIC,
+        .nblocks = hash_num_elements(st->sizes)
+    };
+    size_t len = strlen(st->path);
+    char tmp[len + 5];
+    hash_iterator_t it;
+    FILE *f;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", st->path);
+    f = fopen(tmp, "w");
+    CHECK_ERROR(f == NULL,
+            ("Failure: cannot create %s - %s\n", tmp, strerror(errno)));
+
+    CHECK_ERROR(fwrite(&hdr, sizeof(hdr), 1, f) != 1,
+            ("Failure: cannot write %s\n", tmp));
+    for (it = hash_begin(st->sizes); !hash_is_iterator_null(it);
+            hash_next_iterator(it)) {
+        struct loop_file_block blk = {
+            .tag = hash_iterator_key(it),
+            .size = *(uint64_t *)hash_iterator_value(it)
+        };
+        void *ptr = rmem_table_lookup(&st->table, blk.tag);
+
+        CHECK_ERROR(fwrite(&blk, sizeof(blk), 1, f) != 1 ||
+                fwrite(ptr, 1, blk.size, f) != blk.size,
+                ("Failure: cannot write %s\n", tmp));
+    }
+    hash_delete_iterator(it);
+
+    CHECK_ERROR(fclose(f) != 0 || rename(tmp, st->path) != 0,
+            ("Failure: cannot save %s - %s\n", st->path, strerror(errno)));
+}
+
+/* A client that "fails" by returning from main leaves its stores to the
+ * next process */
+static void save_stores(void)
+{
+    TEST_NZ(pthread_mutex_lock(&s_stores_mutex));
+    for (struct loop_store *st = s_stores; st != NULL; st = st->next) {
+        if (st->path == NULL)
+            continue;
+        TEST_NZ(pthread_mutex_lock(&st->mutex));
+        store_save(st);
+        TEST_NZ(pthread_mutex_unlock(&st->mutex));
+    }
+    TEST_NZ(pthread_mutex_unlock(&s_stores_mutex));
+}
+
+static struct loop_store *store_get(const char *name)
+{
+    struct loop_store *st;
+
+    TEST_NZ(pthread_mutex_lock(&s_stores_mutex));
+    for (st = s_stores; st != NULL; st = st->next)
+        if (strcmp(st->name, name) == 0)
+            break;
+
+    if (st == NULL) {
+        TEST_Z(st = calloc(1, sizeof(*st)));
+        TEST_Z(st->name = strdup(name));
+        st->path = strchr(name, '/') != NULL ? st->name : NULL;
+        TEST_NZ(pthread_mutex_init(&st->mutex, NULL));
+        init_rmem_table(&st->table, RMEM_DEFAULT_CAP);
+        st->sizes = hash_create(HASH_SIZE);
+
+        if (st->path != NULL) {
+            store_load(st);
+            if (!s_atexit)
+                TEST_NZ(atexit(save_stores));
+            s_atexit = 1;
+        }
+
+        st->next = s_stores;
+        s_stores = st;
+    }
+    TEST_NZ(pthread_mutex_unlock(&s_stores_mutex));
+
+    return st;
+}
+
+/*
+ * LAYER
+ */
+
+static void clear_txn(struct loop_rmem *lp)
+{
+    txn_list_clear(&lp->txn);
+    lp->nfreed = 0;
+}
+
+static void loop_connect(rmem_layer_t *rcfg, char *host, char *port)
+{
+    struct loop_rmem *lp = rcfg->layer_data;
+
+    lp->store = store_get(host);
+    loop_delay(lp, 0);
+}
+
+static void loop_disconnect(rmem_layer_t *rcfg)
+{
+    struct loop_rmem *lp = rcfg->layer_data;
+    struct loop_store *st = lp->store;
+
+    clear_txn(lp);
+    if (st->path != NULL) {
+        TEST_NZ(pthread_mutex_lock(&st->mutex));
+        store_save(st);
+        TEST_NZ(pthread_mutex_unlock(&st->mutex));
+    }
+    lp->store = NULL;
+}
+
+static uint64_t loop_malloc(rmem_layer_t *rcfg, size_t size, uint32_t tag)
+{
+    struct loop_rmem *lp = rcfg->layer_data;
+    struct loop_store *st = lp->store;
+    void *ptr;
+
+    TEST_NZ(pthread_mutex_lock(&st->mutex));
+    ptr = store_alloc(st, size, tag);
+    TEST_NZ(pthread_mutex_unlock(&st->mutex));
+    loop_delay(lp, 0);
+
+    return (uintptr_t)ptr;
+}
+
+static int loop_multi_malloc(rmem_layer_t *rcfg, uint64_t *addrs,
+        uint64_t size, uint32_t *tags, uint32_t n)
+{
+    struct loop_rmem *lp = rcfg->layer_data;
+    struct loop_store *st = lp->store;
+    int err = 0;
+
+    TEST_NZ(pthread_mutex_lock(&st->mutex));
+    for (uint32_t i = 0; i < n; i++) {
+        addrs[i] = (uintptr_t)store_alloc(st, size, tags[i]);
+        if (addrs[i] == 0)
+            err = ENOMEM;
+    }
+    TEST_NZ(pthread_mutex_unlock(&st->mutex));
+    loop_delay(lp, 0);
+
+    return err;
+}
+
+static int loop_free(rmem_layer_t *rcfg, uint32_t tag)
+{
+    struct loop_rmem *lp = rcfg->layer_data;
+    struct loop_store *st = lp->store;
+    void *ptr;
+
+    TEST_NZ(pthread_mutex_lock(&st->mutex));
+    ptr = rmem_table_lookup(&st->table, tag);
+    TEST_NZ(pthread_mutex_unlock(&st->mutex));
+    CHECK_ERROR(ptr == NULL, ("Failure: tag %d not found\n", tag));
+
+    // applied with the next commit
+    if (lp->nfreed == lp->max_freed) {
+        lp->max_freed = lp->max_freed ? 2 * lp->max_freed : 64;
+        TEST_Z(lp->freed = realloc(lp->freed,
+                    lp->max_freed * sizeof(*lp->freed)));
+    }
+    lp->freed[lp->nfreed++] = tag;
+    TEST_NZ(txn_list_add_free(&lp->txn, ptr));
+
+    return 0;
+}
+
+static int loop_multi_free(rmem_layer_t *rcfg, uint32_t *tags, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+        loop_free(rcfg, tags[i]);
+
+    return 0;
+}
+
+/* Copy the transfers in or out of the store, as one operation */
+static int loop_transfer(rmem_layer_t *rcfg, rmem_iov_t *iov, int n,
+        int put)
+{
+    struct loop_rmem *lp = rcfg->layer_data;
+    struct loop_store *st = lp->store;
+    uint64_t bytes = 0;
+    int err = 0;
+
+    TEST_NZ(pthread_mutex_lock(&st->mutex));
+    for (int i = 0; i < n; i++) {
+        void *ptr = store_block(st, iov[i].tag, iov[i].size);
+
+        if (ptr == NULL) {
+            iov[i].status = EINVAL;
+            if (err == 0)
+                err = EINVAL;
+            continue;
+        }
+        if (put)
+            memcpy(ptr, iov[i].addr, iov[i].size);
+        else
+            memcpy(iov[i].addr, ptr, iov[i].size);
+        iov[i].status = 0;
+        bytes += iov[i].size;
+    }
+    TEST_NZ(pthread_mutex_unlock(&st->mutex));
+    loop_delay(lp, bytes);
+
+    return err;
+}
+
+static int loop_put(rmem_layer_t *rcfg, uint32_t tag, void *src,
+        void *src_reg, size_t size)
+{
+    rmem_iov_t iov = { .tag = tag, .addr = src, .size = size };
+
+    return loop_transfer(rcfg, &iov, 1, 1);
+}
+
+static int loop_get(rmem_layer_t *rcfg, void *dst, void *dst_reg,
+        uint32_t tag, size_t size)
+{
+    rmem_iov_t iov = { .tag = tag, .addr = dst, .size = size };
+
+    return loop_transfer(rcfg, &iov, 1, 0);
+}
+
+static int loop_put_v(rmem_layer_t *rcfg, rmem_iov_t *iov, int n)
+{
+    return loop_transfer(rcfg, iov, n, 1);
+}
+
+static int loop_get_v(rmem_layer_t *rcfg, rmem_iov_t *iov, int n)
+{
+    return loop_transfer(rcfg, iov, n, 0);
+}
+
+/* Applies the pending frees and the copies together, or nothing if a tag
+ * is unknown, as the server does with a bad descriptor */
+static int loop_atomic_commit(rmem_layer_t *rcfg, uint32_t *tags_src,
+        uint32_t *tags_dst, uint32_t *tags_size, uint32_t num_tags)
+{
+    struct loop_rmem *lp = rcfg->layer_data;
+    struct loop_store *st = lp->store;
+    int err = 0;
+
+    TEST_NZ(pthread_mutex_lock(&st->mutex));
+    for (uint32_t i = 0; i < num_tags && err == 0; i++) {
+        void *dst = store_block(st, tags_dst[i], tags_size[i]);
+        void *src = store_block(st, tags_src[i], tags_size[i]);
+
+        if (dst == NULL || src == NULL)
+            err = EINVAL;
+        else
+            TEST_NZ(txn_list_add_cp(&lp->txn, dst, src, tags_size[i]));
+    }
+
+    if (err == 0) {
+        txn_commit(&st->table, &lp->txn);
+        for (uint32_t i = 0; i < lp->nfreed; i++) {
+            free(hash_get_item(st->sizes, lp->freed[i]));
+            hash_delete_item(st->sizes, lp->freed[i]);
+        }
+    }
+    TEST_NZ(pthread_mutex_unlock(&st->mutex));
+    clear_txn(lp);
+    loop_delay(lp, 0);
+
+    return err;
+}
+
+uint32_t loop_layer_tags(rmem_layer_t *layer, uint32_t **tags)
+{
+    struct loop_rmem *lp = layer->layer_data;
+    struct loop_store *st = lp->store;
+    hash_iterator_t it;
+    uint32_t n = 0;
+
+    TEST_NZ(pthread_mutex_lock(&st->mutex));
+    TEST_Z(*tags = malloc((hash_num_elements(st->sizes) + 1) *
+                sizeof(**tags)));
+    for (it = hash_begin(st->sizes); !hash_is_iterator_null(it);
+            hash_next_iterator(it))
+        (*tags)[n++] = hash_iterator_key(it);
+    hash_delete_iterator(it);
+    TEST_NZ(pthread_mutex_unlock(&st->mutex));
+
+    return n;
+}
+
+/* Nothing to register, the store is in the same address space */
+static void *loop_register_data(rmem_layer_t *rcfg, void *data, size_t size)
+{
+    return data;
+}
+
+static void loop_deregister_data(rmem_layer_t *rcfg, void *data)
+{
+}
+
+rmem_layer_t* create_loop_layer()
+{
+    rmem_layer_t *layer;
+    struct loop_rmem *lp;
+    double bandwidth = env_double("RMEM_LOOP_BANDWIDTH", 0);
+
+    TEST_Z(layer = calloc(1, sizeof(*layer)));
+    TEST_Z(lp = calloc(1, sizeof(*lp)));
+
+    lp->latency = env_double("RMEM_LOOP_LATENCY", 0) * 1000;
+    lp->ns_per_byte = bandwidth > 0 ? 1000.0 / bandwidth : 0;
+    lp->jitter = env_double("RMEM_LOOP_JITTER", 0) * 1000;
+    lp->seed = env_double("RMEM_LOOP_SEED", 1);
+    txn_list_init(&lp->txn);
+
+    layer->connect = loop_connect;
+    layer->disconnect = loop_disconnect;
+    layer->malloc = loop_malloc;
+    layer->free = loop_free;
+    layer->multi_malloc = loop_multi_malloc;
+    layer->multi_free = loop_multi_free;
+    layer->put = loop_put;
+    layer->get = loop_get;
+    layer->put_v = loop_put_v;
+    layer->get_v = loop_get_v;
+    layer->atomic_commit = loop_atomic_commit;
+    layer->register_data = loop_register_data;
+    layer->deregister_data = loop_deregister_data;
+    layer->flags = 0;
+    layer->layer_data = lp;
+
+    return layer;
+}
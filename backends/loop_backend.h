@@ -0,0 +1,40 @@
+/*
+ * loop_backend.h
+ *
+ *  Remote memory in the client's own process, for measuring the client and
+ *  its recovery without a network. Blocks live in an rmem_table as they do
+ *  in rmem-server, and frees and commits follow the server: frees wait for
+ *  the next atomic_commit, which applies them and the copies as one
+ *  transaction.
+ *
+ *  connect's host argument names the store, the port is ignored. A store
+ *  outlives disconnect and later connects in the process find it, as a
+ *  server would. A name with a '/' in it is also a file path: the store is
+ *  loaded from the file when first used and saved to it at disconnect and
+ *  when the process exits, so tests can "fail" and recover in a new process.
+ *
+ *  Every round trip is delayed by a model of the network, set from the
+ *  environment when the layer is created:
+ *    RMEM_LOOP_LATENCY    microseconds per operation (0)
+ *    RMEM_LOOP_BANDWIDTH  MB/s of the store's link, shared by all the
+ *                         layers using it; 0 for no limit (0)
+ *    RMEM_LOOP_JITTER     up to this many microseconds more, uniformly (0)
+ *    RMEM_LOOP_SEED       seed of the jitter, for repeatable runs (1)
+ *  A vectored put or get and a commit are one operation. Frees are sent
+ *  with the commit, so they cost nothing on their own.
+ */
+
+#ifndef LOOP_BACKEND_H_
+#define LOOP_BACKEND_H_
+
+#include "rmem_generic_interface.h"
+
+#define LOOP_BACKEND_MAGIC 0x52564d4c4f4f5031ULL
+
+/* Of type create_rmem_layer_f */
+rmem_layer_t* create_loop_layer();
+
+/* Tags held by the store the layer is connected to, in a malloc'd array */
+uint32_t loop_layer_tags(rmem_layer_t *layer, uint32_t **tags);
+
+#endif /* LOOP_BACKEND_H_ */
@@ -0,0 +1,506 @@
+/*
+ * pmem_backend.c
+ *
+ *  Pool layout: struct pmem_hdr with the tag directory, then the slots,
+ *  each aligned to a cache line.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __x86_64__
+#include <cpuid.h>
+#include <emmintrin.h>
+#endif
+#include <pmem_backend.h>
+#include "log.h"
+#include "error.h"
+
+#define CACHE_LINE 64
+#define LINE_UP(x) (((x) + CACHE_LINE - 1) & ~((uint64_t)CACHE_LINE - 1))
+#define PAGE_UP(x) (((x) + 4095) & ~4095ULL)
+
+enum { PMEM_EMPTY = 0, PMEM_LIVE = 1, PMEM_DEAD = 2 };
+
+/* One tag, in one cache line. A dead entry keeps its slots for the next
+ * tag that lands on it. */
+struct pmem_entry {
+    uint32_t tag;
+    uint32_t flags;
+    uint64_t size;
+    uint64_t off[2];
+    /* epoch << 1 | slot, of the last put. Written in one store, so a crash
+     * leaves either the old or the new value. */
+    volatile uint64_t state;
+    uint64_t pad[3];
+} __attribute__((aligned(CACHE_LINE)));
+
+struct pmem_hdr {
+    uint64_t magic;
+    uint64_t size;              /* of the pool */
+    uint64_t data_end;          /* end of the last slot */
+    uint64_t used;              /* buckets not empty */
+    /* on a line of its own, the commit flushes nothing else */
+    volatile uint64_t epoch __attribute__((aligned(CACHE_LINE)));
+    struct pmem_entry table[PMEM_BUCKETS];
+};
+
+struct pmem_pool {
+    int fd;
+    struct pmem_hdr *hdr;
+    size_t len;
+    int sync;                   /* mapped MAP_SYNC, flushed lines persist */
+
+    uint32_t *frees;            /* applied at the next commit */
+    uint32_t nfrees, max_frees;
+    int dirty;
+};
+
+/*
+ * PERSISTENCE
+ */
+
+#ifdef __x86_64__
+static void flush_clwb(const void *p)
+{
+    asm volatile("clwb %0" : "+m" (*(volatile char *)p));
+}
+
+static void flush_clflushopt(const void *p)
+{
+    asm volatile("clflushopt %0" : "+m" (*(volatile char *)p));
+}
+
+static void flush_clflush(const void *p)
+{
+    asm volatile("clflush %0" : "+m" (*(volatile char *)p));
+}
+
+static void (*flush_line)(const void *p) = flush_clflush;
+
+static void pick_flush(void)
+{
+    unsigned a, b, c, d;
+
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d))
+        return;
+    if (b & (1 << 24))
+        flush_line = flush_clwb;
+    else if (b & (1 << 23))
+        flush_line = flush_clflushopt;
+}
+
+static inline void fence(void)
+{
+    _mm_sfence();
+}
+#else
+static void flush_page(const void *p)
+{
+    msync((void *)((uintptr_t)p & ~4095UL), 4096, MS_SYNC);
+}
+
+static void (*flush_line)(const void *p) = flush_page;
+
+static void pick_flush(void)
+{
+}
+
+static inline void fence(void)
+{
+    __sync_synchronize();
+}
+#endif
+
+static void flush_range(const void *p, size_t len)
+{
+    for (uintptr_t line = (uintptr_t)p & ~(CACHE_LINE - 1UL);
+            line < (uintptr_t)p + len; line += CACHE_LINE)
+        flush_line((const void *)line);
+}
+
+/* Copy to a cache line aligned dst, around the caches where we can */
+static void stream_copy(char *dst, const char *src, size_t size)
+{
+    size_t i = 0;
+
+#ifdef __x86_64__
+    for (; i + CACHE_LINE <= size; i += CACHE_LINE) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + i + 48));
+
+        _mm_stream_si128((__m128i *)(dst + i), a);
+        _mm_stream_si128((__m128i *)(dst + i + 16), b);
+        _mm_stream_si128((__m128i *)(dst + i + 32), c);
+        _mm_stream_si128((__m128i *)(dst + i + 48), d);
+    }
+#endif
+    if (i < size) {
+        memcpy(dst + i, src + i, size - i);
+        flush_range(dst + i, size - i);
+    }
+}
+
+/*
+ * DIRECTORY
+ */
+
+static uint64_t bucket(uint32_t tag)
+{
+    return ((tag * 0x9e3779b1U) >> 8) % PMEM_BUCKETS;
+}
+
+/* The live entry of tag, or NULL. *slot gets the first dead or the empty
+ * bucket tag would go in. */
+static struct pmem_entry *find(struct pmem_pool *pp, uint32_t tag,
+        struct pmem_entry **slot)
+{
+    struct pmem_entry *e;
+
+    *slot = NULL;
+    for (uint64_t i = bucket(tag); ; i = (i + 1) % PMEM_BUCKETS) {
+        e = &pp->hdr->table[i];
+        if (e->flags == PMEM_EMPTY)
+            break;
+        if (e->flags == PMEM_LIVE && e->tag == tag)
+            return e;
+        if (e->flags == PMEM_DEAD && *slot == NULL)
+            *slot = e;
+    }
+    if (*slot == NULL)
+        *slot = e;
+    return NULL;
+}
+
+static struct pmem_entry *lookup(struct pmem_pool *pp, uint32_t tag,
+        size_t size)
+{
+    struct pmem_entry *slot, *e = find(pp, tag, &slot);
+
+    RETURN_ERROR(e == NULL, NULL, ("Failure: tag %d not found\n", tag));
+    RETURN_ERROR(size > e->size, NULL,
+            ("Failure: %ld bytes do not fit in tag %d\n", size, tag));
+    return e;
+}
+
+/* Slot holding the committed contents of e */
+static int committed_slot(struct pmem_pool *pp, struct pmem_entry *e)
+{
+    uint64_t state = e->state;
+
+    if ((state >> 1) <= pp->hdr->epoch)
+        return state & 1;
+    return !(state & 1);
+}
+
+/*
+ * LAYER
+ */
+
+static void pmem_connect(rmem_layer_t* rcfg, char* host, char* port)
+{
+    struct pmem_pool *pp = rcfg->layer_data;
+    struct stat st;
+    int created;
+
+    pp->fd = open(host, O_RDWR | O_CREAT, 0644);
+    CHECK_ERROR(pp->fd < 0,
+            ("Failure: could not open %s: %s\n", host, strerror(errno)));
+    CHECK_ERROR(fstat(pp->fd, &st) != 0,
+            ("Failure: could not stat %s: %s\n", host, strerror(errno)));
+
+    created = (st.st_size == 0);
+    if (created) {
+        uint64_t mb = port != NULL ? strtoull(port, NULL, 10) : 0;
+
+        st.st_size = mb != 0 ? mb << 20 : PMEM_DEFAULT_SIZE;
+        CHECK_ERROR(st.st_size < (off_t)PAGE_UP(sizeof(struct pmem_hdr)),
+                ("Failure: a pool needs more than %ld bytes\n",
+                 sizeof(struct pmem_hdr)));
+        CHECK_ERROR(posix_fallocate(pp->fd, 0, st.st_size) != 0,
+                ("Failure: could not size %s\n", host));
+    }
+    pp->len = st.st_size;
+
+#ifdef MAP_SYNC
+    pp->hdr = mmap(NULL, pp->len, PROT_READ | PROT_WRITE,
+            MAP_SHARED_VALIDATE | MAP_SYNC, pp->fd, 0);
+    pp->sync = (pp->hdr != MAP_FAILED);
+    if (!pp->sync)
+#endif
+        pp->hdr = mmap(NULL, pp->len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                pp->fd, 0);
+    CHECK_ERROR(pp->hdr == MAP_FAILED,
+            ("Failure: could not map %s: %s\n", host, strerror(errno)));
+
+    // the magic goes in last, a pool without it was never set up
+    if (created || pp->hdr->magic == 0) {
+        pp->hdr->size = pp->len;
+        pp->hdr->data_end = PAGE_UP(sizeof(struct pmem_hdr));
+        pp->hdr->used = 0;
+        pp->hdr->epoch = 1;
+        flush_range(pp->hdr, sizeof(*pp->hdr) - sizeof(pp->hdr->table));
+        fence();
+        pp->hdr->magic = PMEM_BACKEND_MAGIC;
+        flush_line(pp->hdr);
+        fence();
+    }
+    CHECK_ERROR(pp->hdr->magic != PMEM_BACKEND_MAGIC ||
+            pp->hdr->size != pp->len,
+            ("Failure: %s is not a block pool\n", host));
+
+    /* a put of an epoch that never committed would count once the epoch is
+     * reached again, point the entry back at its committed slot; the next
+     * commit's fence orders the flushes before the epoch moves */
+    for (uint64_t i = 0; i < PMEM_BUCKETS; i++) {
+        struct pmem_entry *e = &pp->hdr->table[i];
+
+        if (e->flags == PMEM_EMPTY || (e->state >> 1) <= pp->hdr->epoch)
+            continue;
+        e->state = pp->hdr->epoch << 1 | committed_slot(pp, e);
+        flush_line(e);
+    }
+
+    LOG(5, ("mapped %s%s at epoch %ld, %ld of %ld bytes used\n", host,
+                pp->sync ? " (DAX)" : "", pp->hdr->epoch,
+                pp->hdr->data_end, pp->len));
+}
+
+static void pmem_disconnect(rmem_layer_t* rcfg)
+{
+    struct pmem_pool *pp = rcfg->layer_data;
+
+    munmap(pp->hdr, pp->len);
+    close(pp->fd);
+    free(pp->frees);
+    pp->frees = NULL;
+    pp->nfrees = pp->max_frees = 0;
+}
+
+static uint64_t pmem_malloc(rmem_layer_t* rcfg, size_t size, uint32_t tag)
+{
+    struct pmem_pool *pp = rcfg->layer_data;
+    struct pmem_hdr *hdr = pp->hdr;
+    struct pmem_entry *slot, *e = find(pp, tag, &slot);
+
+    /* a tag that survived a restart is handed out again */
+    if (e != NULL)
+        return e->size >= size ? e->off[0] : 0;
+
+    e = slot;
+    if (e->flags == PMEM_EMPTY) {
+        RETURN_ERROR(hdr->used >= PMEM_BUCKETS / 4 * 3, 0,
+                ("Failure: tag directory full\n"));
+        hdr->used++;
+    }
+
+    /* slots are claimed in the header before the entry points at them */
+    if (e->flags == PMEM_EMPTY || e->size < size) {
+        uint64_t len = LINE_UP(size);
+
+        RETURN_ERROR(hdr->data_end + 2 * len > hdr->size, 0,
+                ("Failure: pool is full\n"));
+        e->size = len;
+        e->off[0] = hdr->data_end;
+        e->off[1] = hdr->data_end + len;
+        hdr->data_end += 2 * len;
+    }
+    flush_line(hdr);
+
+    e->tag = tag;
+    e->state = 0;
+    flush_line(e);
+    fence();
+    e->flags = PMEM_LIVE;
+    flush_line(e);
+    pp->dirty = 1;
+
+    return e->off[0];
+}
+
+static int pmem_free(rmem_layer_t* rcfg, uint32_t tag)
+{
+    struct pmem_pool *pp = rcfg->layer_data;
+
+    if (pp->nfrees == pp->max_frees) {
+        uint32_t max = pp->max_frees ? 2 * pp->max_frees : 64;
+        uint32_t *frees = realloc(pp->frees, max * sizeof(*frees));
+
+        RETURN_ERROR(frees == NULL, -1,
+                ("Failure: error allocating free list\n"));
+        pp->frees = frees;
+        pp->max_frees = max;
+    }
+
+    // applied with the next commit
+    pp->frees[pp->nfrees++] = tag;
+    pp->dirty = 1;
+
+    return 0;
+}
+
+static int pmem_multi_malloc(rmem_layer_t *rcfg,
+    uint64_t *addrs, uint64_t size, uint32_t *tags, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        addrs[i] = pmem_malloc(rcfg, size, tags[i]);
+        if (addrs[i] == 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int pmem_multi_free(rmem_layer_t *rcfg,
+    uint32_t *tags, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+        if (pmem_free(rcfg, tags[i]) != 0)
+            return -1;
+
+    return 0;
+}
+
+static int pmem_put(rmem_layer_t* rcfg, uint32_t tag,
+        void *src, void *src_reg, size_t size)
+{
+    struct pmem_pool *pp = rcfg->layer_data;
+    struct pmem_entry *e = lookup(pp, tag, size);
+    uint64_t next = pp->hdr->epoch + 1;
+
+    if (e == NULL)
+        return EINVAL;
+
+    /* the first put of an epoch takes the slot that is not committed,
+     * later ones overwrite it */
+    if ((e->state >> 1) != next) {
+        e->state = next << 1 | !committed_slot(pp, e);
+        flush_line(e);
+    }
+    pp->dirty = 1;
+
+    stream_copy((char *)pp->hdr + e->off[e->state & 1], src, size);
+    return 0;
+}
+
+static int pmem_get(rmem_layer_t* rcfg, void *dst,
+        void *dst_reg, uint32_t tag, size_t size)
+{
+    struct pmem_pool *pp = rcfg->layer_data;
+    struct pmem_entry *e = lookup(pp, tag, size);
+
+    if (e == NULL)
+        return EINVAL;
+
+    memcpy(dst, (char *)pp->hdr + e->off[committed_slot(pp, e)], size);
+    return 0;
+}
+
+static int pmem_put_v(rmem_layer_t* rcfg, rmem_iov_t *iov, int n)
+{
+    int err = 0;
+
+    for (int i = 0; i < n; i++) {
+        iov[i].status = pmem_put(rcfg, iov[i].tag, iov[i].addr, iov[i].reg,
+                iov[i].size);
+        if (iov[i].status != 0 && err == 0)
+            err = iov[i].status;
+    }
+
+    return err;
+}
+
+static int pmem_get_v(rmem_layer_t* rcfg, rmem_iov_t *iov, int n)
+{
+    int err = 0;
+
+    for (int i = 0; i < n; i++) {
+        iov[i].status = pmem_get(rcfg, iov[i].addr, iov[i].reg, iov[i].tag,
+                iov[i].size);
+        if (iov[i].status != 0 && err == 0)
+            err = iov[i].status;
+    }
+
+    return err;
+}
+
+/* Every put since the last commit is committed, the tags only name the
+ * blocks rvm expects to be (RMEM_LAYER_NO_SHADOW passes src == dst). */
+static int pmem_atomic_commit(rmem_layer_t* rcfg,
+        uint32_t* tags_src, uint32_t* tags_dst, uint32_t* sizes, uint32_t ntag)
+{
+    struct pmem_pool *pp = rcfg->layer_data;
+
+    if (!pp->dirty)
+        return 0;
+
+    /* the streamed slots and flushed entries of this epoch persist before
+     * the epoch that makes them count */
+    fence();
+    pp->hdr->epoch++;
+    flush_line((const void *)&pp->hdr->epoch);
+    fence();
+
+    /* the entries persist with the next commit's fence, until then a crash
+     * merely leaves the tags allocated */
+    for (uint32_t i = 0; i < pp->nfrees; i++) {
+        struct pmem_entry *slot, *e = find(pp, pp->frees[i], &slot);
+
+        if (e == NULL)
+            continue;
+        e->flags = PMEM_DEAD;
+        flush_line(e);
+    }
+    pp->dirty = (pp->nfrees > 0);
+    pp->nfrees = 0;
+
+    return 0;
+}
+
+static void* pmem_register_data(rmem_layer_t* rcfg,
+        void* buf, size_t size)
+{
+    return buf;
+}
+
+static void pmem_deregister_data(rmem_layer_t* rcfg, void*buf)
+{
+    return;
+}
+
+rmem_layer_t* create_pmem_layer()
+{
+    rmem_layer_t *layer = malloc(sizeof(rmem_layer_t));
+    struct pmem_pool *pp = calloc(1, sizeof(struct pmem_pool));
+
+    CHECK_ERROR(layer == NULL || pp == NULL,
+            ("Failure: Error allocating layer struct\n"));
+    pick_flush();
+
+    layer->connect = pmem_connect;
+    layer->disconnect = pmem_disconnect;
+    layer->malloc = pmem_malloc;
+    layer->free = pmem_free;
+    layer->put = pmem_put;
+    layer->get = pmem_get;
+    layer->put_v = pmem_put_v;
+    layer->get_v = pmem_get_v;
+    layer->atomic_commit = pmem_atomic_commit;
+    layer->register_data = pmem_register_data;
+    layer->deregister_data = pmem_deregister_data;
+    layer->multi_malloc = pmem_multi_malloc;
+    layer->multi_free = pmem_multi_free;
+    layer->flags = RMEM_LAYER_NO_SHADOW;
+    layer->layer_data = pp;
+
+    return layer;
+}
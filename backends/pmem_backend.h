@@ -0,0 +1,34 @@
+/*
+ * pmem_backend.h
+ *
+ *  Stores blocks in persistent memory, through a file on a DAX file system
+ *  mapped with MAP_SYNC. A file in /dev/shm stands in for testing; it is
+ *  then mapped plainly and only survives process crashes. connect's host
+ *  argument is the path of the pool; port is the size in MB of a new pool
+ *  (0 for PMEM_DEFAULT_SIZE), an existing one keeps its size.
+ *
+ *  The tag directory is an open-addressing table in the pool, so recovery
+ *  is mapping it and turning back the entries of puts that were never
+ *  committed. Every tag has two slots: a put streams into the one
+ *  not holding the committed data with non-temporal stores and flushes the
+ *  tag's entry with CLWB. atomic_commit orders those behind one SFENCE,
+ *  then bumps and flushes the pool's commit epoch, which makes all slots
+ *  written in the epoch current. There are no system calls on the put and
+ *  commit paths. The slots stand in for shadow blocks, so the layer is
+ *  RMEM_LAYER_NO_SHADOW.
+ */
+
+#ifndef PMEM_BACKEND_H_
+#define PMEM_BACKEND_H_
+
+#include "rmem_generic_interface.h"
+
+#define PMEM_BACKEND_MAGIC 0x52564d504d454d31ULL
+#define PMEM_DEFAULT_SIZE (1ULL << 30)
+/* Directory entries, the table is kept at most three quarters full */
+#define PMEM_BUCKETS (1 << 18)
+
+/* Of type create_rmem_layer_f */
+rmem_layer_t* create_pmem_layer();
+
+#endif /* PMEM_BACKEND_H_ */
@@ -4,6 +4,7 @@
 #include <RamCloud.h>
 #include <OptionParser.h>
 #include <map>
+#include <vector>
 #include <algorithm>
 
 #define RAMC_DEBUG
@@ -244,6 +245,92 @@ int rc_get(rmem_layer_t *rmem_layer, void *dst, void *data_mr,
     return 0;
 }
 
+/*
+ * Writes the chunks of every tag in iov with a single multiWrite, so the
+ * whole batch costs one round of RPCs to the masters instead of one RPC per
+ * chunk.
+ */
+int rc_put_v(rmem_layer_t *rmem_layer, rmem_iov_t *iov, int n)
+{
+#ifdef RAMC_DEBUG
+    fprintf(stderr, "rc_put_v %d\n", n);
+#endif
+    ramcloud_data_t* data = (ramcloud_data_t*)rmem_layer->layer_data;
+    tag_map* tag_to_key = data->tag_to_key;
+    uint64_t table_id = data->table_id;
+
+    size_t nchunks = 0;
+    for (int j = 0; j < n; ++j)
+        nchunks += (iov[j].size + VALUE_MAX_SIZE - 1) / VALUE_MAX_SIZE;
+
+    // the keys must outlive the request objects
+    std::vector<std::string> keys;
+    std::vector<MultiWriteObject> objects;
+    std::vector<MultiWriteObject*> requests;
+    keys.reserve(nchunks);
+    objects.reserve(nchunks);
+    requests.reserve(nchunks);
+
+    for (int j = 0; j < n; ++j) {
+        tag_map::iterator it = tag_to_key->find(iov[j].tag);
+        CHECK_ERROR(it == tag_to_key->end(),
+                ("Error: did not find tag %d in tag_to_key map\n",
+                 iov[j].tag));
+
+        int64_t size_left = iov[j].size;
+        for (int i = 0; size_left > 0; ++i) {
+            int64_t size_to_write = std::min(size_left,
+                    (int64_t)VALUE_MAX_SIZE);
+
+            keys.push_back(CHUNK_KEY(it->second, i));
+            objects.push_back(MultiWriteObject(table_id,
+                        keys.back().c_str(), keys.back().size(),
+                        (char*)iov[j].addr + i * VALUE_MAX_SIZE,
+                        size_to_write));
+            size_left -= VALUE_MAX_SIZE;
+        }
+    }
+
+    for (size_t i = 0; i < objects.size(); ++i)
+        requests.push_back(&objects[i]);
+    if (!requests.empty())
+        data->client->multiWrite(&requests[0], requests.size());
+
+    int err = 0;
+    for (size_t i = 0, j = 0; j < (size_t)n; ++j) {
+        size_t chunks = (iov[j].size + VALUE_MAX_SIZE - 1) / VALUE_MAX_SIZE;
+
+        iov[j].status = 0;
+        for (size_t c = 0; c < chunks; ++c, ++i) {
+            if (objects[i].status != STATUS_OK)
+                iov[j].status = EIO;
+        }
+        if (iov[j].status == 0)
+            data->tag_written->operator[](iov[j].tag) = true;
+        else if (err == 0)
+            err = iov[j].status;
+    }
+
+    return err;
+}
+
+/*
+ * Reads go one tag at a time
+ */
+int rc_get_v(rmem_layer_t *rmem_layer, rmem_iov_t *iov, int n)
+{
+    int err = 0;
+
+    for (int j = 0; j < n; ++j) {
+        iov[j].status = rc_get(rmem_layer, iov[j].addr, iov[j].reg,
+                iov[j].tag, iov[j].size);
+        if (iov[j].status != 0 && err == 0)
+            err = iov[j].status;
+    }
+
+    return err;
+}
+
 /*
  * Warning: free is not atomic
  */ 
@@ -574,6 +661,8 @@ extern "C" {
         layer->free = rc_free;
         layer->put = rc_put;
         layer->get = rc_get;
+        layer->put_v = rc_put_v;
+        layer->get_v = rc_get_v;
         layer->atomic_commit = rc_atomic_commit;
         layer->multi_malloc = rc_multi_malloc;
         layer->multi_free = rc_multi_free;
@@ -6,31 +6,122 @@
 #include "rmem_decs.h"
 #include "../data/hash.h"
 #include "../messages.h"
+#include "../redo_log.h"
 #include <semaphore.h>
+#include <stddef.h>
 
 static const int HASH_SIZE = 10000;
 static const int TIMEOUT_IN_MS = 500;
+static const uint64_t DEFAULT_LOG_SIZE = 64 << 20;
+#define LOG_BUF_SIZE (1 << 20)
+#define TAG_READ_SIZE (4 << 20)
+static const uint64_t POOL_LEASE_SIZE = 1 << 20;
+static const int POOL_LEASE_RETRIES = 1000;
+static const int POOL_RETRY_US = 100;
+#define IOV_BATCH 16            /* work requests posted together per QP */
+#define SIGNAL_EVERY 16         /* longest run of unsignaled sends */
+#define MAX_DATA_QPS 8
+#define STRIPE_SIZE (256 << 10) /* longer runs are cut to spread over QPs */
+
+/* A put staged in a shadow pool slot, copied home at commit */
+struct staged_put {
+    uint64_t dst;
+    uint64_t src;
+    uint64_t size;
+};
+
+/* A chunk of server memory and the key to reach it */
+struct remote_segment {
+    uint64_t addr;
+    uint64_t size;
+    uint32_t rkey;
+};
+
+/* Completions the application thread waits for. In event mode the CQ
+ * thread posts sem; in busy-poll mode the waiting thread polls the CQ itself
+ * and only count is used. */
+struct completion {
+    sem_t sem;
+    volatile int count;
+};
 
 struct client_context {
     struct message *send_msg;
     struct ibv_mr *send_msg_mr;
 
-    struct message *recv_msg;
-    struct ibv_mr *recv_msg_mr;
-
-    uint64_t peer_addr;
-    uint32_t peer_rkey;
-
-    sem_t rdma_sem;
-    sem_t send_sem;
-    sem_t recv_sem;
+    /* Replies land in a ring of receives, in the order the requests were
+     * sent, so up to MSG_RING_SIZE requests can be in flight */
+    struct message *recv_ring;
+    struct ibv_mr *recv_ring_mr;
+    unsigned int recv_head;         /**< receives posted */
+    unsigned int recv_tail;         /**< replies consumed */
+    struct message *recv_msg;       /**< last reply consumed */
+
+    struct remote_segment *segs;
+    uint32_t nsegs;
+    uint32_t max_segs;
+    uint32_t seg_gen;               /**< generation segs was fetched at */
+    volatile uint32_t server_gen;   /**< generation of the last message */
+
+    uint64_t desc_addr;             /**< server's commit descriptor buffer */
+    uint32_t desc_rkey;
+
+    /* one-sided commit channel, chan_addr is 0 if the server has none */
+    uint64_t chan_addr;             /**< server's request slot */
+    uint32_t chan_rkey;
+    uint32_t chan_seq;              /**< last request sent */
+    struct chan_req *chan_req;      /**< staging for the request write */
+    struct chan_resp *chan_resp;    /**< the server writes replies here */
+    struct ibv_mr *chan_mr;
+
+    int unsignaled;                 /**< unreaped work requests on the
+                                         control QP */
+
+    int busy_poll;
+    struct completion rdma_done;
+    struct completion send_done;
+    struct completion recv_done;
 };
 
 struct rmem {
     struct rdma_cm_id *id;
     struct rdma_event_channel *ec;
+
+    /* extra connections puts and gets are striped over; messages and the
+     * writes that must stay ordered with them use id */
+    struct rdma_cm_id *data_ids[MAX_DATA_QPS];
+    int ndata;
+    unsigned int next_data;
+
     struct client_context ctx;
     hash_t tag_to_addr;
+    enum rmem_commit_mode commit_mode;
+
+    /* commit descriptor staged for the next MSG_TXN_GO */
+    struct txn_desc_entry *desc;
+    struct ibv_mr *desc_mr;
+    uint64_t desc_n;
+
+    /* redo log state (RMEM_COMMIT_LOG only) */
+    char *log_buf;                  /**< records staged for the next write */
+    struct ibv_mr *log_buf_mr;
+    size_t log_staged;              /**< bytes used in log_buf */
+    struct redo_log_hdr *log_ctl;   /**< scratch for head writes/tail reads */
+    struct ibv_mr *log_ctl_mr;
+    uint64_t log_addr;              /**< remote address of the log header */
+    uint64_t log_size;              /**< size of the remote ring */
+    uint64_t log_pos;               /**< end of the records written so far */
+    uint64_t log_head;              /**< last committed position */
+    uint64_t log_tail;              /**< last applied position we know of */
+    int log_overflow;               /**< the txn outgrew the ring */
+
+    /* shadow pool state (RMEM_COMMIT_POOL only) */
+    uint64_t lease_addr;            /**< remote address of the current lease */
+    uint64_t lease_size;
+    uint64_t lease_used;
+    struct staged_put *staged;      /**< puts of the transaction in flight */
+    int nstaged;
+    int max_staged;
     
 //    struct ibv_mr *blk_tbl_mr;   /**< IB registration info for block table */
 };
@@ -38,6 +129,50 @@ struct rmem {
 #define get_chunk_size(items_left) \
     (((items_left) < MULTI_OP_MAX_ITEMS) ? items_left : MULTI_OP_MAX_ITEMS)
 
+static void parse_commit_mode(struct rmem *rmem)
+{
+    char *mode = getenv("RMEM_COMMIT_MODE");
+
+    rmem->commit_mode = RMEM_COMMIT_COPY;
+    if (mode == NULL)
+        return;
+
+    if (strcmp(mode, "swap") == 0)
+        rmem->commit_mode = RMEM_COMMIT_SWAP;
+    else if (strcmp(mode, "log") == 0)
+        rmem->commit_mode = RMEM_COMMIT_LOG;
+    else if (strcmp(mode, "pool") == 0)
+        rmem->commit_mode = RMEM_COMMIT_POOL;
+    else
+        CHECK_ERROR(strcmp(mode, "copy") != 0,
+                ("Failure: unknown RMEM_COMMIT_MODE %s\n", mode));
+}
+
+static void parse_data_qps(struct rmem *rmem)
+{
+    char *n = getenv("RMEM_DATA_QPS");
+
+    rmem->ndata = n ? atoi(n) : 0;
+    CHECK_ERROR(rmem->ndata < 0 || rmem->ndata > MAX_DATA_QPS,
+            ("Failure: RMEM_DATA_QPS must be between 0 and %d\n",
+             MAX_DATA_QPS));
+}
+
+static void parse_poll_mode(struct rmem *rmem)
+{
+    char *mode = getenv("RMEM_POLL");
+
+    rmem->ctx.busy_poll = 0;
+    if (mode == NULL)
+        return;
+
+    if (strcmp(mode, "busy") == 0)
+        rmem->ctx.busy_poll = 1;
+    else
+        CHECK_ERROR(strcmp(mode, "event") != 0,
+                ("Failure: unknown RMEM_POLL %s\n", mode));
+}
+
 rmem_layer_t* create_rmem_layer()
 {
     rmem_layer_t* layer = (rmem_layer_t*)
@@ -51,6 +186,8 @@ rmem_layer_t* create_rmem_layer()
     layer->free = rmem_free;
     layer->put = rmem_put;
     layer->get = rmem_get;
+    layer->put_v = rmem_put_v;
+    layer->get_v = rmem_get_v;
     layer->atomic_commit = rmem_atomic_commit;
     layer->register_data = rmem_register_data;
     layer->deregister_data = rmem_deregister_data;
@@ -62,17 +199,49 @@ rmem_layer_t* create_rmem_layer()
             ("Failure: error allocating layer-specific data\n"));
 
     memset(layer->layer_data, 0, sizeof(struct rmem));
+    parse_commit_mode((struct rmem*)layer->layer_data);
+    parse_poll_mode((struct rmem*)layer->layer_data);
+    parse_data_qps((struct rmem*)layer->layer_data);
+
+    /* the redo log and the shadow pool both stage writes on the server, no
+     * per-block shadow copies needed */
+    layer->flags = 0;
+    switch (((struct rmem*)layer->layer_data)->commit_mode) {
+        case RMEM_COMMIT_LOG:
+        case RMEM_COMMIT_POOL:
+            layer->flags = RMEM_LAYER_NO_SHADOW;
+            break;
+        default:
+            break;
+    }
     return layer;
 }
 
+uint32_t rmem_layer_tags(rmem_layer_t *layer, uint32_t **tags)
+{
+    struct rmem *rmem = layer->layer_data;
+    hash_iterator_t it;
+    uint32_t n = 0;
+
+    TEST_Z(*tags = malloc((hash_num_elements(rmem->tag_to_addr) + 1) *
+                sizeof(**tags)));
+    for (it = hash_begin(rmem->tag_to_addr); !hash_is_iterator_null(it);
+            hash_next_iterator(it))
+        (*tags)[n++] = hash_iterator_key(it);
+    hash_delete_iterator(it);
+
+    return n;
+}
+
 /*
  * PRIVATE /STATIC METHODS
  */ 
 
+/* Buffers are registered with the device the connection runs on */
 static
-struct ibv_mr *rmem_create_mr(void *data, size_t size)
+struct ibv_mr *rmem_create_mr(struct rmem *rmem, void *data, size_t size)
 {
-    return ibv_reg_mr(rc_get_pd(), data,
+    return ibv_reg_mr(rc_get_pd_of(rmem->id->verbs), data,
             size, IBV_ACCESS_LOCAL_WRITE);
 }
 
@@ -86,12 +255,49 @@ uintptr_t lookup_remote_addr(hash_t tag_to_addr, uint32_t tag) {
    return *(uintptr_t*)addr; 
 }
 
-static int send_message(struct rdma_cm_id *id)
+static void complete(struct client_context *ctx, struct completion *c)
+{
+    if (ctx->busy_poll)
+        __sync_fetch_and_add(&c->count, 1);
+    else
+        sem_post(&c->sem);
+}
+
+/* Wait for one completion of kind c. In busy-poll mode this spins on the CQ
+ * from the calling thread, without sleeping or waking anyone up. */
+static int wait_completion(struct client_context *ctx, struct completion *c)
+{
+    if (!ctx->busy_poll)
+        return sem_wait(&c->sem);
+
+    while (c->count == 0)
+        rc_poll_cq();
+    __sync_fetch_and_sub(&c->count, 1);
+    return 0;
+}
+
+/* Selective signaling on the control QP. An unsignaled work request is
+ * only reaped when a later signaled one completes, so one in SIGNAL_EVERY
+ * asks for a completion to keep the send queue from filling up. Signaled
+ * requests the caller waits for reset the count. */
+static int need_signal(struct client_context *ctx)
+{
+    if (++ctx->unsignaled < SIGNAL_EVERY)
+        return 0;
+    ctx->unsignaled = 0;
+    return 1;
+}
+
+/* Messages that fit are copied into the work request, so the NIC does not
+ * have to fetch them and the buffer is free again at once. Those go out
+ * unsignaled and count as sent right away. */
+static int send_message_len(struct rdma_cm_id *id, size_t len)
 {
     struct client_context *ctx = (struct client_context *)id->context;
 
     struct ibv_send_wr wr, *bad_wr = NULL;
     struct ibv_sge sge;
+    int err;
 
     memset(&wr, 0, sizeof(wr));
 
@@ -102,12 +308,30 @@ static int send_message(struct rdma_cm_id *id)
     wr.send_flags = IBV_SEND_SIGNALED;
 
     sge.addr = (uintptr_t)ctx->send_msg;
-    sge.length = sizeof(*ctx->send_msg);
+    sge.length = len;
     sge.lkey = ctx->send_msg_mr->lkey;
 
+    if (len <= rc_max_inline()) {
+        wr.send_flags = IBV_SEND_INLINE;
+        if (!need_signal(ctx)) {
+            if ((err = ibv_post_send(id->qp, &wr, &bad_wr)) == 0)
+                complete(ctx, &ctx->send_done);
+            return err;
+        }
+        wr.send_flags |= IBV_SEND_SIGNALED;
+    }
+    ctx->unsignaled = 0;
+
     return ibv_post_send(id->qp, &wr, &bad_wr);
 }
 
+static int send_message(struct rdma_cm_id *id)
+{
+    struct client_context *ctx = (struct client_context *)id->context;
+
+    return send_message_len(id, msg_len(ctx->send_msg));
+}
+
 static int post_receive(struct rdma_cm_id *id)
 {
     struct client_context *ctx = (struct client_context *)id->context;
@@ -121,13 +345,173 @@ static int post_receive(struct rdma_cm_id *id)
     wr.sg_list = &sge;
     wr.num_sge = 1;
 
-    sge.addr = (uintptr_t)ctx->recv_msg;
-    sge.length = sizeof(*ctx->recv_msg);
-    sge.lkey = ctx->recv_msg_mr->lkey;
+    sge.addr = (uintptr_t)&ctx->recv_ring[ctx->recv_head % MSG_RING_SIZE];
+    sge.length = sizeof(*ctx->recv_ring);
+    sge.lkey = ctx->recv_ring_mr->lkey;
+    ctx->recv_head++;
 
     return ibv_post_recv(id->qp, &wr, &bad_wr);
 }
 
+/* Wait for the next reply and make it ctx->recv_msg */
+static int wait_reply(struct client_context *ctx)
+{
+    if (wait_completion(ctx, &ctx->recv_done))
+        return -1;
+
+    ctx->recv_msg = &ctx->recv_ring[ctx->recv_tail++ % MSG_RING_SIZE];
+    ctx->server_gen = ctx->recv_msg->seg_gen;
+    return 0;
+}
+
+/* Copy the part of the segment table carried by an MSG_MR. Returns 1 once
+ * the last segment has been stored. */
+static int store_segments(struct client_context *ctx)
+{
+    struct message *msg = ctx->recv_msg;
+    uint32_t first = msg->data.mr.first;
+
+    if (msg->data.mr.total > ctx->max_segs) {
+        ctx->max_segs = msg->data.mr.total;
+        TEST_Z(ctx->segs = realloc(ctx->segs,
+                    ctx->max_segs * sizeof(*ctx->segs)));
+    }
+    ctx->nsegs = msg->data.mr.total;
+
+    for (int i = 0; i < msg->data.mr.nsegs; i++) {
+        ctx->segs[first + i].addr = msg->data.mr.segs[i].addr;
+        ctx->segs[first + i].size = msg->data.mr.segs[i].size;
+        ctx->segs[first + i].rkey = msg->data.mr.segs[i].rkey;
+    }
+
+    return first + msg->data.mr.nsegs >= ctx->nsegs;
+}
+
+/* Fetch the server's segment table again, after it grew or shrank */
+static void refresh_segments(struct rmem *rmem)
+{
+    struct client_context *ctx = &rmem->ctx;
+    uint32_t first = 0, gen = 0;
+
+    do {
+        ctx->send_msg->id = MSG_SEG_TABLE;
+        ctx->send_msg->data.mr.first = first;
+
+        TEST_NZ(post_receive(rmem->id));
+        TEST_NZ(send_message(rmem->id));
+        wait_completion(ctx, &ctx->send_done);
+        wait_reply(ctx);
+
+        CHECK_ERROR(ctx->recv_msg->id != MSG_MR,
+                ("Failure: expected segment table, got %d\n",
+                 ctx->recv_msg->id));
+
+        // start over if the table changed between two pieces
+        if (first > 0 && ctx->recv_msg->seg_gen != gen)
+            first = 0;
+        else if (store_segments(ctx))
+            break;
+        else
+            first += ctx->recv_msg->data.mr.nsegs;
+        gen = ctx->recv_msg->seg_gen;
+    } while (1);
+
+    ctx->seg_gen = ctx->recv_msg->seg_gen;
+    LOG(5, ("segment table: %d segments, generation %d\n",
+                ctx->nsegs, ctx->seg_gen));
+}
+
+static uint32_t lookup_rkey(struct rmem *rmem, uint64_t addr)
+{
+    struct client_context *ctx = &rmem->ctx;
+    uint32_t lo = 0, hi;
+
+    if (ctx->seg_gen != ctx->server_gen)
+        refresh_segments(rmem);
+
+    // segments are sorted by address
+    hi = ctx->nsegs;
+    while (hi - lo > 1) {
+        uint32_t mid = (lo + hi) / 2;
+        if (ctx->segs[mid].addr <= addr)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    CHECK_ERROR(ctx->nsegs == 0 || addr < ctx->segs[lo].addr ||
+            addr >= ctx->segs[lo].addr + ctx->segs[lo].size,
+            ("Failure: address %lx is not in any segment\n", addr));
+
+    return ctx->segs[lo].rkey;
+}
+
+/* The QP for the next bulk transfer: the data QPs in turn, or the control
+ * QP if there are none */
+static struct ibv_qp *data_qp(struct rmem *rmem)
+{
+    if (rmem->ndata == 0)
+        return rmem->id->qp;
+    return rmem->data_ids[rmem->next_data++ % rmem->ndata]->qp;
+}
+
+static int post_rdma(struct rmem *rmem, struct ibv_qp *qp,
+        enum ibv_wr_opcode opcode, void *local, uint32_t lkey,
+        uint64_t remote, uint32_t rkey, size_t size, int send_flags)
+{
+    struct ibv_send_wr wr, *bad_wr = NULL;
+    struct ibv_sge sge;
+
+    memset(&wr, 0, sizeof(wr));
+
+    wr.wr_id = (uintptr_t) rmem->id;
+    wr.opcode = opcode;
+    wr.send_flags = send_flags;
+    wr.wr.rdma.remote_addr = remote;
+    wr.wr.rdma.rkey = rkey;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+
+    sge.addr = (uintptr_t) local;
+    sge.length = size;
+    sge.lkey = lkey;
+
+    if (opcode == IBV_WR_RDMA_WRITE && size <= rc_max_inline())
+        wr.send_flags |= IBV_SEND_INLINE;
+    if (qp == rmem->id->qp) {
+        if (send_flags & IBV_SEND_SIGNALED)
+            rmem->ctx.unsignaled = 0;
+        else
+            rmem->ctx.unsignaled++;
+    }
+
+    return ibv_post_send(qp, &wr, &bad_wr);
+}
+
+/* Post a signaled one-sided operation and wait for it to complete. Any QP
+ * will do since the caller waits. */
+static int rmem_rdma_key(struct rmem *rmem, enum ibv_wr_opcode opcode,
+        void *local, uint32_t lkey, uint64_t remote, uint32_t rkey,
+        size_t size)
+{
+    int err;
+
+    if ((err = post_rdma(rmem, data_qp(rmem), opcode, local, lkey, remote,
+                    rkey, size, IBV_SEND_SIGNALED)) != 0)
+        return err;
+    if (wait_completion(&rmem->ctx, &rmem->ctx.rdma_done))
+        return errno;
+    return 0;
+}
+
+/* Same, for memory in one of the server's segments */
+static int rmem_rdma(struct rmem *rmem, enum ibv_wr_opcode opcode,
+        void *local, uint32_t lkey, uint64_t remote, size_t size)
+{
+    return rmem_rdma_key(rmem, opcode, local, lkey, remote,
+            lookup_rkey(rmem, remote), size);
+}
+
 static
 int rmem_cp(struct rmem *rmem, uint32_t tag_dst, uint32_t tag_src, uint64_t size)
 {
@@ -147,9 +531,9 @@ int rmem_cp(struct rmem *rmem, uint32_t tag_dst, uint32_t tag_src, uint64_t size
 	return -1;
     if (post_receive(rmem->id))
 	return -2;
-    if (sem_wait(&ctx->send_sem))
+    if (wait_completion(ctx, &ctx->send_done))
 	return -3;
-    if (sem_wait(&ctx->recv_sem))
+    if (wait_reply(ctx))
 	return -4;
 
     if (ctx->recv_msg->id != MSG_TXN_ACK)
@@ -158,39 +542,406 @@ int rmem_cp(struct rmem *rmem, uint32_t tag_dst, uint32_t tag_src, uint64_t size
     return 0;
 }
 
-static
-int rmem_txn_go(struct rmem *rmem)
+/* Hand a request to the server's commit channel and spin until the reply
+ * is written back. The request write is placed after the descriptor write
+ * posted ahead of it, and it is signaled only so that its completion can be
+ * reaped and the send queue does not fill up with unsignaled writes. */
+static int chan_send(struct rmem *rmem, enum chan_op op, uint64_t n)
 {
     struct client_context *ctx = &rmem->ctx;
+    uint32_t seq = ++ctx->chan_seq;
 
-    ctx->send_msg->id = MSG_TXN_GO;
+    ctx->chan_req->nentries = n;
+    ctx->chan_req->op = op;
+    ctx->chan_req->seq = seq;
+
+    if (post_rdma(rmem, rmem->id->qp, IBV_WR_RDMA_WRITE, ctx->chan_req,
+                ctx->chan_mr->lkey, ctx->chan_addr, ctx->chan_rkey,
+                sizeof(*ctx->chan_req), IBV_SEND_SIGNALED))
+        return -1;
+
+    while (ctx->chan_resp->seq != seq)
+        ;
+    __sync_synchronize();
+
+    if (wait_completion(ctx, &ctx->rdma_done))
+        return -1;
+    if (ctx->chan_resp->error)
+        return -6;
+
+    return 0;
+}
+
+/* Ask the server to poll a request slot for us; without pollers on the
+ * server commits keep going through messages. */
+static void chan_attach(struct rmem *rmem)
+{
+    struct client_context *ctx = &rmem->ctx;
+    long page = sysconf(_SC_PAGESIZE);
+
+    ctx->chan_mr = NULL;
+    if (ctx->chan_addr == 0)
+        return;
+
+    // request and reply on separate cache lines
+    TEST_NZ(posix_memalign((void **)&ctx->chan_req, page, page));
+    memset(ctx->chan_req, 0, page);
+    ctx->chan_resp = (struct chan_resp *)((char *)ctx->chan_req + 64);
+    // the server writes its replies into this page
+    TEST_Z(ctx->chan_mr = ibv_reg_mr(rc_get_pd_of(rmem->id->verbs),
+                ctx->chan_req, page,
+                IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
+    ctx->chan_seq = 0;
+
+    ctx->send_msg->id = MSG_CHAN_ATTACH;
+    ctx->send_msg->data.chan.addr = (uintptr_t)ctx->chan_resp;
+    ctx->send_msg->data.chan.rkey = ctx->chan_mr->rkey;
+
+    TEST_NZ(post_receive(rmem->id));
+    TEST_NZ(send_message_len(rmem->id, MSG_SIZE(chan)));
+    wait_completion(ctx, &ctx->send_done);
+    wait_reply(ctx);
+
+    if (ctx->recv_msg->id != MSG_TXN_ACK || ctx->recv_msg->data.memresp.error)
+        ctx->chan_addr = 0;
+    LOG(1, ("commit channel %s\n", ctx->chan_addr ? "attached" : "refused"));
+}
+
+/* Write the staged descriptor into the server's buffer and send msg_id
+ * right behind it. RC queue pairs deliver the SEND after the RDMA write
+ * has landed, so the write needs no completion of its own and the whole
+ * descriptor costs one round trip. */
+static int desc_send(struct rmem *rmem, enum message_id msg_id)
+{
+    struct client_context *ctx = &rmem->ctx;
+    uint64_t n = rmem->desc_n;
+
+    rmem->desc_n = 0;
+
+    if (n > 0 && post_rdma(rmem, rmem->id->qp, IBV_WR_RDMA_WRITE, rmem->desc,
+                rmem->desc_mr->lkey, ctx->desc_addr, ctx->desc_rkey,
+                n * sizeof(*rmem->desc), 0))
+        return -1;
+
+    if (ctx->chan_addr != 0)
+        return chan_send(rmem,
+                msg_id == MSG_TXN_GO ? CHAN_GO : CHAN_DESC, n);
+
+    ctx->send_msg->id = msg_id;
+    ctx->send_msg->data.txn_go.nentries = n;
 
-    if (send_message(rmem->id))
-	return -1;
     if (post_receive(rmem->id))
 	return -1;
+    if (send_message_len(rmem->id, MSG_SIZE(txn_go)))
+	return -1;
 
-    if (sem_wait(&ctx->send_sem))
+    if (wait_completion(ctx, &ctx->send_done))
 	return -1;
-    if (sem_wait(&ctx->recv_sem))
+    if (wait_reply(ctx))
 	return -1;
     if (ctx->recv_msg->id != MSG_TXN_ACK)
 	return -1;
+    /* the server refuses swaps between blocks of different sizes */
+    if (ctx->recv_msg->data.memresp.error)
+	return -6;
+
+    return 0;
+}
+
+static void desc_add(struct rmem *rmem, enum txn_desc_op op,
+        uint64_t dst, uint64_t src, uint64_t size)
+{
+    struct txn_desc_entry *entry;
+
+    if (rmem->desc_n == TXN_DESC_MAX_ENTRIES)
+        CHECK_ERROR(desc_send(rmem, MSG_TXN_DESC) != 0,
+                ("Failure: server refused commit descriptor\n"));
+
+    entry = &rmem->desc[rmem->desc_n++];
+    entry->dst = dst;
+    entry->src = src;
+    entry->size = size;
+    entry->op = op;
+}
+
+static
+int rmem_txn_go(struct rmem *rmem)
+{
+    return desc_send(rmem, MSG_TXN_GO);
+}
+
+/*
+ * REDO LOG
+ *
+ * In log mode puts do not touch remote memory directly. Each put becomes a
+ * record (see redo_log.h) staged in log_buf, and the staging buffer is
+ * written into the server's ring with one RDMA write (two if it wraps) when
+ * it fills up or at commit. Commit then writes the new head; RC queue pairs
+ * place RDMA writes in order, so the server never sees a head that covers
+ * records which have not landed yet.
+ */
+
+static void log_read_tail(struct rmem *rmem)
+{
+    TEST_NZ(rmem_rdma(rmem, IBV_WR_RDMA_READ, (void *)&rmem->log_ctl->tail,
+                rmem->log_ctl_mr->lkey,
+                rmem->log_addr + offsetof(struct redo_log_hdr, tail),
+                sizeof(uint64_t)));
+    rmem->log_tail = rmem->log_ctl->tail;
+}
+
+/* Write the staged records to the ring without committing them. The
+ * server only applies committed records, so a txn larger than the ring can
+ * never be written whole: its records are dropped and its commit fails. */
+static void log_flush(struct rmem *rmem)
+{
+    uint64_t ring = rmem->log_addr + sizeof(struct redo_log_hdr);
+    uint64_t len = rmem->log_staged;
+    uint64_t off, first;
+
+    if (len == 0)
+        return;
+
+    if (rmem->log_overflow ||
+            rmem->log_pos + len - rmem->log_head > rmem->log_size) {
+        if (!rmem->log_overflow)
+            LOG(1, ("transaction does not fit in the %lu byte redo log\n",
+                        rmem->log_size));
+        rmem->log_overflow = 1;
+        rmem->log_pos = rmem->log_head;
+        rmem->log_staged = 0;
+        return;
+    }
+
+    /* wait for the server to apply enough of the ring */
+    while (rmem->log_pos + len - rmem->log_tail > rmem->log_size)
+        log_read_tail(rmem);
+
+    off = rmem->log_pos % rmem->log_size;
+    first = (len < rmem->log_size - off) ? len : rmem->log_size - off;
+
+    TEST_NZ(rmem_rdma(rmem, IBV_WR_RDMA_WRITE, rmem->log_buf,
+                rmem->log_buf_mr->lkey, ring + off, first));
+    if (first < len)
+        TEST_NZ(rmem_rdma(rmem, IBV_WR_RDMA_WRITE, rmem->log_buf + first,
+                    rmem->log_buf_mr->lkey, ring, len - first));
+
+    rmem->log_pos += len;
+    rmem->log_staged = 0;
+}
+
+static void log_append(struct rmem *rmem, const void *data, size_t size)
+{
+    const char *p = data;
+
+    while (size > 0) {
+        size_t n = LOG_BUF_SIZE - rmem->log_staged;
+        if (n > size)
+            n = size;
+
+        memcpy(rmem->log_buf + rmem->log_staged, p, n);
+        rmem->log_staged += n;
+        p += n;
+        size -= n;
+
+        if (rmem->log_staged == LOG_BUF_SIZE)
+            log_flush(rmem);
+    }
+}
+
+static int log_put(struct rmem *rmem, uint64_t dst, void *src, size_t size)
+{
+    static const char pad[8];
+    struct redo_log_rec rec = { .dst = dst, .size = size };
+
+    log_append(rmem, &rec, sizeof(rec));
+    log_append(rmem, src, size);
+    log_append(rmem, pad, REDO_LOG_ALIGN(size) - size);
+    return 0;
+}
+
+static int log_commit(struct rmem *rmem)
+{
+    log_flush(rmem);
+
+    if (rmem->log_overflow) {
+        rmem->log_overflow = 0;
+        rmem->desc_n = 0;
+        return E2BIG;
+    }
+
+    if (rmem->log_pos != rmem->log_head) {
+        rmem->log_ctl->head = rmem->log_pos;
+        TEST_NZ(rmem_rdma(rmem, IBV_WR_RDMA_WRITE,
+                    (void *)&rmem->log_ctl->head, rmem->log_ctl_mr->lkey,
+                    rmem->log_addr + offsetof(struct redo_log_hdr, head),
+                    sizeof(uint64_t)));
+        rmem->log_head = rmem->log_pos;
+    }
+
+    /* frees still need the usual GO, which also drains the log first */
+    if (rmem->desc_n > 0)
+        return rmem_txn_go(rmem);
+    return 0;
+}
+
+/* Wait until the server has applied every committed record */
+static void log_wait_applied(struct rmem *rmem)
+{
+    while (rmem->log_tail < rmem->log_head)
+        log_read_tail(rmem);
+}
+
+static void log_attach(struct rmem *rmem)
+{
+    struct client_context *ctx = &rmem->ctx;
+    char *size_env = getenv("RMEM_LOG_SIZE");
+
+    TEST_NZ(posix_memalign((void **)&rmem->log_buf,
+                sysconf(_SC_PAGESIZE), LOG_BUF_SIZE));
+    TEST_Z(rmem->log_buf_mr = rmem_create_mr(rmem, rmem->log_buf,
+                LOG_BUF_SIZE));
+    TEST_NZ(posix_memalign((void **)&rmem->log_ctl,
+                sysconf(_SC_PAGESIZE), sizeof(struct redo_log_hdr)));
+    TEST_Z(rmem->log_ctl_mr = rmem_create_mr(rmem, rmem->log_ctl,
+                sizeof(struct redo_log_hdr)));
+
+    ctx->send_msg->id = MSG_LOG_ATTACH;
+    ctx->send_msg->data.log.tag = RMEM_LOG_TAG;
+    ctx->send_msg->data.log.size = size_env ?
+        strtoull(size_env, NULL, 0) : DEFAULT_LOG_SIZE;
+
+    TEST_NZ(post_receive(rmem->id));
+    TEST_NZ(send_message(rmem->id));
+    wait_completion(ctx, &ctx->send_done);
+    wait_reply(ctx);
+
+    CHECK_ERROR(ctx->recv_msg->id != MSG_LOG_INFO ||
+            ctx->recv_msg->data.log.error,
+            ("Failure: could not attach the redo log\n"));
+
+    rmem->log_addr = ctx->recv_msg->data.log.addr;
+    rmem->log_size = ctx->recv_msg->data.log.size;
+    rmem->log_pos = rmem->log_head = rmem->log_tail =
+        ctx->recv_msg->data.log.head;
+    rmem->log_staged = 0;
+    rmem->log_overflow = 0;
+
+    LOG(5, ("redo log at %lx, %lu bytes\n", rmem->log_addr, rmem->log_size));
+}
+
+static void log_detach(struct rmem *rmem)
+{
+    struct client_context *ctx = &rmem->ctx;
+
+    ctx->send_msg->id = MSG_LOG_DETACH;
+    TEST_NZ(post_receive(rmem->id));
+    TEST_NZ(send_message(rmem->id));
+    wait_completion(ctx, &ctx->send_done);
+    wait_reply(ctx);
+
+    ibv_dereg_mr(rmem->log_buf_mr);
+    ibv_dereg_mr(rmem->log_ctl_mr);
+    free(rmem->log_buf);
+    free(rmem->log_ctl);
+}
+
+/*
+ * SHADOW POOL
+ *
+ * In pool mode blocks have no shadow of their own. Puts go to slots leased
+ * from a pool the server shares between all clients, and commit asks the
+ * server to copy them home. The server takes the leases back when the
+ * transaction ends.
+ */
+
+static uint64_t pool_lease(struct rmem *rmem, size_t size)
+{
+    struct client_context *ctx = &rmem->ctx;
+
+    /* other clients give their slots back when they commit */
+    for (int i = 0; i < POOL_LEASE_RETRIES; i++) {
+        ctx->send_msg->id = MSG_POOL_LEASE;
+        ctx->send_msg->data.alloc.size = size;
+
+        if (post_receive(rmem->id))
+            return 0;
+        if (send_message(rmem->id))
+            return 0;
+        if (wait_completion(ctx, &ctx->send_done))
+            return 0;
+        if (wait_reply(ctx))
+            return 0;
+
+        if (!ctx->recv_msg->data.memresp.error)
+            return ctx->recv_msg->data.memresp.addr;
+        usleep(POOL_RETRY_US);
+    }
+
+    return 0;
+}
+
+static int pool_put(struct rmem *rmem, uint64_t dst, void *src,
+        struct ibv_mr *src_mr, size_t size)
+{
+    uint64_t slot;
+    int err;
+
+    if (rmem->lease_used + size > rmem->lease_size) {
+        size_t lease = (size > POOL_LEASE_SIZE) ? size : POOL_LEASE_SIZE;
+
+        rmem->lease_addr = pool_lease(rmem, lease);
+        CHECK_ERROR(rmem->lease_addr == 0,
+                ("Failure: shadow pool exhausted\n"));
+        rmem->lease_size = lease;
+        rmem->lease_used = 0;
+    }
+
+    slot = rmem->lease_addr + rmem->lease_used;
+    rmem->lease_used += size;
+
+    if ((err = rmem_rdma(rmem, IBV_WR_RDMA_WRITE, src, src_mr->lkey,
+                    slot, size)) != 0)
+        return err;
+
+    if (rmem->nstaged == rmem->max_staged) {
+        rmem->max_staged = rmem->max_staged ? 2 * rmem->max_staged : 64;
+        TEST_Z(rmem->staged = realloc(rmem->staged,
+                    rmem->max_staged * sizeof(*rmem->staged)));
+    }
+    rmem->staged[rmem->nstaged].dst = dst;
+    rmem->staged[rmem->nstaged].src = slot;
+    rmem->staged[rmem->nstaged].size = size;
+    rmem->nstaged++;
 
     return 0;
 }
 
-static void setup_memory(struct client_context *ctx)
+static int pool_commit(struct rmem *rmem)
 {
-    TEST_NZ(posix_memalign((void **)&ctx->recv_msg, sysconf(_SC_PAGESIZE),
-            sizeof(*ctx->recv_msg)));
-    TEST_Z(ctx->recv_msg_mr = ibv_reg_mr(rc_get_pd(), ctx->recv_msg,
-            sizeof(*ctx->recv_msg),
+    for (int i = 0; i < rmem->nstaged; i++)
+        desc_add(rmem, DESC_CP, rmem->staged[i].dst, rmem->staged[i].src,
+                rmem->staged[i].size);
+
+    rmem->nstaged = 0;
+    rmem->lease_size = rmem->lease_used = 0;
+
+    return rmem_txn_go(rmem);
+}
+
+static void setup_memory(struct client_context *ctx, struct ibv_pd *pd)
+{
+    TEST_NZ(posix_memalign((void **)&ctx->recv_ring, sysconf(_SC_PAGESIZE),
+            MSG_RING_SIZE * sizeof(*ctx->recv_ring)));
+    TEST_Z(ctx->recv_ring_mr = ibv_reg_mr(pd, ctx->recv_ring,
+            MSG_RING_SIZE * sizeof(*ctx->recv_ring),
             IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
+    ctx->recv_head = ctx->recv_tail = 0;
+    ctx->recv_msg = NULL;
 
     TEST_NZ(posix_memalign((void **)&ctx->send_msg, sysconf(_SC_PAGESIZE),
             sizeof(*ctx->send_msg)));
-    TEST_Z(ctx->send_msg_mr = ibv_reg_mr(rc_get_pd(), ctx->send_msg,
+    TEST_Z(ctx->send_msg_mr = ibv_reg_mr(pd, ctx->send_msg,
             sizeof(*ctx->send_msg), IBV_ACCESS_LOCAL_WRITE));
 }
 
@@ -201,14 +952,14 @@ static void on_completion(struct ibv_wc *wc)
 
     switch (wc->opcode) {
     case IBV_WC_RECV:
-        sem_post(&ctx->recv_sem);
+        complete(ctx, &ctx->recv_done);
         break;
     case IBV_WC_RDMA_READ:
     case IBV_WC_RDMA_WRITE:
-        sem_post(&ctx->rdma_sem);
+        complete(ctx, &ctx->rdma_done);
         break;
     case IBV_WC_SEND:
-        sem_post(&ctx->send_sem);
+        complete(ctx, &ctx->send_done);
         break;
     default:
         break;
@@ -225,33 +976,104 @@ void insert_tag_to_addr(struct rmem* rmem, uint32_t tag, uintptr_t addr) {
     hash_insert_item(rmem->tag_to_addr, tag, (void*)addr_ptr);
 }
 
+static
+void swap_tag_to_addr(struct rmem* rmem, uint32_t tag_a, uint32_t tag_b)
+{
+    uintptr_t *addr_a = (uintptr_t*)hash_get_item(rmem->tag_to_addr, tag_a);
+    uintptr_t *addr_b = (uintptr_t*)hash_get_item(rmem->tag_to_addr, tag_b);
+    uintptr_t tmp;
+
+    CHECK_ERROR(addr_a == NULL || addr_b == NULL,
+            ("Failure: swapping unknown tags %d and %d\n", tag_a, tag_b));
+
+    tmp = *addr_a;
+    *addr_a = *addr_b;
+    *addr_b = tmp;
+}
+
 static
 void receive_tag_to_addr_info(struct rmem* rmem) 
 {
-    rmem->ctx.send_msg->id = MSG_STARTUP_ACK;
+    struct client_context *ctx = &rmem->ctx;
+    tag_addr_entry_t *entries = NULL;
+    struct ibv_mr *entries_mr;
+    uint64_t addr, count, per_read;
+    uint32_t rkey;
+
+    TEST_NZ(post_receive(rmem->id));
+    wait_reply(ctx);
+
+    addr = ctx->recv_msg->data.tag_addr_map.addr;
+    count = ctx->recv_msg->data.tag_addr_map.count;
+    rkey = ctx->recv_msg->data.tag_addr_map.rkey;
+    LOG(8, ("Reading %lu mappings\n", count));
+
+    if (count > 0) {
+        per_read = TAG_READ_SIZE / sizeof(*entries);
+        TEST_NZ(posix_memalign((void **)&entries, sysconf(_SC_PAGESIZE),
+                    TAG_READ_SIZE));
+        TEST_Z(entries_mr = rmem_create_mr(rmem, entries, TAG_READ_SIZE));
+
+        for (uint64_t i = 0; i < count; i += per_read) {
+            uint64_t n = MIN(count - i, per_read);
+
+            TEST_NZ(rmem_rdma_key(rmem, IBV_WR_RDMA_READ, entries,
+                        entries_mr->lkey, addr + i * sizeof(*entries), rkey,
+                        n * sizeof(*entries)));
+            for (uint64_t j = 0; j < n; j++)
+                insert_tag_to_addr(rmem, entries[j].tag, entries[j].addr);
+        }
 
-    while (1) {
-        TEST_NZ(post_receive(rmem->id));
-        sem_wait(&rmem->ctx.recv_sem);
+        ibv_dereg_mr(entries_mr);
+        free(entries);
+    }
 
-        int size = rmem->ctx.recv_msg->data.tag_addr_map.size;
-        int nleft = rmem->ctx.recv_msg->data.tag_addr_map.nleft;
-        LOG(8, ("Received %d mappings\n", size));
+    // the server can drop its snapshot now
+    ctx->send_msg->id = MSG_STARTUP_ACK;
+    TEST_NZ(send_message(rmem->id));
+    wait_completion(ctx, &ctx->send_done);
+}
 
-        tag_addr_entry_t* entries = 
-            (tag_addr_entry_t*)rmem->ctx.recv_msg->data.tag_addr_map.data;
+/* Open one more connection to the server for striped one-sided traffic */
+static struct rdma_cm_id *connect_data_qp(struct rmem *rmem,
+        struct addrinfo *addr)
+{
+    struct rdma_cm_id *id;
+    struct rdma_conn_param cm_params;
+    struct rdma_cm_event *event = NULL;
+    uint8_t kind = CONN_DATA;
 
-        int i = 0;
-        for (; i < size; ++i) {
-            insert_tag_to_addr(rmem, entries[i].tag, entries[i].addr);
-        }
+    TEST_NZ(rdma_create_id(rmem->ec, &id, NULL, RDMA_PS_TCP));
+    id->context = &rmem->ctx;
+    TEST_NZ(rdma_resolve_addr(id, NULL, addr->ai_addr, TIMEOUT_IN_MS));
 
-        TEST_NZ(send_message(rmem->id));
-        sem_wait(&rmem->ctx.send_sem);
+    build_params(&cm_params);
+    cm_params.private_data = &kind;
+    cm_params.private_data_len = sizeof(kind);
+
+    while (rdma_get_cm_event(rmem->ec, &event) == 0) {
+        struct rdma_cm_event event_copy;
+
+        memcpy(&event_copy, event, sizeof(*event));
+        rdma_ack_cm_event(event);
 
-        if (nleft == 0)
+        if (event_copy.event == RDMA_CM_EVENT_ADDR_RESOLVED) {
+            build_connection(event_copy.id);
+            TEST_NZ(rdma_resolve_route(event_copy.id, TIMEOUT_IN_MS));
+        } else if (event_copy.event == RDMA_CM_EVENT_ROUTE_RESOLVED) {
+            TEST_NZ(rdma_connect(event_copy.id, &cm_params));
+        } else if (event_copy.event == RDMA_CM_EVENT_ESTABLISHED) {
             break;
+        } else {
+            rc_die("data connection failed");
+        }
     }
+
+    // buffers are registered with the control connection's device only
+    CHECK_ERROR(id->verbs != rmem->id->verbs,
+            ("Failure: data connection routed through another device\n"));
+
+    return id;
 }
 
 /*
@@ -264,21 +1086,25 @@ void rmem_connect(rmem_layer_t *rmem_layer, char *host, char *port)
     struct addrinfo *addr;
     struct rdma_conn_param cm_params;
     struct rdma_cm_event *event = NULL;
+    int segs_complete, ndata = rmem->ndata;
+
+    // the handshake reads run on the control QP, data_qp() only stripes
+    // once the data QPs are up
+    rmem->ndata = 0;
 
     TEST_NZ(getaddrinfo(host, port, NULL, &addr));
     TEST_Z(rmem->ec = rdma_create_event_channel());
     TEST_NZ(rdma_create_id(rmem->ec, &rmem->id, NULL, RDMA_PS_TCP));
     TEST_NZ(rdma_resolve_addr(rmem->id, NULL, addr->ai_addr, TIMEOUT_IN_MS));
 
-    freeaddrinfo(addr);
-
     rmem->id->context = &rmem->ctx;
     build_params(&cm_params);
     rc_init(NULL, NULL, on_completion, NULL);
+    rc_set_busy_poll(rmem->ctx.busy_poll);
 
-    TEST_NZ(sem_init(&rmem->ctx.rdma_sem, 0, 0));
-    TEST_NZ(sem_init(&rmem->ctx.send_sem, 0, 0));
-    TEST_NZ(sem_init(&rmem->ctx.recv_sem, 0, 0));
+    TEST_NZ(sem_init(&rmem->ctx.rdma_done.sem, 0, 0));
+    TEST_NZ(sem_init(&rmem->ctx.send_done.sem, 0, 0));
+    TEST_NZ(sem_init(&rmem->ctx.recv_done.sem, 0, 0));
 
     // build tag_to_addr map
     rmem->tag_to_addr = hash_create(HASH_SIZE);
@@ -291,7 +1117,7 @@ void rmem_connect(rmem_layer_t *rmem_layer, char *host, char *port)
 
         if (event_copy.event == RDMA_CM_EVENT_ADDR_RESOLVED) {
             build_connection(event_copy.id);
-            setup_memory(&rmem->ctx);
+            setup_memory(&rmem->ctx, rc_get_pd_of(event_copy.id->verbs));
             TEST_NZ(post_receive(rmem->id));
             TEST_NZ(rdma_resolve_route(event_copy.id, TIMEOUT_IN_MS));
         } else if (event_copy.event == RDMA_CM_EVENT_ROUTE_RESOLVED) {
@@ -302,32 +1128,74 @@ void rmem_connect(rmem_layer_t *rmem_layer, char *host, char *port)
     }
 
     // wait for MR recv
-    sem_wait(&rmem->ctx.recv_sem);
-    rmem->ctx.peer_addr = rmem->ctx.recv_msg->data.mr.addr;
-    rmem->ctx.peer_rkey = rmem->ctx.recv_msg->data.mr.rkey;
+    wait_reply(&rmem->ctx);
+    segs_complete = store_segments(&rmem->ctx);
+    rmem->ctx.seg_gen = rmem->ctx.recv_msg->seg_gen;
+    rmem->ctx.desc_addr = rmem->ctx.recv_msg->data.mr.desc_addr;
+    rmem->ctx.desc_rkey = rmem->ctx.recv_msg->data.mr.desc_rkey;
+    rmem->ctx.chan_addr = rmem->ctx.recv_msg->data.mr.chan_addr;
+    rmem->ctx.chan_rkey = rmem->ctx.recv_msg->data.mr.chan_rkey;
+
+    TEST_NZ(posix_memalign((void **)&rmem->desc, sysconf(_SC_PAGESIZE),
+                TXN_DESC_MAX_ENTRIES * sizeof(*rmem->desc)));
+    TEST_Z(rmem->desc_mr = rmem_create_mr(rmem, rmem->desc,
+                TXN_DESC_MAX_ENTRIES * sizeof(*rmem->desc)));
+    rmem->desc_n = 0;
 
     // acknowledge that we received the MR
     rmem->ctx.send_msg->id = MSG_STARTUP_ACK;
     TEST_NZ(send_message(rmem->id));
-    sem_wait(&rmem->ctx.send_sem);
+    wait_completion(&rmem->ctx, &rmem->ctx.send_done);
 
     receive_tag_to_addr_info(rmem);
+
+    // the rest of the segment table didn't fit the first message
+    if (!segs_complete)
+        refresh_segments(rmem);
+
+    chan_attach(rmem);
+
+    for (int i = 0; i < ndata; i++)
+        rmem->data_ids[i] = connect_data_qp(rmem, addr);
+    rmem->ndata = ndata;
+    LOG(1, ("striping over %d data QPs\n", rmem->ndata));
+    freeaddrinfo(addr);
+
+    if (rmem->commit_mode == RMEM_COMMIT_LOG)
+        log_attach(rmem);
 }
 
 void rmem_disconnect(rmem_layer_t *rmem_layer)
 {
     struct rmem* rmem = (struct rmem*)rmem_layer->layer_data;
+
+    if (rmem->commit_mode == RMEM_COMMIT_LOG)
+        log_detach(rmem);
+    free(rmem->staged);
+    for (int i = 0; i < rmem->ndata; i++) {
+        rdma_disconnect(rmem->data_ids[i]);
+        rdma_destroy_qp(rmem->data_ids[i]);
+        rdma_destroy_id(rmem->data_ids[i]);
+    }
     rdma_disconnect(rmem->id);
 
-    TEST_NZ(sem_destroy(&rmem->ctx.rdma_sem));
-    TEST_NZ(sem_destroy(&rmem->ctx.send_sem));
-    TEST_NZ(sem_destroy(&rmem->ctx.recv_sem));
+    ibv_dereg_mr(rmem->desc_mr);
+    free(rmem->desc);
+    if (rmem->ctx.chan_mr != NULL) {
+        ibv_dereg_mr(rmem->ctx.chan_mr);
+        free(rmem->ctx.chan_req);
+    }
+
+    TEST_NZ(sem_destroy(&rmem->ctx.rdma_done.sem));
+    TEST_NZ(sem_destroy(&rmem->ctx.send_done.sem));
+    TEST_NZ(sem_destroy(&rmem->ctx.recv_done.sem));
 
-    ibv_dereg_mr(rmem->ctx.recv_msg_mr);
+    ibv_dereg_mr(rmem->ctx.recv_ring_mr);
     ibv_dereg_mr(rmem->ctx.send_msg_mr);
 
-    free(rmem->ctx.recv_msg);
+    free(rmem->ctx.recv_ring);
     free(rmem->ctx.send_msg);
+    free(rmem->ctx.segs);
 
     rdma_destroy_id(rmem->id);
     rdma_destroy_event_channel(rmem->ec);
@@ -347,9 +1215,9 @@ uint64_t rmem_malloc(rmem_layer_t *rmem_layer, size_t size, uint32_t tag)
     if (send_message(rmem->id))
         return 0;
 
-    if (sem_wait(&ctx->send_sem))
+    if (wait_completion(ctx, &ctx->send_done))
         return 0;
-    if (sem_wait(&ctx->recv_sem))
+    if (wait_reply(ctx))
         return 0;
 
     if (ctx->recv_msg->data.memresp.error)
@@ -374,9 +1242,9 @@ uint64_t rmem_lookup(struct rmem *rmem, uint32_t tag)
     if (send_message(rmem->id))
 	return 0;
 
-    if (sem_wait(&ctx->send_sem))
+    if (wait_completion(ctx, &ctx->send_done))
         return 0;
-    if (sem_wait(&ctx->recv_sem))
+    if (wait_reply(ctx))
         return 0;
 
     if (ctx->recv_msg->data.memresp.error)
@@ -385,22 +1253,25 @@ uint64_t rmem_lookup(struct rmem *rmem, uint32_t tag)
     return ctx->recv_msg->data.memresp.addr;
 }
 */
+
+/* A put small enough to go inline is done with src as soon as it is
+ * posted, and nothing after it on the control QP can overtake it, so it
+ * need not be waited for. With data QPs a later get could be served
+ * first, so those keep the signaled path. */
+static int small_put(struct rmem *rmem, uintptr_t dst, void *src,
+        uint32_t lkey, size_t size)
+{
+    if (rmem->ctx.unsignaled + 1 < SIGNAL_EVERY)
+        return post_rdma(rmem, rmem->id->qp, IBV_WR_RDMA_WRITE, src, lkey,
+                dst, lookup_rkey(rmem, dst), size, 0);
+    return rmem_rdma(rmem, IBV_WR_RDMA_WRITE, src, lkey, dst, size);
+}
+
 int rmem_put(rmem_layer_t *rmem_layer, uint32_t tag,
         void *src, void *data_mr, size_t size)
 {
     struct rmem* rmem = (struct rmem*)rmem_layer->layer_data;
-    struct client_context *ctx = &rmem->ctx;
     struct ibv_mr* src_mr = (struct ibv_mr*)data_mr;
-    int err;
-
-    struct ibv_send_wr wr, *bad_wr = NULL;
-    struct ibv_sge sge;
-
-    memset(&wr, 0, sizeof(wr));
-
-    wr.wr_id = (uintptr_t) rmem->id;
-    wr.opcode = IBV_WR_RDMA_WRITE;
-    wr.send_flags = IBV_SEND_SIGNALED;
 
     uintptr_t dst = lookup_remote_addr(rmem->tag_to_addr, tag);
     CHECK_ERROR(dst == 0,
@@ -408,38 +1279,21 @@ int rmem_put(rmem_layer_t *rmem_layer, uint32_t tag,
     
     LOG(8, ("rmem_put size: %ld tag: %d dst:%lx\n", size, tag, dst));
 
-    wr.wr.rdma.remote_addr = dst;
-    wr.wr.rdma.rkey = ctx->peer_rkey;
-    wr.sg_list = &sge;
-    wr.num_sge = 1;
-
-    sge.addr = (uintptr_t) src;
-    sge.length = size;
-    sge.lkey = src_mr->lkey;
+    if (rmem->commit_mode == RMEM_COMMIT_LOG)
+        return log_put(rmem, dst, src, size);
+    if (rmem->commit_mode == RMEM_COMMIT_POOL)
+        return pool_put(rmem, dst, src, src_mr, size);
 
-    if ((err = ibv_post_send(rmem->id->qp, &wr, &bad_wr)) != 0)
-        return err;
-    if (sem_wait(&ctx->rdma_sem))
-        return errno;
-    return 0;
+    if (rmem->ndata == 0 && size <= rc_max_inline())
+        return small_put(rmem, dst, src, src_mr->lkey, size);
+    return rmem_rdma(rmem, IBV_WR_RDMA_WRITE, src, src_mr->lkey, dst, size);
 }
 
 int rmem_get(rmem_layer_t *rmem_layer, void *dst, void *data_mr,
         uint32_t tag, size_t size)
 {
     struct rmem* rmem = (struct rmem*)rmem_layer->layer_data;
-    struct client_context *ctx = &rmem->ctx;
     struct ibv_mr* dst_mr = (struct ibv_mr*)data_mr;
-    int err;
-
-    struct ibv_send_wr wr, *bad_wr = NULL;
-    struct ibv_sge sge;
-
-    memset(&wr, 0, sizeof(wr));
-
-    wr.wr_id = (uintptr_t) rmem->id;
-    wr.opcode = IBV_WR_RDMA_READ;
-    wr.send_flags = IBV_SEND_SIGNALED;
 
     uintptr_t src = lookup_remote_addr(rmem->tag_to_addr, tag);
     CHECK_ERROR(src == 0,
@@ -447,89 +1301,169 @@ int rmem_get(rmem_layer_t *rmem_layer, void *dst, void *data_mr,
 
     LOG(8, ("rmem_get size: %ld tag: %d src: %lx\n", size, tag, src));
 
-    wr.wr.rdma.remote_addr = src;
-    wr.wr.rdma.rkey = ctx->peer_rkey;
-    wr.sg_list = &sge;
-    wr.num_sge = 1;
-
-    sge.addr = (uintptr_t) dst;
-    sge.length = size;
-    sge.lkey = dst_mr->lkey;
+    /* committed records may still be sitting in the log */
+    if (rmem->commit_mode == RMEM_COMMIT_LOG)
+        log_wait_applied(rmem);
 
-
-    if ((err = ibv_post_send(rmem->id->qp, &wr, &bad_wr)) != 0)
-        return err;
-    if (sem_wait(&ctx->rdma_sem))
-        return errno;
-    return 0;
+    return rmem_rdma(rmem, IBV_WR_RDMA_READ, dst, dst_mr->lkey, src, size);
 }
 
-int rmem_free(rmem_layer_t *rmem_layer, uint32_t tag)
+/* Run iov as one-sided operations. Transfers to adjacent remote ranges
+ * share a work request, with one SGE per local buffer (or a single SGE when
+ * the local buffers are adjacent too). Work requests are dealt round-robin
+ * to the data QPs, up to IOV_BATCH per QP at a time, and only the last one
+ * on each QP is signaled: RC completes them in order, so one completion
+ * covers everything before it on that QP. */
+static int rmem_rdma_v(struct rmem *rmem, enum ibv_wr_opcode opcode,
+        rmem_iov_t *iov, int n)
 {
-    struct rmem* rmem = (struct rmem*)rmem_layer->layer_data;
-    struct client_context *ctx = &rmem->ctx;
+    struct ibv_send_wr wrs[IOV_BATCH * MAX_DATA_QPS], *bad_wr = NULL;
+    struct ibv_sge sges[IOV_BATCH * MAX_DATA_QPS][RC_MAX_SGE];
+    int nqps = rmem->ndata ? rmem->ndata : 1;
+    int i = 0, err = 0;
+
+    while (i < n) {
+        struct ibv_send_wr *head[MAX_DATA_QPS], *tail[MAX_DATA_QPS];
+        int first = i, nwr = 0, nposted = 0, ret = 0;
+
+        while (i < n && nwr < IOV_BATCH * nqps) {
+            struct ibv_send_wr *wr = &wrs[nwr];
+            struct ibv_sge *sge = sges[nwr];
+            uint64_t remote, end;
+            uint32_t rkey;
+            int nsge = 0;
+
+            remote = lookup_remote_addr(rmem->tag_to_addr, iov[i].tag);
+            CHECK_ERROR(remote == 0,
+                    ("Failure: tag %d not found\n", iov[i].tag));
+            rkey = lookup_rkey(rmem, remote);
+
+            memset(wr, 0, sizeof(*wr));
+            wr->wr_id = (uintptr_t) rmem->id;
+            wr->opcode = opcode;
+            wr->wr.rdma.remote_addr = remote;
+            wr->wr.rdma.rkey = rkey;
+            wr->sg_list = sge;
+
+            end = remote;
+            while (1) {
+                struct ibv_mr *mr = (struct ibv_mr *)iov[i].reg;
+                struct ibv_sge *last = nsge ? &sge[nsge - 1] : NULL;
+
+                if (last && last->lkey == mr->lkey &&
+                        last->addr + last->length == (uintptr_t)iov[i].addr) {
+                    last->length += iov[i].size;
+                } else {
+                    sge[nsge].addr = (uintptr_t)iov[i].addr;
+                    sge[nsge].length = iov[i].size;
+                    sge[nsge].lkey = mr->lkey;
+                    nsge++;
+                }
+                end += iov[i].size;
+
+                if (++i == n || nsge == RC_MAX_SGE)
+                    break;
+                remote = lookup_remote_addr(rmem->tag_to_addr, iov[i].tag);
+                if (remote != end || lookup_rkey(rmem, remote) != rkey ||
+                        end - wr->wr.rdma.remote_addr >= STRIPE_SIZE)
+                    break;
+            }
+
+            wr->num_sge = nsge;
+            nwr++;
+        }
 
-    ctx->send_msg->id = MSG_TXN_FREE;
+        for (int q = 0; q < nqps; q++)
+            head[q] = tail[q] = NULL;
+        for (int w = 0; w < nwr; w++) {
+            int q = w % nqps;
 
-    uintptr_t addr = lookup_remote_addr(rmem->tag_to_addr, tag);
-    CHECK_ERROR(addr == 0,
-            ("Failure: tag %d not found\n", tag));
+            if (tail[q] != NULL)
+                tail[q]->next = &wrs[w];
+            else
+                head[q] = &wrs[w];
+            tail[q] = &wrs[w];
+        }
 
-    LOG(8, ("rmem_free addr: %lx tag: %d\n", addr, tag));
+        LOG(8, ("rmem_rdma_v: %d transfers in %d work requests\n",
+                    i - first, nwr));
 
-    hash_delete_item(rmem->tag_to_addr, tag);
+        for (int q = 0; q < nqps && head[q] != NULL; q++) {
+            struct ibv_qp *qp = rmem->ndata ? rmem->data_ids[q]->qp :
+                rmem->id->qp;
 
-    ctx->send_msg->data.free.addr = addr;
+            tail[q]->send_flags = IBV_SEND_SIGNALED;
+            if ((ret = ibv_post_send(qp, head[q], &bad_wr)) != 0)
+                break;
+            nposted++;
+        }
+        // reap what was posted even if a QP refused its share
+        for (int q = 0; q < nposted; q++) {
+            if (wait_completion(&rmem->ctx, &rmem->ctx.rdma_done) &&
+                    ret == 0)
+                ret = errno;
+        }
+        if (ret != 0 && err == 0)
+            err = ret;
+        for (int j = first; j < i; j++)
+            iov[j].status = ret;
+    }
 
-    if (send_message(rmem->id))
-        return -1;
-    if (post_receive(rmem->id))
-	return -1;
+    return err;
+}
 
-    if (sem_wait(&ctx->send_sem))
-        return -1;
-    if (sem_wait(&ctx->recv_sem))
-	return -1;
+int rmem_put_v(rmem_layer_t *rmem_layer, rmem_iov_t *iov, int n)
+{
+    struct rmem* rmem = (struct rmem*)rmem_layer->layer_data;
+    int err = 0;
+
+    // these modes stage puts on the side, one at a time
+    if (rmem->commit_mode == RMEM_COMMIT_LOG ||
+            rmem->commit_mode == RMEM_COMMIT_POOL) {
+        for (int i = 0; i < n; i++) {
+            iov[i].status = rmem_put(rmem_layer, iov[i].tag, iov[i].addr,
+                    iov[i].reg, iov[i].size);
+            if (iov[i].status != 0 && err == 0)
+                err = iov[i].status;
+        }
+        return err;
+    }
 
-    return 0;
+    return rmem_rdma_v(rmem, IBV_WR_RDMA_WRITE, iov, n);
 }
 
-static int rmem_multi_cp_group(struct rmem *rmem,
-	uint32_t *tag_dst, uint32_t *tag_src, uint32_t *sizes, int n)
+int rmem_get_v(rmem_layer_t *rmem_layer, rmem_iov_t *iov, int n)
 {
-    struct client_context *ctx = &rmem->ctx;
+    struct rmem* rmem = (struct rmem*)rmem_layer->layer_data;
 
-    for (int i = 0; i < n; i++) {
-	uint64_t dst = lookup_remote_addr(rmem->tag_to_addr, tag_dst[i]);
-	uint64_t src = lookup_remote_addr(rmem->tag_to_addr, tag_src[i]);
-	CHECK_ERROR(dst == 0,
-		("Failure: tag %d not found\n", tag_dst[i]));
-	CHECK_ERROR(src == 0,
-		("Failure: tag %d not found\n", tag_src[i]));
-	ctx->send_msg->data.multi_cp.dsts[i] = dst;
-	ctx->send_msg->data.multi_cp.srcs[i] = src;
-	ctx->send_msg->data.multi_cp.sizes[i] = sizes[i];
-    }
-    ctx->send_msg->data.multi_cp.nitems = n;
-    ctx->send_msg->id = MSG_MULTI_TXN_CP;
+    /* committed records may still be sitting in the log */
+    if (rmem->commit_mode == RMEM_COMMIT_LOG)
+        log_wait_applied(rmem);
 
-    if (send_message(rmem->id))
-	return -1;
-    if (post_receive(rmem->id))
-	return -2;
-    if (sem_wait(&ctx->send_sem))
-	return -3;
-    if (sem_wait(&ctx->recv_sem))
-	return -4;
+    return rmem_rdma_v(rmem, IBV_WR_RDMA_READ, iov, n);
+}
 
-    if (ctx->recv_msg->id != MSG_TXN_ACK)
-	return -5;
+int rmem_free(rmem_layer_t *rmem_layer, uint32_t tag)
+{
+    struct rmem* rmem = (struct rmem*)rmem_layer->layer_data;
+
+    uintptr_t addr = lookup_remote_addr(rmem->tag_to_addr, tag);
+    CHECK_ERROR(addr == 0,
+            ("Failure: tag %d not found\n", tag));
+
+    LOG(8, ("rmem_free addr: %lx tag: %d\n", addr, tag));
+
+    hash_delete_item(rmem->tag_to_addr, tag);
+
+    // applied with the next commit
+    desc_add(rmem, DESC_FREE, 0, addr, 0);
 
     return 0;
 }
 
-static int rmem_multi_malloc_group(struct rmem *rmem, uint64_t *addrs,
-	uint64_t size, uint32_t *tags, int n)
+/* Send one MSG_MULTI_ALLOC without waiting for its reply */
+static int rmem_multi_malloc_issue(struct rmem *rmem, uint64_t size,
+	uint32_t *tags, int n)
 {
     struct client_context *ctx = &rmem->ctx;
 
@@ -543,9 +1477,17 @@ static int rmem_multi_malloc_group(struct rmem *rmem, uint64_t *addrs,
     if (send_message(rmem->id))
         return -1;
 
-    if (sem_wait(&ctx->send_sem))
-        return -1;
-    if (sem_wait(&ctx->recv_sem))
+    /* the send buffer is reusable once the send completes */
+    return wait_completion(ctx, &ctx->send_done);
+}
+
+/* Collect the reply to the oldest outstanding MSG_MULTI_ALLOC */
+static int rmem_multi_malloc_collect(struct rmem *rmem, uint64_t *addrs,
+	int n)
+{
+    struct client_context *ctx = &rmem->ctx;
+
+    if (wait_reply(ctx))
         return -1;
 
     if (ctx->recv_msg->id != MSG_MULTI_MEMRESP)
@@ -563,15 +1505,32 @@ int rmem_multi_malloc(rmem_layer_t* rmem_layer, uint64_t *addrs,
 	uint64_t size, uint32_t *tags, uint32_t n)
 {
     struct rmem *rmem = (struct rmem *) rmem_layer->layer_data;
+    unsigned int issued = 0, done = 0;
+    int ret = 0;
+
+    /* Keep up to MSG_RING_SIZE requests in flight; replies come back in
+     * order, so the oldest one is always the next to collect */
+    while (done < n) {
+        if (ret == 0 && issued < n &&
+                issued - done < MSG_RING_SIZE * MULTI_OP_MAX_ITEMS) {
+            int nitems = get_chunk_size(n - issued);
+            LOG(9, ("Allocating %d blocks\n", nitems));
+            ret = rmem_multi_malloc_issue(rmem, size, &tags[issued], nitems);
+            if (ret == 0)
+                issued += nitems;
+            continue;
+        }
 
-    for (unsigned int i = 0; i < n; i += MULTI_OP_MAX_ITEMS) {
-	int nitems = get_chunk_size(n - i);
-	int ret = rmem_multi_malloc_group(
-		rmem, &addrs[i], size, &tags[i], nitems);
-	LOG(9, ("Allocating %d blocks\n", nitems));
-        CHECK_ERROR(ret != 0,
-                ("Failure: error allocating memory: %d\n", ret));
+        if (done == issued)
+            break;
+
+        int nitems = get_chunk_size(n - done);
+        if (rmem_multi_malloc_collect(rmem, &addrs[done], nitems))
+            ret = -1;
+        done += nitems;
     }
+    CHECK_ERROR(ret != 0,
+            ("Failure: error allocating memory: %d\n", ret));
 
     for (unsigned int i = 0; i < n; i++) {
 	uint32_t tag = tags[i];
@@ -582,45 +1541,18 @@ int rmem_multi_malloc(rmem_layer_t* rmem_layer, uint64_t *addrs,
     return 0;
 }
 
-static int rmem_multi_free_group(struct rmem *rmem, uint32_t *tags, int n)
+int rmem_multi_free(rmem_layer_t *rmem_layer, uint32_t *tags, uint32_t n)
 {
-    struct client_context *ctx = &rmem->ctx;
+    struct rmem *rmem = (struct rmem *) rmem_layer->layer_data;
 
-    for (int i = 0; i < n; i++) {
+    for (unsigned int i = 0; i < n; i++) {
         uint32_t tag = tags[i];
         uint64_t addr = lookup_remote_addr(rmem->tag_to_addr, tag);
         CHECK_ERROR(addr == 0,
             ("Failure: tag %d not found\n", tag));
         LOG(8, ("rmem_free addr: %lx tag: %d\n", addr, tag));
-        ctx->send_msg->data.multi_free.addrs[i] = addr;
         hash_delete_item(rmem->tag_to_addr, tag);
-    }
-
-    ctx->send_msg->data.multi_free.nitems = n;
-    ctx->send_msg->id = MSG_MULTI_TXN_FREE;
-
-    if (send_message(rmem->id))
-        return -1;
-    if (post_receive(rmem->id))
-        return -1;
-
-    if (sem_wait(&ctx->send_sem))
-        return -1;
-    if (sem_wait(&ctx->recv_sem))
-        return -1;
-
-    return 0;
-}
-
-int rmem_multi_free(rmem_layer_t *rmem_layer, uint32_t *tags, uint32_t n)
-{
-    struct rmem *rmem = (struct rmem *) rmem_layer->layer_data;
-
-    for (unsigned int i = 0; i < n; i += MULTI_OP_MAX_ITEMS) {
-	int nitems = get_chunk_size(n - i);
-	int ret = rmem_multi_free_group(rmem, &tags[i], nitems);
-        CHECK_ERROR(ret != 0,
-                ("Failure: error freeing memory: %d\n", ret));
+        desc_add(rmem, DESC_FREE, 0, addr, 0);
     }
 
     return 0;
@@ -631,29 +1563,46 @@ int rmem_atomic_commit(rmem_layer_t* rmem_layer, uint32_t* tags_src,
         uint32_t* tags_dst, uint32_t* tags_size,
         uint32_t num_tags)
 {
-    /*
-     * All these RTTs should be merged
-     */
     struct rmem* rmem = (struct rmem*)rmem_layer->layer_data;
-
-    for (int i = 0; i < num_tags; i += MULTI_OP_MAX_ITEMS) {
-	int nitems = get_chunk_size(num_tags - i);
-	int ret = rmem_multi_cp_group(
-		rmem, &tags_dst[i], &tags_src[i], &tags_size[i], nitems);
-	for (int j = i; j < i + nitems; j++) {
-	    LOG(9, ("Commiting %d -> %d (size %d)\n",
-			tags_src[j], tags_dst[j], tags_size[j]));
-	}
-        CHECK_ERROR(ret != 0,
-                ("Failure: error adding tag to commit. ret: %d\n", ret));
+    enum txn_desc_op op = (rmem->commit_mode == RMEM_COMMIT_SWAP) ?
+        DESC_SWAP : DESC_CP;
+    int ret;
+
+    /* the records are already in the log, just publish them */
+    if (rmem->commit_mode == RMEM_COMMIT_LOG)
+        return log_commit(rmem);
+    if (rmem->commit_mode == RMEM_COMMIT_POOL)
+        return pool_commit(rmem);
+
+    for (int i = 0; i < num_tags; i++) {
+	uint64_t dst = lookup_remote_addr(rmem->tag_to_addr, tags_dst[i]);
+	uint64_t src = lookup_remote_addr(rmem->tag_to_addr, tags_src[i]);
+	CHECK_ERROR(dst == 0,
+		("Failure: tag %d not found\n", tags_dst[i]));
+	CHECK_ERROR(src == 0,
+		("Failure: tag %d not found\n", tags_src[i]));
+	LOG(9, ("Commiting %d -> %d (size %d)\n",
+		    tags_src[i], tags_dst[i], tags_size[i]));
+	desc_add(rmem, op, dst, src, tags_size[i]);
     }
-    return rmem_txn_go(rmem);
+
+    ret = rmem_txn_go(rmem);
+    if (ret != 0 || rmem->commit_mode != RMEM_COMMIT_SWAP)
+        return ret;
+
+    /* The server traded the real and shadow blocks, follow along */
+    for (int i = 0; i < num_tags; i++)
+        swap_tag_to_addr(rmem, tags_dst[i], tags_src[i]);
+
+    return 0;
 }
 
 static
 void *rmem_register_data(rmem_layer_t* rmem_layer, void *data, size_t size)
 {
-    return rmem_create_mr(data, size);
+    struct rmem* rmem = (struct rmem*)rmem_layer->layer_data;
+
+    return rmem_create_mr(rmem, data, size);
 }
 
 static
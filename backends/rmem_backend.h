@@ -4,7 +4,46 @@
 #include <rdma/rdma_cma.h>
 #include "rmem_generic_interface.h"
 
+/* How rmem_atomic_commit applies the shadow blocks on the server.
+ *
+ * RMEM_COMMIT_COPY: the server copies every shadow over its real block.
+ * RMEM_COMMIT_SWAP: the server re-binds each real tag to the shadow that was
+ *   just written and turns the old real block into the new shadow. No data is
+ *   copied, and the client mirrors the exchange in its own tag map once the
+ *   commit is acknowledged.
+ * RMEM_COMMIT_LOG: puts are appended to a redo log on the server with a few
+ *   large RDMA writes and committed by writing the log head. A server thread
+ *   applies the log to the home blocks, so no shadow blocks are needed. The
+ *   ring size (in bytes) can be set with RMEM_LOG_SIZE.
+ * RMEM_COMMIT_POOL: blocks have no shadow. Dirty pages are written to slots
+ *   leased from a staging pool shared by all clients of the server (see
+ *   rmem-server -s), and the commit copies them into the home blocks. Remote
+ *   memory use drops from twice the heap to the heap plus the pool.
+ *
+ * The mode is read from the RMEM_COMMIT_MODE environment variable ("copy",
+ * "swap", "log" or "pool") when the layer is created. Copy is the default. */
+enum rmem_commit_mode {
+    RMEM_COMMIT_COPY,
+    RMEM_COMMIT_SWAP,
+    RMEM_COMMIT_LOG,
+    RMEM_COMMIT_POOL
+};
+
+/* Completions are reaped by a thread sleeping on a completion channel, which
+ * wakes the application thread through a semaphore. With RMEM_POLL=busy the
+ * application thread polls the completion queue itself instead: no wakeups
+ * or context switches per operation, at the price of a spinning core while
+ * it waits. RMEM_POLL=event (the default) keeps the power-friendly mode.
+ *
+ * RMEM_DATA_QPS=n (up to 8) opens n extra connections to the server. Puts
+ * and gets, single or vectored, are striped across them, and the original
+ * connection is left to messages and the writes ordered with them. */
+
 rmem_layer_t* create_rmem_layer();
 
+/* The tags the server held when layer connected and those allocated since,
+ * in *tags (malloc'ed, for the caller to free). Returns how many. */
+uint32_t rmem_layer_tags(rmem_layer_t *layer, uint32_t **tags);
+
 #endif
 
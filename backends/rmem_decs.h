@@ -6,6 +6,8 @@ int rmem_free(rmem_layer_t *rmem_layer, uint32_t tag);
 
 int rmem_put(rmem_layer_t*, uint32_t tag, void *src, void *src_mr, size_t size);
 int rmem_get(rmem_layer_t*, void *dst, void *dst_mr, uint32_t tag, size_t size);
+int rmem_put_v(rmem_layer_t*, rmem_iov_t *iov, int n);
+int rmem_get_v(rmem_layer_t*, rmem_iov_t *iov, int n);
 
 int rmem_atomic_commit(rmem_layer_t*, uint32_t*, uint32_t*, uint32_t*, uint32_t);
 static void *rmem_register_data(rmem_layer_t*, void *data, size_t size);
@@ -85,6 +85,29 @@ typedef void* (*rmem_register_data_f)(rmem_layer_t* rcfg,
  */
 typedef void (*rmem_deregister_data_f)(rmem_layer_t* rcfg, void* buf);
 
+/* One transfer of a vectored put or get */
+typedef struct rmem_iov {
+    uint32_t tag;       /* remote block */
+    void *addr;         /* local buffer */
+    void *reg;          /* registration info for addr */
+    size_t size;
+    int status;         /* completion token: 0 or an errno once done */
+} rmem_iov_t;
+
+/* Copy several local buffers to the rmem layer at once. The layer may merge
+ * transfers to adjacent remote ranges into fewer, larger operations. Returns
+ * when every transfer has completed.
+ * \param[in] rcfg RMEM layer config info
+ * \param[in,out] iov Transfers, their status is filled in
+ * \param[in] n Number of transfers
+ *
+ * \returns 0 if all transfers succeeded, otherwise the first error
+ */
+typedef int (*rmem_put_v_f)(rmem_layer_t* rcfg, rmem_iov_t *iov, int n);
+
+/* Fetch several blocks from the rmem layer at once, see rmem_put_v_f */
+typedef int (*rmem_get_v_f)(rmem_layer_t* rcfg, rmem_iov_t *iov, int n);
+
 /* Allocate n memory regions and write their addresses to addrs
  * \param[in] rcfg RMEM layer config info
  * \param[in] addrs pointer to where the results should be placed
@@ -107,12 +130,22 @@ typedef rmem_layer_t* (*create_rmem_layer_f)();
 typedef struct data_record {
 } data_record_t;
 
+/* Layer flags */
+
+/* The layer stages puts itself and only makes them visible in the destination
+ * block at the next atomic_commit. RVM then puts straight to the real tag,
+ * passes the same tags as source and destination to atomic_commit, and never
+ * allocates shadow blocks. */
+#define RMEM_LAYER_NO_SHADOW (1 << 0)
+
 typedef struct rmem_layer {
     rmem_connect_f connect;
     rmem_disconnect_f disconnect;
     rmem_malloc_f malloc;
     rmem_put_f put;
     rmem_get_f get;
+    rmem_put_v_f put_v;
+    rmem_get_v_f get_v;
     rmem_free_f free;
     rmem_atomic_commit_f atomic_commit;
     rmem_register_data_f register_data;
@@ -120,6 +153,7 @@ typedef struct rmem_layer {
     rmem_multi_malloc_f multi_malloc;
     rmem_multi_free_f multi_free;
 
+    uint32_t flags; // RMEM_LAYER_* flags
     void* layer_data; // layer-specific data
 } rmem_layer_t;
 
@@ -0,0 +1,701 @@
+/*
+ * shard_backend.c
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <shard_backend.h>
+#include "common.h"
+#include "log.h"
+#include "error.h"
+#include "rmem_backend.h"
+#include "tcp_backend.h"
+#include "loop_backend.h"
+
+enum shard_op {
+    JOB_NONE,
+    JOB_CONNECT,
+    JOB_DISCONNECT,
+    JOB_PUT_V,
+    JOB_GET_V,
+    JOB_MULTI_MALLOC,
+    JOB_MULTI_FREE,
+    JOB_COMMIT,
+};
+
+#define RECORD_MAX_COPIES ((SHARD_RECORD_SIZE - \
+            sizeof(struct shard_record)) / sizeof(struct shard_copy))
+
+struct shard_set;
+
+struct shard {
+    struct shard_set *set;
+    rmem_layer_t *layer;
+    char *host;
+    char *port;
+    pthread_t thread;
+    uint64_t seen;              /* last run the worker looked at */
+
+    /* the shard's part of the current operation */
+    enum shard_op op;
+    uint32_t n;
+    uint64_t size;
+    int err;
+    int dirty;                  /* frees waiting for its next commit */
+
+    /* scratch, grown as needed */
+    uint32_t cap;
+    rmem_iov_t *iov;
+    uint32_t *index;            /* position in the caller's arrays */
+    uint32_t *tags;
+    uint64_t *addrs;
+    uint32_t *src;
+    uint32_t *dst;
+    uint32_t *sizes;
+};
+
+struct shard_set {
+    int n;
+    uint32_t stripe;
+    struct shard shards[SHARD_MAX];
+
+    pthread_mutex_t lock;
+    pthread_cond_t go;
+    pthread_cond_t done;
+    uint64_t run;               /* bumped for every parallel run */
+    int outstanding;
+    int stop;
+
+    struct shard_record *rec;
+    void *rec_reg;              /* registered with shard 0 */
+    uint64_t txid;
+};
+
+/* What register_data hands out: a registration per shard */
+struct shard_reg {
+    void *regs[SHARD_MAX];
+};
+
+static int shard_of(struct shard_set *ss, uint32_t tag)
+{
+    uint32_t b = tag >> 1;
+
+    if (tag >= SHARD_RECORD_TAG)
+        return 0;
+    if (ss->stripe != 0)
+        return (b / ss->stripe) % ss->n;
+
+    // murmur3 finalizer
+    b ^= b >> 16;
+    b *= 0x85ebca6b;
+    b ^= b >> 13;
+    b *= 0xc2b2ae35;
+    b ^= b >> 16;
+    return b % ss->n;
+}
+
+static void *reg_of(void *reg, int shard)
+{
+    return reg != NULL ? ((struct shard_reg *)reg)->regs[shard] : NULL;
+}
+
+static void reserve(struct shard *sh, uint32_t n)
+{
+    if (n <= sh->cap)
+        return;
+
+    sh->cap = n > 2 * sh->cap ? n : 2 * sh->cap;
+    TEST_Z(sh->iov = realloc(sh->iov, sh->cap * sizeof(*sh->iov)));
+    TEST_Z(sh->index = realloc(sh->index, sh->cap * sizeof(*sh->index)));
+    TEST_Z(sh->tags = realloc(sh->tags, sh->cap * sizeof(*sh->tags)));
+    TEST_Z(sh->addrs = realloc(sh->addrs, sh->cap * sizeof(*sh->addrs)));
+    TEST_Z(sh->src = realloc(sh->src, sh->cap * sizeof(*sh->src)));
+    TEST_Z(sh->dst = realloc(sh->dst, sh->cap * sizeof(*sh->dst)));
+    TEST_Z(sh->sizes = realloc(sh->sizes, sh->cap * sizeof(*sh->sizes)));
+}
+
+/* Size every shard's scratch for its share of n tags */
+static void count_tags(struct shard_set *ss, uint32_t *tags, uint32_t n)
+{
+    uint32_t counts[SHARD_MAX] = { 0 };
+
+    for (uint32_t i = 0; i < n; i++)
+        counts[shard_of(ss, tags[i])]++;
+    for (int k = 0; k < ss->n; k++) {
+        reserve(&ss->shards[k], counts[k]);
+        ss->shards[k].n = 0;
+        ss->shards[k].op = JOB_NONE;
+    }
+}
+
+/*
+ * WORKERS
+ */
+
+static int put_v(rmem_layer_t *layer, rmem_iov_t *iov, int n)
+{
+    int err = 0;
+
+    if (layer->put_v != NULL)
+        return layer->put_v(layer, iov, n);
+    for (int i = 0; i < n; i++) {
+        iov[i].status = layer->put(layer, iov[i].tag, iov[i].addr,
+                iov[i].reg, iov[i].size);
+        if (iov[i].status != 0 && err == 0)
+            err = iov[i].status;
+    }
+    return err;
+}
+
+static int get_v(rmem_layer_t *layer, rmem_iov_t *iov, int n)
+{
+    int err = 0;
+
+    if (layer->get_v != NULL)
+        return layer->get_v(layer, iov, n);
+    for (int i = 0; i < n; i++) {
+        iov[i].status = layer->get(layer, iov[i].addr, iov[i].reg,
+                iov[i].tag, iov[i].size);
+        if (iov[i].status != 0 && err == 0)
+            err = iov[i].status;
+    }
+    return err;
+}
+
+static void do_job(struct shard *sh)
+{
+    rmem_layer_t *layer = sh->layer;
+
+    switch (sh->op) {
+        case JOB_CONNECT:
+            layer->connect(layer, sh->host, sh->port);
+            sh->err = 0;
+            break;
+        case JOB_DISCONNECT:
+            layer->disconnect(layer);
+            sh->err = 0;
+            break;
+        case JOB_PUT_V:
+            sh->err = put_v(layer, sh->iov, sh->n);
+            break;
+        case JOB_GET_V:
+            sh->err = get_v(layer, sh->iov, sh->n);
+            break;
+        case JOB_MULTI_MALLOC:
+            sh->err = layer->multi_malloc(layer, sh->addrs, sh->size,
+                    sh->tags, sh->n);
+            break;
+        case JOB_MULTI_FREE:
+            sh->err = layer->multi_free(layer, sh->tags, sh->n);
+            break;
+        case JOB_COMMIT:
+            sh->err = layer->atomic_commit(layer, sh->src, sh->dst,
+                    sh->sizes, sh->n);
+            if (sh->err == 0)
+                sh->dirty = 0;
+            break;
+        case JOB_NONE:
+            break;
+    }
+}
+
+static void *shard_worker(void *arg)
+{
+    struct shard *sh = arg;
+    struct shard_set *ss = sh->set;
+
+    TEST_NZ(pthread_mutex_lock(&ss->lock));
+    for (;;) {
+        while (sh->seen == ss->run && !ss->stop)
+            TEST_NZ(pthread_cond_wait(&ss->go, &ss->lock));
+        if (sh->seen == ss->run)
+            break;
+        sh->seen = ss->run;
+        if (sh->op == JOB_NONE)
+            continue;
+        TEST_NZ(pthread_mutex_unlock(&ss->lock));
+
+        do_job(sh);
+
+        TEST_NZ(pthread_mutex_lock(&ss->lock));
+        sh->op = JOB_NONE;
+        if (--ss->outstanding == 0)
+            TEST_NZ(pthread_cond_signal(&ss->done));
+    }
+    TEST_NZ(pthread_mutex_unlock(&ss->lock));
+
+    return NULL;
+}
+
+/* Run the jobs set on the shards, in parallel when there are several, and
+ * return the first error */
+static int run_jobs(struct shard_set *ss)
+{
+    struct shard *one = NULL;
+    int njobs = 0, err = 0;
+
+    for (int k = 0; k < ss->n; k++) {
+        ss->shards[k].err = 0;
+        if (ss->shards[k].op != JOB_NONE) {
+            one = &ss->shards[k];
+            njobs++;
+        }
+    }
+
+    if (njobs == 1) {
+        do_job(one);
+        one->op = JOB_NONE;
+        return one->err;
+    }
+
+    if (njobs > 1) {
+        TEST_NZ(pthread_mutex_lock(&ss->lock));
+        ss->outstanding = njobs;
+        ss->run++;
+        TEST_NZ(pthread_cond_broadcast(&ss->go));
+        while (ss->outstanding > 0)
+            TEST_NZ(pthread_cond_wait(&ss->done, &ss->lock));
+        TEST_NZ(pthread_mutex_unlock(&ss->lock));
+    }
+
+    for (int k = 0; k < ss->n && err == 0; k++)
+        err = ss->shards[k].err;
+    return err;
+}
+
+/*
+ * COMMIT RECORDS
+ */
+
+static uint64_t record_sum(struct shard_record *rec)
+{
+    unsigned char *p = (unsigned char *)&rec->nshards;
+    unsigned char *end = (unsigned char *)&rec->copies[rec->n];
+    uint64_t sum = 0xcbf29ce484222325ULL;
+
+    // FNV-1a
+    for (; p < end; p++)
+        sum = (sum ^ *p) * 0x100000001b3ULL;
+    return sum;
+}
+
+static int record_put(struct shard_set *ss, size_t size)
+{
+    rmem_layer_t *s0 = ss->shards[0].layer;
+
+    return s0->put(s0, SHARD_RECORD_TAG, ss->rec, ss->rec_reg, size);
+}
+
+/* Commit the copies staged in the shards' scratch, on every shard that
+ * has copies or frees */
+static int commit_staged(struct shard_set *ss)
+{
+    for (int k = 0; k < ss->n; k++) {
+        struct shard *sh = &ss->shards[k];
+
+        sh->op = sh->n > 0 || sh->dirty ? JOB_COMMIT : JOB_NONE;
+    }
+    return run_jobs(ss);
+}
+
+static void stage_copies(struct shard_set *ss, struct shard_copy *copies,
+        uint32_t n)
+{
+    for (int k = 0; k < ss->n; k++)
+        ss->shards[k].n = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        struct shard *sh = &ss->shards[shard_of(ss, copies[i].dst)];
+
+        reserve(sh, sh->n + 1);
+        sh->src[sh->n] = copies[i].src;
+        sh->dst[sh->n] = copies[i].dst;
+        sh->sizes[sh->n++] = copies[i].size;
+    }
+}
+
+/* Finish a commit the last client recorded but did not mark applied */
+static void recover_record(struct shard_set *ss)
+{
+    struct shard_record *rec = ss->rec;
+    rmem_layer_t *s0 = ss->shards[0].layer;
+    uint32_t n;
+
+    CHECK_ERROR(s0->malloc(s0, SHARD_RECORD_SIZE, SHARD_RECORD_TAG) == 0,
+            ("Failure: no room for the commit record on %s\n",
+             ss->shards[0].host));
+
+    memset(rec, 0, sizeof(*rec));
+    if (s0->get(s0, rec, ss->rec_reg, SHARD_RECORD_TAG, sizeof(*rec)) != 0 ||
+            rec->magic != SHARD_MAGIC)
+        return;
+    ss->txid = rec->txid;
+    if (rec->state != RECORD_PREPARED)
+        return;
+
+    CHECK_ERROR(rec->nshards != (uint32_t)ss->n || rec->stripe != ss->stripe,
+            ("Failure: commit %ld was made over %d shards with stripe %d\n",
+             rec->txid, rec->nshards, rec->stripe));
+    n = rec->n;
+    if (n > RECORD_MAX_COPIES || s0->get(s0, rec, ss->rec_reg,
+                SHARD_RECORD_TAG, SHARD_RECORD_SIZE) != 0 ||
+            rec->n != n || rec->sum != record_sum(rec)) {
+        // torn, so no shard has it
+        LOG(1, ("discarding incomplete commit record %ld\n", rec->txid));
+        return;
+    }
+
+    stage_copies(ss, rec->copies, n);
+    CHECK_ERROR(commit_staged(ss) != 0,
+            ("Failure: could not finish commit %ld\n", rec->txid));
+    rec->state = RECORD_APPLIED;
+    CHECK_ERROR(record_put(ss, sizeof(*rec)) != 0,
+            ("Failure: could not mark commit %ld applied\n", rec->txid));
+
+    LOG(1, ("finished commit %ld over %d copies\n", rec->txid, n));
+}
+
+/*
+ * LAYER
+ */
+
+static void shard_connect(rmem_layer_t* rcfg, char* host, char* port)
+{
+    struct shard_set *ss = rcfg->layer_data;
+    char *hosts, *save = NULL, *name;
+    char *backend = getenv("RMEM_SHARD_BACKEND");
+    char *stripe = getenv("RMEM_SHARD_STRIPE");
+
+    ss->stripe = stripe != NULL ? strtoul(stripe, NULL, 0) : 0;
+    TEST_Z(hosts = strdup(host));
+
+    for (name = strtok_r(hosts, ",", &save); name != NULL;
+            name = strtok_r(NULL, ",", &save)) {
+        struct shard *sh = &ss->shards[ss->n];
+        char *colon = strchr(name, ':');
+
+        CHECK_ERROR(ss->n == SHARD_MAX,
+                ("Failure: more than %d shards\n", SHARD_MAX));
+        TEST_Z(sh->host = strdup(name));
+        if (colon != NULL) {
+            sh->host[colon - name] = '\0';
+            TEST_Z(sh->port = strdup(colon + 1));
+        } else {
+            TEST_Z(sh->port = strdup(port));
+        }
+
+        if (backend == NULL || strcmp(backend, "rdma") == 0)
+            sh->layer = create_rmem_layer();
+        else if (strcmp(backend, "tcp") == 0)
+            sh->layer = create_tcp_layer();
+        else if (strcmp(backend, "loop") == 0)
+            sh->layer = create_loop_layer();
+        else
+            CHECK_ERROR(1, ("Failure: unknown RMEM_SHARD_BACKEND %s\n",
+                        backend));
+        CHECK_ERROR(sh->layer->flags & RMEM_LAYER_NO_SHADOW,
+                ("Failure: shards must commit from shadow blocks\n"));
+
+        sh->set = ss;
+        sh->seen = ss->run;
+        sh->op = JOB_CONNECT;
+        TEST_NZ(pthread_create(&sh->thread, NULL, shard_worker, sh));
+        ss->n++;
+    }
+    free(hosts);
+    CHECK_ERROR(ss->n == 0, ("Failure: no shards in %s\n", host));
+
+    run_jobs(ss);
+
+    rmem_layer_t *s0 = ss->shards[0].layer;
+    TEST_Z(ss->rec = calloc(1, SHARD_RECORD_SIZE));
+    TEST_Z(ss->rec_reg = s0->register_data(s0, ss->rec, SHARD_RECORD_SIZE));
+    recover_record(ss);
+
+    LOG(5, ("connected to %d shards\n", ss->n));
+}
+
+static void shard_disconnect(rmem_layer_t* rcfg)
+{
+    struct shard_set *ss = rcfg->layer_data;
+    rmem_layer_t *s0 = ss->shards[0].layer;
+
+    s0->deregister_data(s0, ss->rec_reg);
+    free(ss->rec);
+    ss->rec = NULL;
+
+    for (int k = 0; k < ss->n; k++)
+        ss->shards[k].op = JOB_DISCONNECT;
+    run_jobs(ss);
+
+    TEST_NZ(pthread_mutex_lock(&ss->lock));
+    ss->stop = 1;
+    TEST_NZ(pthread_cond_broadcast(&ss->go));
+    TEST_NZ(pthread_mutex_unlock(&ss->lock));
+
+    for (int k = 0; k < ss->n; k++) {
+        struct shard *sh = &ss->shards[k];
+
+        TEST_NZ(pthread_join(sh->thread, NULL));
+        free(sh->host);
+        free(sh->port);
+        free(sh->iov);
+        free(sh->index);
+        free(sh->tags);
+        free(sh->addrs);
+        free(sh->src);
+        free(sh->dst);
+        free(sh->sizes);
+        memset(sh, 0, sizeof(*sh));
+    }
+    ss->n = 0;
+    ss->stop = 0;
+}
+
+static uint64_t shard_malloc(rmem_layer_t* rcfg, size_t size, uint32_t tag)
+{
+    struct shard_set *ss = rcfg->layer_data;
+    rmem_layer_t *layer = ss->shards[shard_of(ss, tag)].layer;
+
+    RETURN_ERROR(tag >= SHARD_RECORD_TAG, 0,
+            ("Failure: tag %x is reserved\n", tag));
+    return layer->malloc(layer, size, tag);
+}
+
+static int shard_free(rmem_layer_t* rcfg, uint32_t tag)
+{
+    struct shard_set *ss = rcfg->layer_data;
+    struct shard *sh = &ss->shards[shard_of(ss, tag)];
+
+    sh->dirty = 1;
+    return sh->layer->free(sh->layer, tag);
+}
+
+static int shard_multi_malloc(rmem_layer_t *rcfg,
+    uint64_t *addrs, uint64_t size, uint32_t *tags, uint32_t n)
+{
+    struct shard_set *ss = rcfg->layer_data;
+    int err;
+
+    for (uint32_t i = 0; i < n; i++)
+        RETURN_ERROR(tags[i] >= SHARD_RECORD_TAG, -1,
+                ("Failure: tag %x is reserved\n", tags[i]));
+
+    count_tags(ss, tags, n);
+    for (uint32_t i = 0; i < n; i++) {
+        struct shard *sh = &ss->shards[shard_of(ss, tags[i])];
+
+        sh->index[sh->n] = i;
+        sh->tags[sh->n++] = tags[i];
+        sh->op = JOB_MULTI_MALLOC;
+        sh->size = size;
+    }
+
+    err = run_jobs(ss);
+    for (int k = 0; k < ss->n; k++) {
+        struct shard *sh = &ss->shards[k];
+
+        for (uint32_t j = 0; j < sh->n; j++)
+            addrs[sh->index[j]] = sh->addrs[j];
+    }
+    return err;
+}
+
+static int shard_multi_free(rmem_layer_t *rcfg,
+    uint32_t *tags, uint32_t n)
+{
+    struct shard_set *ss = rcfg->layer_data;
+
+    count_tags(ss, tags, n);
+    for (uint32_t i = 0; i < n; i++) {
+        struct shard *sh = &ss->shards[shard_of(ss, tags[i])];
+
+        sh->tags[sh->n++] = tags[i];
+        sh->op = JOB_MULTI_FREE;
+        sh->dirty = 1;
+    }
+    return run_jobs(ss);
+}
+
+static int shard_put(rmem_layer_t* rcfg, uint32_t tag,
+        void *src, void *src_reg, size_t size)
+{
+    struct shard_set *ss = rcfg->layer_data;
+    int k = shard_of(ss, tag);
+    rmem_layer_t *layer = ss->shards[k].layer;
+
+    return layer->put(layer, tag, src, reg_of(src_reg, k), size);
+}
+
+static int shard_get(rmem_layer_t* rcfg, void *dst,
+        void *dst_reg, uint32_t tag, size_t size)
+{
+    struct shard_set *ss = rcfg->layer_data;
+    int k = shard_of(ss, tag);
+    rmem_layer_t *layer = ss->shards[k].layer;
+
+    return layer->get(layer, dst, reg_of(dst_reg, k), tag, size);
+}
+
+/* Split iov by shard, run op on all of them and collect the statuses */
+static int shard_iov(struct shard_set *ss, rmem_iov_t *iov, int n,
+        enum shard_op op)
+{
+    uint32_t counts[SHARD_MAX] = { 0 };
+    int err;
+
+    for (int i = 0; i < n; i++)
+        counts[shard_of(ss, iov[i].tag)]++;
+    for (int k = 0; k < ss->n; k++) {
+        reserve(&ss->shards[k], counts[k]);
+        ss->shards[k].n = 0;
+        ss->shards[k].op = counts[k] > 0 ? op : JOB_NONE;
+    }
+
+    for (int i = 0; i < n; i++) {
+        int k = shard_of(ss, iov[i].tag);
+        struct shard *sh = &ss->shards[k];
+
+        sh->index[sh->n] = i;
+        sh->iov[sh->n] = iov[i];
+        sh->iov[sh->n++].reg = reg_of(iov[i].reg, k);
+    }
+
+    err = run_jobs(ss);
+    for (int k = 0; k < ss->n; k++) {
+        struct shard *sh = &ss->shards[k];
+
+        for (uint32_t j = 0; j < sh->n; j++)
+            iov[sh->index[j]].status = sh->iov[j].status;
+    }
+    return err;
+}
+
+static int shard_put_v(rmem_layer_t* rcfg, rmem_iov_t *iov, int n)
+{
+    return shard_iov(rcfg->layer_data, iov, n, JOB_PUT_V);
+}
+
+static int shard_get_v(rmem_layer_t* rcfg, rmem_iov_t *iov, int n)
+{
+    return shard_iov(rcfg->layer_data, iov, n, JOB_GET_V);
+}
+
+static int shard_atomic_commit(rmem_layer_t* rcfg,
+        uint32_t* tags_src, uint32_t* tags_dst, uint32_t* sizes, uint32_t ntag)
+{
+    struct shard_set *ss = rcfg->layer_data;
+    struct shard_record *rec = ss->rec;
+    int nshards = 0, err;
+
+    count_tags(ss, tags_dst, ntag);
+    for (uint32_t i = 0; i < ntag; i++) {
+        struct shard *sh = &ss->shards[shard_of(ss, tags_dst[i])];
+
+        RETURN_ERROR(shard_of(ss, tags_src[i]) != shard_of(ss, tags_dst[i]),
+                EINVAL, ("Failure: tags %d and %d are on different shards\n",
+                    tags_src[i], tags_dst[i]));
+        sh->src[sh->n] = tags_src[i];
+        sh->dst[sh->n] = tags_dst[i];
+        sh->sizes[sh->n++] = sizes[i];
+    }
+    for (int k = 0; k < ss->n; k++)
+        nshards += ss->shards[k].n > 0;
+
+    // one shard's own commit is atomic already
+    if (nshards <= 1)
+        return commit_staged(ss);
+
+    RETURN_ERROR(ntag > RECORD_MAX_COPIES, E2BIG,
+            ("Failure: %d copies do not fit a commit record\n", ntag));
+
+    /* the record on shard 0 is the commit point */
+    rec->magic = SHARD_MAGIC;
+    rec->txid = ++ss->txid;
+    rec->state = RECORD_PREPARED;
+    rec->nshards = ss->n;
+    rec->stripe = ss->stripe;
+    rec->n = ntag;
+    for (uint32_t i = 0; i < ntag; i++) {
+        rec->copies[i].src = tags_src[i];
+        rec->copies[i].dst = tags_dst[i];
+        rec->copies[i].size = sizes[i];
+    }
+    rec->sum = record_sum(rec);
+    err = record_put(ss, sizeof(*rec) + ntag * sizeof(struct shard_copy));
+    if (err != 0)
+        return err;
+
+    err = commit_staged(ss);
+    if (err != 0)
+        return err;
+
+    // done before the next txn overwrites any shadow it would replay
+    rec->state = RECORD_APPLIED;
+    return record_put(ss, sizeof(*rec));
+}
+
+static void* shard_register_data(rmem_layer_t* rcfg,
+        void* buf, size_t size)
+{
+    struct shard_set *ss = rcfg->layer_data;
+    struct shard_reg *reg = malloc(sizeof(*reg));
+
+    RETURN_ERROR(reg == NULL, NULL, ("Failure: out of memory\n"));
+    for (int k = 0; k < ss->n; k++) {
+        rmem_layer_t *layer = ss->shards[k].layer;
+
+        reg->regs[k] = layer->register_data(layer, buf, size);
+    }
+
+    return reg;
+}
+
+static void shard_deregister_data(rmem_layer_t* rcfg, void*buf)
+{
+    struct shard_set *ss = rcfg->layer_data;
+    struct shard_reg *reg = buf;
+
+    if (reg == NULL)
+        return;
+    for (int k = 0; k < ss->n; k++) {
+        rmem_layer_t *layer = ss->shards[k].layer;
+
+        layer->deregister_data(layer, reg->regs[k]);
+    }
+    free(reg);
+}
+
+rmem_layer_t* create_shard_layer()
+{
+    rmem_layer_t *layer = malloc(sizeof(rmem_layer_t));
+    struct shard_set *ss = calloc(1, sizeof(struct shard_set));
+
+    CHECK_ERROR(layer == NULL || ss == NULL,
+            ("Failure: Error allocating layer struct\n"));
+
+    TEST_NZ(pthread_mutex_init(&ss->lock, NULL));
+    TEST_NZ(pthread_cond_init(&ss->go, NULL));
+    TEST_NZ(pthread_cond_init(&ss->done, NULL));
+
+    layer->connect = shard_connect;
+    layer->disconnect = shard_disconnect;
+    layer->malloc = shard_malloc;
+    layer->free = shard_free;
+    layer->put = shard_put;
+    layer->get = shard_get;
+    layer->put_v = shard_put_v;
+    layer->get_v = shard_get_v;
+    layer->atomic_commit = shard_atomic_commit;
+    layer->register_data = shard_register_data;
+    layer->deregister_data = shard_deregister_data;
+    layer->multi_malloc = shard_multi_malloc;
+    layer->multi_free = shard_multi_free;
+    layer->flags = 0;
+    layer->layer_data = ss;
+
+    return layer;
+}
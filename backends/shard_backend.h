@@ -0,0 +1,58 @@
+/*
+ * shard_backend.h
+ *
+ *  Spreads blocks over several rmem-servers. connect takes a comma
+ *  separated list of servers as its host, each "host" or "host:port", port
+ *  being the default for those without one. Every server is driven by its
+ *  own layer, picked with RMEM_SHARD_BACKEND ("rdma", the default, "tcp"
+ *  or "loop"), and its own thread, so vectored puts and gets and commits
+ *  run on all shards at once.
+ *
+ *  A tag's shard is picked by hashing tag >> 1, or with RMEM_SHARD_STRIPE=k
+ *  by giving each shard k consecutive blocks in turn. A block and its
+ *  shadow (tags 2b and 2b + 1) thus live on the same shard and commit there.
+ *
+ *  A commit that touches one shard is that shard's atomic commit. One that
+ *  touches several first writes its copy list as a record on shard 0, then
+ *  commits every shard, then marks the record applied. connect finishes a
+ *  commit whose record was written but not marked, so either all shards
+ *  have it or none. Servers must be given in the same order every time.
+ *  Tags from SHARD_RECORD_TAG up are reserved.
+ */
+
+#ifndef SHARD_BACKEND_H_
+#define SHARD_BACKEND_H_
+
+#include "rmem_generic_interface.h"
+
+#define SHARD_MAX 64
+#define SHARD_MAGIC 0x52564d5348415244ULL
+#define SHARD_RECORD_TAG 0xfffffff0U
+/* Room for the copy list of the largest commit spanning shards */
+#define SHARD_RECORD_SIZE (4 << 20)
+
+enum record_state {
+    RECORD_PREPARED = 1,
+    RECORD_APPLIED = 2,
+};
+
+/* A commit spanning shards, kept under SHARD_RECORD_TAG on shard 0 */
+struct shard_record {
+    uint64_t magic;
+    uint64_t txid;
+    uint64_t sum;               /* of everything after state */
+    uint32_t state;
+    uint32_t nshards;
+    uint32_t stripe;
+    uint32_t n;
+    struct shard_copy {
+        uint32_t src;
+        uint32_t dst;
+        uint32_t size;
+    } copies[];
+};
+
+/* Of type create_rmem_layer_f */
+rmem_layer_t* create_shard_layer();
+
+#endif /* SHARD_BACKEND_H_ */
@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "../common.h"
+#include "shm_backend.h"
+#include "tcp_int.h"
+#include "../utils/log.h"
+#include "../utils/error.h"
+
+/* Polls of a pending commit between yields to the server's poller, which
+ * may need our CPU */
+#define COMMIT_SPINS 128
+
+struct shm_rmem {
+    struct tcp_rmem tcp;    /* must come first, it is the layer_data */
+
+    /* the server's memory file, mapped up to len */
+    int pool_fd;
+    char *pool;
+    size_t len;
+    uint64_t base;          /* server address of the start of the file */
+
+    struct shm_ring *ring;
+};
+
+/* Receive the fds of the memory file and of our ring */
+static void recv_fds(int fd, int fds[2])
+{
+    char cbuf[CMSG_SPACE(2 * sizeof(int))];
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    CHECK_ERROR(recvmsg(fd, &msg, MSG_WAITALL) != 1,
+            ("Failure: no memory file from the server: %s\n",
+             strerror(errno)));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    CHECK_ERROR(cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+            cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int)),
+            ("Failure: no memory file from the server\n"));
+    memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+}
+
+/* Where size bytes at server address addr are mapped. The file grows as
+ * the server backs more of its table, the mapping follows on demand. */
+static char *shm_at(struct shm_rmem *shm, uint64_t addr, size_t size)
+{
+    uint64_t off = addr - shm->base;
+    struct stat st;
+    void *pool;
+
+    if (off + size <= shm->len)
+        return shm->pool + off;
+
+    TEST_NZ(fstat(shm->pool_fd, &st));
+    CHECK_ERROR(off + size > (uint64_t) st.st_size,
+            ("Failure: address %lx is not in the server's memory\n", addr));
+
+    if (shm->pool == NULL)
+        pool = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                shm->pool_fd, 0);
+    else
+        pool = mremap(shm->pool, shm->len, st.st_size, MREMAP_MAYMOVE);
+    TEST_Z(pool != MAP_FAILED);
+
+    shm->pool = pool;
+    shm->len = st.st_size;
+    return shm->pool + off;
+}
+
+static void shm_connect(rmem_layer_t *layer, char *host, char *port)
+{
+    struct shm_rmem *shm = layer->layer_data;
+    struct sockaddr_un addr;
+    int fds[2];
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), RMEM_LOCAL_SOCKET, port);
+
+    TEST_Z((shm->tcp.fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0);
+    CHECK_ERROR(connect(shm->tcp.fd, (struct sockaddr *)&addr,
+                sizeof(addr)) != 0,
+            ("Failure: could not connect to %s: %s\n", addr.sun_path,
+             strerror(errno)));
+
+    recv_fds(shm->tcp.fd, fds);
+    shm->pool_fd = fds[0];
+    shm->ring = mmap(NULL, sizeof(*shm->ring), PROT_READ | PROT_WRITE,
+            MAP_SHARED, fds[1], 0);
+    TEST_Z(shm->ring != MAP_FAILED);
+    close(fds[1]);
+
+    // descriptors are staged straight into the ring
+    shm->tcp.desc = shm->ring->desc;
+    tcp_handshake(&shm->tcp);
+    shm->base = shm->tcp.resp.data.tag_addr_map.addr;
+}
+
+static void shm_disconnect(rmem_layer_t *layer)
+{
+    struct shm_rmem *shm = layer->layer_data;
+
+    close(shm->tcp.fd);
+    if (shm->pool != NULL)
+        munmap(shm->pool, shm->len);
+    close(shm->pool_fd);
+    munmap(shm->ring, sizeof(*shm->ring));
+}
+
+static int shm_put(rmem_layer_t *layer, uint32_t tag, void *src,
+        void *src_reg, size_t size)
+{
+    struct shm_rmem *shm = layer->layer_data;
+
+    memcpy(shm_at(shm, tcp_lookup_tag(&shm->tcp, tag), size), src, size);
+    return 0;
+}
+
+static int shm_get(rmem_layer_t *layer, void *dst, void *dst_reg,
+        uint32_t tag, size_t size)
+{
+    struct shm_rmem *shm = layer->layer_data;
+
+    memcpy(dst, shm_at(shm, tcp_lookup_tag(&shm->tcp, tag), size), size);
+    return 0;
+}
+
+static int shm_put_v(rmem_layer_t *layer, rmem_iov_t *iov, int n)
+{
+    for (int i = 0; i < n; i++)
+        iov[i].status = shm_put(layer, iov[i].tag, iov[i].addr, NULL,
+                iov[i].size);
+    return 0;
+}
+
+static int shm_get_v(rmem_layer_t *layer, rmem_iov_t *iov, int n)
+{
+    for (int i = 0; i < n; i++)
+        iov[i].status = shm_get(layer, iov[i].addr, NULL, iov[i].tag,
+                iov[i].size);
+    return 0;
+}
+
+static int shm_atomic_commit(rmem_layer_t *layer, uint32_t *tags_src,
+        uint32_t *tags_dst, uint32_t *tags_size, uint32_t num_tags)
+{
+    struct shm_rmem *shm = layer->layer_data;
+    struct shm_ring *ring = shm->ring;
+    uint64_t pos = ring->head;
+    unsigned spins = 0;
+
+    for (uint32_t i = 0; i < num_tags; i++)
+        tcp_desc_add(&shm->tcp, DESC_CP,
+                tcp_lookup_tag(&shm->tcp, tags_dst[i]),
+                tcp_lookup_tag(&shm->tcp, tags_src[i]), tags_size[i]);
+
+    ring->slots[pos % SHM_RING_SIZE].nentries = shm->tcp.desc_n;
+    ring->slots[pos % SHM_RING_SIZE].op = CHAN_GO;
+    shm->tcp.desc_n = 0;
+    // the server must see the slot and descriptor before head moves
+    __sync_synchronize();
+    ring->head = pos + 1;
+
+    while (ring->slots[pos % SHM_RING_SIZE].done != pos + 1)
+        if (++spins % COMMIT_SPINS == 0)
+            sched_yield();
+    __sync_synchronize();
+
+    return ring->slots[pos % SHM_RING_SIZE].error ? -6 : 0;
+}
+
+rmem_layer_t* create_shm_layer()
+{
+    rmem_layer_t *layer = malloc(sizeof(rmem_layer_t));
+    struct shm_rmem *shm = calloc(1, sizeof(struct shm_rmem));
+
+    CHECK_ERROR(layer == NULL || shm == NULL,
+            ("Failure: Error allocating layer struct\n"));
+
+    tcp_layer_init(layer, &shm->tcp);
+    layer->connect = shm_connect;
+    layer->disconnect = shm_disconnect;
+    layer->put = shm_put;
+    layer->get = shm_get;
+    layer->put_v = shm_put_v;
+    layer->get_v = shm_get_v;
+    layer->atomic_commit = shm_atomic_commit;
+
+    return layer;
+}
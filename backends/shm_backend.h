@@ -0,0 +1,15 @@
+#ifndef SHM_BACKEND_H_
+#define SHM_BACKEND_H_
+
+#include "rmem_generic_interface.h"
+
+/* The rmem protocol for clients on the server's own host. Talks to
+ * rmem-server -m through a Unix socket, over which the server passes its
+ * memory file. The client maps it, so puts and gets are memcpy's into the
+ * server's memory with no system call. Commits are posted to a command
+ * ring shared with the server and spin for its answer. Allocations and
+ * the tag map go through the socket as with the TCP backend; connect's
+ * host argument is ignored. */
+rmem_layer_t* create_shm_layer();
+
+#endif
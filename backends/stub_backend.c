@@ -69,6 +69,25 @@ int stub_get(rmem_layer_t* rcfg, void *dst,
     return -1;
 }
 
+/* Of type rmem_put_v_f */
+int stub_put_v(rmem_layer_t* rcfg, rmem_iov_t *iov, int n)
+{
+    for(int i = 0; i < n; i++)
+    {
+        iov[i].status = 0;
+    }
+
+    return 0;
+}
+
+/* Of type rmem_get_v_f */
+int stub_get_v(rmem_layer_t* rcfg, rmem_iov_t *iov, int n)
+{
+    UNIMPLEMENTED;
+
+    return -1;
+}
+
 /* Of type rmem_atomic_commit_f */
 int stub_atomic_commit(rmem_layer_t* rcfg,
         uint32_t* tags_src, uint32_t* tags_dst, uint32_t* sizes, uint32_t ntag)
@@ -104,9 +123,12 @@ rmem_layer_t* create_stub_layer()
     rcfg->multi_free = stub_multi_free;
     rcfg->put = stub_put;
     rcfg->get = stub_get;
+    rcfg->put_v = stub_put_v;
+    rcfg->get_v = stub_get_v;
     rcfg->atomic_commit = stub_atomic_commit;
     rcfg->register_data = stub_register_data;
     rcfg->deregister_data = stub_deregister_data;
+    rcfg->flags = 0;
 
     /* Set up local data */
     rcfg->layer_data = NULL;
@@ -43,6 +43,12 @@ int stub_put(rmem_layer_t* rcfg, uint32_t tag,
 int stub_get(rmem_layer_t* rcfg, void *dst,
         void *dst_reg, uint32_t tag, size_t size);
 
+/* Of type rmem_put_v_f */
+int stub_put_v(rmem_layer_t* rcfg, rmem_iov_t *iov, int n);
+
+/* Of type rmem_get_v_f */
+int stub_get_v(rmem_layer_t* rcfg, rmem_iov_t *iov, int n);
+
 /* Of type rmem_atomic_commit_f */
 int stub_atomic_commit(rmem_layer_t* rcfg,
         uint32_t* tags_src, uint32_t* tags_dst, uint32_t* sizes, uint32_t ntag);
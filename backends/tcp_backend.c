@@ -0,0 +1,442 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "../common.h"
+#include "tcp_backend.h"
+#include "tcp_int.h"
+#include "../utils/log.h"
+#include "../utils/error.h"
+
+static const int HASH_SIZE = 10000;
+#define PUT_BATCH 256   /* transfers gathered into one sendmsg */
+#define GET_BATCH 64    /* reads in flight, well within the socket buffers */
+
+static void insert_tag(struct tcp_rmem *tcp, uint32_t tag, uint64_t addr)
+{
+    uint64_t *addr_ptr = malloc(sizeof(*addr_ptr));
+    CHECK_ERROR(addr_ptr == NULL,
+            ("Failure: error allocating memory for tag_to_addr entry\n"));
+    *addr_ptr = addr;
+
+    hash_insert_item(tcp->tag_to_addr, tag, addr_ptr);
+}
+
+uint64_t tcp_lookup_tag(struct tcp_rmem *tcp, uint32_t tag)
+{
+    uint64_t *addr = hash_get_item(tcp->tag_to_addr, tag);
+
+    CHECK_ERROR(addr == NULL,
+            ("Failure: tag %d not found\n", tag));
+    return *addr;
+}
+
+/* Fill iov[0..2) with the frame and message of a request */
+static int frame_request(struct tcp_frame *frame, struct message *msg,
+        uint64_t payload, struct iovec *iov)
+{
+    frame->len = msg_len(msg);
+    frame->pad = 0;
+    frame->payload = payload;
+
+    iov[0].iov_base = frame;
+    iov[0].iov_len = sizeof(*frame);
+    iov[1].iov_base = msg;
+    iov[1].iov_len = frame->len;
+    return 2;
+}
+
+static int send_request(struct tcp_rmem *tcp, const void *data,
+        uint64_t payload)
+{
+    struct tcp_frame frame;
+    struct iovec iov[3];
+    int n = frame_request(&frame, &tcp->msg, payload, iov);
+
+    if (payload > 0) {
+        iov[n].iov_base = (void *)data;
+        iov[n++].iov_len = payload;
+    }
+    return tcp_writev_full(tcp->fd, iov, n);
+}
+
+/* Read the next reply into tcp->resp and its payload into data, which has
+ * room for max bytes. A payload that does not fit is an error. */
+static int recv_reply(struct tcp_rmem *tcp, void *data, uint64_t max)
+{
+    struct tcp_frame frame;
+
+    if (tcp_read_full(tcp->fd, &frame, sizeof(frame)))
+        return -1;
+    if (frame.len > sizeof(tcp->resp) || frame.payload > max)
+        return -1;
+
+    memset(&tcp->resp, 0, sizeof(tcp->resp));
+    if (tcp_read_full(tcp->fd, &tcp->resp, frame.len))
+        return -1;
+    if (frame.payload > 0 && tcp_read_full(tcp->fd, data, frame.payload))
+        return -1;
+    return 0;
+}
+
+static int desc_send(struct tcp_rmem *tcp, enum message_id msg_id)
+{
+    uint64_t n = tcp->desc_n;
+
+    tcp->desc_n = 0;
+    tcp->msg.id = msg_id;
+    tcp->msg.data.txn_go.nentries = n;
+
+    if (send_request(tcp, tcp->desc, n * sizeof(*tcp->desc)))
+        return -1;
+    if (recv_reply(tcp, NULL, 0))
+        return -1;
+    if (tcp->resp.id != MSG_TXN_ACK)
+        return -1;
+    if (tcp->resp.data.memresp.error)
+        return -6;
+
+    return 0;
+}
+
+void tcp_desc_add(struct tcp_rmem *tcp, enum txn_desc_op op,
+        uint64_t dst, uint64_t src, uint64_t size)
+{
+    struct txn_desc_entry *entry;
+
+    if (tcp->desc_n == TXN_DESC_MAX_ENTRIES)
+        CHECK_ERROR(desc_send(tcp, MSG_TXN_DESC) != 0,
+                ("Failure: server refused commit descriptor\n"));
+
+    entry = &tcp->desc[tcp->desc_n++];
+    entry->dst = dst;
+    entry->src = src;
+    entry->size = size;
+    entry->op = op;
+}
+
+void tcp_handshake(struct tcp_rmem *tcp)
+{
+    tag_addr_entry_t *entries;
+    struct tcp_frame frame;
+
+    tcp->tag_to_addr = hash_create(HASH_SIZE);
+    if (tcp->desc == NULL)
+        TEST_Z(tcp->desc = malloc(TXN_DESC_MAX_ENTRIES * sizeof(*tcp->desc)));
+    tcp->desc_n = 0;
+
+    // the server opens with its tag map
+    TEST_NZ(tcp_read_full(tcp->fd, &frame, sizeof(frame)));
+    CHECK_ERROR(frame.len > sizeof(tcp->resp) ||
+            frame.payload % sizeof(*entries),
+            ("Failure: bad tag map from the server\n"));
+    TEST_NZ(tcp_read_full(tcp->fd, &tcp->resp, frame.len));
+    CHECK_ERROR(tcp->resp.id != MSG_TAG_ADDR_MAP,
+            ("Failure: bad tag map from the server\n"));
+
+    if (frame.payload > 0) {
+        TEST_Z(entries = malloc(frame.payload));
+        TEST_NZ(tcp_read_full(tcp->fd, entries, frame.payload));
+        for (uint64_t i = 0; i < frame.payload / sizeof(*entries); i++)
+            insert_tag(tcp, entries[i].tag, entries[i].addr);
+        free(entries);
+    }
+    LOG(5, ("connected, %lu mappings\n", frame.payload / sizeof(*entries)));
+}
+
+static void tcp_connect(rmem_layer_t *layer, char *host, char *port)
+{
+    struct tcp_rmem *tcp = layer->layer_data;
+    struct addrinfo hints, *addr;
+    int one = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    TEST_NZ(getaddrinfo(host, port, &hints, &addr));
+
+    TEST_Z((tcp->fd = socket(addr->ai_family, addr->ai_socktype,
+                    addr->ai_protocol)) >= 0);
+    CHECK_ERROR(connect(tcp->fd, addr->ai_addr, addr->ai_addrlen) != 0,
+            ("Failure: could not connect to %s:%s: %s\n", host, port,
+             strerror(errno)));
+    freeaddrinfo(addr);
+    setsockopt(tcp->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    tcp_handshake(tcp);
+}
+
+static void tcp_disconnect(rmem_layer_t *layer)
+{
+    struct tcp_rmem *tcp = layer->layer_data;
+
+    close(tcp->fd);
+    free(tcp->desc);
+}
+
+static uint64_t tcp_malloc(rmem_layer_t *layer, size_t size, uint32_t tag)
+{
+    struct tcp_rmem *tcp = layer->layer_data;
+
+    tcp->msg.id = MSG_ALLOC;
+    tcp->msg.data.alloc.size = size;
+    tcp->msg.data.alloc.tag = tag;
+
+    if (send_request(tcp, NULL, 0) || recv_reply(tcp, NULL, 0))
+        return 0;
+    if (tcp->resp.data.memresp.error)
+        return 0;
+
+    insert_tag(tcp, tag, tcp->resp.data.memresp.addr);
+    return tcp->resp.data.memresp.addr;
+}
+
+static int tcp_multi_malloc(rmem_layer_t *layer, uint64_t *addrs,
+        uint64_t size, uint32_t *tags, uint32_t n)
+{
+    struct tcp_rmem *tcp = layer->layer_data;
+    struct tcp_frame frames[GET_BATCH];
+    struct message *msgs;
+    struct iovec iov[2 * GET_BATCH];
+    int ret = 0;
+
+    TEST_Z(msgs = calloc(GET_BATCH, sizeof(*msgs)));
+
+    /* a round of requests goes out in one call, then the replies are
+     * collected in order */
+    for (uint32_t first = 0; first < n && ret == 0;
+            first += GET_BATCH * MULTI_OP_MAX_ITEMS) {
+        int nreq = 0, niov = 0;
+
+        for (uint32_t i = first; i < n && nreq < GET_BATCH;
+                i += MULTI_OP_MAX_ITEMS, nreq++) {
+            int nitems = MIN(n - i, MULTI_OP_MAX_ITEMS);
+
+            msgs[nreq].id = MSG_MULTI_ALLOC;
+            msgs[nreq].data.multi_alloc.size = size;
+            msgs[nreq].data.multi_alloc.nitems = nitems;
+            memcpy(msgs[nreq].data.multi_alloc.tags, &tags[i],
+                    nitems * sizeof(*tags));
+            niov += frame_request(&frames[nreq], &msgs[nreq], 0, &iov[niov]);
+        }
+        if (tcp_writev_full(tcp->fd, iov, niov)) {
+            ret = -1;
+            break;
+        }
+
+        for (int r = 0; r < nreq; r++) {
+            uint32_t i = first + r * MULTI_OP_MAX_ITEMS;
+
+            if (recv_reply(tcp, NULL, 0) ||
+                    tcp->resp.id != MSG_MULTI_MEMRESP ||
+                    tcp->resp.data.multi_memresp.error) {
+                ret = -1;
+                continue;
+            }
+            memcpy(&addrs[i], tcp->resp.data.multi_memresp.addrs,
+                    MIN(n - i, MULTI_OP_MAX_ITEMS) * sizeof(*addrs));
+        }
+    }
+    free(msgs);
+    CHECK_ERROR(ret != 0,
+            ("Failure: error allocating memory: %d\n", ret));
+
+    for (uint32_t i = 0; i < n; i++)
+        insert_tag(tcp, tags[i], addrs[i]);
+
+    return 0;
+}
+
+int tcp_free(rmem_layer_t *layer, uint32_t tag)
+{
+    struct tcp_rmem *tcp = layer->layer_data;
+    uint64_t addr = tcp_lookup_tag(tcp, tag);
+
+    hash_delete_item(tcp->tag_to_addr, tag);
+
+    // applied with the next commit
+    tcp_desc_add(tcp, DESC_FREE, 0, addr, 0);
+
+    return 0;
+}
+
+int tcp_multi_free(rmem_layer_t *layer, uint32_t *tags, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+        tcp_free(layer, tags[i]);
+
+    return 0;
+}
+
+static int tcp_put(rmem_layer_t *layer, uint32_t tag, void *src,
+        void *src_reg, size_t size)
+{
+    struct tcp_rmem *tcp = layer->layer_data;
+
+    tcp->msg.id = MSG_WRITE;
+    tcp->msg.data.rw.addr = tcp_lookup_tag(tcp, tag);
+    tcp->msg.data.rw.size = size;
+
+    return send_request(tcp, src, size) ? EIO : 0;
+}
+
+static int tcp_get(rmem_layer_t *layer, void *dst, void *dst_reg,
+        uint32_t tag, size_t size)
+{
+    struct tcp_rmem *tcp = layer->layer_data;
+
+    tcp->msg.id = MSG_READ;
+    tcp->msg.data.rw.addr = tcp_lookup_tag(tcp, tag);
+    tcp->msg.data.rw.size = size;
+
+    if (send_request(tcp, NULL, 0) || recv_reply(tcp, dst, size))
+        return EIO;
+    return tcp->resp.data.memresp.error ? EINVAL : 0;
+}
+
+static int tcp_put_v(rmem_layer_t *layer, rmem_iov_t *iov, int n)
+{
+    struct tcp_rmem *tcp = layer->layer_data;
+    struct tcp_frame frames[PUT_BATCH];
+    struct message *msgs;
+    struct iovec vec[3 * PUT_BATCH];
+    int err = 0;
+
+    TEST_Z(msgs = calloc(PUT_BATCH, sizeof(*msgs)));
+
+    for (int first = 0; first < n; first += PUT_BATCH) {
+        int last = MIN(n, first + PUT_BATCH), nvec = 0, ret;
+
+        for (int i = first; i < last; i++) {
+            struct message *msg = &msgs[i - first];
+
+            msg->id = MSG_WRITE;
+            msg->data.rw.addr = tcp_lookup_tag(tcp, iov[i].tag);
+            msg->data.rw.size = iov[i].size;
+            nvec += frame_request(&frames[i - first], msg, iov[i].size,
+                    &vec[nvec]);
+            vec[nvec].iov_base = iov[i].addr;
+            vec[nvec++].iov_len = iov[i].size;
+        }
+
+        ret = tcp_writev_full(tcp->fd, vec, nvec) ? EIO : 0;
+        for (int i = first; i < last; i++)
+            iov[i].status = ret;
+        if (ret != 0 && err == 0)
+            err = ret;
+    }
+    free(msgs);
+
+    return err;
+}
+
+static int tcp_get_v(rmem_layer_t *layer, rmem_iov_t *iov, int n)
+{
+    struct tcp_rmem *tcp = layer->layer_data;
+    struct tcp_frame frames[GET_BATCH];
+    struct message *msgs;
+    struct iovec vec[2 * GET_BATCH];
+    int err = 0;
+
+    TEST_Z(msgs = calloc(GET_BATCH, sizeof(*msgs)));
+
+    for (int first = 0; first < n; first += GET_BATCH) {
+        int last = MIN(n, first + GET_BATCH), nvec = 0;
+
+        for (int i = first; i < last; i++) {
+            struct message *msg = &msgs[i - first];
+
+            msg->id = MSG_READ;
+            msg->data.rw.addr = tcp_lookup_tag(tcp, iov[i].tag);
+            msg->data.rw.size = iov[i].size;
+            nvec += frame_request(&frames[i - first], msg, 0, &vec[nvec]);
+        }
+        if (tcp_writev_full(tcp->fd, vec, nvec)) {
+            for (int i = first; i < n; i++)
+                iov[i].status = EIO;
+            err = EIO;
+            break;
+        }
+
+        // replies come back in order, straight into the caller's buffers
+        for (int i = first; i < last; i++) {
+            if (recv_reply(tcp, iov[i].addr, iov[i].size))
+                iov[i].status = EIO;
+            else
+                iov[i].status = tcp->resp.data.memresp.error ? EINVAL : 0;
+            if (iov[i].status != 0 && err == 0)
+                err = iov[i].status;
+        }
+    }
+    free(msgs);
+
+    return err;
+}
+
+static int tcp_atomic_commit(rmem_layer_t *layer, uint32_t *tags_src,
+        uint32_t *tags_dst, uint32_t *tags_size, uint32_t num_tags)
+{
+    struct tcp_rmem *tcp = layer->layer_data;
+
+    for (uint32_t i = 0; i < num_tags; i++)
+        tcp_desc_add(tcp, DESC_CP, tcp_lookup_tag(tcp, tags_dst[i]),
+                tcp_lookup_tag(tcp, tags_src[i]), tags_size[i]);
+
+    return desc_send(tcp, MSG_TXN_GO);
+}
+
+uint32_t tcp_layer_tags(rmem_layer_t *layer, uint32_t **tags)
+{
+    struct tcp_rmem *tcp = layer->layer_data;
+    hash_iterator_t it;
+    uint32_t n = 0;
+
+    TEST_Z(*tags = malloc((hash_num_elements(tcp->tag_to_addr) + 1) *
+                sizeof(**tags)));
+    for (it = hash_begin(tcp->tag_to_addr); !hash_is_iterator_null(it);
+            hash_next_iterator(it))
+        (*tags)[n++] = hash_iterator_key(it);
+    hash_delete_iterator(it);
+
+    return n;
+}
+
+/* Nothing to register, data goes through the socket */
+static void *tcp_register_data(rmem_layer_t *layer, void *data, size_t size)
+{
+    return data;
+}
+
+static void tcp_deregister_data(rmem_layer_t *layer, void *data)
+{
+}
+
+void tcp_layer_init(rmem_layer_t *layer, struct tcp_rmem *tcp)
+{
+    layer->connect = tcp_connect;
+    layer->disconnect = tcp_disconnect;
+    layer->malloc = tcp_malloc;
+    layer->free = tcp_free;
+    layer->put = tcp_put;
+    layer->get = tcp_get;
+    layer->put_v = tcp_put_v;
+    layer->get_v = tcp_get_v;
+    layer->atomic_commit = tcp_atomic_commit;
+    layer->register_data = tcp_register_data;
+    layer->deregister_data = tcp_deregister_data;
+    layer->multi_malloc = tcp_multi_malloc;
+    layer->multi_free = tcp_multi_free;
+    layer->flags = 0;
+    layer->layer_data = tcp;
+}
+
+rmem_layer_t* create_tcp_layer()
+{
+    rmem_layer_t *layer = malloc(sizeof(rmem_layer_t));
+    struct tcp_rmem *tcp = calloc(1, sizeof(struct tcp_rmem));
+
+    CHECK_ERROR(layer == NULL || tcp == NULL,
+            ("Failure: Error allocating layer struct\n"));
+    tcp_layer_init(layer, tcp);
+
+    return layer;
+}
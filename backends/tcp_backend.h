@@ -0,0 +1,22 @@
+#ifndef TCP_BACKEND_H_
+#define TCP_BACKEND_H_
+
+#include "rmem_generic_interface.h"
+
+/* The rmem protocol over a plain TCP connection, for hosts without RDMA.
+ * Talks to rmem-server -T. Every request is a length-prefixed struct
+ * message (see struct tcp_frame) followed by its bulk payload, and blocks
+ * are written from and read into the caller's buffers without a staging
+ * copy.
+ *
+ * Puts are not acknowledged: they are streamed to the server, which
+ * applies requests in order, and a put the server refuses fails the next
+ * commit. Vectored gets and multi_malloc pipeline their requests. Commits
+ * copy the shadow blocks, like RMEM_COMMIT_COPY. */
+rmem_layer_t* create_tcp_layer();
+
+/* The tags the server held when layer connected and those allocated since,
+ * in *tags (malloc'ed, for the caller to free). Returns how many. */
+uint32_t tcp_layer_tags(rmem_layer_t *layer, uint32_t **tags);
+
+#endif
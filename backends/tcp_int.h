@@ -0,0 +1,39 @@
+#ifndef TCP_INT_H_
+#define TCP_INT_H_
+
+/* Internals of the TCP backend, shared with the shared-memory backend which
+ * speaks the same protocol over a Unix socket. */
+
+#include "rmem_generic_interface.h"
+#include "../data/hash.h"
+#include "../messages.h"
+
+struct tcp_rmem {
+    int fd;
+    hash_t tag_to_addr;
+
+    struct message msg;
+    struct message resp;
+
+    /* commit descriptor staged for the next MSG_TXN_GO */
+    struct txn_desc_entry *desc;
+    uint64_t desc_n;
+};
+
+/* Point layer at the TCP functions, with tcp as its layer_data */
+void tcp_layer_init(rmem_layer_t *layer, struct tcp_rmem *tcp);
+
+/* Read the tag map the server opens a connection on tcp->fd with. The map
+ * message is left in tcp->resp. A desc set beforehand is kept. */
+void tcp_handshake(struct tcp_rmem *tcp);
+
+uint64_t tcp_lookup_tag(struct tcp_rmem *tcp, uint32_t tag);
+
+/* Stage an entry of the next commit, flushing a full descriptor first */
+void tcp_desc_add(struct tcp_rmem *tcp, enum txn_desc_op op,
+        uint64_t dst, uint64_t src, uint64_t size);
+
+int tcp_free(rmem_layer_t *layer, uint32_t tag);
+int tcp_multi_free(rmem_layer_t *layer, uint32_t *tags, uint32_t size);
+
+#endif
@@ -0,0 +1,776 @@
+/*
+ * tiered_backend.c
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <tiered_backend.h>
+#include "common.h"
+#include "hash.h"
+#include "log.h"
+#include "error.h"
+#include "file_backend.h"
+#include "log_backend.h"
+#include "pmem_backend.h"
+#include "rmem_backend.h"
+#include "tcp_backend.h"
+#include "loop_backend.h"
+
+#define TIER_SHADOW_BIT 0x80000000U
+#define TIER_META_TAG 0x7fffffffU
+#define TIER_MAP_SIZE 4096
+/* Commits wait for the replicator beyond this much unshipped data */
+#define TIER_MAX_PENDING (256ULL << 20)
+#define TIER_MAGIC 0x52564d5449455231ULL
+/* Backoff between attempts at a refused batch, in microseconds */
+#define TIER_RETRY_MIN 1000
+#define TIER_RETRY_MAX 1000000
+
+/* Epoch of the commit a tier holds, kept in TIER_META_TAG */
+struct tier_meta {
+    uint64_t magic;
+    uint64_t epoch;
+};
+
+/* What happened to a tag since it was last shipped: allocated, written,
+ * freed, or a mix that nets out to one of {alloc, data}, {data}, {free} */
+struct tier_block {
+    int alloc;
+    int free;
+    uint64_t size;
+    char *data;                 /* latest contents, NULL if not written */
+};
+
+struct tiered {
+    rmem_layer_t *local;
+    rmem_layer_t *remote;
+    int remote_shadow;          /* the remote needs shadow blocks */
+
+    int meta_ready;             /* meta tags exist in both tiers */
+    int from_remote;            /* recovering from the remote tier */
+    int resync;                 /* recovering ahead of the remote tier */
+
+    hash_t txn;                 /* tag -> struct tier_block *, this txn */
+
+    /* shared with the replicator, under lock */
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    hash_t pending;             /* committed, not shipped yet */
+    uint64_t npending;
+    uint64_t pending_bytes;     /* including the batch being shipped */
+    uint64_t local_epoch;
+    uint64_t remote_epoch;
+    uint64_t batches;
+    double last_batch_secs;
+    uint64_t failures;
+    int stop;
+    pthread_t replicator;
+
+    /* the remote tier is used from both threads */
+    pthread_mutex_t remote_lock;
+    char *bounce;               /* registered with the remote */
+    void *bounce_reg;
+    uint64_t bounce_cap;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Caller holds remote_lock */
+static char *bounce(struct tiered *ts, uint64_t len)
+{
+    if (len > ts->bounce_cap) {
+        if (ts->bounce != NULL) {
+            ts->remote->deregister_data(ts->remote, ts->bounce_reg);
+            free(ts->bounce);
+        }
+        ts->bounce_cap = len > 2 * ts->bounce_cap ? len : 2 * ts->bounce_cap;
+        TEST_Z(ts->bounce = malloc(ts->bounce_cap));
+        TEST_Z(ts->bounce_reg = ts->remote->register_data(ts->remote,
+                    ts->bounce, ts->bounce_cap));
+    }
+    return ts->bounce;
+}
+
+/*
+ * CHANGE SETS
+ */
+
+static struct tier_block *block_of(hash_t map, uint32_t tag)
+{
+    struct tier_block *b = hash_get_item(map, tag);
+
+    if (b == NULL) {
+        TEST_Z(b = calloc(1, sizeof(*b)));
+        hash_insert_item(map, tag, b);
+    }
+    return b;
+}
+
+static void block_drop(hash_t map, uint32_t tag)
+{
+    struct tier_block *b = hash_get_item(map, tag);
+
+    if (b == NULL)
+        return;
+    hash_delete_item(map, tag);
+    free(b->data);
+    free(b);
+}
+
+static void note_alloc(hash_t map, uint32_t tag, uint64_t size)
+{
+    struct tier_block *b = block_of(map, tag);
+
+    // freed and allocated again, the other tier still has it
+    if (b->free)
+        b->free = 0;
+    else
+        b->alloc = 1;
+    b->size = size;
+}
+
+/* Returns the bytes of data dropped */
+static uint64_t note_free(hash_t map, uint32_t tag)
+{
+    struct tier_block *b = block_of(map, tag);
+    uint64_t dropped = b->data != NULL ? b->size : 0;
+
+    if (b->alloc) {
+        // never got to the other tier
+        block_drop(map, tag);
+        return dropped;
+    }
+    free(b->data);
+    b->data = NULL;
+    b->free = 1;
+    return dropped;
+}
+
+/* Hand data to the entry of tag, returns the bytes of data replaced */
+static uint64_t note_data(hash_t map, uint32_t tag, uint64_t size,
+        char *data)
+{
+    struct tier_block *b = block_of(map, tag);
+    uint64_t replaced = b->data != NULL ? b->size : 0;
+
+    free(b->data);
+    b->data = data;
+    b->size = size;
+    return replaced;
+}
+
+static void map_destroy(hash_t map)
+{
+    hash_iterator_t it;
+
+    for (it = hash_begin(map); !hash_is_iterator_null(it);
+            hash_next_iterator(it)) {
+        struct tier_block *b = hash_iterator_value(it);
+
+        free(b->data);
+        free(b);
+    }
+    hash_delete_iterator(it);
+    hash_destroy(map);
+}
+
+/*
+ * REPLICATION
+ */
+
+/* Write the change set to the remote and commit it as epoch */
+static int ship(struct tiered *ts, hash_t batch, uint64_t epoch)
+{
+    rmem_layer_t *remote = ts->remote;
+    hash_iterator_t it;
+    rmem_iov_t *iov;
+    uint32_t *src, *dst, *sizes;
+    uint64_t n = 0, nfree = 0, len = sizeof(struct tier_meta), off = 0;
+    uint32_t *frees;
+    struct tier_meta *meta;
+    char *buf;
+    int err = 0;
+
+    for (it = hash_begin(batch); !hash_is_iterator_null(it);
+            hash_next_iterator(it)) {
+        struct tier_block *b = hash_iterator_value(it);
+
+        len += b->data != NULL ? b->size : 0;
+        n++;
+    }
+    hash_delete_iterator(it);
+
+    TEST_Z(iov = calloc(n + 1, sizeof(*iov)));
+    TEST_Z(src = calloc(n + 1, sizeof(*src)));
+    TEST_Z(dst = calloc(n + 1, sizeof(*dst)));
+    TEST_Z(sizes = calloc(n + 1, sizeof(*sizes)));
+    TEST_Z(frees = calloc(n + 1, sizeof(*frees)));
+
+    TEST_NZ(pthread_mutex_lock(&ts->remote_lock));
+    buf = bounce(ts, len);
+    n = 0;
+    for (it = hash_begin(batch); !hash_is_iterator_null(it);
+            hash_next_iterator(it)) {
+        uint32_t tag = hash_iterator_key(it);
+        struct tier_block *b = hash_iterator_value(it);
+
+        if (b->free) {
+            frees[nfree++] = tag;
+            continue;
+        }
+        if (b->alloc && (remote->malloc(remote, b->size, tag) == 0 ||
+                    (ts->remote_shadow && remote->malloc(remote, b->size,
+                        tag | TIER_SHADOW_BIT) == 0))) {
+            err = -1;
+            break;
+        }
+        if (b->data == NULL)
+            continue;
+
+        memcpy(buf + off, b->data, b->size);
+        dst[n] = tag;
+        src[n] = ts->remote_shadow ? tag | TIER_SHADOW_BIT : tag;
+        sizes[n] = b->size;
+        iov[n].tag = src[n];
+        iov[n].addr = buf + off;
+        iov[n].reg = ts->bounce_reg;
+        iov[n++].size = b->size;
+        off += b->size;
+    }
+    hash_delete_iterator(it);
+
+    meta = (struct tier_meta *)(buf + off);
+    meta->magic = TIER_MAGIC;
+    meta->epoch = epoch;
+    dst[n] = TIER_META_TAG;
+    src[n] = ts->remote_shadow ? TIER_META_TAG | TIER_SHADOW_BIT :
+        TIER_META_TAG;
+    sizes[n] = sizeof(*meta);
+    iov[n].tag = src[n];
+    iov[n].addr = meta;
+    iov[n].reg = ts->bounce_reg;
+    iov[n++].size = sizeof(*meta);
+
+    if (err == 0)
+        err = remote->put_v(remote, iov, n);
+    if (err == 0)
+        err = remote->atomic_commit(remote, src, dst, sizes, n);
+
+    // frees land with the next remote commit
+    for (uint64_t i = 0; i < nfree && err == 0; i++) {
+        remote->free(remote, frees[i]);
+        if (ts->remote_shadow)
+            remote->free(remote, frees[i] | TIER_SHADOW_BIT);
+    }
+    TEST_NZ(pthread_mutex_unlock(&ts->remote_lock));
+
+    free(iov);
+    free(src);
+    free(dst);
+    free(sizes);
+    free(frees);
+
+    return err;
+}
+
+static uint64_t map_bytes(hash_t map)
+{
+    hash_iterator_t it;
+    uint64_t bytes = 0;
+
+    for (it = hash_begin(map); !hash_is_iterator_null(it);
+            hash_next_iterator(it)) {
+        struct tier_block *b = hash_iterator_value(it);
+
+        bytes += b->data != NULL ? b->size : 0;
+    }
+    hash_delete_iterator(it);
+    return bytes;
+}
+
+/* Ship whatever was committed since the last batch, as one batch. A refused
+ * batch is shipped again before anything committed after it, so the remote
+ * never skips an epoch's changes. */
+static void *replicator(void *arg)
+{
+    struct tiered *ts = arg;
+    hash_t batch = NULL;
+    uint64_t epoch = 0, bytes = 0, backoff = TIER_RETRY_MIN;
+
+    TEST_NZ(pthread_mutex_lock(&ts->lock));
+    while (batch != NULL || !ts->stop || ts->npending > 0) {
+        double start;
+        int err;
+
+        if (batch == NULL) {
+            if (ts->npending == 0) {
+                TEST_NZ(pthread_cond_wait(&ts->work, &ts->lock));
+                continue;
+            }
+            batch = ts->pending;
+            epoch = ts->local_epoch;
+            ts->pending = hash_create(TIER_MAP_SIZE);
+            ts->npending = 0;
+            bytes = map_bytes(batch);
+        } else if (ts->stop && backoff == TIER_RETRY_MAX) {
+            LOG(1, ("remote tier still refuses epoch %ld, left at %ld\n",
+                        epoch, ts->remote_epoch));
+            break;
+        } else {
+            TEST_NZ(pthread_mutex_unlock(&ts->lock));
+            usleep(backoff);
+            backoff = 2 * backoff < TIER_RETRY_MAX ? 2 * backoff :
+                TIER_RETRY_MAX;
+            TEST_NZ(pthread_mutex_lock(&ts->lock));
+        }
+        TEST_NZ(pthread_mutex_unlock(&ts->lock));
+
+        start = now();
+        err = ship(ts, batch, epoch);
+
+        TEST_NZ(pthread_mutex_lock(&ts->lock));
+        if (err != 0) {
+            if (ts->failures++ == 0)
+                LOG(1, ("remote tier refused epoch %ld, retrying\n", epoch));
+            TEST_NZ(pthread_cond_broadcast(&ts->done));
+            continue;
+        }
+        map_destroy(batch);
+        batch = NULL;
+        backoff = TIER_RETRY_MIN;
+        ts->pending_bytes -= bytes;
+        ts->failures = 0;
+        ts->remote_epoch = epoch;
+        ts->batches++;
+        ts->last_batch_secs = now() - start;
+        TEST_NZ(pthread_cond_broadcast(&ts->done));
+    }
+    TEST_NZ(pthread_mutex_unlock(&ts->lock));
+
+    if (batch != NULL)
+        map_destroy(batch);
+
+    return NULL;
+}
+
+/*
+ * RECOVERY
+ */
+
+/* Both tiers keep their epoch under TIER_META_TAG, allocating it again
+ * hands out the existing block */
+static void alloc_meta(struct tiered *ts)
+{
+    uint32_t size = sizeof(struct tier_meta);
+
+    CHECK_ERROR(ts->local->malloc(ts->local, size, TIER_META_TAG) == 0,
+            ("Failure: local tier has no room for its epoch\n"));
+    CHECK_ERROR(ts->remote->malloc(ts->remote, size, TIER_META_TAG) == 0 ||
+            (ts->remote_shadow && ts->remote->malloc(ts->remote, size,
+                TIER_META_TAG | TIER_SHADOW_BIT) == 0),
+            ("Failure: remote tier has no room for its epoch\n"));
+    ts->meta_ready = 1;
+}
+
+static uint64_t read_epoch(rmem_layer_t *layer, void *buf, void *reg)
+{
+    struct tier_meta *meta = buf;
+
+    memset(meta, 0, sizeof(*meta));
+    if (layer->get(layer, meta, reg, TIER_META_TAG, sizeof(*meta)) != 0)
+        return 0;
+    return meta->magic == TIER_MAGIC ? meta->epoch : 0;
+}
+
+/* The first get of a run decides which tier it recovers from */
+static void choose_tier(struct tiered *ts)
+{
+    struct tier_meta meta;
+    uint64_t local, remote;
+
+    TEST_NZ(pthread_mutex_lock(&ts->remote_lock));
+    alloc_meta(ts);
+    local = read_epoch(ts->local, &meta, &meta);
+    remote = read_epoch(ts->remote, bounce(ts, sizeof(meta)),
+            ts->bounce_reg);
+    TEST_NZ(pthread_mutex_unlock(&ts->remote_lock));
+
+    ts->from_remote = remote > local;
+    ts->resync = local > remote;
+    ts->local_epoch = local > remote ? local : remote;
+    ts->remote_epoch = remote;
+
+    LOG(5, ("local tier at epoch %ld, remote at %ld, recovering from %s\n",
+                local, remote, ts->from_remote ? "remote" : "local"));
+}
+
+/* A fresh run starts the remote tier over at epoch 0 */
+static void init_meta(struct tiered *ts)
+{
+    rmem_layer_t *remote = ts->remote;
+    struct tier_meta *meta;
+    uint32_t tag = TIER_META_TAG, shadow = TIER_META_TAG | TIER_SHADOW_BIT;
+    uint32_t size = sizeof(*meta);
+
+    TEST_NZ(pthread_mutex_lock(&ts->remote_lock));
+    alloc_meta(ts);
+    meta = (struct tier_meta *)bounce(ts, size);
+    meta->magic = TIER_MAGIC;
+    meta->epoch = 0;
+    CHECK_ERROR(remote->put(remote, ts->remote_shadow ? shadow : tag, meta,
+                ts->bounce_reg, size) != 0 ||
+            remote->atomic_commit(remote,
+                ts->remote_shadow ? &shadow : &tag, &tag, &size, 1) != 0,
+            ("Failure: could not reset the remote tier\n"));
+    TEST_NZ(pthread_mutex_unlock(&ts->remote_lock));
+}
+
+/*
+ * LAYER
+ */
+
+static void tiered_connect(rmem_layer_t* rcfg, char* host, char* port)
+{
+    struct tiered *ts = rcfg->layer_data;
+    char *path = strdup(host), *remote_host;
+
+    TEST_Z(path);
+    remote_host = strchr(path, '@');
+    CHECK_ERROR(remote_host == NULL,
+            ("Failure: host should be local_path@remote_host, not %s\n",
+             host));
+    *remote_host++ = '\0';
+
+    ts->local->connect(ts->local, path, "0");
+    ts->remote->connect(ts->remote, remote_host, port);
+    free(path);
+
+    TEST_NZ(pthread_create(&ts->replicator, NULL, replicator, ts));
+}
+
+static void tiered_disconnect(rmem_layer_t* rcfg)
+{
+    struct tiered *ts = rcfg->layer_data;
+
+    /* the replicator drains what is pending before it stops */
+    TEST_NZ(pthread_mutex_lock(&ts->lock));
+    ts->stop = 1;
+    TEST_NZ(pthread_cond_signal(&ts->work));
+    TEST_NZ(pthread_mutex_unlock(&ts->lock));
+    TEST_NZ(pthread_join(ts->replicator, NULL));
+
+    map_destroy(ts->txn);
+    map_destroy(ts->pending);
+    ts->txn = hash_create(TIER_MAP_SIZE);
+    ts->pending = hash_create(TIER_MAP_SIZE);
+    ts->npending = 0;
+    ts->pending_bytes = 0;
+    ts->failures = 0;
+    if (ts->bounce != NULL) {
+        ts->remote->deregister_data(ts->remote, ts->bounce_reg);
+        free(ts->bounce);
+        ts->bounce = NULL;
+        ts->bounce_cap = 0;
+    }
+    ts->local->disconnect(ts->local);
+    ts->remote->disconnect(ts->remote);
+}
+
+static uint64_t tiered_malloc(rmem_layer_t* rcfg, size_t size, uint32_t tag)
+{
+    struct tiered *ts = rcfg->layer_data;
+    uint64_t addr;
+
+    RETURN_ERROR(tag >= TIER_RESERVED_TAG, 0,
+            ("Failure: tag %x is reserved\n", tag));
+    if (!ts->meta_ready)
+        init_meta(ts);
+
+    addr = ts->local->malloc(ts->local, size, tag);
+    if (addr != 0)
+        note_alloc(ts->txn, tag, size);
+    return addr;
+}
+
+static int tiered_free(rmem_layer_t* rcfg, uint32_t tag)
+{
+    struct tiered *ts = rcfg->layer_data;
+
+    RETURN_ERROR(tag >= TIER_RESERVED_TAG, EINVAL,
+            ("Failure: tag %x is reserved\n", tag));
+    note_free(ts->txn, tag);
+    return ts->local->free(ts->local, tag);
+}
+
+static int tiered_multi_malloc(rmem_layer_t *rcfg,
+    uint64_t *addrs, uint64_t size, uint32_t *tags, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        addrs[i] = tiered_malloc(rcfg, size, tags[i]);
+        if (addrs[i] == 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int tiered_multi_free(rmem_layer_t *rcfg,
+    uint32_t *tags, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+        if (tiered_free(rcfg, tags[i]) != 0)
+            return -1;
+
+    return 0;
+}
+
+static int tiered_put(rmem_layer_t* rcfg, uint32_t tag,
+        void *src, void *src_reg, size_t size)
+{
+    struct tiered *ts = rcfg->layer_data;
+    struct tier_block *b;
+    int err = ts->local->put(ts->local, tag, src, src_reg, size);
+
+    if (err != 0)
+        return err;
+
+    // a copy for the replicator, reused by later puts of the txn
+    b = block_of(ts->txn, tag);
+    if (b->data == NULL || b->size != size) {
+        free(b->data);
+        TEST_Z(b->data = malloc(size));
+        b->size = size;
+    }
+    memcpy(b->data, src, size);
+
+    return 0;
+}
+
+static int tiered_get(rmem_layer_t* rcfg, void *dst,
+        void *dst_reg, uint32_t tag, size_t size)
+{
+    struct tiered *ts = rcfg->layer_data;
+    char *data;
+    int err;
+
+    if (!ts->meta_ready)
+        choose_tier(ts);
+    if (!ts->from_remote) {
+        err = ts->local->get(ts->local, dst, dst_reg, tag, size);
+        if (err != 0 || !ts->resync)
+            return err;
+
+        // the remote may not have it, the next commit ships it again
+        note_alloc(ts->txn, tag, size);
+        TEST_Z(data = malloc(size));
+        memcpy(data, dst, size);
+        note_data(ts->txn, tag, size, data);
+        return 0;
+    }
+
+    TEST_NZ(pthread_mutex_lock(&ts->remote_lock));
+    err = ts->remote->get(ts->remote, bounce(ts, size), ts->bounce_reg,
+            tag, size);
+    if (err == 0)
+        memcpy(dst, ts->bounce, size);
+    TEST_NZ(pthread_mutex_unlock(&ts->remote_lock));
+    if (err != 0)
+        return err;
+
+    // the local tier gets it back with the next commit
+    if (ts->local->malloc(ts->local, size, tag) == 0 ||
+            ts->local->put(ts->local, tag, dst, dst_reg, size) != 0)
+        return EIO;
+    return 0;
+}
+
+static int tiered_put_v(rmem_layer_t* rcfg, rmem_iov_t *iov, int n)
+{
+    int err = 0;
+
+    for (int i = 0; i < n; i++) {
+        iov[i].status = tiered_put(rcfg, iov[i].tag, iov[i].addr,
+                iov[i].reg, iov[i].size);
+        if (iov[i].status != 0 && err == 0)
+            err = iov[i].status;
+    }
+
+    return err;
+}
+
+static int tiered_get_v(rmem_layer_t* rcfg, rmem_iov_t *iov, int n)
+{
+    int err = 0;
+
+    for (int i = 0; i < n; i++) {
+        iov[i].status = tiered_get(rcfg, iov[i].addr, iov[i].reg,
+                iov[i].tag, iov[i].size);
+        if (iov[i].status != 0 && err == 0)
+            err = iov[i].status;
+    }
+
+    return err;
+}
+
+static int tiered_atomic_commit(rmem_layer_t* rcfg,
+        uint32_t* tags_src, uint32_t* tags_dst, uint32_t* sizes, uint32_t ntag)
+{
+    struct tiered *ts = rcfg->layer_data;
+    struct tier_meta meta = { TIER_MAGIC, ts->local_epoch + 1 };
+    hash_iterator_t it;
+    int err;
+
+    if (ts->meta_ready) {
+        err = ts->local->put(ts->local, TIER_META_TAG, &meta, &meta,
+                sizeof(meta));
+        if (err != 0)
+            return err;
+    }
+    err = ts->local->atomic_commit(ts->local, tags_src, tags_dst, sizes,
+            ntag);
+    if (err != 0 || !ts->meta_ready)
+        return err;
+    ts->from_remote = 0;
+    ts->resync = 0;
+
+    /* the txn joins what the replicator has yet to ship; while the remote
+     * refuses batches commits only go to the local tier */
+    TEST_NZ(pthread_mutex_lock(&ts->lock));
+    while (ts->pending_bytes > TIER_MAX_PENDING && ts->failures == 0)
+        TEST_NZ(pthread_cond_wait(&ts->done, &ts->lock));
+
+    for (it = hash_begin(ts->txn); !hash_is_iterator_null(it);
+            hash_next_iterator(it)) {
+        uint32_t tag = hash_iterator_key(it);
+        struct tier_block *b = hash_iterator_value(it);
+
+        if (b->alloc)
+            note_alloc(ts->pending, tag, b->size);
+        if (b->data != NULL) {
+            ts->pending_bytes += b->size;
+            ts->pending_bytes -= note_data(ts->pending, tag, b->size,
+                    b->data);
+            b->data = NULL;
+        }
+        if (b->free)
+            ts->pending_bytes -= note_free(ts->pending, tag);
+    }
+    hash_delete_iterator(it);
+    map_destroy(ts->txn);
+    ts->txn = hash_create(TIER_MAP_SIZE);
+
+    ts->npending = hash_num_elements(ts->pending);
+    ts->local_epoch = meta.epoch;
+    TEST_NZ(pthread_cond_signal(&ts->work));
+    TEST_NZ(pthread_mutex_unlock(&ts->lock));
+
+    return 0;
+}
+
+static void* tiered_register_data(rmem_layer_t* rcfg,
+        void* buf, size_t size)
+{
+    struct tiered *ts = rcfg->layer_data;
+
+    return ts->local->register_data(ts->local, buf, size);
+}
+
+static void tiered_deregister_data(rmem_layer_t* rcfg, void*buf)
+{
+    struct tiered *ts = rcfg->layer_data;
+
+    ts->local->deregister_data(ts->local, buf);
+}
+
+void tiered_get_lag(rmem_layer_t *layer, struct tiered_lag *lag)
+{
+    struct tiered *ts = layer->layer_data;
+
+    TEST_NZ(pthread_mutex_lock(&ts->lock));
+    lag->local_epoch = ts->local_epoch;
+    lag->remote_epoch = ts->remote_epoch;
+    lag->pending_bytes = ts->pending_bytes;
+    lag->batches = ts->batches;
+    lag->last_batch_secs = ts->last_batch_secs;
+    lag->failures = ts->failures;
+    TEST_NZ(pthread_mutex_unlock(&ts->lock));
+}
+
+rmem_layer_t* tiered_layer_create(rmem_layer_t *local, rmem_layer_t *remote)
+{
+    rmem_layer_t *layer = malloc(sizeof(rmem_layer_t));
+    struct tiered *ts = calloc(1, sizeof(struct tiered));
+
+    CHECK_ERROR(layer == NULL || ts == NULL,
+            ("Failure: Error allocating layer struct\n"));
+    CHECK_ERROR(!(local->flags & RMEM_LAYER_NO_SHADOW),
+            ("Failure: the local tier must stage its own puts\n"));
+
+    ts->local = local;
+    ts->remote = remote;
+    ts->remote_shadow = !(remote->flags & RMEM_LAYER_NO_SHADOW);
+    ts->txn = hash_create(TIER_MAP_SIZE);
+    ts->pending = hash_create(TIER_MAP_SIZE);
+    TEST_NZ(pthread_mutex_init(&ts->lock, NULL));
+    TEST_NZ(pthread_mutex_init(&ts->remote_lock, NULL));
+    TEST_NZ(pthread_cond_init(&ts->work, NULL));
+    TEST_NZ(pthread_cond_init(&ts->done, NULL));
+
+    layer->connect = tiered_connect;
+    layer->disconnect = tiered_disconnect;
+    layer->malloc = tiered_malloc;
+    layer->free = tiered_free;
+    layer->put = tiered_put;
+    layer->get = tiered_get;
+    layer->put_v = tiered_put_v;
+    layer->get_v = tiered_get_v;
+    layer->atomic_commit = tiered_atomic_commit;
+    layer->register_data = tiered_register_data;
+    layer->deregister_data = tiered_deregister_data;
+    layer->multi_malloc = tiered_multi_malloc;
+    layer->multi_free = tiered_multi_free;
+    layer->flags = RMEM_LAYER_NO_SHADOW;
+    layer->layer_data = ts;
+
+    return layer;
+}
+
+rmem_layer_t* create_tiered_layer()
+{
+    char *local = getenv("RMEM_TIER_LOCAL");
+    char *remote = getenv("RMEM_TIER_REMOTE");
+    rmem_layer_t *l, *r;
+
+    if (local == NULL || strcmp(local, "file") == 0)
+        l = create_file_layer();
+    else if (strcmp(local, "pmem") == 0)
+        l = create_pmem_layer();
+    else if (strcmp(local, "log") == 0)
+        l = create_log_layer();
+    else
+        CHECK_ERROR(1, ("Failure: unknown RMEM_TIER_LOCAL %s\n", local));
+
+    if (remote == NULL || strcmp(remote, "rdma") == 0)
+        r = create_rmem_layer();
+    else if (strcmp(remote, "tcp") == 0)
+        r = create_tcp_layer();
+    else if (strcmp(remote, "loop") == 0)
+        r = create_loop_layer();
+    else
+        CHECK_ERROR(1, ("Failure: unknown RMEM_TIER_REMOTE %s\n", remote));
+
+    return tiered_layer_create(l, r);
+}
@@ -0,0 +1,54 @@
+/*
+ * tiered_backend.h
+ *
+ *  A local durable tier in front of a remote one. Commits return once the
+ *  local tier has them; a replicator thread ships committed blocks to the
+ *  remote tier in the background, coalescing the commits made while it was
+ *  busy into one remote commit. The remote thus always holds some earlier
+ *  committed state, never a partial one.
+ *
+ *  connect takes "local_path@remote_host" as its host and the remote port.
+ *  Both tiers record the epoch of the commit they hold. Recovery (the gets
+ *  rvm makes before its first commit) reads from the tier with the newer
+ *  epoch; blocks read from the remote are written back to the local tier,
+ *  so the next commit makes it whole again.
+ *
+ *  The local tier is picked with RMEM_TIER_LOCAL ("file", the default,
+ *  "pmem" or "log") and the remote with RMEM_TIER_REMOTE ("rdma", the
+ *  default, "tcp" or "loop"). Tags from TIER_RESERVED_TAG up are reserved: the
+ *  remote's shadow of a tag is the tag with the top bit set, and the top
+ *  tags of the server are its own.
+ *
+ *  A batch the remote refuses is shipped again, with backoff, before any
+ *  commit made after it; tiered_get_lag() counts the refusals. Disconnect
+ *  gives up on a remote that still refuses at the longest backoff, leaving
+ *  it at its last epoch.
+ */
+
+#ifndef TIERED_BACKEND_H_
+#define TIERED_BACKEND_H_
+
+#include "rmem_generic_interface.h"
+
+#define TIER_RESERVED_TAG 0x7ffffff0U
+
+/* How far the remote tier trails */
+struct tiered_lag {
+    uint64_t local_epoch;       /* last commit durable locally */
+    uint64_t remote_epoch;      /* last commit the remote tier holds */
+    uint64_t pending_bytes;     /* block data waiting to be shipped */
+    uint64_t batches;           /* remote commits so far */
+    double last_batch_secs;     /* time the last one took */
+    uint64_t failures;          /* times in a row the remote refused the
+                                   batch being shipped */
+};
+
+/* Of type create_rmem_layer_f */
+rmem_layer_t* create_tiered_layer();
+
+/* Compose two layers. local must be RMEM_LAYER_NO_SHADOW. */
+rmem_layer_t* tiered_layer_create(rmem_layer_t *local, rmem_layer_t *remote);
+
+void tiered_get_lag(rmem_layer_t *layer, struct tiered_lag *lag);
+
+#endif /* TIERED_BACKEND_H_ */
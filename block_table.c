@@ -6,6 +6,7 @@
  */
 
 #include <limits.h>
+#include <stddef.h>
 #include "block_table.h"
 
 bool rbtbl_init(raw_blk_tbl_t *rbtbl)
@@ -32,6 +33,32 @@ bool rbtbl_init(raw_blk_tbl_t *rbtbl)
     return true;
 }
 
+bool rbtbl_relocate(raw_blk_tbl_t *rbtbl)
+{
+    size_t npg = BLOCK_TBL_NPG(rbtbl->nentries);
+    /* The first descriptor is the first page of the table itself */
+    ptrdiff_t delta = (uint8_t *)rbtbl -
+        (uint8_t *)rbtbl->tbl[BLOCK_TBL_ID].local_addr;
+
+    if(delta == 0)
+        return true;
+
+    for(size_t i = 0; i < npg; i++)
+        rbtbl->tbl[BLOCK_TBL_ID + i].local_addr = (uint8_t *)rbtbl + i*4096;
+
+    /* Free descriptors link to each other through local_addr */
+    for(size_t bx = npg; bx < rbtbl->nentries; bx++)
+    {
+        blk_desc_t *blk = &(rbtbl->tbl[bx]);
+        if(blk->bid < 0 && blk->local_addr != NULL)
+            blk->local_addr = (uint8_t *)blk->local_addr + delta;
+    }
+    if(rbtbl->free != NULL)
+        rbtbl->free = (blk_desc_t *)((uint8_t *)rbtbl->free + delta);
+
+    return true;
+}
+
 bool btbl_init(blk_tbl_t *btbl, raw_blk_tbl_t *rbtbl)
 {
     /* Allocate and initialize the block change list */
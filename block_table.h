@@ -93,6 +93,11 @@ typedef struct
 /* Initialize a freshly allocated raw block table */
 bool rbtbl_init(raw_blk_tbl_t *rbtbl);
 
+/* Point the free list and the descriptors of the table's own pages at where
+ * a recovered raw block table is mapped now. The run that wrote it may have
+ * had it at another address. */
+bool rbtbl_relocate(raw_blk_tbl_t *rbtbl);
+
 /* Initialize a block table index from a raw block table */
 bool btbl_init(blk_tbl_t *btbl, raw_blk_tbl_t *rbtbl);
 
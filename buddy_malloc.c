@@ -22,8 +22,7 @@
 
 /** Size of the pool of recoverable pages used for buddy allocation. Must be
  * a multiple of the page size and a power of 2 */
-//#define POOL_SZ (1 << 18)
-#define POOL_SZ (0)
+#define POOL_SZ (1 << 18)
 
 /** Minimum allocation returned by the buddy allocator in bytes. Must be a
  * power of 2 and < POOL_SZ. */
@@ -119,9 +118,17 @@ void *buddy_malloc(rvm_cfg_t *cfg, size_t n_bytes)
   int idx;
   int lvl;  //The originally requested level
 
+  if(n_bytes == 0) {
+      //As rvm_blk_alloc, nothing to hand out
+      return NULL;
+  }
+
   map_t *map = (map_t *)rvm_get_alloc_data(cfg);
   if(map == NULL) {
       map = (map_t*)buddy_meminit(cfg);
+      if(map == NULL) {
+          return NULL;
+      }
       rvm_set_alloc_data(cfg, map);
   }
 
@@ -183,7 +190,8 @@ bool buddy_free(rvm_cfg_t *cfg, void *buf)
 
   /* Check if buf is managed by the buddy allocator */
   map_t *map = (map_t *)rvm_get_alloc_data(cfg);
-  if(buf < (void*)map || buf >= (void*)map + POOL_SZ) {
+  if(map == NULL || buf < (void*)MEM_REG(map) ||
+     buf >= (void*)MEM_REG(map) + POOL_SZ) {
       //Assume memory was allocated by the block allocator
       return rvm_blk_free(cfg, buf);
   }
@@ -3,10 +3,19 @@
 #include <netdb.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <errno.h>
 #include "utils/log.h"
 
 const int TIMEOUT_IN_MS = 500;
-
+/* The CQ is shared by every connection, each of which may have a ring of
+ * receives and pipelined sends outstanding */
+static const int CQ_SIZE = 4096;
+static const int QP_MAX_WR = 32;
+/* Buffers sendmsg takes at once on Linux (IOV_MAX) */
+#define TCP_MAX_IOV 1024
+
+/* Everything tied to one RDMA device. Connections use the context of the
+ * device their route goes through. */
 struct context {
     struct ibv_context *ctx;
     struct ibv_pd *pd;
@@ -16,46 +25,87 @@ struct context {
     pthread_t cq_poller_thread;
 };
 
-static struct context *s_ctx = NULL;
+static struct context *s_ctxs[RC_MAX_DEVICES];
+static int s_nctxs = 0;
+static pthread_mutex_t s_ctx_lock = PTHREAD_MUTEX_INITIALIZER;
+static int s_busy_poll = 0;
+static size_t s_max_inline = RC_MAX_INLINE;
+/* private data of the connect request being handled */
+static char s_conn_private[RC_PRIVATE_DATA_MAX];
+static size_t s_conn_private_len = 0;
 static pre_conn_cb_fn s_on_pre_conn_cb = NULL;
 static connect_cb_fn s_on_connect_cb = NULL;
 static completion_cb_fn s_on_completion_cb = NULL;
 static disconnect_cb_fn s_on_disconnect_cb = NULL;
 
-static void build_context(struct ibv_context *verbs);
-static void build_qp_attr(struct ibv_qp_init_attr *qp_attr);
+static struct context *build_context(struct ibv_context *verbs);
+static void build_qp_attr(struct context *ctx,
+        struct ibv_qp_init_attr *qp_attr);
 static void event_loop(struct rdma_event_channel *ec, int exit_on_disconnect);
 static void * poll_cq(void *);
 
 void build_connection(struct rdma_cm_id *id)
 {
     struct ibv_qp_init_attr qp_attr;
+    struct context *ctx = build_context(id->verbs);
+
+    build_qp_attr(ctx, &qp_attr);
 
-    build_context(id->verbs);
-    build_qp_attr(&qp_attr);
+    // devices that can't inline as much as asked refuse the QP
+    if (rdma_create_qp(id, ctx->pd, &qp_attr) != 0) {
+        build_qp_attr(ctx, &qp_attr);
+        qp_attr.cap.max_inline_data = 0;
+        TEST_NZ(rdma_create_qp(id, ctx->pd, &qp_attr));
+    }
 
-    TEST_NZ(rdma_create_qp(id, s_ctx->pd, &qp_attr));
+    // the provider reports what it actually granted
+    TEST_NZ(pthread_mutex_lock(&s_ctx_lock));
+    s_max_inline = MIN(s_max_inline, qp_attr.cap.max_inline_data);
+    TEST_NZ(pthread_mutex_unlock(&s_ctx_lock));
 }
 
-void build_context(struct ibv_context *verbs)
+/* The context of a device, set up the first time the device is seen */
+struct context *build_context(struct ibv_context *verbs)
 {
-    if (s_ctx) {
-        if (s_ctx->ctx != verbs)
-            rc_die("cannot handle events in more than one context.");
+    struct context *ctx = NULL;
+
+    TEST_NZ(pthread_mutex_lock(&s_ctx_lock));
 
-        return;
+    for (int i = 0; i < s_nctxs; i++) {
+        if (s_ctxs[i]->ctx == verbs) {
+            ctx = s_ctxs[i];
+            goto out;
+        }
     }
 
-    s_ctx = (struct context *)malloc(sizeof(struct context));
+    if (s_nctxs == RC_MAX_DEVICES)
+        rc_die("too many RDMA devices");
+
+    TEST_Z(ctx = (struct context *)malloc(sizeof(struct context)));
+
+    ctx->ctx = verbs;
 
-    s_ctx->ctx = verbs;
+    TEST_Z(ctx->pd = ibv_alloc_pd(ctx->ctx));
 
-    TEST_Z(s_ctx->pd = ibv_alloc_pd(s_ctx->ctx));
-    TEST_Z(s_ctx->comp_channel = ibv_create_comp_channel(s_ctx->ctx));
-    TEST_Z(s_ctx->cq = ibv_create_cq(s_ctx->ctx, 10, NULL, s_ctx->comp_channel, 0)); /* cqe=10 is arbitrary */
-    TEST_NZ(ibv_req_notify_cq(s_ctx->cq, 0));
+    // the caller reaps completions itself with rc_poll_cq
+    if (s_busy_poll) {
+        ctx->comp_channel = NULL;
+        TEST_Z(ctx->cq = ibv_create_cq(ctx->ctx, CQ_SIZE, NULL, NULL, 0));
+    } else {
+        TEST_Z(ctx->comp_channel = ibv_create_comp_channel(ctx->ctx));
+        TEST_Z(ctx->cq = ibv_create_cq(ctx->ctx, CQ_SIZE, NULL,
+                    ctx->comp_channel, 0));
+        TEST_NZ(ibv_req_notify_cq(ctx->cq, 0));
 
-    TEST_NZ(pthread_create(&s_ctx->cq_poller_thread, NULL, poll_cq, NULL));
+        TEST_NZ(pthread_create(&ctx->cq_poller_thread, NULL, poll_cq, ctx));
+    }
+
+    s_ctxs[s_nctxs++] = ctx;
+    LOG(1, ("using RDMA device %d\n", s_nctxs - 1));
+
+out:
+    TEST_NZ(pthread_mutex_unlock(&s_ctx_lock));
+    return ctx;
 }
 
 void build_params(struct rdma_conn_param *params)
@@ -66,18 +116,19 @@ void build_params(struct rdma_conn_param *params)
     params->rnr_retry_count = 7; /* infinite retry */
 }
 
-void build_qp_attr(struct ibv_qp_init_attr *qp_attr)
+void build_qp_attr(struct context *ctx, struct ibv_qp_init_attr *qp_attr)
 {
     memset(qp_attr, 0, sizeof(*qp_attr));
 
-    qp_attr->send_cq = s_ctx->cq;
-    qp_attr->recv_cq = s_ctx->cq;
+    qp_attr->send_cq = ctx->cq;
+    qp_attr->recv_cq = ctx->cq;
     qp_attr->qp_type = IBV_QPT_RC;
 
-    qp_attr->cap.max_send_wr = 10;
-    qp_attr->cap.max_recv_wr = 10;
-    qp_attr->cap.max_send_sge = 1;
+    qp_attr->cap.max_send_wr = QP_MAX_WR;
+    qp_attr->cap.max_recv_wr = QP_MAX_WR;
+    qp_attr->cap.max_send_sge = RC_MAX_SGE;
     qp_attr->cap.max_recv_sge = 1;
+    qp_attr->cap.max_inline_data = RC_MAX_INLINE;
 }
 
 void event_loop(struct rdma_event_channel *ec, int exit_on_disconnect)
@@ -91,6 +142,16 @@ void event_loop(struct rdma_event_channel *ec, int exit_on_disconnect)
         struct rdma_cm_event event_copy;
 
         memcpy(&event_copy, event, sizeof(*event));
+
+        // the private data goes away with the event
+        if (event->event == RDMA_CM_EVENT_CONNECT_REQUEST) {
+            s_conn_private_len = MIN(event->param.conn.private_data_len,
+                    RC_PRIVATE_DATA_MAX);
+            memset(s_conn_private, 0, RC_PRIVATE_DATA_MAX);
+            if (event->param.conn.private_data != NULL)
+                memcpy(s_conn_private, event->param.conn.private_data,
+                        s_conn_private_len);
+        }
         rdma_ack_cm_event(event);
 
         if (event_copy.event == RDMA_CM_EVENT_ADDR_RESOLVED) {
@@ -139,13 +200,15 @@ void dump_wc(struct ibv_wc *wc)
     fprintf(stderr, "opcode: %d\n", wc->opcode);
 }
 
-void * poll_cq(void *ctx)
+void * poll_cq(void *arg)
 {
+    struct context *ctx = (struct context *)arg;
     struct ibv_cq *cq;
     struct ibv_wc wc;
+    void *cq_ctx;
 
     while (1) {
-        TEST_NZ(ibv_get_cq_event(s_ctx->comp_channel, &cq, &ctx));
+        TEST_NZ(ibv_get_cq_event(ctx->comp_channel, &cq, &cq_ctx));
         ibv_ack_cq_events(cq, 1);
         TEST_NZ(ibv_req_notify_cq(cq, 0));
 
@@ -162,6 +225,34 @@ void * poll_cq(void *ctx)
     return NULL;
 }
 
+int rc_poll_cq()
+{
+    struct ibv_wc wc[16];
+    int total = 0;
+
+    for (int d = 0; d < s_nctxs; d++) {
+        int n = ibv_poll_cq(s_ctxs[d]->cq, 16, wc);
+
+        for (int i = 0; i < n; i++) {
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                dump_wc(&wc[i]);
+                rc_die("rc_poll_cq: status is not IBV_WC_SUCCESS");
+            }
+            s_on_completion_cb(&wc[i]);
+        }
+        total += n;
+    }
+
+    return total;
+}
+
+void rc_set_busy_poll(int busy)
+{
+    if (s_nctxs > 0 && busy != s_busy_poll)
+        rc_die("completion mode must be set before the first connection");
+    s_busy_poll = busy;
+}
+
 void rc_init(pre_conn_cb_fn pc, connect_cb_fn conn, completion_cb_fn comp, disconnect_cb_fn disc)
 {
     s_on_pre_conn_cb = pc;
@@ -226,7 +317,108 @@ void rc_die(const char *reason)
     exit(EXIT_FAILURE);
 }
 
+const void * rc_conn_private_data(size_t *len)
+{
+    if (len != NULL)
+        *len = s_conn_private_len;
+    return s_conn_private;
+}
+
 struct ibv_pd * rc_get_pd()
 {
-    return s_ctx->pd;
+    return s_ctxs[0]->pd;
+}
+
+struct ibv_pd * rc_get_pd_of(struct ibv_context *verbs)
+{
+    return build_context(verbs)->pd;
+}
+
+int rc_device_index(struct ibv_context *verbs)
+{
+    struct context *ctx = build_context(verbs);
+
+    for (int i = 0; i < s_nctxs; i++)
+        if (s_ctxs[i] == ctx)
+            return i;
+    return -1;
+}
+
+size_t rc_max_inline()
+{
+    return s_max_inline;
+}
+
+int rc_ndevices()
+{
+    return s_nctxs;
+}
+
+struct ibv_pd * rc_device_pd(int index)
+{
+    return s_ctxs[index]->pd;
+}
+
+struct ibv_pd * rc_open_device()
+{
+    struct ibv_context **devices;
+    int n;
+
+    // rdma_cm hands out these same contexts for incoming connections
+    TEST_Z(devices = rdma_get_devices(&n));
+    if (n == 0)
+        rc_die("no RDMA devices found");
+
+    for (int i = 0; i < n && i < RC_MAX_DEVICES; i++)
+        build_context(devices[i]);
+    rdma_free_devices(devices);
+
+    return s_ctxs[0]->pd;
+}
+
+int tcp_read_full(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = recv(fd, p, len, MSG_WAITALL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int tcp_writev_full(int fd, struct iovec *iov, int n)
+{
+    struct msghdr msg;
+    ssize_t done;
+
+    memset(&msg, 0, sizeof(msg));
+    while (n > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n < TCP_MAX_IOV ? n : TCP_MAX_IOV;
+        // a peer that went away shows up as an error, not SIGPIPE
+        done = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done < 0)
+            return -1;
+
+        // skip what went out, a partial write leaves the rest of one iovec
+        while (n > 0 && (size_t)done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return 0;
 }
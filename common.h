@@ -9,6 +9,7 @@
 #include <rdma/rdma_cma.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #define rvm_log(M, ... ) fprintf(stderr, "RVM_LOG %s:%d: " M, \
     __FILE__, __LINE__, ##__VA_ARGS__)
@@ -38,6 +39,15 @@ typedef int32_t bitmap_t;
 #define BITNSLOTS(nb) ((nb + 32 - 1) / 32)
 #define MIN(a,b) ((a)<(b)?(a):(b))
 
+/* Scatter/gather entries per send work request */
+#define RC_MAX_SGE 16
+/* RDMA devices a process can drive, each with its own PD, CQ and poller */
+#define RC_MAX_DEVICES 4
+/* Inline data asked for when creating QPs, see rc_max_inline() */
+#define RC_MAX_INLINE 256
+/* Bytes of connect request private data kept for the pre-connect callback */
+#define RC_PRIVATE_DATA_MAX 56
+
 typedef void (*pre_conn_cb_fn)(struct rdma_cm_id *id);
 typedef void (*connect_cb_fn)(struct rdma_cm_id *id);
 typedef void (*completion_cb_fn)(struct ibv_wc *wc);
@@ -47,9 +57,37 @@ void rc_init(pre_conn_cb_fn, connect_cb_fn, completion_cb_fn, disconnect_cb_fn);
 void rc_client_loop(const char *host, const char *port, void *context);
 void rc_disconnect(struct rdma_cm_id *id);
 void rc_die(const char *message);
+/* PD of the first device in use */
 struct ibv_pd * rc_get_pd();
+/* PD of the device a connection runs on (id->verbs) */
+struct ibv_pd * rc_get_pd_of(struct ibv_context *verbs);
+/* Devices in use so far, numbered from 0 in the order they were opened */
+int rc_device_index(struct ibv_context *verbs);
+int rc_ndevices();
+/* Bytes every QP created so far can send inline (IBV_SEND_INLINE) */
+size_t rc_max_inline();
+struct ibv_pd * rc_device_pd(int index);
+/* Private data of the connect request, valid in the pre-connect callback.
+ * Zero-filled past what the peer sent. */
+const void * rc_conn_private_data(size_t *len);
+/* Set up the PD, CQ and poller of every device before any connection
+ * exists. Returns the PD of the first one. */
+struct ibv_pd * rc_open_device();
 void rc_server_loop(const char *port);
+/* Reap completions from the calling thread instead of a poller thread that
+ * sleeps on a completion channel. Set before the first connection. */
+void rc_set_busy_poll(int busy);
+/* Hand the completions that are ready to the completion callback, returns
+ * how many there were (busy-poll mode only) */
+int rc_poll_cq();
 void build_connection(struct rdma_cm_id *id);
 void build_params(struct rdma_conn_param *params);
 
+/* Read exactly len bytes from a stream socket. Returns 0, or -1 on error or
+ * if the peer closed the connection first. */
+int tcp_read_full(int fd, void *buf, size_t len);
+/* Write all of iov[0..n) to a stream socket, gathering as many buffers
+ * per call as the kernel takes. iov is consumed. Returns 0 or -1. */
+int tcp_writev_full(int fd, struct iovec *iov, int n);
+
 #endif
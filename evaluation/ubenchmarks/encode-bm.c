@@ -0,0 +1,62 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include <ec_gf.h>
+
+#include "util.h"
+
+/* Single thread Reed-Solomon throughput, in MB of data per second: encoding
+ * whole groups of k blocks, and folding the difference of one block into
+ * the m parity blocks as a commit of part of a group does */
+int main(int argc, char *argv[])
+{
+    int k, m, iters;
+    size_t block;
+    uint8_t coef[256 * 256];
+    uint8_t *data[256], *parity[256], *delta;
+    double start, encode, update;
+
+    if (argc < 4) {
+	fprintf(stderr, "Usage: %s <k> <m> <block size> [iterations]\n",
+		argv[0]);
+	return -1;
+    }
+
+    k = atoi(argv[1]);
+    m = atoi(argv[2]);
+    block = atol(argv[3]);
+    iters = argc > 4 ? atoi(argv[4]) : 10000;
+    if (k < 1 || m < 1 || k + m > 256) {
+	fprintf(stderr, "k and m must be positive, k + m at most 256\n");
+	return -1;
+    }
+
+    ec_gf_cauchy(coef, k, m);
+    for (int i = 0; i < k; i++) {
+	data[i] = malloc(block);
+	for (size_t b = 0; b < block; b++)
+	    data[i][b] = random();
+    }
+    for (int j = 0; j < m; j++)
+	parity[j] = malloc(block);
+    delta = data[0];
+
+    start = gettime();
+    for (int it = 0; it < iters; it++)
+	ec_gf_encode(parity, data, coef, k, m, block);
+    encode = gettime() - start;
+
+    start = gettime();
+    for (int it = 0; it < iters; it++)
+	for (int j = 0; j < m; j++)
+	    ec_gf_mul_add(parity[j], delta, coef[j * k + it % k], block);
+    update = gettime() - start;
+
+    printf("kernel %s, k %d, m %d, %ld byte blocks\n", ec_gf_kernel(),
+	    k, m, block);
+    printf("encode %f MB/s\n", (double)iters * k * block / encode / 1e6);
+    printf("update %f MB/s\n", (double)iters * block / update / 1e6);
+
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <rmem_generic_interface.h>
+
+#include "util.h"
+
+#define DEFAULT_ITERS 100000
+#define DEFAULT_SIZE 64
+
+enum { TAG_REAL = 1, TAG_SHADOW = 2 };
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Print the latency distribution of one operation in microseconds */
+static void report(const char *op, double *lat, int n)
+{
+    qsort(lat, n, sizeof(*lat), cmp_double);
+
+    printf("%s,%d,%.2f,%.2f,%.2f,%.2f,%.2f\n", op, n,
+	    lat[n / 2] * 1e6,
+	    lat[(int)(n * 0.90)] * 1e6,
+	    lat[(int)(n * 0.99)] * 1e6,
+	    lat[(int)(n * 0.999)] * 1e6,
+	    lat[n - 1] * 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+    rmem_layer_t *layer;
+    int niters = DEFAULT_ITERS;
+    size_t size = DEFAULT_SIZE;
+    uint32_t src = TAG_SHADOW, dst = TAG_REAL, sz;
+    double *lat, start;
+    char *buf;
+    void *buf_reg;
+
+    if (argc < 3) {
+	fprintf(stderr, "Usage: %s <host> <port> [iterations] [size]\n",
+		argv[0]);
+	return -1;
+    }
+    if (argc > 3)
+	niters = atoi(argv[3]);
+    if (argc > 4)
+	size = atoi(argv[4]);
+
+    layer = backend_layer();
+    layer->connect(layer, argv[1], argv[2]);
+
+    if (layer->malloc(layer, size, TAG_REAL) == 0 ||
+	    layer->malloc(layer, size, TAG_SHADOW) == 0) {
+	fprintf(stderr, "could not allocate remote blocks\n");
+	exit(EXIT_FAILURE);
+    }
+
+    buf = malloc(size);
+    lat = malloc(niters * sizeof(*lat));
+    if (buf == NULL || lat == NULL) {
+	perror("malloc");
+	exit(EXIT_FAILURE);
+    }
+    memset(buf, 0xab, size);
+    buf_reg = layer->register_data(layer, buf, size);
+
+    printf("op,n,p50_us,p90_us,p99_us,p99.9_us,max_us\n");
+
+    for (int i = 0; i < niters; i++) {
+	start = gettime();
+	layer->put(layer, TAG_SHADOW, buf, buf_reg, size);
+	lat[i] = gettime() - start;
+    }
+    report("put", lat, niters);
+
+    for (int i = 0; i < niters; i++) {
+	start = gettime();
+	layer->get(layer, buf, buf_reg, TAG_REAL, size);
+	lat[i] = gettime() - start;
+    }
+    report("get", lat, niters);
+
+    // layers without shadow blocks commit puts through their own path
+    if (!(layer->flags & RMEM_LAYER_NO_SHADOW)) {
+	sz = size;
+	for (int i = 0; i < niters; i++) {
+	    start = gettime();
+	    layer->atomic_commit(layer, &src, &dst, &sz, 1);
+	    lat[i] = gettime() - start;
+	}
+	report("commit", lat, niters);
+    }
+
+    layer->deregister_data(layer, buf_reg);
+    layer->free(layer, TAG_SHADOW);
+    layer->free(layer, TAG_REAL);
+    layer->disconnect(layer);
+
+    free(lat);
+    free(buf);
+
+    return 0;
+}
@@ -0,0 +1,44 @@
+# Commit latency over TCP with chains of 1 to MAX_CHAIN rmem-servers on
+# this host. The client talks to the head; server i forwards to server
+# i + 1, and a commit returns once the tail has it.
+UBM_DIR=$(readlink -f $(dirname $0))
+RMEM_DIR=$(readlink -f "$UBM_DIR/../..")
+
+MAX_CHAIN=${MAX_CHAIN:-3}
+HOST=127.0.0.1
+PORT=1234
+TCP_PORT=1435
+
+# tail first, so every server's successor is up before it
+function start_chain {
+    $RMEM_DIR/rmem-server -T $((TCP_PORT + $1)) $((PORT + $1)) &> /dev/null &
+    sleep 0.5
+    for i in $(seq $(($1 - 1)) -1 1); do
+        $RMEM_DIR/rmem-server -T $((TCP_PORT + i)) \
+            -R $HOST:$((TCP_PORT + i + 1)) $((PORT + i)) &> /dev/null &
+        sleep 0.5
+    done
+}
+
+function stop_chain {
+    for i in $(seq 1 $1); do
+        kill `cat /tmp/rmem-server-$((PORT + i)).pid`
+    done
+    sleep 1
+}
+
+PAGE_NUMS="1 10 100 1000 10000"
+
+ARCH=$(uname -m)
+
+for pn in $PAGE_NUMS; do
+    printf "%d" $pn
+    for n in $(seq 1 $MAX_CHAIN); do
+        start_chain $n
+        result=$(setarch $ARCH -R $UBM_DIR/commit-bm-tcp $HOST \
+            $((TCP_PORT + 1)) $pn | tail -n 1)
+        printf ",%f" $result
+        stop_chain $n
+    done
+    printf "\n"
+done > commit-results-chain.csv
@@ -0,0 +1,24 @@
+# Commit and recovery time against the in-process loopback store, over a
+# range of modelled networks. Needs no server or device. Each network is
+# "latency_us:bandwidth_MBps", 0 meaning none, so 0:0 is the client alone.
+UBM_DIR=$(readlink -f $(dirname $0))
+
+NETWORKS=${NETWORKS:-"0:0 2:5000 10:1000 50:100"}
+PAGE_NUMS="1 10 100 1000 10000"
+
+ARCH=$(uname -m)
+
+for net in $NETWORKS; do
+    export RMEM_LOOP_LATENCY=${net%:*}
+    export RMEM_LOOP_BANDWIDTH=${net#*:}
+    for bm in commit recovery; do
+        for pn in $PAGE_NUMS; do
+            printf "%d" $pn
+            for trial in {1..3}; do
+                result=$(setarch $ARCH -R $UBM_DIR/$bm-bm-loop loop 0 $pn | tail -n 1)
+                printf ",%f" $result
+            done
+            printf "\n"
+        done > $bm-results-loop-${net/:/-}.csv
+    done
+done
@@ -41,3 +41,22 @@ for pn in $PAGE_NUMS; do
     done
     printf "\n"
 done > recovery-results-rm.csv
+
+for mode in event busy; do
+    start_rmem_server
+    ssh $CLIENT "RMEM_POLL=$mode setarch $ARCH -R $UBM_DIR/latency-bm-rm $SERVER $PORT" | sed "s/^/$mode,/"
+    stop_rmem_server
+done > latency-results-rm.csv
+
+# commit bandwidth (MB/s) as bulk writes are striped over more QPs
+STRIPE_PAGES=10000
+for qps in 0 1 2 4 8; do
+    printf "%d" $qps
+    for trial in {1..3}; do
+        start_rmem_server
+        result=$(ssh $CLIENT "RMEM_DATA_QPS=$qps setarch $ARCH -R $UBM_DIR/commit-bm-rm $SERVER $PORT $STRIPE_PAGES" | tail -n 1)
+        printf ",%f" $(echo "$STRIPE_PAGES * 4096 / $result / 1048576" | bc -l)
+        stop_rmem_server
+    done
+    printf "\n"
+done > commit-qps-results-rm.csv
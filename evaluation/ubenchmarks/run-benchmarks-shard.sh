@@ -0,0 +1,52 @@
+# Commit bandwidth of the sharded backend over 1 to MAX_SHARDS servers on
+# this host, over TCP. Set SHARD_HOSTS to a space separated list of server
+# hosts to spread the shards over several machines instead.
+UBM_DIR=$(readlink -f $(dirname $0))
+RMEM_DIR=$(readlink -f "$UBM_DIR/../..")
+
+MAX_SHARDS=${MAX_SHARDS:-4}
+SHARD_HOSTS=${SHARD_HOSTS:-127.0.0.1}
+PORT=1234
+TCP_PORT=1335
+
+export RMEM_SHARD_BACKEND=tcp
+
+function start_rmem_servers {
+    for i in $(seq 1 $1); do
+        $RMEM_DIR/rmem-server -T $((TCP_PORT + i)) $((PORT + i)) &> /dev/null &
+    done
+    sleep 1
+}
+
+function stop_rmem_servers {
+    for i in $(seq 1 $1); do
+        kill `cat /tmp/rmem-server-$((PORT + i)).pid`
+    done
+    sleep 1
+}
+
+# host:port of the first n shards, placed round robin over SHARD_HOSTS
+function shard_list {
+    local hosts=($SHARD_HOSTS) list=""
+    for i in $(seq 1 $1); do
+        list="$list,${hosts[$(((i - 1) % ${#hosts[@]}))]}:$((TCP_PORT + i))"
+    done
+    echo ${list#,}
+}
+
+PAGE_NUMS="100 1000 10000 50000"
+
+ARCH=$(uname -m)
+
+for pn in $PAGE_NUMS; do
+    printf "%d" $pn
+    for n in $(seq 1 $MAX_SHARDS); do
+        start_rmem_servers $n
+        result=$(setarch $ARCH -R $UBM_DIR/commit-bm-shard $(shard_list $n) \
+            0 $pn | tail -n 1)
+        # MB committed per second
+        awk -v p=$pn -v t=$result 'BEGIN { printf ",%f", p * 4096 / t / 1e6 }'
+        stop_rmem_servers $n
+    done
+    printf "\n"
+done > commit-results-shard.csv
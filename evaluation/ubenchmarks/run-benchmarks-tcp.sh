@@ -0,0 +1,45 @@
+# TCP and shared-memory backends against the RDMA one, client and server
+# on this host. The RDMA half needs a device; without one only the TCP and
+# shared-memory results are written.
+UBM_DIR=$(readlink -f $(dirname $0))
+RMEM_DIR=$(readlink -f "$UBM_DIR/../..")
+
+HOST=127.0.0.1
+PORT=1234
+TCP_PORT=1235
+
+function start_rmem_server {
+    $RMEM_DIR/rmem-server -m -T $TCP_PORT $PORT &> /dev/null &
+    sleep 1
+}
+
+function stop_rmem_server {
+    kill `cat /tmp/rmem-server-${PORT}.pid`
+    sleep 1
+}
+
+PAGE_NUMS="1 10 20 50 100 200 500 1000 2000 5000 10000"
+
+ARCH=$(uname -m)
+
+if ls /sys/class/infiniband/* &> /dev/null; then
+    TRANSPORTS="tcp shm rm"
+else
+    TRANSPORTS="tcp shm"
+fi
+
+for t in $TRANSPORTS; do
+    [ $t = tcp ] && port=$TCP_PORT || port=$PORT
+    for bm in commit recovery; do
+        for pn in $PAGE_NUMS; do
+            printf "%d" $pn
+            for trial in {1..3}; do
+                start_rmem_server
+                result=$(setarch $ARCH -R $UBM_DIR/$bm-bm-$t $HOST $port $pn | tail -n 1)
+                printf ",%f" $result
+                stop_rmem_server
+            done
+            printf "\n"
+        done > $bm-results-loopback-$t.csv
+    done
+done
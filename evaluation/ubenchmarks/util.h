@@ -10,6 +10,33 @@
 #ifdef RAMC
 #include <ramcloud_backend.h>
 #define backend_layer create_ramcloud_layer
+#elif defined(TCP)
+#include <tcp_backend.h>
+#define backend_layer create_tcp_layer
+#elif defined(SHM)
+#include <shm_backend.h>
+#define backend_layer create_shm_layer
+#elif defined(FILE_STORE)
+#include <file_backend.h>
+#define backend_layer create_file_layer
+#elif defined(LOG_STORE)
+#include <log_backend.h>
+#define backend_layer create_log_layer
+#elif defined(PMEM_STORE)
+#include <pmem_backend.h>
+#define backend_layer create_pmem_layer
+#elif defined(TIERED)
+#include <tiered_backend.h>
+#define backend_layer create_tiered_layer
+#elif defined(SHARD)
+#include <shard_backend.h>
+#define backend_layer create_shard_layer
+#elif defined(EC)
+#include <ec_backend.h>
+#define backend_layer create_ec_layer
+#elif defined(LOOP)
+#include <loop_backend.h>
+#define backend_layer create_loop_layer
 #else
 #include <rmem_backend.h>
 #define backend_layer create_rmem_layer
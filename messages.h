@@ -2,9 +2,83 @@
 #define RDMA_MESSAGES_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include "tag_addr_map.h"
 
 #define MULTI_OP_MAX_ITEMS 20
+#define SEG_TABLE_MSG_MAX 16
+/* Receives the server keeps posted per connection, i.e. how many requests a
+ * client may have in flight */
+#define MSG_RING_SIZE 8
+/* Entries that fit the per-connection commit descriptor buffer */
+#define TXN_DESC_MAX_ENTRIES 32768
+
+/* Operations of a commit descriptor */
+enum txn_desc_op {
+    DESC_CP,
+    DESC_FREE,
+    DESC_SWAP
+};
+
+/* A commit descriptor is an array of these, RDMA-written by the client into
+ * the buffer advertised in MSG_MR and applied at MSG_TXN_DESC/MSG_TXN_GO */
+struct txn_desc_entry {
+    uint64_t dst;
+    uint64_t src;
+    uint64_t size;
+    uint32_t op;
+    uint32_t pad;
+};
+
+/* One-sided commit channel. The client RDMA-writes a chan_req into the slot
+ * advertised in MSG_MR, a server poller thread spots the new seq, applies
+ * the request and RDMA-writes a chan_resp into the client's slot. seq is the
+ * last field, so it is the last part of the write to land. */
+enum chan_op {
+    CHAN_DESC,
+    CHAN_GO,
+    CHAN_ABORT
+};
+
+struct chan_req {
+    uint64_t nentries;      /* entries written to the descriptor buffer */
+    uint32_t op;
+    volatile uint32_t seq;
+};
+
+struct chan_resp {
+    int32_t error;
+    volatile uint32_t seq;
+};
+
+/* Command ring of a client on the server's host, in a memory file the
+ * server hands over when the client connects. The client writes the
+ * commit descriptor to desc, fills slots[head % SHM_RING_SIZE] with a
+ * chan_op and bumps head. A server thread applies commands in order, sets
+ * error and then done to the command's position in the ring plus one. */
+#define SHM_RING_SIZE 8
+
+struct shm_ring {
+    volatile uint64_t head;
+    uint64_t pad0[7];           /* keep head and tail on their own lines */
+    volatile uint64_t tail;
+    uint64_t pad1[7];
+    struct {
+        uint64_t nentries;
+        uint32_t op;
+        int32_t error;
+        volatile uint64_t done;
+    } slots[SHM_RING_SIZE];
+    struct txn_desc_entry desc[TXN_DESC_MAX_ENTRIES];
+};
+
+/* Sent as connect private data. A data connection only carries one-sided
+ * traffic striped over it by a client that also has a control connection;
+ * the server exchanges no messages on it. */
+enum conn_kind {
+    CONN_CONTROL = 0,
+    CONN_DATA
+};
 
 enum message_id {
     MSG_INVALID = 0,
@@ -23,16 +97,74 @@ enum message_id {
     MSG_MULTI_LOOKUP,
     MSG_MULTI_MEMRESP,
     MSG_MULTI_TXN_FREE,
-    MSG_MULTI_TXN_CP
+    MSG_MULTI_TXN_CP,
+    MSG_MULTI_TXN_SWAP,
+    MSG_LOG_ATTACH,
+    MSG_LOG_INFO,
+    MSG_LOG_DETACH,
+    MSG_POOL_LEASE,
+    MSG_SEG_TABLE,
+    MSG_TXN_DESC,
+    MSG_CHAN_ATTACH,
+    MSG_WRITE,
+    MSG_READ,
+    MSG_CHAIN
+};
+
+/* Over TCP every message is preceded by a tcp_frame: len bytes of struct
+ * message follow (see msg_len()), then payload bytes of bulk data. The
+ * payload is the block of a MSG_WRITE or of the MSG_MEMRESP to a MSG_READ,
+ * the commit descriptor of a MSG_TXN_DESC or MSG_TXN_GO, the transaction
+ * of a MSG_CHAIN, and the tag_addr_entry_t array of the MSG_TAG_ADDR_MAP
+ * sent on connect. */
+struct tcp_frame {
+    uint32_t len;
+    uint32_t pad;
+    uint64_t payload;
 };
 
+/* A committed transaction a server forwards to its successor in a chain
+ * (rmem-server -R). The MSG_CHAIN payload is nentries chain_entry, then the
+ * data of the CHAIN_WRITE entries back to back, in entry order. Blocks are
+ * named by tag, the successor's layout need not match. */
+enum chain_op {
+    CHAIN_ALLOC,    /* allocate size bytes under tag, if it is new */
+    CHAIN_WRITE,    /* size bytes at off in the block of tag */
+    CHAIN_FREE
+};
+
+struct chain_entry {
+    uint32_t op;
+    uint32_t tag;
+    uint64_t off;
+    uint64_t size;
+};
+
+/* Clients on the server's host speak the same protocol over this Unix
+ * socket (%s is the server's port). The server first passes them the file
+ * descriptors of its memory and of their shm_ring, and the address of its
+ * memory goes in the addr field of MSG_TAG_ADDR_MAP. */
+#define RMEM_LOCAL_SOCKET "/tmp/rmem-server-%s.sock"
+
 struct message {
     enum message_id id;
+    /* generation of the server's segment table when the message was sent */
+    uint32_t seg_gen;
 
     union {
         struct {
-            uint64_t addr;
-            uint32_t rkey;
+            uint64_t desc_addr;     /* commit descriptor buffer */
+            uint32_t desc_rkey;
+            uint32_t chan_rkey;
+            uint64_t chan_addr;     /* commit channel slot, 0 if none */
+            uint32_t total;
+            uint32_t first;
+            uint8_t nsegs;
+            struct {
+                uint64_t addr;
+                uint64_t size;
+                uint32_t rkey;
+            } segs[SEG_TABLE_MSG_MAX];
         } mr;
         struct {
             uint64_t size;
@@ -54,9 +186,23 @@ struct message {
 	    uint64_t size;
 	} cp;
 	struct {
-            int size;
-            int nleft;
-	    tag_addr_entry_t data[TAG_ADDR_MAP_SIZE_MSG];
+	    uint64_t nentries;  /* entries written to the descriptor buffer */
+	} txn_go;
+	struct {
+	    uint64_t addr;      /* server address of the block */
+	    uint64_t size;
+	} rw;
+	struct {
+	    uint64_t nentries;
+	} chain;
+	struct {
+	    uint64_t addr;      /* client's chan_resp */
+	    uint32_t rkey;
+	} chan;
+	struct {
+	    uint64_t addr;      /* tag_addr_entry_t[count] to RDMA-read */
+	    uint64_t count;
+	    uint32_t rkey;
 	} tag_addr_map;
 	struct {
 	    uint64_t size;
@@ -82,7 +228,71 @@ struct message {
 	    uint64_t sizes[MULTI_OP_MAX_ITEMS];
 	    uint8_t nitems;
 	} multi_cp;
+	struct {
+	    uint64_t addr;
+	    uint64_t size;
+	    uint64_t head;
+	    uint32_t tag;
+	    int8_t error;
+	} log;
     } data;
 };
 
+/* Bytes to send for a message that only uses the given payload */
+#define MSG_SIZE(field) (offsetof(struct message, data) + \
+        sizeof(((struct message *)0)->data.field))
+
+/* Bytes to send for msg. Most messages are small enough to go inline. */
+static inline size_t msg_len(const struct message *msg)
+{
+    switch (msg->id) {
+        case MSG_MR:
+        case MSG_SEG_TABLE:
+            return MSG_SIZE(mr);
+        case MSG_ALLOC:
+        case MSG_POOL_LEASE:
+            return MSG_SIZE(alloc);
+        case MSG_LOOKUP:
+            return MSG_SIZE(lookup);
+        case MSG_TXN_FREE:
+            return MSG_SIZE(free);
+        case MSG_TXN_CP:
+            return MSG_SIZE(cp);
+        case MSG_TXN_GO:
+        case MSG_TXN_DESC:
+            return MSG_SIZE(txn_go);
+        case MSG_TAG_ADDR_MAP:
+            return MSG_SIZE(tag_addr_map);
+        case MSG_MULTI_ALLOC:
+            return MSG_SIZE(multi_alloc);
+        case MSG_MULTI_LOOKUP:
+            return MSG_SIZE(multi_lookup);
+        case MSG_MULTI_MEMRESP:
+            return MSG_SIZE(multi_memresp);
+        case MSG_MULTI_TXN_FREE:
+            return MSG_SIZE(multi_free);
+        case MSG_MULTI_TXN_CP:
+        case MSG_MULTI_TXN_SWAP:
+            return MSG_SIZE(multi_cp);
+        case MSG_LOG_ATTACH:
+        case MSG_LOG_INFO:
+        case MSG_LOG_DETACH:
+            return MSG_SIZE(log);
+        case MSG_CHAN_ATTACH:
+            return MSG_SIZE(chan);
+        case MSG_WRITE:
+        case MSG_READ:
+            return MSG_SIZE(rw);
+        case MSG_CHAIN:
+            return MSG_SIZE(chain);
+        case MSG_MEMRESP:
+        case MSG_TXN_ABORT:
+        case MSG_TXN_ACK:
+        case MSG_STARTUP_ACK:
+            return MSG_SIZE(memresp);
+        default:
+            return sizeof(*msg);
+    }
+}
+
 #endif
@@ -0,0 +1,39 @@
+#ifndef REDO_LOG_H
+#define REDO_LOG_H
+
+#include <stdint.h>
+
+/* Layout of the remote redo log shared by rmem-server and the rmem backend.
+ *
+ * The log is an ordinary allocation in the rmem table (tagged with
+ * RMEM_LOG_TAG) that starts with a redo_log_hdr and is followed by a ring of
+ * hdr->size bytes. Positions are byte offsets that only ever grow; the ring
+ * index of a position is pos % size and records may wrap around the end of
+ * the ring.
+ *
+ * The client RDMA-writes records past head and then commits them by writing
+ * the new head. The server applies everything between tail and head to the
+ * home locations and then advances tail, which the client reads to find out
+ * how much of the ring it may reuse. */
+
+#define RMEM_LOG_TAG 0xFFFFFFFEu
+
+/* Records are padded so that every header is 8-byte aligned */
+#define REDO_LOG_ALIGN(x) (((x) + 7) & ~((uint64_t) 7))
+
+struct redo_log_hdr {
+    volatile uint64_t head; /**< end of the committed records (client) */
+    volatile uint64_t tail; /**< end of the applied records (server) */
+    uint64_t size;          /**< size of the ring in bytes */
+    uint64_t pad;
+};
+
+struct redo_log_rec {
+    uint64_t dst;  /**< home address of the data on the server */
+    uint64_t size; /**< number of data bytes following this header */
+};
+
+#define REDO_LOG_REC_SIZE(size) \
+    (sizeof(struct redo_log_rec) + REDO_LOG_ALIGN(size))
+
+#endif
@@ -1,13 +1,21 @@
+#define _GNU_SOURCE
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <assert.h>
 #include <signal.h>
 #include <semaphore.h>
+#include <sched.h>
+#include <dirent.h>
 
 #include "common.h"
 #include "messages.h"
 #include "rmem_table.h"
 #include "rmem_multi_ops.h"
+#include "rmem_log.h"
+#include "shadow_pool.h"
+#include "rmem_tcp.h"
+#include "rmem_chain.h"
 #include "backends/rmem_backend.h"
 #include "utils/log.h"
 #include "utils/error.h"
@@ -15,27 +23,110 @@
 
 static const char *DEFAULT_PORT = "12345";
 static const size_t BUFFER_SIZE = 10 * 1024 * 1024;
+static const size_t DEFAULT_POOL_SIZE = 64 << 20;
 
 struct stats stats;
 struct rmem_table rmem;
 pthread_mutex_t alloc_mutex;
+struct shadow_pool pool;
+int pool_enabled;
+size_t pool_size = DEFAULT_POOL_SIZE;   /**< allocated at the first lease */
+// segments are registered once with the PD of each of these devices and
+// shared by all connections on that device
+int ndevices;
+
+struct conn_context;
+
+/* A thread spinning on the commit channel slots of its connections */
+struct chan_poller
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    volatile int waiting;           /**< others want the lock */
+    struct conn_context *conns;
+};
+
+static struct chan_poller *pollers;
+static int npollers;
+static int next_poller;
+
+struct pool_lease
+{
+    void *ptr;
+    size_t size;
+};
+
+struct recv_slot
+{
+    struct rdma_cm_id *id;
+    int index;
+};
 
 struct conn_context
 {
-    struct ibv_mr *rmem_mr;
+    int data_only;  /**< a client's extra QP for striped RDMA, no messages */
+    int dev;        /**< device the connection runs on */
 
-    struct message *recv_msg;
-    struct ibv_mr *recv_msg_mr;
+    /* MSG_RING_SIZE receives stay posted, so clients can pipeline requests.
+     * The reply to the request in recv_ring[i] goes out of send_ring[i]; the
+     * last send buffer is used for the connection handshake. */
+    struct message *recv_ring;
+    struct ibv_mr *recv_ring_mr;
+    struct recv_slot slots[MSG_RING_SIZE];
 
-    struct message *send_msg;
-    struct ibv_mr *send_msg_mr;
+    struct message *send_ring;
+    struct ibv_mr *send_ring_mr;
+
+    struct message *send_msg;   /**< reply to the request being handled */
+    struct message *hs_msg;
 
     struct rmem_txn_list txn_list;
+    int txn_error;  /**< a descriptor of the open transaction was bad */
+
+    struct txn_desc_entry *desc;
+    struct ibv_mr *desc_mr;
+
+    /* commit channel, only with pollers running */
+    struct rdma_cm_id *id;
+    struct chan_req *chan_req;
+    struct chan_resp *chan_resp;    /**< staging for the RDMA-written reply */
+    struct ibv_mr *chan_mr;
+    uint32_t chan_seq;              /**< last request handled */
+    uint64_t chan_resp_addr;
+    uint32_t chan_resp_rkey;
+    struct chan_poller *poller;
+    struct conn_context *chan_next;
+
+    struct redo_log_hdr *log_region;
+    struct rmem_log *log;
+
+    struct pool_lease *leases;
+    int nleases;
+    int max_leases;
 
     sem_t ack_sem;
+
+    int unsignaled;             /* sends posted since the last signaled one */
 };
 
-static void send_message(struct rdma_cm_id *id)
+#define SIGNAL_EVERY 16
+
+/* Flags for a send of len bytes. Small ones are copied into the work
+ * request, so the buffer is never read after posting and they need no
+ * completion; every SIGNAL_EVERY-th is still signaled so that the send
+ * queue gets reaped. The client waits for every reply, so the event
+ * thread and a channel poller never send on one connection at once. */
+static int send_flags(struct conn_context *ctx, size_t len)
+{
+    if (len > rc_max_inline())
+        return IBV_SEND_SIGNALED;
+    if (++ctx->unsignaled < SIGNAL_EVERY)
+        return IBV_SEND_INLINE;
+    ctx->unsignaled = 0;
+    return IBV_SEND_INLINE | IBV_SEND_SIGNALED;
+}
+
+static void send_message(struct rdma_cm_id *id, struct message *msg)
 {
     stats_start(KSTATS_SEND_MSG);
 
@@ -50,11 +141,14 @@ static void send_message(struct rdma_cm_id *id)
     wr.opcode = IBV_WR_SEND;
     wr.sg_list = &sge;
     wr.num_sge = 1;
-    wr.send_flags = IBV_SEND_SIGNALED;
 
-    sge.addr = (uintptr_t)ctx->send_msg;
-    sge.length = sizeof(*ctx->send_msg);
-    sge.lkey = ctx->send_msg_mr->lkey;
+    // lets the client notice segments it hasn't seen yet
+    msg->seg_gen = rmem.seg_gen;
+
+    sge.addr = (uintptr_t)msg;
+    sge.length = msg_len(msg);
+    sge.lkey = ctx->send_ring_mr->lkey;
+    wr.send_flags = send_flags(ctx, sge.length);
 
     LOG(8, ("posting sending WR\n"));
 
@@ -63,7 +157,7 @@ static void send_message(struct rdma_cm_id *id)
     stats_end(KSTATS_SEND_MSG);
 }
 
-static void post_msg_receive(struct rdma_cm_id *id)
+static void post_msg_receive(struct rdma_cm_id *id, int index)
 {
     stats_start(KSTATS_POST_MSG_RECV);
 
@@ -74,13 +168,13 @@ static void post_msg_receive(struct rdma_cm_id *id)
 
     memset(&wr, 0, sizeof(wr));
 
-    wr.wr_id = (uintptr_t)id;
+    wr.wr_id = (uintptr_t)&ctx->slots[index];
     wr.sg_list = &sge;
     wr.num_sge = 1;
 
-    sge.addr = (uintptr_t) ctx->recv_msg;
-    sge.length = sizeof(*ctx->recv_msg);
-    sge.lkey = ctx->recv_msg_mr->lkey;
+    sge.addr = (uintptr_t) &ctx->recv_ring[index];
+    sge.length = sizeof(ctx->recv_ring[index]);
+    sge.lkey = ctx->recv_ring_mr->lkey;
 
     LOG(8, ("posting receive WR\n"));
 
@@ -89,6 +183,63 @@ static void post_msg_receive(struct rdma_cm_id *id)
     stats_end(KSTATS_POST_MSG_RECV);
 }
 
+/* seg->priv holds one MR per device */
+static void register_segment(struct rmem_table *table,
+        struct rmem_segment *seg)
+{
+    struct ibv_mr **mrs;
+
+    LOG(5, ("Creating rmem mr. addr: %ld size: %ld\n",
+                (uintptr_t)seg->start, seg->size));
+    TEST_Z(mrs = calloc(RC_MAX_DEVICES, sizeof(*mrs)));
+    for (int i = 0; i < ndevices; i++)
+        TEST_Z(mrs[i] = ibv_reg_mr(
+                    rc_device_pd(i), seg->start, seg->size,
+                    IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
+                    IBV_ACCESS_REMOTE_READ));
+    seg->priv = mrs;
+}
+
+static void deregister_segment(struct rmem_table *table,
+        struct rmem_segment *seg)
+{
+    struct ibv_mr **mrs = (struct ibv_mr **)seg->priv;
+
+    if (mrs == NULL)
+        return;
+    for (int i = 0; i < RC_MAX_DEVICES; i++)
+        if (mrs[i] != NULL)
+            ibv_dereg_mr(mrs[i]);
+    free(mrs);
+    seg->priv = NULL;
+}
+
+static uint32_t segment_rkey(struct rmem_segment *seg, int dev)
+{
+    return ((struct ibv_mr **)seg->priv)[dev]->rkey;
+}
+
+static void fill_seg_table(struct message *msg, uint32_t first, int dev)
+{
+    TEST_NZ(pthread_mutex_lock(&alloc_mutex));
+
+    msg->data.mr.total = rmem.nsegs;
+    msg->data.mr.first = first;
+    msg->data.mr.nsegs = 0;
+
+    for (size_t i = first; i < rmem.nsegs &&
+            msg->data.mr.nsegs < SEG_TABLE_MSG_MAX; i++) {
+        struct rmem_segment *seg = &rmem.segs[i];
+        int n = msg->data.mr.nsegs++;
+
+        msg->data.mr.segs[n].addr = (uintptr_t)seg->start;
+        msg->data.mr.segs[n].size = seg->size;
+        msg->data.mr.segs[n].rkey = segment_rkey(seg, dev);
+    }
+
+    TEST_NZ(pthread_mutex_unlock(&alloc_mutex));
+}
+
 static void on_pre_conn(struct rdma_cm_id *id)
 {
     stats_start(KSTATS_PRE_CONN);
@@ -98,61 +249,118 @@ static void on_pre_conn(struct rdma_cm_id *id)
 
     id->context = ctx;
 
-    LOG(5, ("Creating rmem mr. addr: %ld size: %d\n", 
-                (uintptr_t)rmem.mem, RMEM_SIZE));
-    TEST_Z(ctx->rmem_mr = ibv_reg_mr(
-                rc_get_pd(), rmem.mem, RMEM_SIZE,
-                IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
-                IBV_ACCESS_REMOTE_READ));
-
-    TEST_NZ(posix_memalign((void **)&ctx->recv_msg, sysconf(_SC_PAGESIZE),
-            sizeof(*ctx->recv_msg)));
-    TEST_Z(ctx->recv_msg_mr = ibv_reg_mr(
-                rc_get_pd(), ctx->recv_msg, sizeof(*ctx->recv_msg),
+    // memory is only registered with the devices there were at startup
+    ctx->dev = rc_device_index(id->verbs);
+    if (ctx->dev >= ndevices)
+        rc_die("connection on a device that was not there at startup");
+
+    // only the QP matters for data connections
+    ctx->data_only = (*(const uint8_t *)rc_conn_private_data(NULL) ==
+            CONN_DATA);
+    if (ctx->data_only) {
+        LOG(5, ("data connection\n"));
+        stats_end(KSTATS_PRE_CONN);
+        return;
+    }
+
+    TEST_NZ(posix_memalign((void **)&ctx->recv_ring, sysconf(_SC_PAGESIZE),
+            MSG_RING_SIZE * sizeof(*ctx->recv_ring)));
+    TEST_Z(ctx->recv_ring_mr = ibv_reg_mr(
+                rc_device_pd(ctx->dev), ctx->recv_ring,
+                MSG_RING_SIZE * sizeof(*ctx->recv_ring),
                 IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
 
-    TEST_NZ(posix_memalign((void **)&ctx->send_msg, sysconf(_SC_PAGESIZE),
-            sizeof(*ctx->send_msg)));
-    TEST_Z(ctx->send_msg_mr = ibv_reg_mr(
-                rc_get_pd(), ctx->send_msg, sizeof(*ctx->send_msg),
+    for (int i = 0; i < MSG_RING_SIZE; i++) {
+        ctx->slots[i].id = id;
+        ctx->slots[i].index = i;
+    }
+
+    TEST_NZ(posix_memalign((void **)&ctx->send_ring, sysconf(_SC_PAGESIZE),
+            (MSG_RING_SIZE + 1) * sizeof(*ctx->send_ring)));
+    TEST_Z(ctx->send_ring_mr = ibv_reg_mr(
+                rc_device_pd(ctx->dev), ctx->send_ring,
+                (MSG_RING_SIZE + 1) * sizeof(*ctx->send_ring),
                 IBV_ACCESS_LOCAL_WRITE));
+    ctx->send_msg = &ctx->send_ring[0];
+    ctx->hs_msg = &ctx->send_ring[MSG_RING_SIZE];
+
+    TEST_NZ(posix_memalign((void **)&ctx->desc, sysconf(_SC_PAGESIZE),
+            TXN_DESC_MAX_ENTRIES * sizeof(*ctx->desc)));
+    TEST_Z(ctx->desc_mr = ibv_reg_mr(
+                rc_device_pd(ctx->dev), ctx->desc,
+                TXN_DESC_MAX_ENTRIES * sizeof(*ctx->desc),
+                IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
+
+    ctx->id = id;
+    ctx->chan_req = NULL;
+    ctx->chan_mr = NULL;
+    ctx->chan_seq = 0;
+    ctx->poller = NULL;
+    if (npollers > 0) {
+        // request and reply on separate cache lines
+        TEST_NZ(posix_memalign((void **)&ctx->chan_req, sysconf(_SC_PAGESIZE),
+                    sysconf(_SC_PAGESIZE)));
+        memset(ctx->chan_req, 0, sysconf(_SC_PAGESIZE));
+        ctx->chan_resp = (struct chan_resp *)((char *)ctx->chan_req + 64);
+        TEST_Z(ctx->chan_mr = ibv_reg_mr(
+                    rc_device_pd(ctx->dev), ctx->chan_req,
+                    sysconf(_SC_PAGESIZE),
+                    IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
+    }
 
     txn_list_init(&ctx->txn_list);
+    ctx->txn_error = 0;
+
+    ctx->log_region = NULL;
+    ctx->log = NULL;
+
+    ctx->leases = NULL;
+    ctx->nleases = 0;
+    ctx->max_leases = 0;
 
     TEST_NZ(sem_init(&ctx->ack_sem, 0, 0));
 
     stats_end(KSTATS_PRE_CONN);
 }
 
+/* Publish a snapshot of the tag map in registered memory. The client pulls
+ * it with a few large RDMA reads and acks once, instead of paying a round
+ * trip for every TAG_ADDR_MAP_SIZE_MSG mappings. */
 static void send_tag_to_addr_info(struct rdma_cm_id *id) 
 {
     struct conn_context *ctx = (struct conn_context *)id->context;
     struct rmem_iterator iter;
-    int nleft = rmem.nblocks;
-
-    ctx->send_msg->id = MSG_TAG_ADDR_MAP;
-
-    if (rmem.nblocks == 0) {
-	ctx->send_msg->data.tag_addr_map.size = 0;
-	ctx->send_msg->data.tag_addr_map.nleft = 0;
-	send_message(id);
-	return;
+    tag_addr_entry_t *table = NULL;
+    struct ibv_mr *table_mr = NULL;
+    size_t n = 0;
+
+    TEST_NZ(pthread_mutex_lock(&alloc_mutex));
+    if (rmem.nblocks > 0) {
+        TEST_Z(table = malloc(rmem.nblocks * sizeof(*table)));
+        init_rmem_iterator(&iter, &rmem);
+        while (!rmem_iter_finished(&iter))
+            n += rmem_iter_next_set(&iter, &table[n]);
     }
+    TEST_NZ(pthread_mutex_unlock(&alloc_mutex));
 
-    init_rmem_iterator(&iter, &rmem);
+    if (n > 0)
+        TEST_Z(table_mr = ibv_reg_mr(rc_device_pd(ctx->dev), table,
+                    n * sizeof(*table),
+                    IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ));
 
-    while (!rmem_iter_finished(&iter)) {
-	int to_send = rmem_iter_next_set(&iter,
-		ctx->send_msg->data.tag_addr_map.data);
-        nleft -= to_send;
-	ctx->send_msg->data.tag_addr_map.size = to_send;
-        ctx->send_msg->data.tag_addr_map.nleft = nleft;
+    ctx->hs_msg->id = MSG_TAG_ADDR_MAP;
+    ctx->hs_msg->data.tag_addr_map.addr = (uintptr_t) table;
+    ctx->hs_msg->data.tag_addr_map.count = n;
+    ctx->hs_msg->data.tag_addr_map.rkey = table_mr ? table_mr->rkey : 0;
 
-	LOG(5, ("Sending %d mappings\n", to_send));
+    LOG(5, ("Publishing %zu mappings\n", n));
 
-	send_message(id);
-	TEST_NZ(sem_wait(&ctx->ack_sem));
-    }
+    send_message(id, ctx->hs_msg);
+    TEST_NZ(sem_wait(&ctx->ack_sem));
+
+    if (table_mr != NULL)
+        ibv_dereg_mr(table_mr);
+    free(table);
 }
 
 static void on_connection(struct rdma_cm_id *id)
@@ -161,34 +369,331 @@ static void on_connection(struct rdma_cm_id *id)
 
     struct conn_context *ctx = (struct conn_context *)id->context;
 
-    // post the initial receive
-    post_msg_receive(id);
+    if (ctx->data_only) {
+        stats_end(KSTATS_ON_CONN);
+        return;
+    }
+
+    // post the receive ring
+    for (int i = 0; i < MSG_RING_SIZE; i++)
+        post_msg_receive(id, i);
 
-    ctx->send_msg->id = MSG_MR;
-    ctx->send_msg->data.mr.addr = (uintptr_t)ctx->rmem_mr->addr;
-    ctx->send_msg->data.mr.rkey = ctx->rmem_mr->rkey;
+    ctx->hs_msg->id = MSG_MR;
+    fill_seg_table(ctx->hs_msg, 0, ctx->dev);
+    ctx->hs_msg->data.mr.desc_addr = (uintptr_t)ctx->desc;
+    ctx->hs_msg->data.mr.desc_rkey = ctx->desc_mr->rkey;
+    ctx->hs_msg->data.mr.chan_addr = (uintptr_t)ctx->chan_req;
+    ctx->hs_msg->data.mr.chan_rkey = ctx->chan_mr ? ctx->chan_mr->rkey : 0;
 
-    send_message(id);
+    send_message(id, ctx->hs_msg);
     TEST_NZ(sem_wait(&ctx->ack_sem));
 
-    LOG(5, ("On connection. mr.addrd: %ld rmem.mem: %ld\n", (uintptr_t)ctx->send_msg->data.mr.addr,
-                (uintptr_t)rmem.mem));
+    LOG(5, ("On connection. %d segments, rmem.mem: %ld\n",
+                ctx->hs_msg->data.mr.total, (uintptr_t)rmem.mem));
 
     send_tag_to_addr_info(id);
 
     stats_end(KSTATS_ON_CONN);
 }
 
+static void attach_log(struct conn_context *ctx, struct message *msg)
+{
+    uint32_t tag = msg->data.log.tag;
+    uint64_t size = msg->data.log.size;
+    struct redo_log_hdr *region;
+    int fresh = 0;
+
+    // logged writes would reach the chain after the commits they are in
+    if (rmem_chain_enabled()) {
+        LOG(1, ("refusing a redo log, commits are forwarded\n"));
+        ctx->send_msg->id = MSG_LOG_INFO;
+        ctx->send_msg->data.log.error = 1;
+        return;
+    }
+
+    TEST_NZ(pthread_mutex_lock(&alloc_mutex));
+    region = rmem_table_lookup(&rmem, tag);
+    if (region == NULL) {
+        region = rmem_table_alloc(&rmem, sizeof(*region) + size, tag);
+        fresh = 1;
+    }
+    TEST_NZ(pthread_mutex_unlock(&alloc_mutex));
+
+    // refused while another connection writes the ring
+    if (region != NULL && ctx->log == NULL) {
+        ctx->log = rmem_log_attach(region, size, fresh);
+        ctx->log_region = region;
+    }
+
+    ctx->send_msg->id = MSG_LOG_INFO;
+    ctx->send_msg->data.log.error = (ctx->log == NULL);
+    if (ctx->log != NULL) {
+        ctx->send_msg->data.log.addr = (uintptr_t) region;
+        ctx->send_msg->data.log.size = region->size;
+        ctx->send_msg->data.log.head = region->head;
+        ctx->send_msg->data.log.tag = tag;
+    }
+}
+
+static void detach_log(struct conn_context *ctx, int free_region)
+{
+    if (ctx->log == NULL)
+        return;
+
+    rmem_log_detach(ctx->log);
+    ctx->log = NULL;
+
+    if (free_region) {
+        TEST_NZ(pthread_mutex_lock(&alloc_mutex));
+        rmem_table_free(&rmem, ctx->log_region);
+        TEST_NZ(pthread_mutex_unlock(&alloc_mutex));
+    }
+    ctx->log_region = NULL;
+}
+
+/* Servers whose clients never use the pool do not pay for it */
+static int pool_ready(void)
+{
+    void *base;
+    int ready;
+
+    TEST_NZ(pthread_mutex_lock(&alloc_mutex));
+    if (!pool_enabled && pool_size > 0) {
+        base = rmem_table_alloc(&rmem, pool_size, RMEM_POOL_TAG);
+        if (base != NULL) {
+            shadow_pool_init(&pool, base, pool_size);
+            pool_enabled = 1;
+        } else {
+            fprintf(stderr, "Could not allocate a %lu byte shadow pool\n",
+                    pool_size);
+            pool_size = 0;
+        }
+    }
+    ready = pool_enabled;
+    TEST_NZ(pthread_mutex_unlock(&alloc_mutex));
+
+    return ready;
+}
+
+static void *lease_slots(struct conn_context *ctx, size_t size)
+{
+    void *ptr;
+
+    if (!pool_ready())
+        return NULL;
+    if ((ptr = shadow_pool_lease(&pool, size)) == NULL)
+        return NULL;
+
+    if (ctx->nleases == ctx->max_leases) {
+        ctx->max_leases = ctx->max_leases ? 2 * ctx->max_leases : 16;
+        TEST_Z(ctx->leases = realloc(ctx->leases,
+                    ctx->max_leases * sizeof(*ctx->leases)));
+    }
+    ctx->leases[ctx->nleases].ptr = ptr;
+    ctx->leases[ctx->nleases].size = size;
+    ctx->nleases++;
+
+    return ptr;
+}
+
+// slots are only needed until the transaction that staged into them ends
+static void release_slots(struct conn_context *ctx)
+{
+    for (int i = 0; i < ctx->nleases; i++)
+        shadow_pool_release(&pool, ctx->leases[i].ptr, ctx->leases[i].size);
+    ctx->nleases = 0;
+}
+
+/* Queue the n descriptor entries the client wrote into ctx->desc */
+static void queue_desc(struct conn_context *ctx, uint64_t n)
+{
+    if (n > TXN_DESC_MAX_ENTRIES)
+        ctx->txn_error = 1;
+    if (ctx->txn_error || n == 0)
+        return;
+
+    TEST_NZ(pthread_mutex_lock(&alloc_mutex));
+    if (txn_add_desc(&rmem, &ctx->txn_list, ctx->desc, n) != 0)
+        ctx->txn_error = 1;
+    TEST_NZ(pthread_mutex_unlock(&alloc_mutex));
+}
+
+/* Apply the open transaction. Returns nonzero if it was refused. */
+static int commit_txn(struct conn_context *ctx)
+{
+    int error = ctx->txn_error;
+
+    // logged writes must land before any block is freed
+    if (ctx->log != NULL)
+        rmem_log_drain(ctx->log);
+    // a bad descriptor aborts the whole transaction
+    if (!error)
+        error = rmem_chain_commit(&rmem, &alloc_mutex, &ctx->txn_list);
+    txn_list_clear(&ctx->txn_list);
+    release_slots(ctx);
+    ctx->txn_error = 0;
+
+    return error;
+}
+
+static void abort_txn(struct conn_context *ctx)
+{
+    txn_list_clear(&ctx->txn_list);
+    ctx->txn_error = 0;
+    release_slots(ctx);
+}
+
+/*
+ * COMMIT CHANNEL
+ *
+ * With -P the server starts poller threads that spin on a request slot per
+ * connection instead of waiting for SEND completions. A client writes the
+ * commit descriptor and then the request slot with RDMA writes; RC queue
+ * pairs place them in order, so by the time a poller sees the new seq the
+ * descriptor is in place. The reply goes back as an RDMA write into a slot
+ * the client spins on, and neither side takes a CQ event or a semaphore.
+ */
+
+static void chan_handle(struct conn_context *ctx)
+{
+    struct chan_req *req = ctx->chan_req;
+    struct ibv_send_wr wr, *bad_wr = NULL;
+    struct ibv_sge sge;
+    int error = 0;
+
+    switch (req->op) {
+        case CHAN_DESC:
+            queue_desc(ctx, req->nentries);
+            error = ctx->txn_error;
+            break;
+        case CHAN_GO:
+            queue_desc(ctx, req->nentries);
+            error = commit_txn(ctx);
+            break;
+        case CHAN_ABORT:
+            abort_txn(ctx);
+            break;
+        default:
+            error = -1;
+    }
+
+    ctx->chan_resp->error = error;
+    ctx->chan_resp->seq = ctx->chan_seq;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = (uintptr_t)ctx->id;
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.send_flags = send_flags(ctx, sizeof(*ctx->chan_resp));
+    wr.wr.rdma.remote_addr = ctx->chan_resp_addr;
+    wr.wr.rdma.rkey = ctx->chan_resp_rkey;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+
+    sge.addr = (uintptr_t)ctx->chan_resp;
+    sge.length = sizeof(*ctx->chan_resp);
+    sge.lkey = ctx->chan_mr->lkey;
+
+    TEST_NZ(ibv_post_send(ctx->id->qp, &wr, &bad_wr));
+}
+
+static void *chan_poll(void *arg)
+{
+    struct chan_poller *poller = (struct chan_poller *)arg;
+    struct conn_context *ctx;
+
+    while (1) {
+        TEST_NZ(pthread_mutex_lock(&poller->lock));
+        for (ctx = poller->conns; ctx != NULL; ctx = ctx->chan_next) {
+            if (ctx->chan_req->seq == ctx->chan_seq)
+                continue;
+            __sync_synchronize();
+            ctx->chan_seq = ctx->chan_req->seq;
+            chan_handle(ctx);
+        }
+        TEST_NZ(pthread_mutex_unlock(&poller->lock));
+
+        // let attach/detach in
+        if (poller->waiting)
+            sched_yield();
+    }
+
+    return NULL;
+}
+
+static void chan_lock(struct chan_poller *poller)
+{
+    __sync_fetch_and_add(&poller->waiting, 1);
+    TEST_NZ(pthread_mutex_lock(&poller->lock));
+    __sync_fetch_and_sub(&poller->waiting, 1);
+}
+
+static int chan_attach(struct conn_context *ctx, struct message *msg)
+{
+    struct chan_poller *poller;
+
+    if (ctx->chan_mr == NULL || ctx->poller != NULL)
+        return 1;
+
+    ctx->chan_resp_addr = msg->data.chan.addr;
+    ctx->chan_resp_rkey = msg->data.chan.rkey;
+
+    poller = &pollers[__sync_fetch_and_add(&next_poller, 1) % npollers];
+    chan_lock(poller);
+    ctx->chan_next = poller->conns;
+    poller->conns = ctx;
+    ctx->poller = poller;
+    TEST_NZ(pthread_mutex_unlock(&poller->lock));
+
+    LOG(5, ("commit channel attached to poller %ld\n",
+                (long)(poller - pollers)));
+    return 0;
+}
+
+static void chan_detach(struct conn_context *ctx)
+{
+    struct chan_poller *poller = ctx->poller;
+    struct conn_context **pp;
+
+    if (poller == NULL)
+        return;
+
+    chan_lock(poller);
+    for (pp = &poller->conns; *pp != NULL; pp = &(*pp)->chan_next) {
+        if (*pp == ctx) {
+            *pp = ctx->chan_next;
+            break;
+        }
+    }
+    TEST_NZ(pthread_mutex_unlock(&poller->lock));
+    ctx->poller = NULL;
+}
+
+void start_pollers(int n)
+{
+    if (n <= 0)
+        return;
+
+    TEST_Z(pollers = calloc(n, sizeof(*pollers)));
+    for (int i = 0; i < n; i++) {
+        pthread_mutex_init(&pollers[i].lock, NULL);
+        TEST_NZ(pthread_create(&pollers[i].thread, NULL, chan_poll,
+                    &pollers[i]));
+    }
+    npollers = n;
+}
+
 static void on_completion(struct ibv_wc *wc)
 {
     //stats_start(KSTATS_ON_COMPL);
 
-    struct rdma_cm_id *id = (struct rdma_cm_id *)(uintptr_t)wc->wr_id;
-    struct conn_context *ctx = (struct conn_context *)id->context;
-
     if (wc->opcode == IBV_WC_RECV) {
-        struct message *msg = ctx->recv_msg;
+        struct recv_slot *slot = (struct recv_slot *)(uintptr_t)wc->wr_id;
+        struct rdma_cm_id *id = slot->id;
+        struct conn_context *ctx = (struct conn_context *)id->context;
+        struct message *msg = &ctx->recv_ring[slot->index];
         void *ptr;
+
+        ctx->send_msg = &ctx->send_ring[slot->index];
         LOG(5, ("on_completion: IBV_WC_RECV\n"));
 
         switch (msg->id) {
@@ -196,6 +701,9 @@ static void on_completion(struct ibv_wc *wc)
                 TEST_NZ(pthread_mutex_lock(&alloc_mutex));
                 ptr = rmem_table_alloc(&rmem, msg->data.alloc.size,
                         msg->data.alloc.tag);
+                if (ptr != NULL)
+                    rmem_chain_note_alloc(msg->data.alloc.tag,
+                            msg->data.alloc.size);
                 TEST_NZ(pthread_mutex_unlock(&alloc_mutex));
                 ctx->send_msg->id = MSG_MEMRESP;
                 ctx->send_msg->data.memresp.addr = (uintptr_t) ptr;
@@ -208,7 +716,7 @@ static void on_completion(struct ibv_wc *wc)
                     printf("Error allocating\n");
                 }
 #endif
-                send_message(id);
+                send_message(id, ctx->send_msg);
                 break;
             case MSG_LOOKUP:
                 LOG(5, ("MSG_LOOKUP\n"));
@@ -218,14 +726,14 @@ static void on_completion(struct ibv_wc *wc)
                 ctx->send_msg->id = MSG_MEMRESP;
                 ctx->send_msg->data.memresp.addr = (uintptr_t) ptr;
                 ctx->send_msg->data.memresp.error = (ptr == NULL);
-                send_message(id);
+                send_message(id, ctx->send_msg);
                 break;
             case MSG_TXN_FREE:
                 LOG(5, ("MSG_TXN_FREE\n"));
 		txn_list_add_free(&ctx->txn_list,
 			(void *) msg->data.free.addr);
                 ctx->send_msg->id = MSG_TXN_ACK;
-                send_message(id);
+                send_message(id, ctx->send_msg);
                 break;
             case MSG_TXN_CP:
                 LOG(5, ("MSG_TXN_CP\n"));
@@ -234,22 +742,27 @@ static void on_completion(struct ibv_wc *wc)
                         (void *) msg->data.cp.src,
                         (size_t) msg->data.cp.size);
                 ctx->send_msg->id = MSG_TXN_ACK;
-                send_message(id);
+                send_message(id, ctx->send_msg);
+                break;
+            case MSG_TXN_DESC:
+                LOG(5, ("MSG_TXN_DESC\n"));
+		queue_desc(ctx, msg->data.txn_go.nentries);
+                ctx->send_msg->id = MSG_TXN_ACK;
+                ctx->send_msg->data.memresp.error = ctx->txn_error;
+                send_message(id, ctx->send_msg);
                 break;
             case MSG_TXN_GO:
                 LOG(5, ("MSG_TXN_GO\n"));
-                TEST_NZ(pthread_mutex_lock(&alloc_mutex));
-		txn_commit(&rmem, &ctx->txn_list);
-                TEST_NZ(pthread_mutex_unlock(&alloc_mutex));
-		txn_list_clear(&ctx->txn_list);
+		queue_desc(ctx, msg->data.txn_go.nentries);
                 ctx->send_msg->id = MSG_TXN_ACK;
-                send_message(id);
+                ctx->send_msg->data.memresp.error = commit_txn(ctx);
+                send_message(id, ctx->send_msg);
                 break;
             case MSG_TXN_ABORT:
                 LOG(5, ("MSG_TXN_ABORT\n"));
-		txn_list_clear(&ctx->txn_list);
+		abort_txn(ctx);
                 ctx->send_msg->id = MSG_TXN_ACK;
-                send_message(id);
+                send_message(id, ctx->send_msg);
                 break;
 	    case MSG_STARTUP_ACK:
 		TEST_NZ(sem_post(&ctx->ack_sem));
@@ -266,8 +779,13 @@ static void on_completion(struct ibv_wc *wc)
 			    msg->data.multi_alloc.size,
 			    msg->data.multi_alloc.tags,
 			    msg->data.multi_alloc.nitems);
+		// a failure leaves the tags before it allocated
+		for (int i = 0; i < msg->data.multi_alloc.nitems; i++)
+		    if (rmem_table_lookup(&rmem, msg->data.multi_alloc.tags[i]))
+			rmem_chain_note_alloc(msg->data.multi_alloc.tags[i],
+				msg->data.multi_alloc.size);
                 TEST_NZ(pthread_mutex_unlock(&alloc_mutex));
-		send_message(id);
+		send_message(id, ctx->send_msg);
 		break;
 	    case MSG_MULTI_LOOKUP:
                 LOG(5, ("MSG_MULTI_LOOKUP\n"));
@@ -281,7 +799,7 @@ static void on_completion(struct ibv_wc *wc)
 			    msg->data.multi_alloc.tags,
 			    msg->data.multi_alloc.nitems);
                 TEST_NZ(pthread_mutex_unlock(&alloc_mutex));
-		send_message(id);
+		send_message(id, ctx->send_msg);
 		break;
 	    case MSG_MULTI_TXN_FREE:
                 LOG(5, ("MSG_MULTI_TXN_FREE\n"));
@@ -289,7 +807,7 @@ static void on_completion(struct ibv_wc *wc)
 			msg->data.multi_free.addrs,
 			msg->data.multi_free.nitems);
 		ctx->send_msg->id = MSG_TXN_ACK;
-		send_message(id);
+		send_message(id, ctx->send_msg);
 		break;
 	    case MSG_MULTI_TXN_CP:
                 LOG(5, ("MSG_MULTI_TXN_CP\n"));
@@ -299,14 +817,58 @@ static void on_completion(struct ibv_wc *wc)
 			msg->data.multi_cp.sizes,
 			msg->data.multi_cp.nitems);
 		ctx->send_msg->id = MSG_TXN_ACK;
-		send_message(id);
+		send_message(id, ctx->send_msg);
+		break;
+	    case MSG_MULTI_TXN_SWAP:
+                LOG(5, ("MSG_MULTI_TXN_SWAP\n"));
+                TEST_NZ(pthread_mutex_lock(&alloc_mutex));
+		ctx->send_msg->data.memresp.error =
+		    txn_multi_add_swap(&rmem, &ctx->txn_list,
+			    msg->data.multi_cp.dsts,
+			    msg->data.multi_cp.srcs,
+			    msg->data.multi_cp.sizes,
+			    msg->data.multi_cp.nitems) != 0;
+                TEST_NZ(pthread_mutex_unlock(&alloc_mutex));
+		ctx->send_msg->id = MSG_TXN_ACK;
+		send_message(id, ctx->send_msg);
+		break;
+	    case MSG_LOG_ATTACH:
+                LOG(5, ("MSG_LOG_ATTACH\n"));
+		attach_log(ctx, msg);
+		send_message(id, ctx->send_msg);
+		break;
+	    case MSG_LOG_DETACH:
+                LOG(5, ("MSG_LOG_DETACH\n"));
+		detach_log(ctx, 1);
+		ctx->send_msg->id = MSG_TXN_ACK;
+		send_message(id, ctx->send_msg);
+		break;
+	    case MSG_SEG_TABLE:
+                LOG(5, ("MSG_SEG_TABLE\n"));
+		ctx->send_msg->id = MSG_MR;
+		fill_seg_table(ctx->send_msg, msg->data.mr.first, ctx->dev);
+		send_message(id, ctx->send_msg);
+		break;
+	    case MSG_CHAN_ATTACH:
+                LOG(5, ("MSG_CHAN_ATTACH\n"));
+		ctx->send_msg->id = MSG_TXN_ACK;
+		ctx->send_msg->data.memresp.error = chan_attach(ctx, msg);
+		send_message(id, ctx->send_msg);
+		break;
+	    case MSG_POOL_LEASE:
+                LOG(5, ("MSG_POOL_LEASE\n"));
+		ptr = lease_slots(ctx, msg->data.alloc.size);
+		ctx->send_msg->id = MSG_MEMRESP;
+		ctx->send_msg->data.memresp.addr = (uintptr_t) ptr;
+		ctx->send_msg->data.memresp.error = (ptr == NULL);
+		send_message(id, ctx->send_msg);
 		break;
             default:
                 fprintf(stderr, "Invalid message type %d\n", msg->id);
                 exit(EXIT_FAILURE);
         }
 
-        post_msg_receive(id);
+        post_msg_receive(id, slot->index);
     } else {
         LOG(5, ("on_completion: else\n"));
     }
@@ -320,14 +882,30 @@ static void on_disconnect(struct rdma_cm_id *id)
 
     LOG(5, ("on_disconnect\n"));
 
-    txn_list_clear(&ctx->txn_list);
+    if (ctx->data_only) {
+        free(ctx);
+        return;
+    }
 
-    ibv_dereg_mr(ctx->rmem_mr);
-    ibv_dereg_mr(ctx->recv_msg_mr);
-    ibv_dereg_mr(ctx->send_msg_mr);
+    // the pollers must be done with the connection before it goes away
+    chan_detach(ctx);
 
-    free(ctx->send_msg);
-    free(ctx->recv_msg);
+    txn_list_clear(&ctx->txn_list);
+    release_slots(ctx);
+    free(ctx->leases);
+    // keep the log around, the client will pick it up when it recovers
+    detach_log(ctx, 0);
+
+    ibv_dereg_mr(ctx->recv_ring_mr);
+    ibv_dereg_mr(ctx->send_ring_mr);
+    ibv_dereg_mr(ctx->desc_mr);
+    free(ctx->desc);
+    if (ctx->chan_mr != NULL)
+        ibv_dereg_mr(ctx->chan_mr);
+    free(ctx->chan_req);
+
+    free(ctx->send_ring);
+    free(ctx->recv_ring);
 
     free(ctx);
 }
@@ -360,30 +938,226 @@ void write_pid(const char *port)
     fclose(f);
 }
 
-int main(int argc, char **argv)
+void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-c cap] [-s pool_size] [-H page_size] "
+            "[-N node] [-P pollers] [-T tcp_port] [-m] [-R host:port] "
+            "[port]\n", prog);
+    fprintf(stderr, "  -c  bytes the memory pool may grow to\n");
+    fprintf(stderr, "  -s  bytes of staging slots shared by all clients, "
+            "allocated at the first\n      lease (0 disables the pool)\n");
+    fprintf(stderr, "  -H  back the pool with 2M or 1G hugepages\n");
+    fprintf(stderr, "  -N  NUMA node for memory and threads (default: the "
+            "node of the first RDMA device, -1 for none)\n");
+    fprintf(stderr, "  -P  threads spinning on the one-sided commit channel "
+            "(default: 0, commits use messages)\n");
+    fprintf(stderr, "  -T  also serve the TCP backend on tcp_port\n");
+    fprintf(stderr, "  -m  keep the pool in shared memory and also serve "
+            "clients on this host\n      through " RMEM_LOCAL_SOCKET "\n",
+            "<port>");
+    fprintf(stderr, "  -R  replicate commits to the server serving TCP on "
+            "host:port, which\n      must be up first; commits complete "
+            "once the chain's tail has them;\n      its clients cannot use "
+            "RMEM_COMMIT_LOG\n");
+    fprintf(stderr, "  with -T or -m and no RDMA devices, only those clients "
+            "are served\n");
+    exit(EXIT_FAILURE);
+}
+
+/* Sizes may carry a K, M or G suffix */
+size_t parse_size(const char *str)
 {
-    const char *port;
+    char *end;
+    size_t size = strtoull(str, &end, 0);
+
+    switch (*end) {
+        case 'G': case 'g': size <<= 10;
+        case 'M': case 'm': size <<= 10;
+        case 'K': case 'k': size <<= 10;
+    }
+    return size;
+}
 
-    if (argc > 1)
-	port = argv[1];
+static int have_rdma_devices()
+{
+    struct ibv_context **devices;
+    int n = 0;
+
+    if ((devices = rdma_get_devices(&n)) != NULL)
+        rdma_free_devices(devices);
+    return n > 0;
+}
+
+/* NUMA node the first RDMA device hangs off, -1 if unknown */
+int nic_numa_node()
+{
+    DIR *dir;
+    struct dirent *ent;
+    char path[512];
+    FILE *f;
+    int node = -1;
+
+    if ((dir = opendir("/sys/class/infiniband")) == NULL)
+        return -1;
+
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.')
+            continue;
+
+        snprintf(path, sizeof(path),
+                "/sys/class/infiniband/%s/device/numa_node", ent->d_name);
+        if ((f = fopen(path, "r")) != NULL) {
+            if (fscanf(f, "%d", &node) != 1)
+                node = -1;
+            fclose(f);
+        }
+        LOG(1, ("%s is on NUMA node %d\n", ent->d_name, node));
+        break;
+    }
+
+    closedir(dir);
+    return node;
+}
+
+/* Run on the cores of node. Threads started later (the CQ poller and the
+ * log applier) inherit the mask. */
+void pin_to_node(int node)
+{
+    char path[64];
+    FILE *f;
+    cpu_set_t set;
+    int lo, hi;
+    char sep;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+            node);
+    if ((f = fopen(path, "r")) == NULL) {
+        perror(path);
+        return;
+    }
+
+    // the list looks like 0-7,16-23
+    CPU_ZERO(&set);
+    while (fscanf(f, "%d", &lo) == 1) {
+        hi = lo;
+        sep = fgetc(f);
+        if (sep == '-') {
+            if (fscanf(f, "%d", &hi) != 1)
+                break;
+            sep = fgetc(f);
+        }
+        for (int cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, &set);
+        if (sep != ',')
+            break;
+    }
+    fclose(f);
+
+    if (CPU_COUNT(&set) == 0 || sched_setaffinity(0, sizeof(set), &set) != 0)
+        fprintf(stderr, "Could not pin threads to node %d\n", node);
     else
-	port = DEFAULT_PORT;
+        LOG(1, ("pinned to the %d cores of node %d\n", CPU_COUNT(&set), node));
+}
+
+int main(int argc, char **argv)
+{
+    const char *port = DEFAULT_PORT;
+    size_t cap = RMEM_DEFAULT_CAP;
+    size_t page_size = 0;
+    int node = nic_numa_node();
+    int nchan_pollers = 0;
+    const char *tcp_port = NULL;
+    int shm = 0;
+    char local_path[108];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:s:H:N:P:T:mR:")) != -1) {
+        switch (opt) {
+            case 'c':
+                cap = parse_size(optarg);
+                break;
+            case 's':
+                pool_size = parse_size(optarg);
+                break;
+            case 'H':
+                page_size = parse_size(optarg);
+                if (page_size != (2 << 20) && page_size != (1 << 30))
+                    usage(argv[0]);
+                break;
+            case 'N':
+                node = atoi(optarg);
+                break;
+            case 'P':
+                nchan_pollers = atoi(optarg);
+                break;
+            case 'T':
+                tcp_port = optarg;
+                break;
+            case 'm':
+                shm = 1;
+                break;
+            case 'R':
+                rmem_chain_start(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (optind < argc)
+	port = argv[optind];
+    // the memory file is made of ordinary pages
+    if (shm && page_size != 0)
+        usage(argv[0]);
 
     write_pid(port);
 
     LOG(1, ("starting rmem-server\n"));
-    init_rmem_table(&rmem);
+    if (node >= 0)
+        pin_to_node(node);
+
+    init_rmem_table(&rmem, cap);
+    rmem.page_size = page_size;
+    rmem.numa_node = node;
+    rmem.seg_added = register_segment;
+    rmem.seg_removed = deregister_segment;
+    if (shm)
+        TEST_Z((rmem.fd = memfd_create("rmem", 0)) >= 0);
     pthread_mutex_init(&alloc_mutex, NULL);
+    rmem_log_init(&rmem, &alloc_mutex);
 
     stats_init();
     set_ctrlc_handler();
 
+    snprintf(local_path, sizeof(local_path), RMEM_LOCAL_SOCKET, port);
+
+    if ((tcp_port != NULL || shm) && !have_rdma_devices()) {
+        LOG(1, ("no RDMA devices, serving TCP and local clients only\n"));
+        if (tcp_port != NULL)
+            rmem_tcp_start(tcp_port, &rmem, &alloc_mutex);
+        if (shm)
+            rmem_local_start(local_path, &rmem, &alloc_mutex);
+        printf("waiting for connections. interrupt (^C) to exit.\n");
+        rmem_tcp_join();
+        return 0;
+    }
+
     rc_init(
             on_pre_conn,
             on_connection,
             on_completion,
             on_disconnect);
 
+    // connections only create QPs, the memory is registered up front with
+    // every device; the listener accepts connections on all of them
+    rc_open_device();
+    ndevices = rc_ndevices();
+    start_pollers(nchan_pollers);
+    if (tcp_port != NULL)
+        rmem_tcp_start(tcp_port, &rmem, &alloc_mutex);
+    if (shm)
+        rmem_local_start(local_path, &rmem, &alloc_mutex);
+
     printf("waiting for connections. interrupt (^C) to exit.\n");
 
     rc_server_loop(port);
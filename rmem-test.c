@@ -1,4 +1,5 @@
 #include "rmem_table.h"
+#include "shadow_pool.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,9 +9,9 @@
 int main(void)
 {
     struct rmem_table rmem;
-    char *data1, *data2, *data3, *data4;
+    char *data1, *data2, *data3, *data4, *data5;
 
-    init_rmem_table(&rmem);
+    init_rmem_table(&rmem, RMEM_DEFAULT_CAP);
 
     data1 = rmem_table_alloc(&rmem, 100, 1);
     data2 = rmem_table_alloc(&rmem, 50, 2);
@@ -36,6 +37,33 @@ int main(void)
     assert(data3 == rmem_table_lookup(&rmem, 3));
     assert(data4 == rmem_table_lookup(&rmem, 4));
 
+    data5 = rmem_table_alloc(&rmem, 120, 5);
+    assert(rmem_table_swap(&rmem, data3, data5) == 0);
+    assert(data5 == rmem_table_lookup(&rmem, 3));
+    assert(data3 == rmem_table_lookup(&rmem, 5));
+    assert(rmem_table_swap(&rmem, data1, data3) != 0);
+
+    struct shadow_pool pool;
+    char *slots = rmem_table_alloc(&rmem, 4 * POOL_SLOT_SIZE, RMEM_POOL_TAG);
+    shadow_pool_init(&pool, slots, 4 * POOL_SLOT_SIZE);
+    char *lease1 = shadow_pool_lease(&pool, POOL_SLOT_SIZE + 1);
+    char *lease2 = shadow_pool_lease(&pool, POOL_SLOT_SIZE);
+    assert(lease1 == slots && lease2 == slots + 2 * POOL_SLOT_SIZE);
+    assert(shadow_pool_lease(&pool, 2 * POOL_SLOT_SIZE) == NULL);
+    shadow_pool_release(&pool, lease1, POOL_SLOT_SIZE + 1);
+    assert(shadow_pool_lease(&pool, 2 * POOL_SLOT_SIZE) == slots);
+
+    // a block that doesn't fit the first segment starts a new one, which
+    // goes away again once the block is freed
+    assert(rmem.nsegs == 1);
+    char *big = rmem_table_alloc(&rmem, RMEM_SEGMENT_SIZE, 6);
+    assert(rmem.nsegs == 2 && big - sizeof(void *) == (char *) rmem.segs[1].start);
+    memset(big, '6', RMEM_SEGMENT_SIZE);
+    char *small = rmem_table_alloc(&rmem, 100, 7);
+    assert(small < (char *) rmem.segs[1].start);
+    rmem_table_free(&rmem, big);
+    assert(rmem.nsegs == 1);
+
     dump_rmem_table(&rmem);
     free_rmem_table(&rmem);
 
@@ -0,0 +1,399 @@
+#include "rmem_chain.h"
+#include "common.h"
+#include "messages.h"
+#include "data/hash.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include "utils/log.h"
+#include "utils/error.h"
+
+/* Tags allocated since the last forwarded commit */
+struct chain_alloc {
+    tag_t tag;
+    size_t size;
+};
+
+static char *s_host;
+static char *s_port;
+static int s_fd = -1;
+/* Forwards go out, and are applied downstream, in commit order */
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct chain_alloc *s_allocs;
+static size_t s_nallocs;
+static size_t s_max_allocs;
+
+static char *s_buf;
+static size_t s_buf_size;
+
+/* A transaction the successor did not acknowledge. It is sent again before
+ * anything else; applying one twice leaves the same state. */
+static char *s_held;
+static size_t s_held_size;
+static uint64_t s_held_len;
+static uint64_t s_held_n;
+static int s_holding;
+
+void rmem_chain_start(const char *successor)
+{
+    char *colon;
+
+    TEST_Z(s_host = strdup(successor));
+    colon = strrchr(s_host, ':');
+    CHECK_ERROR(colon == NULL,
+            ("Failure: successor should be host:port, not %s\n", successor));
+    *colon = '\0';
+    s_port = colon + 1;
+
+    LOG(1, ("forwarding commits to %s:%s\n", s_host, s_port));
+}
+
+int rmem_chain_enabled(void)
+{
+    return s_host != NULL;
+}
+
+void rmem_chain_note_alloc(tag_t tag, size_t size)
+{
+    if (s_host == NULL)
+        return;
+
+    if (s_nallocs == s_max_allocs) {
+        s_max_allocs = s_max_allocs ? 2 * s_max_allocs : 256;
+        TEST_Z(s_allocs = realloc(s_allocs,
+                    s_max_allocs * sizeof(*s_allocs)));
+    }
+    s_allocs[s_nallocs].tag = tag;
+    s_allocs[s_nallocs++].size = size;
+}
+
+/* Connect to the successor's TCP front end, which opens with its tag map */
+static int chain_connect(void)
+{
+    struct addrinfo hints, *addr;
+    struct tcp_frame frame;
+    struct message msg;
+    char skip[4096];
+    int one = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(s_host, s_port, &hints, &addr) != 0)
+        return -1;
+
+    s_fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (s_fd < 0 || connect(s_fd, addr->ai_addr, addr->ai_addrlen) != 0) {
+        LOG(1, ("could not reach successor %s:%s: %s\n", s_host, s_port,
+                    strerror(errno)));
+        freeaddrinfo(addr);
+        if (s_fd >= 0)
+            close(s_fd);
+        s_fd = -1;
+        return -1;
+    }
+    freeaddrinfo(addr);
+    setsockopt(s_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (tcp_read_full(s_fd, &frame, sizeof(frame)) ||
+            frame.len > sizeof(msg) ||
+            tcp_read_full(s_fd, &msg, frame.len))
+        goto fail;
+    while (frame.payload > 0) {
+        size_t n = MIN(frame.payload, sizeof(skip));
+
+        if (tcp_read_full(s_fd, skip, n))
+            goto fail;
+        frame.payload -= n;
+    }
+    return 0;
+
+fail:
+    close(s_fd);
+    s_fd = -1;
+    return -1;
+}
+
+/* Send a transaction to the successor and wait until it is applied down
+ * the chain. Caller holds s_lock. */
+static int forward(void *buf, uint64_t len, uint64_t nentries)
+{
+    struct message msg;
+    struct tcp_frame frame;
+    struct iovec iov[3];
+
+    if (s_fd < 0 && chain_connect() != 0)
+        return -1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.id = MSG_CHAIN;
+    msg.data.chain.nentries = nentries;
+    frame.len = msg_len(&msg);
+    frame.pad = 0;
+    frame.payload = len;
+
+    iov[0] = (struct iovec){ &frame, sizeof(frame) };
+    iov[1] = (struct iovec){ &msg, frame.len };
+    iov[2] = (struct iovec){ buf, len };
+    if (tcp_writev_full(s_fd, iov, 3) ||
+            tcp_read_full(s_fd, &frame, sizeof(frame)) ||
+            frame.len > sizeof(msg) || frame.payload != 0 ||
+            tcp_read_full(s_fd, &msg, frame.len)) {
+        LOG(1, ("lost successor %s:%s\n", s_host, s_port));
+        close(s_fd);
+        s_fd = -1;
+        return -1;
+    }
+
+    return msg.id != MSG_TXN_ACK || msg.data.memresp.error;
+}
+
+/* Keep a transaction the successor did not take. Caller holds s_lock. */
+static void hold(void *buf, uint64_t len, uint64_t nentries)
+{
+    if (len > s_held_size) {
+        s_held_size = len;
+        TEST_Z(s_held = realloc(s_held, s_held_size));
+    }
+    memcpy(s_held, buf, len);
+    s_held_len = len;
+    s_held_n = nentries;
+    s_holding = 1;
+}
+
+/* Bring the successor up to date before a new transaction goes down.
+ * Caller holds s_lock. */
+static int resend(void)
+{
+    if (!s_holding)
+        return 0;
+    if (forward(s_held, s_held_len, s_held_n) != 0)
+        return -1;
+
+    LOG(1, ("successor %s:%s caught up\n", s_host, s_port));
+    s_holding = 0;
+    return 0;
+}
+
+static char *chain_buf(size_t len)
+{
+    if (len > s_buf_size) {
+        s_buf_size = len > 2 * s_buf_size ? len : 2 * s_buf_size;
+        TEST_Z(s_buf = realloc(s_buf, s_buf_size));
+    }
+    return s_buf;
+}
+
+int rmem_chain_commit(struct rmem_table *rmem, pthread_mutex_t *table_mutex,
+        struct rmem_txn_list *list)
+{
+    struct list_head *node;
+    struct chain_entry *entries;
+    uint64_t n = 0, max, data = 0;
+    char *buf, *p;
+    int err;
+
+    if (s_host == NULL) {
+        TEST_NZ(pthread_mutex_lock(table_mutex));
+        txn_commit(rmem, list);
+        TEST_NZ(pthread_mutex_unlock(table_mutex));
+        return 0;
+    }
+
+    // the successor would miss what it did not take, stop until it has it
+    TEST_NZ(pthread_mutex_lock(&s_lock));
+    if (resend() != 0) {
+        TEST_NZ(pthread_mutex_unlock(&s_lock));
+        return -1;
+    }
+    TEST_NZ(pthread_mutex_lock(table_mutex));
+
+    max = s_nallocs;
+    for (node = list->head.next; node != &list->head; node = node->next) {
+        struct rmem_txn *txn = (struct rmem_txn *)node;
+
+        max++;
+        if (txn->type != TXN_FREE)
+            data += txn->size;
+    }
+    buf = chain_buf(max * sizeof(*entries) + data);
+    entries = (struct chain_entry *)buf;
+
+    for (size_t i = 0; i < s_nallocs; i++)
+        entries[n++] = (struct chain_entry){ CHAIN_ALLOC, s_allocs[i].tag,
+            0, s_allocs[i].size };
+    s_nallocs = 0;
+
+    // blocks are named by tag, which a free drops
+    for (node = list->head.next; node != &list->head; node = node->next) {
+        struct rmem_txn *txn = (struct rmem_txn *)node;
+        struct chain_entry *e = &entries[n];
+
+        switch (txn->type) {
+            case TXN_CP:
+            case TXN_SWAP:
+                if (rmem_table_tag_of(rmem, txn->dst, &e->tag) == 0) {
+                    e->op = CHAIN_WRITE;
+                    e->off = 0;
+                    e->size = txn->size;
+                    n++;
+                }
+                break;
+            case TXN_FREE:
+                if (rmem_table_tag_of(rmem, txn->src, &e->tag) == 0) {
+                    e->op = CHAIN_FREE;
+                    e->off = e->size = 0;
+                    n++;
+                }
+                break;
+        }
+    }
+
+    txn_commit(rmem, list);
+
+    /* the data as committed, a swap moved the tag to the new block */
+    p = (char *)&entries[n];
+    for (uint64_t i = 0; i < n; i++) {
+        char *block;
+
+        if (entries[i].op != CHAIN_WRITE)
+            continue;
+        block = rmem_table_lookup(rmem, entries[i].tag);
+        if (block == NULL) {
+            // freed by the same txn
+            entries[i].size = 0;
+            continue;
+        }
+        memcpy(p, block + entries[i].off, entries[i].size);
+        p += entries[i].size;
+    }
+    TEST_NZ(pthread_mutex_unlock(table_mutex));
+
+    err = n > 0 ? forward(buf, p - buf, n) : 0;
+    if (err != 0)
+        hold(buf, p - buf, n);
+    TEST_NZ(pthread_mutex_unlock(&s_lock));
+
+    return err;
+}
+
+/* Does a write of size bytes at off fit the block of tag, which may be one
+ * the txn allocates (in fresh)? */
+static int write_fits(struct rmem_table *rmem, hash_t fresh, tag_t tag,
+        uint64_t off, uint64_t size)
+{
+    struct chain_entry *alloc = hash_get_item(fresh, tag);
+    char *block;
+
+    if (alloc != NULL)
+        return size <= alloc->size && off <= alloc->size - size;
+    block = rmem_table_lookup(rmem, tag);
+    return block != NULL && rmem_table_contains(rmem, block + off, size);
+}
+
+/* Check the txn's writes against the blocks they go to, then make its
+ * allocations. Nothing is allocated or written unless all of it fits. */
+static int chain_check(struct rmem_table *rmem, struct chain_entry *entries,
+        uint64_t n, uint64_t data)
+{
+    hash_t fresh = hash_create(NUM_BUCKETS);
+    uint64_t used = 0, i;
+    int err = 0;
+
+    for (i = 0; i < n && err == 0; i++) {
+        struct chain_entry *e = &entries[i];
+
+        switch (e->op) {
+            case CHAIN_ALLOC:
+                // an existing tag keeps its block, as for a client
+                if (rmem_table_lookup(rmem, e->tag) == NULL &&
+                        hash_get_item(fresh, e->tag) == NULL)
+                    hash_insert_item(fresh, e->tag, e);
+                break;
+            case CHAIN_WRITE:
+                if (e->size > data - used || (e->size > 0 &&
+                            !write_fits(rmem, fresh, e->tag, e->off,
+                                e->size)))
+                    err = -1;
+                used += e->size;
+                break;
+            case CHAIN_FREE:
+                break;
+            default:
+                err = -1;
+        }
+    }
+    if (err == 0 && used != data)
+        err = -1;
+
+    // the table may still run out of room, undo what was allocated
+    for (i = 0; i < n && err == 0; i++) {
+        if (entries[i].op != CHAIN_ALLOC ||
+                hash_get_item(fresh, entries[i].tag) != &entries[i])
+            continue;
+        if (rmem_table_alloc(rmem, entries[i].size, entries[i].tag) == NULL)
+            err = -1;
+    }
+    while (err != 0 && i-- > 0) {
+        char *block;
+
+        if (entries[i].op == CHAIN_ALLOC &&
+                hash_get_item(fresh, entries[i].tag) == &entries[i] &&
+                (block = rmem_table_lookup(rmem, entries[i].tag)) != NULL)
+            rmem_table_free(rmem, block);
+    }
+    hash_destroy(fresh);
+
+    return err;
+}
+
+int rmem_chain_apply(struct rmem_table *rmem, pthread_mutex_t *table_mutex,
+        void *buf, uint64_t len, uint64_t nentries)
+{
+    struct chain_entry *entries = buf;
+    char *p;
+    int err;
+
+    if (nentries > len / sizeof(*entries))
+        return -1;
+
+    TEST_NZ(pthread_mutex_lock(&s_lock));
+    if (s_host != NULL && resend() != 0) {
+        TEST_NZ(pthread_mutex_unlock(&s_lock));
+        return -1;
+    }
+    TEST_NZ(pthread_mutex_lock(table_mutex));
+
+    err = chain_check(rmem, entries, nentries,
+            len - nentries * sizeof(*entries));
+    p = (char *)&entries[nentries];
+    for (uint64_t i = 0; i < nentries && err == 0; i++) {
+        struct chain_entry *e = &entries[i];
+        char *block;
+
+        switch (e->op) {
+            case CHAIN_WRITE:
+                if (e->size == 0)
+                    break;
+                block = rmem_table_lookup(rmem, e->tag);
+                memcpy(block + e->off, p, e->size);
+                p += e->size;
+                break;
+            case CHAIN_FREE:
+                if ((block = rmem_table_lookup(rmem, e->tag)) != NULL)
+                    rmem_table_free(rmem, block);
+                break;
+        }
+    }
+    TEST_NZ(pthread_mutex_unlock(table_mutex));
+
+    if (err == 0 && s_host != NULL && (err = forward(buf, len, nentries)))
+        hold(buf, len, nentries);
+    TEST_NZ(pthread_mutex_unlock(&s_lock));
+
+    return err;
+}
@@ -0,0 +1,38 @@
+#ifndef RMEM_CHAIN_H
+#define RMEM_CHAIN_H
+
+#include <pthread.h>
+
+#include "rmem_table.h"
+
+/* Forward every commit to the server at successor ("host:port", its TCP
+ * front end) and only report it done once that server, and through it the
+ * rest of the chain, has applied it. A commit goes down as one MSG_CHAIN
+ * with the blocks it wrote, the tags allocated since the last one and the
+ * tags it freed, so each server adds one round trip whatever its size.
+ * Start the chain tail first; a successor only ever gets what is committed
+ * after it joined. A transaction the successor does not take stays applied
+ * here and is sent again before the next one, which is refused until it
+ * goes through. Clients of a chained server cannot attach a redo log, its
+ * records are applied behind their commits. */
+void rmem_chain_start(const char *successor);
+
+/* Is this server forwarding to a successor? */
+int rmem_chain_enabled(void);
+
+/* Record an allocation made for a client, forwarded with the next commit.
+ * The caller holds table_mutex. */
+void rmem_chain_note_alloc(tag_t tag, size_t size);
+
+/* Apply list to rmem and pass it down the chain. Returns nonzero if it
+ * was refused, or if the successor did not take it; it stays applied here
+ * then. */
+int rmem_chain_commit(struct rmem_table *rmem, pthread_mutex_t *table_mutex,
+        struct rmem_txn_list *list);
+
+/* Apply a transaction forwarded by the predecessor, the payload of a
+ * MSG_CHAIN, and pass it on. Returns nonzero if it was refused. */
+int rmem_chain_apply(struct rmem_table *rmem, pthread_mutex_t *table_mutex,
+        void *buf, uint64_t len, uint64_t nentries);
+
+#endif
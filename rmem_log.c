@@ -0,0 +1,187 @@
+#include "rmem_log.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "utils/log.h"
+
+/* Maximum number of logs (clients) applied at the same time */
+#define MAX_LOGS 64
+/* How long the applier sleeps when no log has anything to apply */
+#define LOG_IDLE_US 10
+
+struct rmem_log {
+    struct redo_log_hdr *hdr;
+    char *ring;
+    pthread_mutex_t mutex;
+};
+
+static struct rmem_table *s_rmem;
+static pthread_mutex_t *s_table_mutex;
+
+static pthread_mutex_t s_logs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct rmem_log *s_logs[MAX_LOGS];
+static pthread_t s_applier;
+
+static void ring_read(struct rmem_log *log, uint64_t pos, void *dst, size_t len)
+{
+    uint64_t off = pos % log->hdr->size;
+    size_t first = MIN(len, log->hdr->size - off);
+
+    memcpy(dst, log->ring + off, first);
+    memcpy(dst + first, log->ring, len - first);
+}
+
+/* Apply every committed record, returns the number of records applied.
+ * Must be called with log->mutex held. */
+static int apply_log(struct rmem_log *log)
+{
+    struct redo_log_rec rec;
+    uint64_t head = log->hdr->head;
+    uint64_t tail = log->hdr->tail;
+    int napplied = 0;
+
+    if (tail == head)
+        return 0;
+
+    // don't read any record before we have seen the head that covers it
+    __sync_synchronize();
+
+    TEST_NZ(pthread_mutex_lock(s_table_mutex));
+    if (head - tail > log->hdr->size) {
+        fprintf(stderr, "Dropping log from %lu, head %lu is past the ring\n",
+                tail, head);
+        tail = head;
+    }
+    while (tail < head) {
+        // a torn or corrupt header must not send us past the published
+        // records
+        if (head - tail < sizeof(rec)) {
+            fprintf(stderr, "Dropping log from %lu, short record\n", tail);
+            tail = head;
+            break;
+        }
+        ring_read(log, tail, &rec, sizeof(rec));
+        if (rec.size > head - tail - sizeof(rec) ||
+                REDO_LOG_REC_SIZE(rec.size) > head - tail ||
+                !rmem_table_contains(s_rmem, (void *) rec.dst, rec.size)) {
+            fprintf(stderr, "Dropping log from %lu, bad record dst: %lx "
+                    "size: %lu\n", tail, rec.dst, rec.size);
+            tail = head;
+            break;
+        }
+        ring_read(log, tail + sizeof(rec), (void *) rec.dst, rec.size);
+        tail += REDO_LOG_REC_SIZE(rec.size);
+        napplied++;
+    }
+    TEST_NZ(pthread_mutex_unlock(s_table_mutex));
+
+    // the data must be in place before the client sees the new tail
+    __sync_synchronize();
+    log->hdr->tail = tail;
+
+    LOG(8, ("applied %d log records, tail: %lu\n", napplied, tail));
+
+    return napplied;
+}
+
+static void *log_applier(void *arg)
+{
+    int napplied;
+
+    while (1) {
+        napplied = 0;
+
+        TEST_NZ(pthread_mutex_lock(&s_logs_mutex));
+        for (int i = 0; i < MAX_LOGS; i++) {
+            if (s_logs[i] == NULL)
+                continue;
+            TEST_NZ(pthread_mutex_lock(&s_logs[i]->mutex));
+            napplied += apply_log(s_logs[i]);
+            TEST_NZ(pthread_mutex_unlock(&s_logs[i]->mutex));
+        }
+        TEST_NZ(pthread_mutex_unlock(&s_logs_mutex));
+
+        if (napplied == 0)
+            usleep(LOG_IDLE_US);
+    }
+
+    return NULL;
+}
+
+void rmem_log_init(struct rmem_table *rmem, pthread_mutex_t *table_mutex)
+{
+    s_rmem = rmem;
+    s_table_mutex = table_mutex;
+
+    TEST_NZ(pthread_create(&s_applier, NULL, log_applier, NULL));
+}
+
+void rmem_log_drain(struct rmem_log *log)
+{
+    TEST_NZ(pthread_mutex_lock(&log->mutex));
+    apply_log(log);
+    TEST_NZ(pthread_mutex_unlock(&log->mutex));
+}
+
+struct rmem_log *rmem_log_attach(struct redo_log_hdr *region, size_t size,
+        int fresh)
+{
+    struct rmem_log *log;
+    int i, free_slot = -1;
+
+    TEST_Z(log = (struct rmem_log *) malloc(sizeof(struct rmem_log)));
+    TEST_NZ(pthread_mutex_init(&log->mutex, NULL));
+    log->hdr = region;
+    log->ring = (char *) (region + 1);
+
+    // the applier waits while the ring is reset or recovered
+    TEST_NZ(pthread_mutex_lock(&s_logs_mutex));
+    for (i = 0; i < MAX_LOGS; i++) {
+        if (s_logs[i] == NULL && free_slot < 0)
+            free_slot = i;
+        else if (s_logs[i] != NULL && s_logs[i]->hdr == region)
+            break;
+    }
+    if (i < MAX_LOGS || free_slot < 0) {
+        TEST_NZ(pthread_mutex_unlock(&s_logs_mutex));
+        if (i < MAX_LOGS) {
+            LOG(1, ("Redo log already attached\n"));
+        } else {
+            LOG(1, ("Too many redo logs\n"));
+        }
+        pthread_mutex_destroy(&log->mutex);
+        free(log);
+        return NULL;
+    }
+
+    if (fresh) {
+        memset(region, 0, sizeof(*region));
+        region->size = size;
+    } else {
+        // replay whatever the last owner committed before it went away
+        LOG(5, ("recovering log, head: %lu tail: %lu\n",
+                    region->head, region->tail));
+        rmem_log_drain(log);
+    }
+    s_logs[free_slot] = log;
+    TEST_NZ(pthread_mutex_unlock(&s_logs_mutex));
+
+    return log;
+}
+
+void rmem_log_detach(struct rmem_log *log)
+{
+    TEST_NZ(pthread_mutex_lock(&s_logs_mutex));
+    for (int i = 0; i < MAX_LOGS; i++) {
+        if (s_logs[i] == log)
+            s_logs[i] = NULL;
+    }
+    TEST_NZ(pthread_mutex_unlock(&s_logs_mutex));
+
+    rmem_log_drain(log);
+
+    pthread_mutex_destroy(&log->mutex);
+    free(log);
+}
@@ -0,0 +1,28 @@
+#ifndef RMEM_LOG_H
+#define RMEM_LOG_H
+
+#include <pthread.h>
+
+#include "rmem_table.h"
+#include "redo_log.h"
+
+struct rmem_log;
+
+/* Start the background thread that applies committed log records. Records
+ * are copied into the table with table_mutex held. */
+void rmem_log_init(struct rmem_table *rmem, pthread_mutex_t *table_mutex);
+
+/* Start applying the log stored at region. Set fresh for a region that has
+ * just been allocated, otherwise the ring is left as it was and every record
+ * committed before a client failure is applied before returning. Returns
+ * NULL if the region is already attached: a ring has one writer. */
+struct rmem_log *rmem_log_attach(struct redo_log_hdr *region, size_t size,
+        int fresh);
+
+/* Apply everything committed so far and stop watching the log */
+void rmem_log_detach(struct rmem_log *log);
+
+/* Apply everything committed so far */
+void rmem_log_drain(struct rmem_log *log);
+
+#endif
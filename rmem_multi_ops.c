@@ -48,3 +48,49 @@ int txn_multi_add_cp(struct rmem_txn_list *list, uint64_t *dsts, uint64_t *srcs,
     }
     return 0;
 }
+
+int txn_multi_add_swap(struct rmem_table *rmem, struct rmem_txn_list *list,
+	uint64_t *dsts, uint64_t *srcs, uint64_t *sizes, int n)
+{
+    int err;
+    for (int i = 0; i < n; i++) {
+	if (!rmem_table_can_swap(rmem, (void *) dsts[i], (void *) srcs[i]))
+	    return -1;
+	err = txn_list_add_swap(list,
+		(void *) dsts[i], (void *) srcs[i], sizes[i]);
+	if (err != 0)
+	    return err;
+    }
+    return 0;
+}
+
+/* Queue every entry of a commit descriptor. Swaps are validated here so the
+ * commit itself can't fail half way. */
+int txn_add_desc(struct rmem_table *rmem, struct rmem_txn_list *list,
+	struct txn_desc_entry *entries, uint64_t n)
+{
+    int err;
+    for (uint64_t i = 0; i < n; i++) {
+	void *dst = (void *) entries[i].dst;
+	void *src = (void *) entries[i].src;
+
+	switch (entries[i].op) {
+	case DESC_CP:
+	    err = txn_list_add_cp(list, dst, src, entries[i].size);
+	    break;
+	case DESC_FREE:
+	    err = txn_list_add_free(list, src);
+	    break;
+	case DESC_SWAP:
+	    if (!rmem_table_can_swap(rmem, dst, src))
+		return -1;
+	    err = txn_list_add_swap(list, dst, src, entries[i].size);
+	    break;
+	default:
+	    return -1;
+	}
+	if (err != 0)
+	    return err;
+    }
+    return 0;
+}
@@ -2,6 +2,7 @@
 #define __RMEM_MULTI_OPS__
 
 #include "rmem_table.h"
+#include "messages.h"
 
 int rmem_multi_alloc(struct rmem_table *rmem, uint64_t *addrs, uint64_t size,
 	uint32_t *tags, int n);
@@ -10,5 +11,9 @@ int rmem_multi_lookup(struct rmem_table *rmem, uint64_t *addrs,
 int txn_multi_add_free(struct rmem_txn_list *list, uint64_t *addrs, int n);
 int txn_multi_add_cp(struct rmem_txn_list *list, uint64_t *dsts, uint64_t *srcs,
 	uint64_t *sizes, int n);
+int txn_multi_add_swap(struct rmem_table *rmem, struct rmem_txn_list *list,
+	uint64_t *dsts, uint64_t *srcs, uint64_t *sizes, int n);
+int txn_add_desc(struct rmem_table *rmem, struct rmem_txn_list *list,
+	struct txn_desc_entry *entries, uint64_t n);
 
 #endif
@@ -3,9 +3,17 @@
 
 #include <stdio.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <assert.h>
 #include "utils/log.h"
 
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+
 #define HASH_SIZE 10000
 #define DATA_OFFSET (sizeof(struct alloc_entry *))
 
@@ -70,16 +78,44 @@ static inline int list_empty(struct list_head *list)
     return (list->next == list);
 }
 
-void init_rmem_table(struct rmem_table *rmem)
+void init_rmem_table(struct rmem_table *rmem, size_t cap)
 {
     int i;
 
-    rmem->mem = mmap(NULL, RMEM_SIZE, PROT_READ | PROT_WRITE,
-            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (rmem->mem == MAP_FAILED) {
+    void *map;
+    size_t lead;
+
+    // only reserve the address space, segments are backed as we grow. The
+    // start is aligned so that segments can later be backed by hugepages.
+    rmem->cap = cap;
+    map = mmap(NULL, cap + RMEM_MAX_PAGE_SIZE, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
         fprintf(stderr, "Failed to map remote memory\n");
         exit(EXIT_FAILURE);
     }
+    lead = RMEM_MAX_PAGE_SIZE - (uintptr_t)map % RMEM_MAX_PAGE_SIZE;
+    lead %= RMEM_MAX_PAGE_SIZE;
+    if (lead > 0)
+        munmap(map, lead);
+    munmap(map + lead + cap, RMEM_MAX_PAGE_SIZE - lead);
+    rmem->mem = map + lead;
+
+    rmem->page_size = 0;
+    rmem->numa_node = -1;
+    rmem->fd = -1;
+
+    rmem->mapped = 0;
+    rmem->nsegs = 0;
+    rmem->seg_gen = 0;
+    rmem->seg_added = NULL;
+    rmem->seg_removed = NULL;
+    rmem->segs = calloc(cap / RMEM_SEGMENT_SIZE + 1, sizeof(*rmem->segs));
+    if (rmem->segs == NULL) {
+	fprintf(stderr, "Failed to allocate segment table\n");
+	exit(EXIT_FAILURE);
+    }
+
     list_init(&rmem->list);
     list_init(&rmem->free_list);
     rmem->alloc_size = 0;
@@ -96,12 +132,141 @@ void init_rmem_table(struct rmem_table *rmem)
     rmem->nblocks = 0;
 }
 
+/* Put the reserved range back the way init_rmem_table left it */
+static void unback_range(struct rmem_table *rmem, void *start, size_t size)
+{
+    if (rmem->fd >= 0) {
+        mmap(start, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS |
+                MAP_NORESERVE | MAP_FIXED, -1, 0);
+        // segments go away from the end, so the file just gets shorter
+        if (ftruncate(rmem->fd, start - rmem->mem) != 0)
+            perror("ftruncate");
+    } else if (rmem->page_size == 0) {
+        madvise(start, size, MADV_DONTNEED);
+        mprotect(start, size, PROT_NONE);
+    } else {
+        mmap(start, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS |
+                MAP_NORESERVE | MAP_FIXED, -1, 0);
+    }
+}
+
+static int back_range(struct rmem_table *rmem, void *start, size_t size)
+{
+    if (rmem->fd >= 0) {
+        off_t off = start - rmem->mem;
+
+        if (ftruncate(rmem->fd, off + size) != 0) {
+            perror("ftruncate");
+            return -1;
+        }
+        if (mmap(start, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                    rmem->fd, off) == MAP_FAILED) {
+            perror("mmap");
+            unback_range(rmem, start, size);
+            return -1;
+        }
+    } else if (rmem->page_size == 0) {
+        if (mprotect(start, size, PROT_READ | PROT_WRITE) != 0) {
+            perror("mprotect");
+            return -1;
+        }
+    } else {
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB |
+            (__builtin_ctzl(rmem->page_size) << MAP_HUGE_SHIFT);
+
+        if (mmap(start, size, PROT_READ | PROT_WRITE, flags, -1, 0) ==
+                MAP_FAILED) {
+            perror("mmap (are enough hugepages reserved?)");
+            unback_range(rmem, start, size);
+            return -1;
+        }
+    }
+
+    // pages are only placed when first touched, which is after this
+    if (rmem->numa_node >= 0) {
+        unsigned long mask[16] = { 0 };
+
+        mask[rmem->numa_node / (8 * sizeof(long))] |=
+            1UL << (rmem->numa_node % (8 * sizeof(long)));
+        if (syscall(SYS_mbind, start, size, MPOL_BIND, mask,
+                    8 * sizeof(mask), 0) != 0)
+            perror("mbind");
+    }
+
+    return 0;
+}
+
+static int add_segment(struct rmem_table *rmem, size_t min_size)
+{
+    struct rmem_segment *seg;
+    size_t unit = (rmem->page_size > RMEM_SEGMENT_SIZE) ?
+        rmem->page_size : RMEM_SEGMENT_SIZE;
+    size_t size = unit * INT_DIV_CEIL(min_size, unit);
+
+    if (rmem->mapped + size > rmem->cap)
+        return -1;
+
+    seg = &rmem->segs[rmem->nsegs];
+    seg->start = rmem->mem + rmem->mapped;
+    seg->size = size;
+    seg->priv = NULL;
+
+    if (back_range(rmem, seg->start, size) != 0)
+        return -1;
+
+    rmem->nsegs++;
+    rmem->mapped += size;
+    rmem->seg_gen++;
+    if (rmem->seg_added)
+        rmem->seg_added(rmem, seg);
+
+    LOG(1, ("added segment %zu at %p (%zu bytes)\n",
+                rmem->nsegs - 1, seg->start, size));
+    return 0;
+}
+
+/* Give the last segment back to the OS */
+static void remove_segment(struct rmem_table *rmem)
+{
+    struct rmem_segment *seg = &rmem->segs[rmem->nsegs - 1];
+
+    if (rmem->seg_removed)
+        rmem->seg_removed(rmem, seg);
+
+    unback_range(rmem, seg->start, seg->size);
+
+    LOG(1, ("removed segment %zu at %p\n", rmem->nsegs - 1, seg->start));
+
+    rmem->nsegs--;
+    rmem->mapped -= seg->size;
+    rmem->seg_gen++;
+}
+
+/* End of the segment holding ptr */
+static void *segment_end(struct rmem_table *rmem, void *ptr)
+{
+    size_t lo = 0, hi = rmem->nsegs;
+
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (rmem->segs[mid].start <= ptr)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return rmem->segs[lo].start + rmem->segs[lo].size;
+}
+
 void free_rmem_table(struct rmem_table *rmem)
 {
     struct list_head *node = rmem->list.next;
     struct alloc_entry *entry;
 
-    munmap(rmem->mem, RMEM_SIZE);
+    while (rmem->nsegs > 0)
+        remove_segment(rmem);
+    munmap(rmem->mem, rmem->cap);
+    free(rmem->segs);
 
     while (node != &rmem->list) {
         struct list_head *next = node->next;
@@ -179,6 +344,7 @@ static inline void reserve_entry(struct rmem_table *rmem,
         free_entry->tag = 0;
         free_entry->size = free_size;
         free_entry->start = entry->start + req_size;
+        list_init(&free_entry->htable);
         list_insert(&entry->list, &free_entry->list);
         list_insert(last_free, &free_entry->free_list);
         free_node = &free_entry->free_list;
@@ -207,6 +373,27 @@ static struct alloc_entry *find_entry(struct rmem_table *rmem, tag_t tag)
     return NULL;
 }
 
+/* Carve a block off the end of the used memory */
+static struct alloc_entry *append_entry(struct rmem_table *rmem, size_t size)
+{
+    struct alloc_entry *entry;
+
+    TEST_Z(entry = (struct alloc_entry*)malloc(sizeof(struct alloc_entry)));
+    list_append(&rmem->list, &entry->list);
+    entry->free_list.next = &rmem->free_list;
+    entry->free_list.prev = rmem->free_list.prev;
+    entry->start = rmem->mem + rmem->alloc_size;
+    rmem->alloc_size += size;
+    entry->size = size;
+    entry->free = 0;
+    entry->tag = 0;
+    list_init(&entry->htable);
+
+    return entry;
+}
+
+static void release_entry(struct rmem_table *rmem, struct alloc_entry *entry);
+
 void *rmem_table_alloc(struct rmem_table *rmem, size_t size, tag_t tag)
 {
     size_t req_size = size + DATA_OFFSET;
@@ -231,27 +418,35 @@ void *rmem_table_alloc(struct rmem_table *rmem, size_t size, tag_t tag)
         entry = entry_of_free_list(free_node);
         // make sure entry is actually free
         TEST_Z(entry->free);
-        if (entry->size >= req_size)
+        if (entry->size >= req_size &&
+                entry->start + req_size <= segment_end(rmem, entry->start))
             break;
         free_node = free_node->next;
     }
 
     if (free_node == &rmem->free_list) {
-        // make sure we haven't run out of memory
-        if (rmem->alloc_size + req_size > RMEM_SIZE) {
-            LOG(5, ("Out of memory\n"));
-            return NULL;
+        struct alloc_entry *pad = NULL;
+
+        if (rmem->alloc_size + req_size > rmem->mapped) {
+            size_t pad_size = rmem->mapped - rmem->alloc_size;
+
+            // make sure we haven't run out of memory
+            if (add_segment(rmem, req_size) != 0) {
+                LOG(5, ("Out of memory\n"));
+                return NULL;
+            }
+
+            // the block starts the new segment, the rest of the old one
+            // becomes free space
+            if (pad_size > 0)
+                pad = append_entry(rmem, pad_size);
         }
 
-        TEST_Z(entry = (struct alloc_entry*)malloc(sizeof(struct alloc_entry)));
-        list_append(&rmem->list, &entry->list);
-        entry->free_list.next = &rmem->free_list;
-        entry->free_list.prev = free_node->prev;
-        entry->start = rmem->mem + rmem->alloc_size;
-        rmem->alloc_size += req_size;
-        entry->size = req_size;
-        entry->free = 0;
+        entry = append_entry(rmem, req_size);
         entry->tag = tag;
+
+        if (pad != NULL)
+            release_entry(rmem, pad);
     } else {
         entry->tag = tag;
         reserve_entry(rmem, entry, req_size);
@@ -263,13 +458,25 @@ void *rmem_table_alloc(struct rmem_table *rmem, size_t size, tag_t tag)
 
     memcpy(entry->start, &entry, sizeof(struct alloc_entry *));
 
+    // whatever a freed block left there, new blocks read as zeros
+    memset(entry->start + DATA_OFFSET, 0, size);
+
     return entry->start + DATA_OFFSET;
 }
 
+/* Free blocks are only merged within a segment: first fit never places a
+ * block across a segment boundary, so a merged block spanning one could
+ * only be reused up to the boundary. */
+static inline int same_segment(struct rmem_table *rmem,
+        struct alloc_entry *a, struct alloc_entry *b)
+{
+    return segment_end(rmem, a->start) == segment_end(rmem, b->start);
+}
+
 static inline struct alloc_entry *merge_free_blocks(
         struct rmem_table *rmem, struct alloc_entry *entry)
 {
-    struct alloc_entry *prev_entry, *next_entry;
+    struct alloc_entry *prev_entry, *next_entry, *last;
     void *start, *end;
 
     start = entry->start;
@@ -277,7 +484,7 @@ static inline struct alloc_entry *merge_free_blocks(
 
     if (entry->list.prev != &rmem->list) {
         prev_entry = entry_of_list(entry->list.prev);
-        if (prev_entry->free) {
+        if (prev_entry->free && same_segment(rmem, prev_entry, entry)) {
             start = prev_entry->start;
             prev_entry->size = (uintptr_t)end - (uintptr_t)start;
             list_delete(&entry->list);
@@ -303,11 +510,27 @@ static inline struct alloc_entry *merge_free_blocks(
 	list_delete(&entry->htable);
         rmem->alloc_size -= entry->size;
         free(entry);
+
+        // free blocks of earlier segments it was not merged with now end
+        // the table too
+        while (rmem->list.prev != &rmem->list &&
+                (last = entry_of_list(rmem->list.prev))->free) {
+            list_delete(&last->list);
+            list_delete(&last->free_list);
+            list_delete(&last->htable);
+            rmem->alloc_size -= last->size;
+            free(last);
+        }
+        // and the blocks now at the end have no free block after them
+        for (struct list_head *node = rmem->list.prev;
+                node != &rmem->list && !entry_of_list(node)->free;
+                node = node->prev)
+            entry_of_list(node)->free_list.next = &rmem->free_list;
         return NULL;
     }
 
     next_entry = entry_of_list(entry->list.next);
-    if (next_entry->free) {
+    if (next_entry->free && same_segment(rmem, entry, next_entry)) {
         end = next_entry->start + next_entry->size;
         list_delete(&next_entry->list);
         list_delete(&next_entry->free_list);
@@ -356,6 +579,20 @@ void rmem_table_free(struct rmem_table *rmem, void *ptr)
 
     rmem->nblocks--;
 
+    // free blocks must not be found by tag (or re-bucketed by a swap)
+    list_delete(&entry->htable);
+    list_init(&entry->htable);
+
+    release_entry(rmem, entry);
+
+    // hand segments nothing lives in anymore back to the OS
+    while (rmem->nsegs > 0 &&
+            rmem->segs[rmem->nsegs - 1].start >= rmem->mem + rmem->alloc_size)
+        remove_segment(rmem);
+}
+
+static void release_entry(struct rmem_table *rmem, struct alloc_entry *entry)
+{
     entry->free = 1;
     entry->tag = 0;
     //dump_free_list(rmem);
@@ -378,6 +615,64 @@ void *rmem_table_lookup(struct rmem_table *rmem, tag_t tag)
     return entry->start + DATA_OFFSET;
 }
 
+/* Check that [ptr, ptr + size) lies in the memory handed out by the table */
+int rmem_table_contains(struct rmem_table *rmem, void *ptr, size_t size)
+{
+    return ptr >= rmem->mem && size <= rmem->mapped &&
+        ptr - rmem->mem <= rmem->mapped - size;
+}
+
+/* The tag of the live block that starts at ptr. As with rmem_table_free,
+   ptr must be a block's start. Returns -1 for a freed block. */
+int rmem_table_tag_of(struct rmem_table *rmem, void *ptr, tag_t *tag)
+{
+    struct alloc_entry *entry;
+
+    memcpy(&entry, ptr - DATA_OFFSET, sizeof(struct alloc_entry *));
+    if (entry->free)
+        return -1;
+
+    *tag = entry->tag;
+    return 0;
+}
+
+/* Only live blocks of the same size can trade places */
+int rmem_table_can_swap(struct rmem_table *rmem, void *a, void *b)
+{
+    struct alloc_entry *entry_a, *entry_b;
+
+    memcpy(&entry_a, a - DATA_OFFSET, sizeof(struct alloc_entry *));
+    memcpy(&entry_b, b - DATA_OFFSET, sizeof(struct alloc_entry *));
+
+    return !entry_a->free && !entry_b->free && entry_a->size == entry_b->size;
+}
+
+/* Exchange the tags bound to the allocations at a and b, so that a lookup of
+   a's tag returns b and vice versa. Returns -1 (and leaves the table alone)
+   if the blocks can't be swapped. */
+int rmem_table_swap(struct rmem_table *rmem, void *a, void *b)
+{
+    struct alloc_entry *entry_a, *entry_b;
+    tag_t tag;
+
+    if (!rmem_table_can_swap(rmem, a, b))
+        return -1;
+
+    memcpy(&entry_a, a - DATA_OFFSET, sizeof(struct alloc_entry *));
+    memcpy(&entry_b, b - DATA_OFFSET, sizeof(struct alloc_entry *));
+
+    tag = entry_a->tag;
+    entry_a->tag = entry_b->tag;
+    entry_b->tag = tag;
+
+    list_delete(&entry_a->htable);
+    list_delete(&entry_b->htable);
+    list_append(&rmem->htable[entry_a->tag % NUM_BUCKETS], &entry_a->htable);
+    list_append(&rmem->htable[entry_b->tag % NUM_BUCKETS], &entry_b->htable);
+
+    return 0;
+}
+
 void dump_rmem_table(struct rmem_table *rmem)
 {
     struct list_head *iter_node = rmem->list.next;
@@ -468,6 +763,25 @@ int txn_list_add_free(struct rmem_txn_list *list, void *addr)
     return 0;
 }
 
+int txn_list_add_swap(struct rmem_txn_list *list,
+	void *dst, void *src, size_t size)
+{
+    struct rmem_txn *txn;
+
+    txn = (struct rmem_txn*)malloc(sizeof(struct rmem_txn));
+    if (txn == NULL)
+	return -1;
+
+    txn->type = TXN_SWAP;
+    txn->src = src;
+    txn->dst = dst;
+    txn->size = size;
+
+    list_append(&list->head, &txn->list);
+
+    return 0;
+}
+
 void txn_commit(struct rmem_table *rmem, struct rmem_txn_list *list)
 {
     struct rmem_txn *txn;
@@ -482,6 +796,14 @@ void txn_commit(struct rmem_table *rmem, struct rmem_txn_list *list)
 	case TXN_FREE:
 	    rmem_table_free(rmem, txn->src);
 	    break;
+	case TXN_SWAP:
+	    /* swaps are validated when they are added to the list */
+	    if (rmem_table_swap(rmem, txn->dst, txn->src) != 0) {
+		fprintf(stderr, "Cannot swap blocks %p and %p\n",
+			txn->dst, txn->src);
+		abort();
+	    }
+	    break;
 	default:
 	    fprintf(stderr, "Unknown TXN type\n");
 	    abort();
@@ -6,13 +6,26 @@
 
 #include "tag_addr_map.h"
 
-//#define RMEM_SIZE (1 << 15)
-#define RMEM_SIZE (1 << 30)
+/* Default limit on the memory the table will grow to */
+#define RMEM_DEFAULT_CAP (1UL << 34)
+/* The table grows by segments of at least this size */
+#define RMEM_SEGMENT_SIZE (1UL << 26)
+/* Largest supported hugepage, the address space is aligned to it */
+#define RMEM_MAX_PAGE_SIZE (1UL << 30)
 #define MIN_SIZE (2 * sizeof(void*))
 #define NUM_BUCKETS 1024
 
 typedef uint32_t tag_t;
 
+/* A chunk of the address space backed by memory. Allocations never cross
+ * segment boundaries, so a block can always be reached through the
+ * registration of the segment it lives in. */
+struct rmem_segment {
+    void *start;
+    size_t size;
+    void *priv;     /**< owned by the seg_added/seg_removed hooks */
+};
+
 struct list_head {
     struct list_head *next;
     struct list_head *prev;
@@ -30,6 +43,19 @@ struct alloc_entry {
 
 struct rmem_table {
     void *mem;
+    size_t cap;         /**< bytes of address space reserved at mem */
+    size_t mapped;      /**< bytes backed by segments */
+    struct rmem_segment *segs;
+    size_t nsegs;
+    uint32_t seg_gen;   /**< bumped whenever a segment comes or goes */
+    size_t page_size;   /**< hugepage size backing segments, 0 for 4KB pages */
+    int numa_node;      /**< node segments are bound to, -1 for any */
+    int fd;             /**< file segments are mapped from at their offset
+                             from mem, so other processes on the host can
+                             map them too; -1 for anonymous memory */
+    /* called when a segment is added, and before one is given back */
+    void (*seg_added)(struct rmem_table *rmem, struct rmem_segment *seg);
+    void (*seg_removed)(struct rmem_table *rmem, struct rmem_segment *seg);
     struct list_head list;
     struct list_head free_list;
     size_t alloc_size;
@@ -39,7 +65,8 @@ struct rmem_table {
 
 enum rmem_txn_type {
     TXN_CP,
-    TXN_FREE
+    TXN_FREE,
+    TXN_SWAP
 };
 
 struct rmem_txn {
@@ -60,12 +87,16 @@ struct rmem_iterator {
     size_t block_ind;
 };
 
-void init_rmem_table(struct rmem_table *rmem);
+void init_rmem_table(struct rmem_table *rmem, size_t cap);
 void *rmem_table_alloc(struct rmem_table *rmem, size_t size, tag_t tag);
 void rmem_table_free(struct rmem_table *rmem, void *ptr);
 void *rmem_table_lookup(struct rmem_table *rmem, tag_t tag);
 void free_rmem_table(struct rmem_table *rmem);
 void dump_rmem_table(struct rmem_table *rmem);
+int rmem_table_contains(struct rmem_table *rmem, void *ptr, size_t size);
+int rmem_table_tag_of(struct rmem_table *rmem, void *ptr, tag_t *tag);
+int rmem_table_can_swap(struct rmem_table *rmem, void *a, void *b);
+int rmem_table_swap(struct rmem_table *rmem, void *a, void *b);
 
 void txn_list_init(struct rmem_txn_list *list);
 void txn_list_clear(struct rmem_txn_list *list);
@@ -73,6 +104,8 @@ int txn_list_add_cp(struct rmem_txn_list *list,
 	void *dst, void *src, size_t size);
 //int txn_list_add_alloc(struct rmem_txn_list *list, size_t size);
 int txn_list_add_free(struct rmem_txn_list *list, void *addr);
+int txn_list_add_swap(struct rmem_txn_list *list,
+	void *dst, void *src, size_t size);
 void txn_commit(struct rmem_table *rmem, struct rmem_txn_list *list);
 
 void init_rmem_iterator(struct rmem_iterator *iter, struct rmem_table *rmem);
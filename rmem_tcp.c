@@ -0,0 +1,530 @@
+#define _GNU_SOURCE
+#include "rmem_tcp.h"
+#include "common.h"
+#include "messages.h"
+#include "rmem_multi_ops.h"
+#include "rmem_chain.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "utils/log.h"
+
+/* Payloads that have nowhere to go are read into a buffer of this size */
+#define SCRATCH_SIZE (64 << 10)
+/* How long the ring poller sleeps while no local client is connected */
+#define RING_IDLE_US 1000
+
+/* A TCP client. Requests are handled in the order they arrive, so a client
+ * may pipeline as many as the socket buffers hold. */
+struct tcp_conn {
+    int fd;
+    struct message req;
+    struct message resp;
+
+    struct rmem_txn_list txn_list;
+    int txn_error;  /**< a write or descriptor of the open txn was bad */
+
+    struct txn_desc_entry *desc;
+    char *scratch;
+    char *chain;    /**< a transaction forwarded by the predecessor */
+    uint64_t chain_size;
+
+    /* same-host clients only */
+    struct shm_ring *ring;
+    int ring_fd;
+    struct tcp_conn *ring_next;
+};
+
+static struct rmem_table *s_rmem;
+static pthread_mutex_t *s_table_mutex;
+static int s_tcp_fd = -1;
+static int s_local_fd = -1;
+static pthread_t s_tcp_listener;
+static pthread_t s_local_listener;
+
+static pthread_mutex_t s_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tcp_conn *s_rings;
+static pthread_t s_ring_poller;
+
+/* Send resp followed by payload bytes at data */
+static int reply(struct tcp_conn *conn, const void *data, uint64_t payload)
+{
+    struct tcp_frame frame = { .len = msg_len(&conn->resp),
+        .payload = payload };
+    struct iovec iov[3] = {
+        { &frame, sizeof(frame) },
+        { &conn->resp, frame.len },
+        { (void *)data, payload }
+    };
+
+    conn->resp.seg_gen = s_rmem->seg_gen;
+    return tcp_writev_full(conn->fd, iov, payload ? 3 : 2);
+}
+
+static int skip_payload(struct tcp_conn *conn, uint64_t len)
+{
+    while (len > 0) {
+        size_t n = MIN(len, SCRATCH_SIZE);
+
+        if (tcp_read_full(conn->fd, conn->scratch, n))
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+static int valid_block(uint64_t addr, uint64_t size)
+{
+    int ok;
+
+    TEST_NZ(pthread_mutex_lock(s_table_mutex));
+    ok = rmem_table_contains(s_rmem, (void *)addr, size);
+    TEST_NZ(pthread_mutex_unlock(s_table_mutex));
+
+    return ok;
+}
+
+/* The client starts out with a copy of the tag map, sent unasked */
+static int send_tag_map(struct tcp_conn *conn)
+{
+    struct rmem_iterator iter;
+    tag_addr_entry_t *table = NULL;
+    size_t n = 0;
+    int err;
+
+    TEST_NZ(pthread_mutex_lock(s_table_mutex));
+    if (s_rmem->nblocks > 0) {
+        TEST_Z(table = malloc(s_rmem->nblocks * sizeof(*table)));
+        init_rmem_iterator(&iter, s_rmem);
+        while (!rmem_iter_finished(&iter))
+            n += rmem_iter_next_set(&iter, &table[n]);
+    }
+    TEST_NZ(pthread_mutex_unlock(s_table_mutex));
+
+    memset(&conn->resp, 0, sizeof(conn->resp));
+    conn->resp.id = MSG_TAG_ADDR_MAP;
+    conn->resp.data.tag_addr_map.count = n;
+    // local clients find blocks in the memory file by their offset from it
+    conn->resp.data.tag_addr_map.addr = (uintptr_t) s_rmem->mem;
+    err = reply(conn, table, n * sizeof(*table));
+    free(table);
+
+    return err;
+}
+
+/* Add n descriptor entries to the open txn, a bad one spoils it */
+static void add_desc(struct tcp_conn *conn, struct txn_desc_entry *entries,
+        uint64_t n)
+{
+    if (n > TXN_DESC_MAX_ENTRIES)
+        conn->txn_error = 1;
+    if (conn->txn_error || n == 0)
+        return;
+
+    TEST_NZ(pthread_mutex_lock(s_table_mutex));
+    if (txn_add_desc(s_rmem, &conn->txn_list, entries, n) != 0)
+        conn->txn_error = 1;
+    TEST_NZ(pthread_mutex_unlock(s_table_mutex));
+}
+
+/* Descriptor entries come as the payload */
+static int queue_desc(struct tcp_conn *conn, uint64_t payload)
+{
+    uint64_t n = payload / sizeof(*conn->desc);
+
+    if (n > TXN_DESC_MAX_ENTRIES || payload % sizeof(*conn->desc)) {
+        conn->txn_error = 1;
+        return skip_payload(conn, payload);
+    }
+    if (tcp_read_full(conn->fd, conn->desc, payload))
+        return -1;
+    add_desc(conn, conn->desc, n);
+
+    return 0;
+}
+
+static int commit_txn(struct tcp_conn *conn)
+{
+    int error = conn->txn_error;
+
+    if (!error)
+        error = rmem_chain_commit(s_rmem, s_table_mutex, &conn->txn_list);
+    txn_list_clear(&conn->txn_list);
+    conn->txn_error = 0;
+
+    return error;
+}
+
+/* Handle one request. Returns nonzero to drop the connection. */
+static int handle(struct tcp_conn *conn, uint64_t payload)
+{
+    struct message *msg = &conn->req;
+    struct message *resp = &conn->resp;
+    void *ptr;
+
+    memset(resp, 0, offsetof(struct message, data) +
+            sizeof(resp->data.memresp));
+
+    switch (msg->id) {
+        case MSG_WRITE:
+            /* not acknowledged, a bad one fails the next commit */
+            if (payload != msg->data.rw.size ||
+                    !valid_block(msg->data.rw.addr, payload)) {
+                conn->txn_error = 1;
+                return skip_payload(conn, payload);
+            }
+            return tcp_read_full(conn->fd, (void *)msg->data.rw.addr,
+                    payload);
+        case MSG_READ:
+            resp->id = MSG_MEMRESP;
+            if (!valid_block(msg->data.rw.addr, msg->data.rw.size)) {
+                resp->data.memresp.error = 1;
+                return skip_payload(conn, payload) || reply(conn, NULL, 0);
+            }
+            if (skip_payload(conn, payload))
+                return -1;
+            return reply(conn, (void *)msg->data.rw.addr,
+                    msg->data.rw.size);
+        case MSG_ALLOC:
+            TEST_NZ(pthread_mutex_lock(s_table_mutex));
+            ptr = rmem_table_alloc(s_rmem, msg->data.alloc.size,
+                    msg->data.alloc.tag);
+            if (ptr != NULL)
+                rmem_chain_note_alloc(msg->data.alloc.tag,
+                        msg->data.alloc.size);
+            TEST_NZ(pthread_mutex_unlock(s_table_mutex));
+            resp->id = MSG_MEMRESP;
+            resp->data.memresp.addr = (uintptr_t) ptr;
+            resp->data.memresp.error = (ptr == NULL);
+            break;
+        case MSG_LOOKUP:
+            TEST_NZ(pthread_mutex_lock(s_table_mutex));
+            ptr = rmem_table_lookup(s_rmem, msg->data.lookup.tag);
+            TEST_NZ(pthread_mutex_unlock(s_table_mutex));
+            resp->id = MSG_MEMRESP;
+            resp->data.memresp.addr = (uintptr_t) ptr;
+            resp->data.memresp.error = (ptr == NULL);
+            break;
+        case MSG_MULTI_ALLOC:
+            if (msg->data.multi_alloc.nitems > MULTI_OP_MAX_ITEMS)
+                return -1;
+            resp->id = MSG_MULTI_MEMRESP;
+            resp->data.multi_memresp.nitems = msg->data.multi_alloc.nitems;
+            TEST_NZ(pthread_mutex_lock(s_table_mutex));
+            resp->data.multi_memresp.error = rmem_multi_alloc(s_rmem,
+                    resp->data.multi_memresp.addrs,
+                    msg->data.multi_alloc.size,
+                    msg->data.multi_alloc.tags,
+                    msg->data.multi_alloc.nitems);
+            // a failure leaves the tags before it allocated
+            for (int i = 0; i < msg->data.multi_alloc.nitems; i++)
+                if (rmem_table_lookup(s_rmem, msg->data.multi_alloc.tags[i]))
+                    rmem_chain_note_alloc(msg->data.multi_alloc.tags[i],
+                            msg->data.multi_alloc.size);
+            TEST_NZ(pthread_mutex_unlock(s_table_mutex));
+            break;
+        case MSG_MULTI_LOOKUP:
+            if (msg->data.multi_lookup.nitems > MULTI_OP_MAX_ITEMS)
+                return -1;
+            resp->id = MSG_MULTI_MEMRESP;
+            resp->data.multi_memresp.nitems = msg->data.multi_lookup.nitems;
+            TEST_NZ(pthread_mutex_lock(s_table_mutex));
+            resp->data.multi_memresp.error = rmem_multi_lookup(s_rmem,
+                    resp->data.multi_memresp.addrs,
+                    msg->data.multi_lookup.tags,
+                    msg->data.multi_lookup.nitems);
+            TEST_NZ(pthread_mutex_unlock(s_table_mutex));
+            break;
+        case MSG_TXN_DESC:
+            if (queue_desc(conn, payload))
+                return -1;
+            payload = 0;
+            resp->id = MSG_TXN_ACK;
+            resp->data.memresp.error = conn->txn_error;
+            break;
+        case MSG_TXN_GO:
+            if (queue_desc(conn, payload))
+                return -1;
+            payload = 0;
+            resp->id = MSG_TXN_ACK;
+            resp->data.memresp.error = commit_txn(conn);
+            break;
+        case MSG_TXN_ABORT:
+            txn_list_clear(&conn->txn_list);
+            conn->txn_error = 0;
+            resp->id = MSG_TXN_ACK;
+            break;
+        case MSG_CHAIN:
+            if (payload > conn->chain_size) {
+                free(conn->chain);
+                TEST_Z(conn->chain = malloc(payload));
+                conn->chain_size = payload;
+            }
+            if (tcp_read_full(conn->fd, conn->chain, payload))
+                return -1;
+            resp->id = MSG_TXN_ACK;
+            resp->data.memresp.error = rmem_chain_apply(s_rmem,
+                    s_table_mutex, conn->chain, payload,
+                    msg->data.chain.nentries) != 0;
+            payload = 0;
+            break;
+        default:
+            fprintf(stderr, "Invalid TCP message type %d\n", msg->id);
+            return -1;
+    }
+
+    if (skip_payload(conn, payload))
+        return -1;
+    return reply(conn, NULL, 0);
+}
+
+/*
+ * SAME-HOST CLIENTS
+ *
+ * With the table backed by a memory file, clients on this host connect
+ * through a Unix socket, get the file and map it. Puts and gets are then
+ * plain copies on the client side, and commits go through a command ring
+ * in memory shared with this process, applied by one polling thread. The
+ * socket still carries allocations, lookups and the tag map.
+ */
+
+static void ring_attach(struct tcp_conn *conn)
+{
+    TEST_Z((conn->ring_fd = memfd_create("rmem-ring", 0)) >= 0);
+    TEST_NZ(ftruncate(conn->ring_fd, sizeof(*conn->ring)));
+    conn->ring = mmap(NULL, sizeof(*conn->ring), PROT_READ | PROT_WRITE,
+            MAP_SHARED, conn->ring_fd, 0);
+    TEST_Z(conn->ring != MAP_FAILED);
+
+    TEST_NZ(pthread_mutex_lock(&s_rings_lock));
+    conn->ring_next = s_rings;
+    s_rings = conn;
+    TEST_NZ(pthread_mutex_unlock(&s_rings_lock));
+}
+
+// the poller is done with the ring once the lock is ours
+static void ring_detach(struct tcp_conn *conn)
+{
+    struct tcp_conn **p;
+
+    TEST_NZ(pthread_mutex_lock(&s_rings_lock));
+    for (p = &s_rings; *p != conn; p = &(*p)->ring_next)
+        ;
+    *p = conn->ring_next;
+    TEST_NZ(pthread_mutex_unlock(&s_rings_lock));
+
+    munmap(conn->ring, sizeof(*conn->ring));
+    close(conn->ring_fd);
+}
+
+/* Apply the next command of conn's ring, returns 0 if there was none */
+static int ring_apply(struct tcp_conn *conn)
+{
+    struct shm_ring *ring = conn->ring;
+    uint64_t pos = ring->tail;
+    int error = 0;
+
+    if (pos == ring->head)
+        return 0;
+    // the slot and descriptor were written before head
+    __sync_synchronize();
+
+    switch (ring->slots[pos % SHM_RING_SIZE].op) {
+        case CHAN_DESC:
+            add_desc(conn, ring->desc,
+                    ring->slots[pos % SHM_RING_SIZE].nentries);
+            error = conn->txn_error;
+            break;
+        case CHAN_GO:
+            add_desc(conn, ring->desc,
+                    ring->slots[pos % SHM_RING_SIZE].nentries);
+            error = commit_txn(conn);
+            break;
+        case CHAN_ABORT:
+            txn_list_clear(&conn->txn_list);
+            conn->txn_error = 0;
+            break;
+        default:
+            error = -1;
+    }
+
+    ring->slots[pos % SHM_RING_SIZE].error = error;
+    __sync_synchronize();
+    ring->slots[pos % SHM_RING_SIZE].done = pos + 1;
+    ring->tail = pos + 1;
+
+    return 1;
+}
+
+static void *ring_poll(void *arg)
+{
+    while (1) {
+        struct tcp_conn *conn;
+        int busy = 0, idle;
+
+        TEST_NZ(pthread_mutex_lock(&s_rings_lock));
+        for (conn = s_rings; conn != NULL; conn = conn->ring_next)
+            busy += ring_apply(conn);
+        idle = (s_rings == NULL);
+        TEST_NZ(pthread_mutex_unlock(&s_rings_lock));
+
+        if (idle)
+            usleep(RING_IDLE_US);
+        else if (!busy)
+            sched_yield();
+    }
+
+    return NULL;
+}
+
+/* Hand a local client the table's memory file and its ring */
+static int send_fds(struct tcp_conn *conn)
+{
+    int fds[2] = { s_rmem->fd, conn->ring_fd };
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    return sendmsg(conn->fd, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+static void *serve(void *arg)
+{
+    struct tcp_conn *conn = arg;
+    struct tcp_frame frame;
+
+    txn_list_init(&conn->txn_list);
+    TEST_Z(conn->desc = malloc(TXN_DESC_MAX_ENTRIES * sizeof(*conn->desc)));
+    TEST_Z(conn->scratch = malloc(SCRATCH_SIZE));
+
+    if ((conn->ring == NULL || send_fds(conn) == 0) &&
+            send_tag_map(conn) == 0) {
+        while (tcp_read_full(conn->fd, &frame, sizeof(frame)) == 0) {
+            if (frame.len > sizeof(conn->req))
+                break;
+            memset(&conn->req, 0, sizeof(conn->req));
+            if (tcp_read_full(conn->fd, &conn->req, frame.len))
+                break;
+            if (handle(conn, frame.payload))
+                break;
+        }
+    }
+
+    LOG(5, ("TCP client %d gone\n", conn->fd));
+
+    if (conn->ring != NULL)
+        ring_detach(conn);
+    txn_list_clear(&conn->txn_list);
+    close(conn->fd);
+    free(conn->scratch);
+    free(conn->chain);
+    free(conn->desc);
+    free(conn);
+
+    return NULL;
+}
+
+static void *listen_loop(void *arg)
+{
+    int listen_fd = *(int *)arg;
+    int local = (arg == &s_local_fd);
+    int fd, one = 1;
+    pthread_t thread;
+    struct tcp_conn *conn;
+
+    while (1) {
+        if ((fd = accept(listen_fd, NULL, NULL)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            break;
+        }
+        // requests and replies are small, don't let Nagle hold them back
+        if (!local)
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        TEST_Z(conn = calloc(1, sizeof(*conn)));
+        conn->fd = fd;
+        if (local)
+            ring_attach(conn);
+        TEST_NZ(pthread_create(&thread, NULL, serve, conn));
+        TEST_NZ(pthread_detach(thread));
+    }
+
+    return NULL;
+}
+
+void rmem_tcp_start(const char *port, struct rmem_table *rmem,
+        pthread_mutex_t *table_mutex)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+
+    s_rmem = rmem;
+    s_table_mutex = table_mutex;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(port));
+
+    TEST_Z((s_tcp_fd = socket(AF_INET, SOCK_STREAM, 0)) >= 0);
+    TEST_NZ(setsockopt(s_tcp_fd, SOL_SOCKET, SO_REUSEADDR, &one,
+                sizeof(one)));
+    TEST_NZ(bind(s_tcp_fd, (struct sockaddr *)&addr, sizeof(addr)));
+    TEST_NZ(listen(s_tcp_fd, 64));
+
+    TEST_NZ(pthread_create(&s_tcp_listener, NULL, listen_loop, &s_tcp_fd));
+    LOG(1, ("serving TCP clients on port %s\n", port));
+}
+
+void rmem_local_start(const char *path, struct rmem_table *rmem,
+        pthread_mutex_t *table_mutex)
+{
+    struct sockaddr_un addr;
+
+    TEST_Z(rmem->fd >= 0);
+    s_rmem = rmem;
+    s_table_mutex = table_mutex;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    // left behind by a server that did not exit cleanly
+    unlink(path);
+
+    TEST_Z((s_local_fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0);
+    TEST_NZ(bind(s_local_fd, (struct sockaddr *)&addr, sizeof(addr)));
+    TEST_NZ(listen(s_local_fd, 64));
+
+    TEST_NZ(pthread_create(&s_ring_poller, NULL, ring_poll, NULL));
+    TEST_NZ(pthread_create(&s_local_listener, NULL, listen_loop,
+                &s_local_fd));
+    LOG(1, ("serving local clients on %s\n", path));
+}
+
+void rmem_tcp_join()
+{
+    if (s_tcp_fd >= 0)
+        pthread_join(s_tcp_listener, NULL);
+    if (s_local_fd >= 0)
+        pthread_join(s_local_listener, NULL);
+}
@@ -0,0 +1,23 @@
+#ifndef RMEM_TCP_H
+#define RMEM_TCP_H
+
+#include <pthread.h>
+
+#include "rmem_table.h"
+
+/* Serve clients of the TCP backend on port, from a listener thread and a
+ * thread per connection. They share rmem with the RDMA clients; the table
+ * is only touched with table_mutex held. */
+void rmem_tcp_start(const char *port, struct rmem_table *rmem,
+        pthread_mutex_t *table_mutex);
+
+/* Serve clients on this host on the Unix socket at path. rmem must be
+ * backed by a memory file (rmem->fd), which they map to copy blocks in and
+ * out themselves; their commits come in through a shm_ring. */
+void rmem_local_start(const char *path, struct rmem_table *rmem,
+        pthread_mutex_t *table_mutex);
+
+/* Wait for the listeners, i.e. forever unless they failed */
+void rmem_tcp_join();
+
+#endif
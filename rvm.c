@@ -22,6 +22,61 @@ static inline int rvm_unprotect(void *addr, size_t size)
     return mprotect(addr, size, PROT_READ | PROT_WRITE | PROT_EXEC);
 }
 
+/* Number of remote blocks backing each local block */
+static inline int rvm_tags_per_blk(rvm_cfg_t *cfg)
+{
+    return cfg->shadow ? 2 : 1;
+}
+
+/* The tag a modified block is written to before it is committed */
+static inline uint32_t rvm_stage_tag(rvm_cfg_t *cfg, int32_t bid)
+{
+    return cfg->shadow ? BLK_SHDW_TAG(bid) : BLK_REAL_TAG(bid);
+}
+
+/* Vectored put/get, one transfer at a time for layers that lack them */
+static int rvm_put_v(rmem_layer_t *rmem_layer, rmem_iov_t *iov, int n)
+{
+    int err = 0;
+
+    if (rmem_layer->put_v != NULL)
+        return rmem_layer->put_v(rmem_layer, iov, n);
+
+    for (int i = 0; i < n; i++) {
+        iov[i].status = rmem_layer->put(rmem_layer, iov[i].tag,
+                iov[i].addr, iov[i].reg, iov[i].size);
+        if (iov[i].status != 0 && err == 0)
+            err = iov[i].status;
+    }
+    return err;
+}
+
+static int rvm_get_v(rmem_layer_t *rmem_layer, rmem_iov_t *iov, int n)
+{
+    int err = 0;
+
+    if (rmem_layer->get_v != NULL)
+        return rmem_layer->get_v(rmem_layer, iov, n);
+
+    for (int i = 0; i < n; i++) {
+        iov[i].status = rmem_layer->get(rmem_layer, iov[i].addr,
+                iov[i].reg, iov[i].tag, iov[i].size);
+        if (iov[i].status != 0 && err == 0)
+            err = iov[i].status;
+    }
+    return err;
+}
+
+static inline void rvm_iov_set(rmem_iov_t *iov, uint32_t tag, void *addr,
+        void *reg, size_t size)
+{
+    iov->tag = tag;
+    iov->addr = addr;
+    iov->reg = reg;
+    iov->size = size;
+    iov->status = 0;
+}
+
 /* Flag to indicate whether we are currently handling a fault */
 volatile bool in_sighdl;
 
@@ -38,10 +93,16 @@ static bool recover_blocks(rvm_cfg_t *cfg)
     int err;
     rmem_layer_t* rmem_layer = (rmem_layer_t*)cfg->rmem_layer;
     uint64_t btbl_nentries, btbl_npg;
+    rmem_iov_t *iov;
+    int niov = 0;
 
     btbl_nentries = cfg->blk_tbl.rbtbl->nentries;
     btbl_npg = BLOCK_TBL_NPG(btbl_nentries);
 
+    /* One transfer per block table page, then one per live block */
+    iov = malloc(btbl_nentries * sizeof(*iov));
+    CHECK_ERROR(iov == NULL, ("Failed to allocate recovery vector\n"));
+
     /* Recover the block table */
     for(size_t i = 0; i < btbl_npg; i++)
     {
@@ -51,20 +112,25 @@ static bool recover_blocks(rvm_cfg_t *cfg)
         CHECK_ERROR(rec_tmp == NULL, ("Failed to register page %ld "
                    "of the block table with rmem\n", i));
 
-        /* Fetch the block table page from server */
-        err = rmem_layer->get(rmem_layer,
-                (((void*)cfg->blk_tbl.rbtbl) + cfg->blk_sz*i),
-                rec_tmp,
-                BLK_REAL_TAG(BLOCK_TBL_ID + i), cfg->blk_sz);
-        CHECK_ERROR(err != 0,
-                ("Failed to recover page %ld of the block table\n", i));
-
-        /* Fill in registration info */
-        cfg->blk_tbl.rbtbl->tbl[BLOCK_TBL_ID + i].blk_rec = rec_tmp;
+        rvm_iov_set(&iov[niov++], BLK_REAL_TAG(BLOCK_TBL_ID + i),
+                ((void*)cfg->blk_tbl.rbtbl) + cfg->blk_sz*i, rec_tmp,
+                cfg->blk_sz);
     }
 
+    /* Fetch the block table pages from server */
+    err = rvm_get_v(rmem_layer, iov, niov);
+    CHECK_ERROR(err != 0, ("Failed to recover the block table\n"));
+
+    /* The table may have been somewhere else in the run that wrote it */
+    rbtbl_relocate(cfg->blk_tbl.rbtbl);
+
+    /* Fill in registration info. The fetch overwrote it. */
+    for(size_t i = 0; i < btbl_npg; i++)
+        cfg->blk_tbl.rbtbl->tbl[BLOCK_TBL_ID + i].blk_rec = iov[i].reg;
+
     /* Recover every previously allocated block. Start reading the block table
      * after the entries describing itself (those were recovered above). */
+    niov = 0;
     int bx;
     for(bx = btbl_npg; bx < btbl_nentries; bx++)
     {
@@ -84,6 +150,7 @@ static bool recover_blocks(rvm_cfg_t *cfg)
             int er_tmp = errno;
             LOG(1, ("Failed to allocate space for recovered block: %s\n",
                     strerror(errno)));
+            free(iov);
             errno = er_tmp;
             return false;
         }
@@ -93,25 +160,36 @@ static bool recover_blocks(rvm_cfg_t *cfg)
                 rmem_layer, blk->local_addr, cfg->blk_sz);
         if(blk->blk_rec == NULL) {
             rvm_log("Failed to register memory for block\n");
+            free(iov);
             errno = EUNKNOWN;
-            return NULL;
+            return false;
         }
 
-        /* Actual fetch from server */
-        err = rmem_layer->get(rmem_layer, blk->local_addr,
-                (struct ibv_mr*)blk->blk_rec, BLK_REAL_TAG(blk->bid), cfg->blk_sz);
-        if(err != 0) {
-            rvm_log("Failed to recover block %d\n", bx);
-            errno = EUNKNOWN;
-            return false;
+        rvm_iov_set(&iov[niov++], BLK_REAL_TAG(blk->bid), blk->local_addr,
+                blk->blk_rec, cfg->blk_sz);
+    }
+
+    /* Actual fetch from server, all blocks at once */
+    err = rvm_get_v(rmem_layer, iov, niov);
+    if(err != 0) {
+        for(int i = 0; i < niov; i++) {
+            if(iov[i].status != 0)
+                rvm_log("Failed to recover block with tag %u\n",
+                        iov[i].tag);
         }
+        free(iov);
+        errno = EUNKNOWN;
+        return false;
+    }
 
-        /* Protect the block to detect changes */
-        rvm_protect(blk->local_addr, cfg->blk_sz);
+    /* Protect the blocks to detect changes */
+    for(int i = 0; i < niov; i++) {
+        rvm_protect(iov[i].addr, cfg->blk_sz);
 
-        LOG(9, ("Recovered block %d (shadow %d) - local addr: %p\n",
-                    blk->bid, BLK_SHDW_TAG(blk->bid), blk->local_addr));
+        LOG(9, ("Recovered tag %u - local addr: %p\n",
+                    iov[i].tag, iov[i].addr));
     }
+    free(iov);
 
     /* Protect the block table to prevent further changes */
     rvm_protect(cfg->blk_tbl.rbtbl, BLOCK_TBL_SIZE(btbl_nentries));
@@ -143,6 +221,7 @@ rvm_cfg_t *rvm_cfg_create(rvm_opt_t *opts, create_rmem_layer_f create_rmem_layer
     check_cfg_fields(opts);
         
     rmem_layer_t* rmem_layer = cfg->rmem_layer = create_rmem_layer_function();
+    cfg->shadow = !(rmem_layer->flags & RMEM_LAYER_NO_SHADOW);
 
     rmem_layer->connect(rmem_layer, opts->host, opts->port);
 
@@ -169,6 +248,7 @@ rvm_cfg_t *rvm_cfg_create(rvm_opt_t *opts, create_rmem_layer_f create_rmem_layer
     } else {
         uint32_t tags[btbl_npg*2];
         uint64_t addrs[btbl_npg*2];
+        int ntags = btbl_npg * rvm_tags_per_blk(cfg);
 
 	    /* Initialize the raw block table (that will be preserved) */
         res = rbtbl_init(cfg->blk_tbl.rbtbl);
@@ -193,12 +273,13 @@ rvm_cfg_t *rvm_cfg_create(rvm_opt_t *opts, create_rmem_layer_f create_rmem_layer
 
             /* Set up rmem_malloc info */
 	        tags[i] = BLK_REAL_TAG(blk->bid);
-	        tags[btbl_npg + i] = BLK_SHDW_TAG(blk->bid);
+	        if(cfg->shadow)
+	            tags[btbl_npg + i] = BLK_SHDW_TAG(blk->bid);
         }
 
         /* Allocate and register the block table remotely */
         int ret = rmem_layer->multi_malloc(
-            rmem_layer, addrs, cfg->blk_sz, tags, btbl_npg*2);
+            rmem_layer, addrs, cfg->blk_sz, tags, ntags);
         CHECK_ERROR(ret != 0, ("Failed to allocate memory for block table\n"));
 
 #if (LOG_LEVEL > 9)
@@ -268,7 +349,8 @@ bool rvm_cfg_destroy(rvm_cfg_t *cfg)
 
         /* Free the remote blocks */
         rmem_layer->free(rmem_layer, BLK_REAL_TAG(blk->bid));
-        rmem_layer->free(rmem_layer, BLK_SHDW_TAG(blk->bid));
+        if(cfg->shadow)
+            rmem_layer->free(rmem_layer, BLK_SHDW_TAG(blk->bid));
 
         rmem_layer->deregister_data(rmem_layer, blk->blk_rec);
     }
@@ -385,6 +467,9 @@ bool rvm_txn_commit(rvm_cfg_t* cfg, rvm_txid_t txid)
     uint32_t tags_size[btbl_nentries];
     int count = 0;
 
+    rmem_iov_t *iov = malloc(btbl_nentries * sizeof(*iov));
+    CHECK_ERROR(iov == NULL, ("Failed to allocate commit vector\n"));
+
     /* Walk the block table and commit everything that's changed */
     int bx;
     for(bx = 0; bx < btbl_nentries; bx++)
@@ -395,21 +480,31 @@ bool rvm_txn_commit(rvm_cfg_t* cfg, rvm_txid_t txid)
         if(!btbl_test_mod(&(cfg->blk_tbl), blk))
             continue;
 
-        err = rmem_layer->put(rmem_layer, BLK_SHDW_TAG(blk->bid),
+        rvm_iov_set(&iov[count], rvm_stage_tag(cfg, blk->bid),
                 blk->local_addr, blk->blk_rec, cfg->blk_sz);
-        CHECK_ERROR(err != 0, ("Failed to write block %d", bx));
 
-        tags_src[count] = BLK_SHDW_TAG(blk->bid);
+        tags_src[count] = rvm_stage_tag(cfg, blk->bid);
         tags_dst[count] = BLK_REAL_TAG(blk->bid);
         tags_size[count++] = cfg->blk_sz;
 
-        /* Re-protect the block for the next txn */
-        rvm_protect(blk->local_addr, cfg->blk_sz);
     }
 
+    /* Write all dirty blocks in one go */
+    err = rvm_put_v(rmem_layer, iov, count);
+    CHECK_ERROR(err != 0, ("Failed to write dirty blocks: %d\n", err));
+
+    /* Re-protect the blocks for the next txn */
+    for(int i = 0; i < count; i++)
+        rvm_protect(iov[i].addr, cfg->blk_sz);
+    free(iov);
+
     int ret = rmem_layer->atomic_commit(
             rmem_layer, tags_src, tags_dst, tags_size, count);
-    CHECK_ERROR(ret != 0, ("Failure: atomic commit\n"));
+    if(ret != 0) {
+        rvm_log("Failure: atomic commit\n");
+        errno = ret > 0 ? ret : EUNKNOWN;
+        return false;
+    }
 
     return true;
 }
@@ -478,8 +573,9 @@ void *rvm_blk_alloc(rvm_cfg_t* cfg, size_t size)
         return NULL;
     }
 
-    uint32_t *tags = malloc(2 * nblocks * sizeof(uint32_t));
-    uint64_t *addrs = malloc(2 * nblocks * sizeof(uint64_t));
+    int tags_per_blk = rvm_tags_per_blk(cfg);
+    uint32_t *tags = malloc(tags_per_blk * nblocks * sizeof(uint32_t));
+    uint64_t *addrs = malloc(tags_per_blk * nblocks * sizeof(uint64_t));
     int tag_ind = 0;
 
     CHECK_ERROR(tags == NULL, ("Failure: alloc tag and addr buffers\n"));
@@ -504,8 +600,9 @@ void *rvm_blk_alloc(rvm_cfg_t* cfg, size_t size)
         }
 
         tags[tag_ind] = BLK_REAL_TAG(block->bid);
-        tags[tag_ind + 1] = BLK_SHDW_TAG(block->bid);
-        tag_ind += 2;
+        if(cfg->shadow)
+            tags[tag_ind + 1] = BLK_SHDW_TAG(block->bid);
+        tag_ind += tags_per_blk;
 
         LOG(9, ("Allocated block %d (shadow %d) - local addr: %p\n",
                     BLK_REAL_TAG(block->bid), BLK_SHDW_TAG(block->bid),
@@ -513,7 +610,7 @@ void *rvm_blk_alloc(rvm_cfg_t* cfg, size_t size)
     }
 
     int ret = rmem_layer->multi_malloc(
-	    rmem_layer, addrs, cfg->blk_sz, tags, 2 * nblocks);
+	    rmem_layer, addrs, cfg->blk_sz, tags, tag_ind);
     if (ret != 0) {
 	rvm_log("Failed to allocate remote memory for blocks\n");
 	errno = EUNKNOWN;
@@ -553,7 +650,7 @@ bool rvm_blk_free(rvm_cfg_t* cfg, void *buf)
     /* Cleanup remote info */
     tags[0] = BLK_REAL_TAG(blk->bid);
     tags[1] = BLK_SHDW_TAG(blk->bid);
-    rmem_layer->multi_free(rmem_layer, tags, 2);
+    rmem_layer->multi_free(rmem_layer, tags, rvm_tags_per_blk(cfg));
     rmem_layer->deregister_data(rmem_layer, blk->blk_rec);
 
     /* Unset the change bit for this block */
@@ -11,6 +11,7 @@ struct rvm_cfg
     size_t blk_sz;               /**< Size of minimum rvm allocation */
     bool in_txn;                 /**< Are we currently in a transaction? */
     rmem_layer_t* rmem_layer;    /**< State info for low-level interface */
+    bool shadow;                 /**< Does every block have a remote shadow? */
     
     /* Block Table */
     blk_tbl_t blk_tbl;          /**< Info about all blocks tracked by rvm */
@@ -0,0 +1,61 @@
+#include "shadow_pool.h"
+#include "common.h"
+
+#include <string.h>
+#include "utils/log.h"
+
+#define NSLOTS(size) (((size) + POOL_SLOT_SIZE - 1) / POOL_SLOT_SIZE)
+
+void shadow_pool_init(struct shadow_pool *pool, void *base, size_t size)
+{
+    pool->base = base;
+    pool->nslots = size / POOL_SLOT_SIZE;
+    pool->nfree = pool->nslots;
+    TEST_Z(pool->used = calloc(pool->nslots, 1));
+    pthread_mutex_init(&pool->mutex, NULL);
+
+    LOG(1, ("shadow pool: %zu slots of %d bytes\n",
+                pool->nslots, POOL_SLOT_SIZE));
+}
+
+void *shadow_pool_lease(struct shadow_pool *pool, size_t size)
+{
+    size_t n = NSLOTS(size);
+    size_t run = 0;
+    void *ptr = NULL;
+
+    if (n == 0)
+        return NULL;
+
+    TEST_NZ(pthread_mutex_lock(&pool->mutex));
+
+    if (n <= pool->nfree) {
+        // first fit
+        for (size_t i = 0; i < pool->nslots; i++) {
+            run = pool->used[i] ? 0 : run + 1;
+            if (run == n) {
+                size_t first = i + 1 - n;
+                memset(&pool->used[first], 1, n);
+                pool->nfree -= n;
+                ptr = pool->base + first * POOL_SLOT_SIZE;
+                break;
+            }
+        }
+    }
+
+    TEST_NZ(pthread_mutex_unlock(&pool->mutex));
+
+    LOG(5, ("shadow pool: lease %zu bytes -> %p\n", size, ptr));
+    return ptr;
+}
+
+void shadow_pool_release(struct shadow_pool *pool, void *ptr, size_t size)
+{
+    size_t first = ((char *) ptr - pool->base) / POOL_SLOT_SIZE;
+    size_t n = NSLOTS(size);
+
+    TEST_NZ(pthread_mutex_lock(&pool->mutex));
+    memset(&pool->used[first], 0, n);
+    pool->nfree += n;
+    TEST_NZ(pthread_mutex_unlock(&pool->mutex));
+}
@@ -0,0 +1,32 @@
+#ifndef SHADOW_POOL_H
+#define SHADOW_POOL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Tag of the block that backs the shared staging pool */
+#define RMEM_POOL_TAG 0xFFFFFFFDu
+/* Leases are handed out in multiples of this */
+#define POOL_SLOT_SIZE 4096
+
+/* A shared pool of staging slots. Instead of keeping a permanent shadow for
+ * every block, clients lease slots for the pages written by the transaction
+ * in flight and give them back when it commits or aborts. */
+struct shadow_pool {
+    char *base;
+    size_t nslots;
+    size_t nfree;
+    uint8_t *used;
+    pthread_mutex_t mutex;
+};
+
+void shadow_pool_init(struct shadow_pool *pool, void *base, size_t size);
+
+/* Lease a contiguous run of slots covering size bytes. Returns NULL if the
+ * pool has no room left. */
+void *shadow_pool_lease(struct shadow_pool *pool, size_t size);
+
+void shadow_pool_release(struct shadow_pool *pool, void *ptr, size_t size);
+
+#endif
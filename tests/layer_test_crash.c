@@ -0,0 +1,118 @@
+/* A client that dies between its puts and the commit must leave the
+ * committed blocks as they were, also once later commits have moved the
+ * store past the epoch the dead puts were written in. Runs against the
+ * durable local stores (built with -DFILE_STORE or -DPMEM_STORE). */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/wait.h>
+
+#include "rvm_test_layer.h"
+#include <log.h>
+#include <error.h>
+
+#define NBLOCKS 64
+#define BLOCK_SIZE 4096
+/* Committed by the dead client and by the next one */
+#define OTHER_TAG (NBLOCKS + 1)
+
+static char buf[BLOCK_SIZE];
+
+static void put_all(rmem_layer_t *layer, char c)
+{
+    memset(buf, c, BLOCK_SIZE);
+    for (uint32_t tag = 1; tag <= NBLOCKS; tag++)
+        CHECK_ERROR(layer->put(layer, tag, buf, buf, BLOCK_SIZE) != 0,
+                ("FAILURE: could not write block %d\n", tag));
+}
+
+static void commit(rmem_layer_t *layer)
+{
+    CHECK_ERROR(layer->atomic_commit(layer, NULL, NULL, NULL, 0) != 0,
+            ("FAILURE: could not commit - %s\n", strerror(errno)));
+}
+
+static int check_all(rmem_layer_t *layer, char expect, const char *when)
+{
+    for (uint32_t tag = 1; tag <= NBLOCKS; tag++) {
+        memset(buf, 0, BLOCK_SIZE);
+        CHECK_ERROR(layer->get(layer, buf, buf, tag, BLOCK_SIZE) != 0,
+                ("FAILURE: could not read block %d\n", tag));
+        for (int i = 0; i < BLOCK_SIZE; i++) {
+            if (buf[i] != expect) {
+                printf("FAILURE: block %d %s has %s data\n", tag, when,
+                        buf[i] == expect + 1 ? "uncommitted" : "unexpected");
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* Commit 'a' everywhere, write 'b' everywhere and die */
+static void crash(char *host, char *port)
+{
+    rmem_layer_t *layer = test_layer();
+
+    layer->connect(layer, host, port);
+    for (uint32_t tag = 1; tag <= OTHER_TAG; tag++)
+        CHECK_ERROR(layer->malloc(layer, BLOCK_SIZE, tag) == 0,
+                ("FAILURE: could not allocate block %d\n", tag));
+    put_all(layer, 'a');
+    CHECK_ERROR(layer->put(layer, OTHER_TAG, buf, buf, BLOCK_SIZE) != 0,
+            ("FAILURE: could not write block %d\n", OTHER_TAG));
+    commit(layer);
+
+    put_all(layer, 'b');
+    _exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char **argv)
+{
+    rmem_layer_t *layer;
+    int status;
+    pid_t pid;
+
+    if (argc != 3) {
+        printf("usage: %s <store> <port>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    unlink(argv[1]);
+
+    pid = fork();
+    CHECK_ERROR(pid < 0, ("FAILURE: fork - %s\n", strerror(errno)));
+    if (pid == 0)
+        crash(argv[1], argv[2]);
+    CHECK_ERROR(waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != EXIT_SUCCESS,
+            ("FAILURE: the crashing client did not get to its puts\n"));
+
+    layer = test_layer();
+    layer->connect(layer, argv[1], argv[2]);
+    if (!check_all(layer, 'a', "after the crash"))
+        return EXIT_FAILURE;
+
+    /* move the store past the epoch of the dead puts */
+    for (int i = 0; i < 2; i++) {
+        memset(buf, 'c' + i, BLOCK_SIZE);
+        CHECK_ERROR(layer->put(layer, OTHER_TAG, buf, buf, BLOCK_SIZE) != 0,
+                ("FAILURE: could not write block %d\n", OTHER_TAG));
+        commit(layer);
+    }
+    if (!check_all(layer, 'a', "after the next commits"))
+        return EXIT_FAILURE;
+    layer->disconnect(layer);
+
+    layer = test_layer();
+    layer->connect(layer, argv[1], argv[2]);
+    if (!check_all(layer, 'a', "after a restart"))
+        return EXIT_FAILURE;
+    layer->disconnect(layer);
+    unlink(argv[1]);
+
+    printf("SUCCESS: uncommitted puts were dropped\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,176 @@
+/* A store that loses part of itself must come back with the committed
+ * blocks from the parts left, and hold them again whole once it has. Built
+ * with -DTIERED, to run with RMEM_TIER_REMOTE=loop, the local tier is
+ * deleted and later the remote one is replaced by an empty store. Built
+ * with -DEC, to run over RMEM_EC_BACKEND=loop, m of the servers come back
+ * empty each time, the second time one of them rebuilt the first time. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "rvm_test_layer.h"
+#include <log.h>
+#include <error.h>
+
+#define NBLOCKS 64
+#define BLOCK_SIZE 4096
+
+static char buf[BLOCK_SIZE];
+static void *buf_reg;
+static uint32_t tags[NBLOCKS], sizes[NBLOCKS];
+
+/* Write c to every step-th block and commit, the blocks named as both
+ * source and destination as rvm does with RMEM_LAYER_NO_SHADOW */
+static void commit_all(rmem_layer_t *layer, char c, int step)
+{
+    uint32_t n = 0;
+
+    memset(buf, c, BLOCK_SIZE);
+    for (uint32_t tag = 1; tag <= NBLOCKS; tag += step) {
+        CHECK_ERROR(layer->put(layer, tag, buf, buf_reg, BLOCK_SIZE) != 0,
+                ("FAILURE: could not write block %d\n", tag));
+        tags[n] = tag;
+        sizes[n++] = BLOCK_SIZE;
+    }
+    CHECK_ERROR(layer->atomic_commit(layer, tags, tags, sizes, n) != 0,
+            ("FAILURE: could not commit - %s\n", strerror(errno)));
+}
+
+/* The odd blocks hold odd, the even ones even */
+static int check_all(rmem_layer_t *layer, char odd, char even,
+        const char *when)
+{
+    for (uint32_t tag = 1; tag <= NBLOCKS; tag++) {
+        char expect = tag % 2 ? odd : even;
+
+        memset(buf, 0, BLOCK_SIZE);
+        CHECK_ERROR(layer->get(layer, buf, buf_reg, tag, BLOCK_SIZE) != 0,
+                ("FAILURE: could not read block %d\n", tag));
+        for (int i = 0; i < BLOCK_SIZE; i++) {
+            if (buf[i] != expect) {
+                printf("FAILURE: block %d %s has '%c', not '%c'\n", tag,
+                        when, buf[i], expect);
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+#if defined(TIERED)
+static void remove_local(char *host)
+{
+    char *path = strdup(host);
+
+    CHECK_ERROR(path == NULL, ("FAILURE: out of memory\n"));
+    path[strcspn(path, "@")] = '\0';
+    unlink(path);
+    free(path);
+}
+
+/* The first time the local tier is lost, then the remote one */
+static char *lose(char *host, int round)
+{
+    char *lost = malloc(strlen(host) + 2);
+
+    CHECK_ERROR(lost == NULL, ("FAILURE: out of memory\n"));
+    if (round == 0)
+        remove_local(host);
+    sprintf(lost, "%s%s", host, round == 0 ? "" : "x");
+    return lost;
+}
+#elif defined(EC)
+static void remove_local(char *host)
+{
+}
+
+/* Replace m servers, from the round-th on, with empty stores */
+static char *lose(char *host, int round)
+{
+    char *m_env = getenv("RMEM_EC_PARITY");
+    int m = m_env != NULL ? atoi(m_env) : 1;
+    char *lost = malloc(2 * strlen(host) + 1), *p = lost;
+    int s = 0;
+
+    CHECK_ERROR(lost == NULL, ("FAILURE: out of memory\n"));
+    for (char *c = host; ; c++) {
+        if (*c == ',' || *c == '\0') {
+            if (s >= round && s < round + m)
+                *p++ = 'x';
+            s++;
+        }
+        *p++ = *c;
+        if (*c == '\0')
+            break;
+    }
+    return lost;
+}
+#else
+static void remove_local(char *host)
+{
+}
+
+static char *lose(char *host, int round)
+{
+    CHECK_ERROR(1, ("FAILURE: built for no store this test can cut\n"));
+    return NULL;
+}
+#endif
+
+static rmem_layer_t *connect_layer(char *host, char *port)
+{
+    rmem_layer_t *layer = test_layer();
+
+    layer->connect(layer, host, port);
+    buf_reg = layer->register_data(layer, buf, BLOCK_SIZE);
+    return layer;
+}
+
+static void disconnect_layer(rmem_layer_t *layer)
+{
+    layer->deregister_data(layer, buf_reg);
+    layer->disconnect(layer);
+}
+
+int main(int argc, char **argv)
+{
+    rmem_layer_t *layer;
+    char *host, *lost;
+
+    if (argc != 3) {
+        printf("usage: %s <store> <port>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    remove_local(argv[1]);
+
+    layer = connect_layer(argv[1], argv[2]);
+    for (uint32_t tag = 1; tag <= NBLOCKS; tag++)
+        CHECK_ERROR(layer->malloc(layer, BLOCK_SIZE, tag) == 0,
+                ("FAILURE: could not allocate block %d\n", tag));
+    commit_all(layer, 'a', 1);
+    disconnect_layer(layer);
+
+    host = lose(argv[1], 0);
+    layer = connect_layer(host, argv[2]);
+    if (!check_all(layer, 'a', 'a', "after the first loss"))
+        return EXIT_FAILURE;
+    commit_all(layer, 'b', 2);
+    disconnect_layer(layer);
+
+    /* what came back must be there for the next loss */
+    lost = lose(host, 1);
+    free(host);
+    host = lost;
+    layer = connect_layer(host, argv[2]);
+    if (!check_all(layer, 'b', 'a', "after the second loss"))
+        return EXIT_FAILURE;
+    disconnect_layer(layer);
+    remove_local(host);
+    free(host);
+
+    printf("SUCCESS: the store came back whole\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,185 @@
+/* A commit that reaches the store torn must be dropped whole at recovery,
+ * and the store must take commits after it. Built with -DLOG_STORE the end
+ * of the last commit record in the log is lost; built with -DSHARD, to run
+ * over RMEM_SHARD_BACKEND=loop, the client dies with a commit record on
+ * shard 0 that is prepared but does not check out. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "rvm_test_layer.h"
+#include <log.h>
+#include <error.h>
+
+#define NBLOCKS 64
+#define BLOCK_SIZE 4096
+#define REAL_TAG(b) (2 * (b) + 2)
+#define SHADOW_TAG(b) (2 * (b) + 3)
+
+static char buf[BLOCK_SIZE];
+static void *buf_reg;
+static uint32_t src[NBLOCKS], dst[NBLOCKS], sizes[NBLOCKS];
+
+/* Write c to every block, through the shadows if the layer has them */
+static void write_all(rmem_layer_t *layer, char c)
+{
+    int shadow = !(layer->flags & RMEM_LAYER_NO_SHADOW);
+
+    memset(buf, c, BLOCK_SIZE);
+    for (int b = 0; b < NBLOCKS; b++) {
+        src[b] = shadow ? SHADOW_TAG(b) : REAL_TAG(b);
+        dst[b] = REAL_TAG(b);
+        sizes[b] = BLOCK_SIZE;
+        CHECK_ERROR(layer->put(layer, src[b], buf, buf_reg, BLOCK_SIZE) != 0,
+                ("FAILURE: could not write block %d\n", b));
+    }
+}
+
+static void commit(rmem_layer_t *layer)
+{
+    CHECK_ERROR(layer->atomic_commit(layer, src, dst, sizes, NBLOCKS) != 0,
+            ("FAILURE: could not commit - %s\n", strerror(errno)));
+}
+
+static int check_all(rmem_layer_t *layer, char expect, const char *when)
+{
+    for (int b = 0; b < NBLOCKS; b++) {
+        memset(buf, 0, BLOCK_SIZE);
+        CHECK_ERROR(layer->get(layer, buf, buf_reg, REAL_TAG(b),
+                    BLOCK_SIZE) != 0,
+                ("FAILURE: could not read block %d\n", b));
+        for (int i = 0; i < BLOCK_SIZE; i++) {
+            if (buf[i] != expect) {
+                printf("FAILURE: block %d %s has '%c', not '%c'\n", b, when,
+                        buf[i], expect);
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+#if defined(LOG_STORE)
+/* The record goes to the log whole */
+static void last_commit(rmem_layer_t *layer)
+{
+    commit(layer);
+}
+
+/* Lose the last page of the log, the end of the last record */
+static void tear(char *host, char *port)
+{
+    struct stat st;
+    int fd = open(host, O_WRONLY);
+
+    CHECK_ERROR(fd < 0 || fstat(fd, &st) != 0,
+            ("FAILURE: could not open %s - %s\n", host, strerror(errno)));
+    memset(buf, 0, BLOCK_SIZE);
+    CHECK_ERROR(pwrite(fd, buf, BLOCK_SIZE, st.st_size - BLOCK_SIZE) !=
+            BLOCK_SIZE, ("FAILURE: could not tear %s\n", host));
+    close(fd);
+}
+#elif defined(SHARD)
+#include <loop_backend.h>
+
+/* The shadows are written, the client dies putting the commit record */
+static void last_commit(rmem_layer_t *layer)
+{
+}
+
+/* Leave shard 0 with the next commit's record prepared, one copy of it
+ * torn. The last record has the same copies, only marked applied. */
+static void tear(char *host, char *port)
+{
+    rmem_layer_t *shard0 = create_loop_layer();
+    struct shard_record *rec;
+    char *name = strdup(host);
+    void *rec_reg;
+
+    rec = malloc(SHARD_RECORD_SIZE);
+    CHECK_ERROR(name == NULL || rec == NULL, ("FAILURE: out of memory\n"));
+    name[strcspn(name, ",:")] = '\0';
+    shard0->connect(shard0, name, port);
+    rec_reg = shard0->register_data(shard0, rec, SHARD_RECORD_SIZE);
+    CHECK_ERROR(shard0->get(shard0, rec, rec_reg, SHARD_RECORD_TAG,
+                SHARD_RECORD_SIZE) != 0 || rec->magic != SHARD_MAGIC ||
+            rec->n != NBLOCKS,
+            ("FAILURE: no commit record on %s\n", name));
+    rec->txid++;
+    rec->state = RECORD_PREPARED;
+    rec->copies[0].size /= 2;
+    CHECK_ERROR(shard0->put(shard0, SHARD_RECORD_TAG, rec, rec_reg,
+                SHARD_RECORD_SIZE) != 0 ||
+            shard0->atomic_commit(shard0, NULL, NULL, NULL, 0) != 0,
+            ("FAILURE: could not tear the record on %s\n", name));
+    shard0->deregister_data(shard0, rec_reg);
+    shard0->disconnect(shard0);
+    free(rec);
+    free(name);
+}
+#else
+static void last_commit(rmem_layer_t *layer)
+{
+    commit(layer);
+}
+
+static void tear(char *host, char *port)
+{
+    CHECK_ERROR(1, ("FAILURE: built for no store this test can tear\n"));
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    rmem_layer_t *layer;
+
+    if (argc != 3) {
+        printf("usage: %s <store> <port>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    unlink(argv[1]);
+
+    layer = test_layer();
+    layer->connect(layer, argv[1], argv[2]);
+    buf_reg = layer->register_data(layer, buf, BLOCK_SIZE);
+    for (int b = 0; b < NBLOCKS; b++)
+        CHECK_ERROR(layer->malloc(layer, BLOCK_SIZE, REAL_TAG(b)) == 0 ||
+                ((layer->flags & RMEM_LAYER_NO_SHADOW) == 0 &&
+                 layer->malloc(layer, BLOCK_SIZE, SHADOW_TAG(b)) == 0),
+                ("FAILURE: could not allocate block %d\n", b));
+    write_all(layer, 'a');
+    commit(layer);
+    write_all(layer, 'b');
+    last_commit(layer);
+    layer->deregister_data(layer, buf_reg);
+    layer->disconnect(layer);
+
+    tear(argv[1], argv[2]);
+
+    layer = test_layer();
+    layer->connect(layer, argv[1], argv[2]);
+    buf_reg = layer->register_data(layer, buf, BLOCK_SIZE);
+    if (!check_all(layer, 'a', "after the torn commit"))
+        return EXIT_FAILURE;
+    write_all(layer, 'c');
+    commit(layer);
+    layer->deregister_data(layer, buf_reg);
+    layer->disconnect(layer);
+
+    layer = test_layer();
+    layer->connect(layer, argv[1], argv[2]);
+    buf_reg = layer->register_data(layer, buf, BLOCK_SIZE);
+    if (!check_all(layer, 'c', "after a restart"))
+        return EXIT_FAILURE;
+    layer->deregister_data(layer, buf_reg);
+    layer->disconnect(layer);
+    unlink(argv[1]);
+
+    printf("SUCCESS: the torn commit was dropped\n");
+    return EXIT_SUCCESS;
+}
@@ -3,12 +3,14 @@ set -e
 DIR=$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )
 HOST=$1
 PORT=$2
+# "loop" runs the test built against the loopback store
+TEST=$DIR/rvm_test_full${3:+_$3}
 
-$DIR/rvm_test_full $HOST $PORT -1
-$DIR/rvm_test_full $HOST $PORT 0
-$DIR/rvm_test_full $HOST $PORT 1
-$DIR/rvm_test_full $HOST $PORT 2
-$DIR/rvm_test_full $HOST $PORT 3
-$DIR/rvm_test_full $HOST $PORT 4
-$DIR/rvm_test_full $HOST $PORT 5
-$DIR/rvm_test_full $HOST $PORT 6
+$TEST $HOST $PORT -1
+$TEST $HOST $PORT 0
+$TEST $HOST $PORT 1
+$TEST $HOST $PORT 2
+$TEST $HOST $PORT 3
+$TEST $HOST $PORT 4
+$TEST $HOST $PORT 5
+$TEST $HOST $PORT 6
@@ -10,10 +10,11 @@
 #include <unistd.h>
 #include <errno.h>
 
-#include <backends/rmem_backend.h>
+#include "rvm_test_layer.h"
 #include <rvm.h>
 #include <log.h>
 #include <error.h>
+#include "buddy_malloc.h"
 
 #define ARR_SIZE 10
 #define SAFE_ARR_SIZE 1000
@@ -36,12 +37,15 @@ rvm_cfg_t* initialize_rvm(char* host, char* port)
     rvm_opt_t opt;
     opt.host = host;
     opt.port = port;
+    opt.alloc_fp = buddy_malloc;
+    opt.free_fp = buddy_free;
+    opt.nentries = DEFAULT_BLK_TBL_NENT;
 
     /* Non-recovery case */
     opt.recovery = false;
 
     LOG(8, ("rvm_cfg_create\n"));
-    rvm_cfg_t *cfg = rvm_cfg_create(&opt, create_rmem_layer);
+    rvm_cfg_t *cfg = rvm_cfg_create(&opt, test_layer);
     CHECK_ERROR(cfg == NULL, 
             ("FAILURE: Failed to initialize rvm configuration - %s\n", strerror(errno)));
 
@@ -10,7 +10,7 @@
 #include <errno.h>
 
 #include "buddy_malloc.h"
-#include <backends/rmem_backend.h>
+#include "rvm_test_layer.h"
 #include <rvm.h>
 #include <log.h>
 #include <error.h>
@@ -23,11 +23,12 @@ rvm_cfg_t* initialize_rvm(char* host, char* port) {
     opt.port = port;
     opt.alloc_fp = buddy_malloc;
     opt.free_fp = buddy_free;
+    opt.nentries = DEFAULT_BLK_TBL_NENT;
 
     /* Non-recovery case */
     opt.recovery = false;
 
-    rvm_cfg_t *cfg = rvm_cfg_create(&opt, create_rmem_layer);
+    rvm_cfg_t *cfg = rvm_cfg_create(&opt, test_layer);
     CHECK_ERROR(cfg == NULL, 
             ("FAILURE: Failed to initialize rvm configuration - %s\n", strerror(errno)));
 
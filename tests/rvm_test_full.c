@@ -13,7 +13,7 @@
 #include <sys/queue.h>
 
 #include "rvm.h"
-#include "backends/rmem_backend.h"
+#include "rvm_test_layer.h"
 //#include "malloc_simple.h"
 #include "buddy_malloc.h"
 #include "rvm_test_common.h"
@@ -133,14 +133,14 @@ int main(int argc, char **argv)
     if(start_phase >= 0) {
         /* Try to recover from server */
         cfg = initialize_rvm(argv[1], argv[2], true,
-                create_rmem_layer);
+                test_layer);
 
         /* Recover the state (if any) */
         state = (test_state_t*)rvm_get_usr_data(cfg);
     } else {
         /* Starting from scratch */
         cfg = initialize_rvm(argv[1], argv[2], false,
-                create_rmem_layer);
+                test_layer);
         CHECK_ERROR(cfg == NULL, ("Failed to initialize rvm\n"));
 
         state = NULL;
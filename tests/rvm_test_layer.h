@@ -0,0 +1,40 @@
+#ifndef __RVM_TEST_LAYER__
+#define __RVM_TEST_LAYER__
+
+/* The layer the generic tests run against, picked at build time with the
+ * flags of the microbenchmarks (-DTCP, -DSHM, -DFILE_STORE, -DLOG_STORE,
+ * -DPMEM_STORE, -DTIERED, -DSHARD, -DEC or -DLOOP), rmem-server over RDMA
+ * otherwise. The Makefile builds tests/<test>_<backend> this way. */
+#if defined(TCP)
+#include <tcp_backend.h>
+#define test_layer create_tcp_layer
+#elif defined(SHM)
+#include <shm_backend.h>
+#define test_layer create_shm_layer
+#elif defined(FILE_STORE)
+#include <file_backend.h>
+#define test_layer create_file_layer
+#elif defined(LOG_STORE)
+#include <log_backend.h>
+#define test_layer create_log_layer
+#elif defined(PMEM_STORE)
+#include <pmem_backend.h>
+#define test_layer create_pmem_layer
+#elif defined(TIERED)
+#include <tiered_backend.h>
+#define test_layer create_tiered_layer
+#elif defined(SHARD)
+#include <shard_backend.h>
+#define test_layer create_shard_layer
+#elif defined(EC)
+#include <ec_backend.h>
+#define test_layer create_ec_layer
+#elif defined(LOOP)
+#include <loop_backend.h>
+#define test_layer create_loop_layer
+#else
+#include <rmem_backend.h>
+#define test_layer create_rmem_layer
+#endif
+
+#endif
@@ -8,7 +8,7 @@
 #include <errno.h>
 
 #include <rvm.h>
-#include <rmem_backend.h>
+#include "rvm_test_layer.h"
 #include <log.h>
 #include <error.h>
 
@@ -62,7 +62,7 @@ int main(int argc, char **argv)
     if(restart) {
         /* Try to recover from server */
         rvm_cfg_t *cfg = initialize_rvm(argv[1], argv[2], true,
-                create_rmem_layer);
+                test_layer);
 
         /* Get the new addresses for arr0 and arr1 */
         int **arr_ptr = (int**)rvm_get_usr_data(cfg);
@@ -91,7 +91,7 @@ int main(int argc, char **argv)
         printf("SUCCESS: Memory recovered after \"failure\"\n");
     } else {
         rvm_cfg_t* cfg = initialize_rvm(argv[1], argv[2], false, 
-                create_rmem_layer);
+                test_layer);
 
         LOG(8,("rvm_txn_begin\n"));
         rvm_txid_t txid = rvm_txn_begin(cfg);
@@ -9,10 +9,11 @@
 #include <unistd.h>
 #include <errno.h>
 
-#include <backends/rmem_backend.h>
+#include "rvm_test_layer.h"
 #include <rvm.h>
 #include <log.h>
 #include <error.h>
+#include "buddy_malloc.h"
 
 #define ARR_SIZE 10
 
@@ -32,12 +33,15 @@ rvm_cfg_t* initialize_rvm(char* host, char* port)
     rvm_opt_t opt;
     opt.host = host;
     opt.port = port;
+    opt.alloc_fp = buddy_malloc;
+    opt.free_fp = buddy_free;
+    opt.nentries = DEFAULT_BLK_TBL_NENT;
 
     /* Non-recovery case */
     opt.recovery = false;
 
     LOG(8, ("rvm_cfg_create\n"));
-    rvm_cfg_t *cfg = rvm_cfg_create(&opt, create_rmem_layer);
+    rvm_cfg_t *cfg = rvm_cfg_create(&opt, test_layer);
     CHECK_ERROR(cfg == NULL, 
             ("FAILURE: Failed to initialize rvm configuration - %s\n", strerror(errno)));
 
@@ -68,6 +72,8 @@ int main(int argc, char **argv)
             ("Allocated array with size 0 - %s", strerror(errno)));
     CHECK_ERROR(safe_arr3 == NULL,
             ("Failed to allocate array inside a txn - %s", strerror(errno)));
+    CHECK_ERROR(safe_arr4 == NULL,
+            ("Failed to allocate array inside a txn - %s", strerror(errno)));
 
     memset(safe_arr1, 0, ARR_SIZE*sizeof(int));
     memset(safe_arr3, 0, 1*sizeof(int));
@@ -75,7 +81,7 @@ int main(int argc, char **argv)
 
     fill_arr(safe_arr1, ARR_SIZE);
     fill_arr(safe_arr3, 1);
-    fill_arr(safe_arr1, 2*ARR_SIZE);
+    fill_arr(safe_arr4, 2*ARR_SIZE);
     
     CHECK_ERROR(check_txn_commit(cfg, txid) == true,
             ("FAILURE: data got through before commit - %s", strerror(errno)));